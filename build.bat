@@ -8,8 +8,17 @@ cl /nologo /W3 /Od /Zi /Fe:build\tcc.exe ^
     src\parse.c ^
     src\sym.c ^
     src\gen.c ^
+    src\eval.c ^
     src\x86_64-gen.c ^
+    src\x86_64-sched.c ^
+    src\layout.c ^
+    src\profile.c ^
     src\pe.c ^
+    src\coff.c ^
+    src\link.c ^
+    src\lto.c ^
+    src\incr.c ^
+    src\cache.c ^
     src\section.c ^
     src\utils.c ^
     /I src ^
@@ -0,0 +1,424 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Machine code cache (-fcode-cache=dir). The code generated for a
+ * function definition is kept in dir under a key: a hash of the body's
+ * tokens, of the function's type and parameters, of what each
+ * identifier of the body stands for at that point (the keys of earlier
+ * functions included, as their calls may be folded), and of the options
+ * that change code. A definition whose key is found is not parsed: its
+ * code is copied in, with the fixups of its rel32 fields:
+ *
+ * - branches within the function, which the layout moves along;
+ * - calls and address references, by the name of the function;
+ * - string literals, as offsets into the .rdata the function added.
+ *
+ * Functions that emit anything else (profile counters, data) are not
+ * kept, nor those that gave warnings, which compiling them again shows.
+ */
+
+#include "tcc.h"
+
+#define CACHE_MAGIC 0x46434354 /* "TCCF" */
+#define CACHE_VERSION 1
+#define CACHE_HEADER_SIZE 40
+
+/* Kinds of fixup */
+#define CACHE_BRANCH 0 /* within the function */
+#define CACHE_CALL 1   /* call of a named function */
+#define CACHE_ADDR 2   /* address of a named function */
+#define CACHE_RDATA 3  /* offset into the .rdata of the function */
+
+/*============================================================
+ * Keys
+ *============================================================*/
+
+static uint64_t cache_hash(uint64_t h, const void *p, size_t len) {
+  const uint8_t *b = p;
+
+  while (len-- > 0)
+    h = (h ^ *b++) * 1099511628211ull;
+  return h;
+}
+
+static uint64_t cache_hash_int(uint64_t h, int64_t v) {
+  return cache_hash(h, &v, sizeof(v));
+}
+
+static uint64_t cache_hash_str(uint64_t h, const char *str) {
+  return cache_hash(h, str, strlen(str) + 1);
+}
+
+/* The key of function sym if it was compiled before, else 0 */
+static uint64_t cache_func_key(TCCState *s, Sym *sym) {
+  int i;
+
+  for (i = s->nb_cache_keys - 1; i >= 0; i--) {
+    if (s->cache_keys[i].func == sym)
+      return s->cache_keys[i].key;
+  }
+  return 0;
+}
+
+/* What identifier name of the body stands for: a function by its type
+   and code, anything else by its type and place as well */
+static uint64_t cache_hash_ident(TCCState *s, uint64_t h, const char *name) {
+  Sym *sym = sym_find2(s, name);
+
+  h = cache_hash_str(h, name);
+  if (!sym)
+    return cache_hash_int(h, -1);
+  h = cache_hash_int(h, sym->t);
+  h = cache_hash_int(h, sym->r);
+  h = cache_hash_int(h, sym->flags);
+  if ((sym->t & VT_BTYPE) == VT_FUNC)
+    return cache_hash_int(h, cache_func_key(s, sym));
+  return cache_hash_int(h, sym->c);
+}
+
+/* The options code depends on */
+static uint64_t cache_hash_options(TCCState *s, uint64_t h) {
+  h = cache_hash_str(h, TCC_VERSION);
+  h = cache_hash_int(h, CACHE_VERSION);
+  h = cache_hash(h, s->pass, sizeof(s->pass));
+  h = cache_hash_int(h, s->cpu_features);
+  h = cache_hash_int(h, s->tune);
+  h = cache_hash_int(h, s->output_type);
+  return h;
+}
+
+/*============================================================
+ * Cache Files
+ *============================================================*/
+
+static void cache_buf_init(Section *buf) {
+  memset(buf, 0, sizeof(*buf));
+  buf->data_alloc = 256;
+  buf->data = tcc_malloc(buf->data_alloc);
+}
+
+static void cache_file_name(TCCState *s, uint64_t key, const char *ext,
+                            char *buf, size_t size) {
+  snprintf(buf, size, "%s/%08x%08x%s", s->code_cache,
+           (unsigned)(key >> 32), (unsigned)key, ext);
+}
+
+/* The cached code for key, which the caller frees; NULL if there is
+   none that makes sense */
+static uint8_t *cache_read(TCCState *s, uint64_t key, uint32_t *size) {
+  char name[1024];
+  uint8_t *data;
+  long len;
+  FILE *f;
+
+  cache_file_name(s, key, ".tcf", name, sizeof(name));
+  f = fopen(name, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (len < CACHE_HEADER_SIZE) {
+    fclose(f);
+    return NULL;
+  }
+  data = tcc_malloc(len);
+  if (fread(data, 1, len, f) != (size_t)len ||
+      read_u32(data) != CACHE_MAGIC || read_u32(data + 4) != CACHE_VERSION ||
+      read_u32(data + 8) != (uint32_t)key ||
+      read_u32(data + 12) != (uint32_t)(key >> 32)) {
+    tcc_free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *size = (uint32_t)len;
+  return data;
+}
+
+/* Whether an entry read in holds together, fields within the code and
+   names within the names */
+static int cache_valid(const uint8_t *data, uint32_t size) {
+  uint32_t code_size = read_u32(data + 16), nb_chunks = read_u32(data + 20);
+  uint32_t nb_fixups = read_u32(data + 24), rdata_size = read_u32(data + 28);
+  uint32_t names_size = read_u32(data + 32), i;
+  const uint8_t *chunks = data + CACHE_HEADER_SIZE;
+  const uint8_t *fixups = chunks + 8ull * nb_chunks;
+
+  if ((uint64_t)CACHE_HEADER_SIZE + 8ull * nb_chunks + 12ull * nb_fixups +
+          code_size + rdata_size + names_size !=
+      size)
+    return 0;
+  if (nb_chunks == 0 || read_u32(chunks) != 0 ||
+      (names_size && data[size - 1] != '\0'))
+    return 0;
+  for (i = 1; i < nb_chunks; i++) {
+    if (read_u32(chunks + 8 * i) <= read_u32(chunks + 8 * (i - 1)) ||
+        read_u32(chunks + 8 * i) >= code_size)
+      return 0;
+  }
+  for (i = 0; i < nb_fixups; i++) {
+    uint32_t at = read_u32(fixups + 12 * i), kind = read_u32(fixups + 12 * i + 4);
+    if (code_size < 4 || at > code_size - 4 || kind > CACHE_RDATA)
+      return 0;
+    if ((kind == CACHE_CALL || kind == CACHE_ADDR) &&
+        read_u32(fixups + 12 * i + 8) >= names_size)
+      return 0;
+    if (kind == CACHE_RDATA &&
+        read_u32(data + size - names_size - rdata_size - code_size + at) >=
+            rdata_size)
+      return 0;
+  }
+  return 1;
+}
+
+/* Write the entry for key under a name of this state first, so that
+   readers never see part of it; whoever else writes the key writes the
+   same bytes */
+static void cache_write(TCCState *s, uint64_t key, const Section *entry) {
+  char tmp[1024], name[1024], ext[32];
+  FILE *f;
+
+  snprintf(ext, sizeof(ext), ".%p.tmp", (void *)s);
+  cache_file_name(s, key, ext, tmp, sizeof(tmp));
+  cache_file_name(s, key, ".tcf", name, sizeof(name));
+  if (tcc_mkdir(s->code_cache) < 0)
+    return;
+  f = fopen(tmp, "wb");
+  if (!f)
+    return;
+  fwrite(entry->data, 1, entry->data_size, f);
+  fclose(f);
+  if (rename(tmp, name) != 0)
+    remove(tmp);
+}
+
+/*============================================================
+ * Functions
+ *============================================================*/
+
+/* At the '{' of the definition of sym: copy its code in from the cache
+ * and step over the body if it is there, and return 1. Otherwise
+ * return 0, back at the '{', with m ready for cache_end() once the body
+ * is compiled. */
+int cache_begin(TCCState *s, Sym *sym, int ret_type, Sym *params,
+                int nb_params, CacheMark *m) {
+  uint64_t h = 14695981039346656037ull;
+  TokenPos body;
+  uint8_t *data, *code, *rdata;
+  const uint8_t *chunks, *fixups;
+  const char *names;
+  uint32_t size, code_size, nb_chunks, nb_fixups, rdata_size;
+  uint32_t start, base, i;
+  Sym *p;
+  int depth = 0;
+
+  m->key = 0;
+  if (!s->code_cache || s->unit_mode || s->lto || s->prof_generate ||
+      s->prof_counts)
+    return 0;
+
+  /* The function, then its body token by token */
+  h = cache_hash_options(s, h);
+  h = cache_hash_int(h, ret_type);
+  h = cache_hash_int(h, sym->t);
+  h = cache_hash_int(h, sym->flags);
+  h = cache_hash_int(h, nb_params);
+  for (p = s->local_stack.top; p != params; p = p->prev) {
+    h = cache_hash_str(h, p->name ? p->name : "");
+    h = cache_hash_int(h, p->t);
+    h = cache_hash_int(h, p->c);
+  }
+  tok_save(s, &body);
+  do {
+    if (s->tok == '{')
+      depth++;
+    else if (s->tok == '}')
+      depth--;
+    h = cache_hash_int(h, s->tok);
+    if (s->tok == TOK_IDENT) {
+      h = cache_hash_ident(s, h, s->tokc.str);
+      tcc_free(s->tokc.str);
+    } else if (s->tok == TOK_STR) {
+      h = cache_hash_str(h, s->tokc.str);
+      tcc_free(s->tokc.str);
+    } else if (s->tok == TOK_NUM) {
+      h = cache_hash_int(h, s->tokc.i);
+    }
+    next(s);
+  } while (depth > 0 && s->tok != TOK_EOF);
+  h += !h; /* 0 means none */
+
+  s->cache_keys =
+      tcc_realloc(s->cache_keys, (s->nb_cache_keys + 1) * sizeof(CacheKey));
+  s->cache_keys[s->nb_cache_keys].func = sym;
+  s->cache_keys[s->nb_cache_keys++].key = h;
+
+  data = depth == 0 ? cache_read(s, h, &size) : NULL;
+  if (data) {
+    code_size = read_u32(data + 16);
+    nb_chunks = read_u32(data + 20);
+    nb_fixups = read_u32(data + 24);
+    rdata_size = read_u32(data + 28);
+    if (!cache_valid(data, size)) {
+      tcc_free(data);
+      data = NULL;
+    }
+  }
+  if (!data) {
+    tok_restore(s, &body);
+    m->key = h;
+    m->start = (uint32_t)s->ind;
+    m->nb_relocs = s->nb_text_relocs;
+    m->rdata = s->rdata_section ? (uint32_t)s->rdata_section->data_size : 0;
+    m->data = (uint32_t)s->data_section->data_size;
+    m->nb_warnings = s->nb_warnings;
+    return 0;
+  }
+
+  chunks = data + CACHE_HEADER_SIZE;
+  fixups = chunks + 8 * nb_chunks;
+  code = (uint8_t *)fixups + 12 * nb_fixups;
+  rdata = code + code_size;
+  names = (const char *)rdata + rdata_size;
+
+  /* The string literals, then the code pointing at them */
+  base = 0;
+  if (rdata_size > 0) {
+    if (!s->rdata_section)
+      s->rdata_section = new_section(s, ".rdata", 1, 0);
+    base = (uint32_t)section_add(s->rdata_section, rdata, rdata_size);
+  }
+  start = (uint32_t)s->ind;
+  sym->c = start;
+  sym->sec = s->text_section;
+  prof_new_counter(s);
+  memcpy(section_ptr_add(s->text_section, code_size), code, code_size);
+
+  s->func_sym = sym;
+  for (i = 0; i < nb_chunks; i++) {
+    s->ind = (int)(start + read_u32(chunks + 8 * i));
+    text_begin_chunk(s, (int)read_u32(chunks + 8 * i + 4));
+  }
+  s->func_sym = NULL;
+  s->ind = (int)(start + code_size);
+  s->sched_start = s->ind; /* as gfunc_epilog() leaves it */
+
+  for (i = 0; i < nb_fixups; i++) {
+    uint32_t offset = start + read_u32(fixups + 12 * i);
+    uint32_t kind = read_u32(fixups + 12 * i + 4);
+    const char *name = names + read_u32(fixups + 12 * i + 8);
+    uint8_t *field = s->text_section->data + offset;
+    Sym *target = NULL;
+
+    if (kind == CACHE_CALL || kind == CACHE_ADDR) {
+      target = global_sym_find2(s, name);
+      if (!target)
+        target = global_sym_push2(s, name, VT_FUNC | VT_INT, VT_CONST, 0);
+    }
+    if (kind == CACHE_CALL) {
+      write_u32(field, (uint32_t)(target->c - (offset + 4)));
+      text_add_reloc(s, offset, target);
+    } else if (kind == CACHE_ADDR) {
+      text_add_addr_reloc(s, offset, target);
+    } else if (kind == CACHE_RDATA) {
+      write_u32(field, read_u32(field) + base);
+      text_add_sec_reloc(s, offset, s->rdata_section);
+    } else {
+      text_add_reloc(s, offset, NULL);
+    }
+  }
+
+  s->nb_cache_hits++;
+  tcc_free(data);
+  return 1;
+}
+
+/* After the body of sym, compiled from mark m: keep its code */
+void cache_end(TCCState *s, Sym *sym, const CacheMark *m) {
+  Section entry, names;
+  uint8_t *p, *code;
+  uint32_t end = (uint32_t)s->ind, code_size = end - m->start;
+  uint32_t rdata_end, nb_chunks = 0;
+  int i, first;
+
+  if (!m->key || s->nb_errors || s->nb_warnings != m->nb_warnings ||
+      s->data_section->data_size != m->data)
+    return;
+  rdata_end = s->rdata_section ? (uint32_t)s->rdata_section->data_size : 0;
+
+  /* Its chunks, the first one starting where it does */
+  for (first = s->nb_text_chunks; first > 0; first--) {
+    if (s->text_chunks[first - 1].start < m->start)
+      break;
+  }
+  if (first == s->nb_text_chunks || s->text_chunks[first].start != m->start)
+    return;
+  for (i = first; i < s->nb_text_chunks; i++) {
+    if (s->text_chunks[i].func != sym)
+      return;
+    nb_chunks++;
+  }
+
+  cache_buf_init(&entry);
+  cache_buf_init(&names);
+  p = section_ptr_add(&entry, CACHE_HEADER_SIZE);
+  memset(p, 0, CACHE_HEADER_SIZE);
+  for (i = first; i < s->nb_text_chunks; i++) {
+    p = section_ptr_add(&entry, 8);
+    write_u32(p, s->text_chunks[i].start - m->start);
+    write_u32(p + 4, (uint32_t)s->text_chunks[i].cold);
+  }
+
+  /* The code with its fields made independent of where it goes */
+  code = tcc_malloc(code_size + 1);
+  memcpy(code, s->text_section->data + m->start, code_size);
+  for (i = m->nb_relocs; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    uint32_t at = rel->offset - m->start, kind;
+    uint32_t name = 0;
+
+    if (rel->sec) {
+      uint32_t target = read_u32(code + at);
+      if (rel->sec != s->rdata_section || target < m->rdata ||
+          target >= rdata_end)
+        break;
+      write_u32(code + at, target - m->rdata);
+      kind = CACHE_RDATA;
+    } else if (rel->sym) {
+      if (!rel->sym->name)
+        break;
+      name = (uint32_t)section_add(&names, rel->sym->name,
+                                   strlen(rel->sym->name) + 1);
+      write_u32(code + at, 0);
+      kind = rel->abi ? CACHE_ADDR : CACHE_CALL;
+    } else {
+      kind = CACHE_BRANCH;
+    }
+    p = section_ptr_add(&entry, 12);
+    write_u32(p, at);
+    write_u32(p + 4, kind);
+    write_u32(p + 8, name);
+  }
+
+  if (i == s->nb_text_relocs) {
+    section_add(&entry, code, code_size);
+    if (rdata_end > m->rdata)
+      section_add(&entry, s->rdata_section->data + m->rdata,
+                  rdata_end - m->rdata);
+    section_add(&entry, names.data, names.data_size);
+    p = entry.data;
+    write_u32(p, CACHE_MAGIC);
+    write_u32(p + 4, CACHE_VERSION);
+    write_u32(p + 8, (uint32_t)m->key);
+    write_u32(p + 12, (uint32_t)(m->key >> 32));
+    write_u32(p + 16, code_size);
+    write_u32(p + 20, nb_chunks);
+    write_u32(p + 24, (uint32_t)(s->nb_text_relocs - m->nb_relocs));
+    write_u32(p + 28, rdata_end - m->rdata);
+    write_u32(p + 32, (uint32_t)names.data_size);
+    cache_write(s, m->key, &entry);
+  }
+  tcc_free(code);
+  tcc_free(names.data);
+  tcc_free(entry.data);
+}
@@ -0,0 +1,642 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * COFF object files, written for -c and read by the link. An object
+ * holds the sections as they are before the link and what the link
+ * needs to place them:
+ *   file header, section headers,
+ *   the raw data of each section, .text followed by its relocations,
+ *   symbol table (a symbol for each section first), string table.
+ * Calls between functions of .text are bound already; relocations are
+ * left for references into the other sections, to functions defined
+ * elsewhere and to imported functions (as __imp_name).
+ *
+ * Objects from other compilers have more sections, named for grouping
+ * (".text$mn"); they are merged into the link's .text, .data, .rdata
+ * and .bss by their characteristics. Debug and linker directive
+ * sections are dropped, and a COMDAT section is kept from the first
+ * object that defines its symbol only.
+ */
+
+#include "tcc.h"
+
+#define COFF_HEADER_SIZE 20
+#define COFF_SECTION_HEADER_SIZE 40
+#define COFF_RELOC_SIZE 10
+#define COFF_SYM_SIZE 18
+#define COFF_MAX_SECTIONS 4
+
+#define IMAGE_SYM_CLASS_EXTERNAL 2
+#define IMAGE_SYM_CLASS_STATIC 3
+#define IMAGE_SYM_CLASS_WEAK_EXTERNAL 105
+#define IMAGE_SYM_DTYPE_FUNCTION 0x20
+#define IMAGE_SYM_ABSOLUTE (-1)
+
+#define IMAGE_SCN_CNT_CODE 0x00000020
+#define IMAGE_SCN_CNT_UNINITIALIZED_DATA 0x00000080
+#define IMAGE_SCN_LNK_INFO 0x00000200
+#define IMAGE_SCN_LNK_REMOVE 0x00000800
+#define IMAGE_SCN_LNK_COMDAT 0x00001000
+#define IMAGE_SCN_ALIGN_8BYTES 0x00400000
+#define IMAGE_SCN_ALIGN_16BYTES 0x00500000
+#define IMAGE_SCN_ALIGN_MASK 0x00f00000
+#define IMAGE_SCN_LNK_NRELOC_OVFL 0x01000000
+#define IMAGE_SCN_MEM_WRITE 0x80000000
+
+#define IMAGE_COMDAT_SELECT_ASSOCIATIVE 5
+
+/*============================================================
+ * Writing
+ *============================================================*/
+
+/* A symbol table being built, with names longer than 8 bytes in the
+   string table */
+typedef struct {
+  Section syms;
+  Section strs;
+  int nb_syms;
+  char **names; /* undefined symbols added so far */
+  int *index;
+  int nb_names;
+} CoffSyms;
+
+static void coff_buf_init(Section *buf) {
+  memset(buf, 0, sizeof(*buf));
+  buf->data_alloc = 256;
+  buf->data = tcc_malloc(buf->data_alloc);
+}
+
+/* Append a symbol; returns its index */
+static int coff_add_sym(CoffSyms *cs, const char *name, uint32_t value,
+                        int secnum, int type, int sclass, int naux) {
+  uint8_t *p = section_ptr_add(&cs->syms, COFF_SYM_SIZE);
+  size_t len = strlen(name);
+
+  memset(p, 0, COFF_SYM_SIZE);
+  if (len <= 8) {
+    memcpy(p, name, len);
+  } else {
+    write_u32(p + 4, 4 + (uint32_t)cs->strs.data_size);
+    section_add(&cs->strs, name, len + 1);
+  }
+  write_u32(p + 8, value);
+  write_u16(p + 12, (uint16_t)secnum);
+  write_u16(p + 14, (uint16_t)type);
+  p[16] = (uint8_t)sclass;
+  p[17] = (uint8_t)naux;
+  memset(section_ptr_add(&cs->syms, naux * COFF_SYM_SIZE), 0,
+         naux * COFF_SYM_SIZE);
+  cs->nb_syms += 1 + naux;
+  return cs->nb_syms - 1 - naux;
+}
+
+/* Index of the undefined external name, added on first use */
+static int coff_extern(CoffSyms *cs, const char *name, int type) {
+  int i;
+
+  for (i = 0; i < cs->nb_names; i++) {
+    if (strcmp(cs->names[i], name) == 0)
+      return cs->index[i];
+  }
+  cs->names = tcc_realloc(cs->names, (cs->nb_names + 1) * sizeof(char *));
+  cs->index = tcc_realloc(cs->index, (cs->nb_names + 1) * sizeof(int));
+  cs->names[cs->nb_names] = tcc_strdup(name);
+  cs->index[cs->nb_names] =
+      coff_add_sym(cs, name, 0, 0, type, IMAGE_SYM_CLASS_EXTERNAL, 0);
+  return cs->index[cs->nb_names++];
+}
+
+/* Name of sym in the object. The objects of a file split by
+   -fparallel-codegen share its statics under names of their own. */
+static const char *coff_sym_name(TCCState *s, Sym *sym, char *buf,
+                                 size_t size) {
+  if (!(sym->t & VT_STATIC) || !s->unit_prefix)
+    return sym->name;
+  snprintf(buf, size, "%s%s", s->unit_prefix, sym->name);
+  return buf;
+}
+
+static int coff_section_index(Section **secs, int nb_secs, Section *sec) {
+  int i;
+
+  for (i = 0; i < nb_secs; i++) {
+    if (secs[i] == sec)
+      return i;
+  }
+  return -1;
+}
+
+/* Relocation records for .text, with the rel32 fields holding the
+   addend each refers to */
+static int coff_text_relocs(TCCState *s, Section **secs, int nb_secs,
+                            CoffSyms *cs, Section *relocs) {
+  Section *text = s->text_section;
+  int i, j, index, nb_relocs = 0;
+
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    uint8_t *field = text->data + rel->offset;
+    uint8_t *p;
+
+    if (rel->sec && rel->sec == s->idata_section) {
+      /* The field holds the IAT slot of the import */
+      char name[256];
+      snprintf(name, sizeof(name), "__imp_%s",
+               s->imports[*(uint32_t *)field / 8]);
+      index = coff_extern(cs, name, 0);
+      write_u32(field, 0);
+    } else if (rel->sec) {
+      j = coff_section_index(secs, nb_secs, rel->sec);
+      if (j < 0) {
+        tcc_error(s, "reference to section '%s' in an object file",
+                  rel->sec->name);
+        return -1;
+      }
+      index = 2 * j;
+    } else if (rel->sym && rel->sym->sec != text) {
+      char name[256];
+      index = coff_extern(cs, coff_sym_name(s, rel->sym, name, sizeof(name)),
+                          IMAGE_SYM_DTYPE_FUNCTION);
+      write_u32(field, 0);
+    } else {
+      continue;
+    }
+
+    p = section_ptr_add(relocs, COFF_RELOC_SIZE);
+    write_u32(p, rel->offset);
+    write_u32(p + 4, (uint32_t)index);
+    write_u16(p + 8, IMAGE_REL_AMD64_REL32);
+    nb_relocs++;
+  }
+  return nb_relocs;
+}
+
+/* The object file for the code and data compiled into s, built in out;
+   the caller frees out->data */
+int coff_build(TCCState *s, Section *out) {
+  uint8_t header[COFF_HEADER_SIZE + COFF_MAX_SECTIONS * COFF_SECTION_HEADER_SIZE];
+  Section *secs[COFF_MAX_SECTIONS];
+  Section relocs;
+  CoffSyms cs;
+  Sym **defs, *sym;
+  uint8_t strs_size[4];
+  uint32_t pos;
+  int nb_secs = 0, nb_defs = 0, nb_relocs, i, j, ret = -1;
+
+  secs[nb_secs++] = s->text_section;
+  secs[nb_secs++] = s->data_section;
+  if (s->rdata_section)
+    secs[nb_secs++] = s->rdata_section;
+  secs[nb_secs++] = s->bss_section;
+
+  memset(&cs, 0, sizeof(cs));
+  coff_buf_init(out);
+  coff_buf_init(&cs.syms);
+  coff_buf_init(&cs.strs);
+  coff_buf_init(&relocs);
+
+  /* A symbol for each section, referred to by the relocations; its
+     auxiliary record gives the size and relocation count */
+  for (i = 0; i < nb_secs; i++)
+    coff_add_sym(&cs, secs[i]->name, 0, i + 1, 0, IMAGE_SYM_CLASS_STATIC, 1);
+
+  /* Functions and variables defined here, in source order */
+  defs = tcc_malloc(sizeof(Sym *));
+  for (sym = s->global_stack.top; sym; sym = sym->prev) {
+    if (!sym->name || coff_section_index(secs, nb_secs, sym->sec) < 0)
+      continue;
+    defs = tcc_realloc(defs, (nb_defs + 1) * sizeof(Sym *));
+    defs[nb_defs++] = sym;
+  }
+  for (i = nb_defs - 1; i >= 0; i--) {
+    char name[256];
+    sym = defs[i];
+    coff_add_sym(&cs, coff_sym_name(s, sym, name, sizeof(name)),
+                 (uint32_t)sym->c,
+                 coff_section_index(secs, nb_secs, sym->sec) + 1,
+                 (sym->t & VT_BTYPE) == VT_FUNC ? IMAGE_SYM_DTYPE_FUNCTION : 0,
+                 (sym->t & VT_STATIC) && !s->unit_prefix
+                     ? IMAGE_SYM_CLASS_STATIC
+                     : IMAGE_SYM_CLASS_EXTERNAL,
+                 0);
+  }
+  tcc_free(defs);
+
+  nb_relocs = coff_text_relocs(s, secs, nb_secs, &cs, &relocs);
+  if (nb_relocs < 0)
+    goto done;
+
+  /* Headers, then the raw data, with the relocations after .text */
+  memset(header, 0, sizeof(header));
+  pos = COFF_HEADER_SIZE + nb_secs * COFF_SECTION_HEADER_SIZE;
+  for (i = 0; i < nb_secs; i++) {
+    Section *sec = secs[i];
+    uint8_t *sh = header + COFF_HEADER_SIZE + i * COFF_SECTION_HEADER_SIZE;
+    uint8_t *aux = cs.syms.data + (2 * i + 1) * COFF_SYM_SIZE;
+    uint32_t flags = pe_section_flags(sec);
+
+    flags |= (sec->sh_flags & 4) ? IMAGE_SCN_ALIGN_16BYTES
+                                 : IMAGE_SCN_ALIGN_8BYTES;
+    memcpy(sh, sec->name, strlen(sec->name) < 8 ? strlen(sec->name) : 8);
+    write_u32(sh + 16, (uint32_t)sec->data_size);
+    if (sec->sh_type != 8) {
+      write_u32(sh + 20, pos);
+      pos += (uint32_t)sec->data_size;
+    }
+    if (sec == s->text_section && nb_relocs > 0) {
+      /* More than 0xfffe: the first record holds the count */
+      write_u32(sh + 24, pos);
+      if (nb_relocs >= 0xffff) {
+        flags |= IMAGE_SCN_LNK_NRELOC_OVFL;
+        write_u16(sh + 32, 0xffff);
+        pos += COFF_RELOC_SIZE;
+      } else {
+        write_u16(sh + 32, (uint16_t)nb_relocs);
+      }
+      pos += (uint32_t)relocs.data_size;
+      write_u16(aux + 4, (uint16_t)(nb_relocs < 0xffff ? nb_relocs : 0xffff));
+    }
+    write_u32(sh + 36, flags);
+    write_u32(aux, (uint32_t)sec->data_size);
+  }
+
+  write_u16(header, IMAGE_FILE_MACHINE_AMD64);
+  write_u16(header + 2, (uint16_t)nb_secs);
+  write_u32(header + 8, pos); /* symbol table */
+  write_u32(header + 12, (uint32_t)cs.nb_syms);
+
+  section_add(out, header,
+              COFF_HEADER_SIZE + nb_secs * COFF_SECTION_HEADER_SIZE);
+  for (i = 0; i < nb_secs; i++) {
+    if (secs[i]->sh_type == 8)
+      continue;
+    section_add(out, secs[i]->data, secs[i]->data_size);
+    if (secs[i] == s->text_section && nb_relocs > 0) {
+      if (nb_relocs >= 0xffff) {
+        uint8_t *count = section_ptr_add(out, COFF_RELOC_SIZE);
+        memset(count, 0, COFF_RELOC_SIZE);
+        write_u32(count, (uint32_t)nb_relocs + 1);
+      }
+      section_add(out, relocs.data, relocs.data_size);
+    }
+  }
+  section_add(out, cs.syms.data, cs.syms.data_size);
+  write_u32(strs_size, 4 + (uint32_t)cs.strs.data_size);
+  section_add(out, strs_size, 4);
+  section_add(out, cs.strs.data, cs.strs.data_size);
+
+  if (s->verbose)
+    printf("COFF object: %d symbols, %d relocations\n", cs.nb_syms,
+           nb_relocs);
+  ret = 0;
+
+done:
+  for (j = 0; j < cs.nb_names; j++)
+    tcc_free(cs.names[j]);
+  tcc_free(cs.names);
+  tcc_free(cs.index);
+  tcc_free(cs.syms.data);
+  tcc_free(cs.strs.data);
+  tcc_free(relocs.data);
+  return ret;
+}
+
+int coff_output_file(TCCState *s, const char *filename) {
+  Section out;
+  FILE *f;
+  int ret;
+
+  ret = coff_build(s, &out);
+  if (ret == 0) {
+    f = fopen(filename, "wb");
+    if (!f) {
+      tcc_error(s, "cannot create output file '%s'", filename);
+      ret = -1;
+    } else {
+      fwrite(out.data, 1, out.data_size, f);
+      fclose(f);
+    }
+  }
+  tcc_free(out.data);
+  return ret;
+}
+
+/* An object of a single information section holding data, which a
+   link that does not ask for it drops: no symbols and no code */
+int coff_build_info(Section *out, const char *name, const void *data,
+                    size_t size) {
+  uint8_t header[COFF_HEADER_SIZE + COFF_SECTION_HEADER_SIZE];
+  uint8_t *sh = header + COFF_HEADER_SIZE;
+  uint32_t pos = sizeof(header);
+
+  coff_buf_init(out);
+  memset(header, 0, sizeof(header));
+  write_u16(header, IMAGE_FILE_MACHINE_AMD64);
+  write_u16(header + 2, 1);
+  write_u32(header + 8, pos + (uint32_t)size); /* empty symbol table */
+  memcpy(sh, name, strlen(name) < 8 ? strlen(name) : 8);
+  write_u32(sh + 16, (uint32_t)size);
+  write_u32(sh + 20, pos);
+  write_u32(sh + 36, IMAGE_SCN_LNK_INFO | IMAGE_SCN_LNK_REMOVE);
+
+  section_add(out, header, sizeof(header));
+  section_add(out, data, size);
+  write_u32(section_ptr_add(out, 4), 4); /* string table size */
+  return 0;
+}
+
+/*============================================================
+ * Reading
+ *============================================================*/
+
+/* Where a section of the object being read goes */
+typedef struct {
+  const uint8_t *header;
+  Section *dest; /* NULL when dropped */
+  uint32_t base; /* its offset in dest */
+  int assoc;     /* section an associative COMDAT goes with, 1-based */
+} CoffInSection;
+
+/* What a symbol of the object being read refers to */
+typedef struct {
+  Sym *sym;      /* external: the link's symbol */
+  Section *sec;  /* local: a place, sec NULL for an absolute value */
+  uint32_t value;
+  int valid;
+} CoffInSym;
+
+/* Name of a symbol or section: inline, or "/offset" (sections) or a
+   zero word and an offset (symbols) into the string table */
+static void coff_name(const uint8_t *p, int section, const char *strs,
+                      uint32_t strs_size, char *buf, size_t size) {
+  uint32_t off = 0;
+  int indirect = 0;
+
+  if (section && p[0] == '/') {
+    off = (uint32_t)strtoul((const char *)p + 1, NULL, 10);
+    indirect = 1;
+  } else if (!section && read_u32(p) == 0) {
+    off = read_u32(p + 4);
+    indirect = 1;
+  }
+  if (indirect) {
+    snprintf(buf, size, "%s", off < strs_size ? strs + off : "");
+  } else {
+    memcpy(buf, p, 8);
+    buf[8] = '\0';
+  }
+}
+
+/* The raw data of the section called name in the object in data, or
+   NULL if it has none */
+const uint8_t *coff_find_section(const uint8_t *data, size_t size,
+                                 const char *name, uint32_t *len) {
+  const uint8_t *sh;
+  uint32_t nb_secs, sym_ptr, i;
+  char buf[256];
+
+  if (size < COFF_HEADER_SIZE || read_u16(data) != IMAGE_FILE_MACHINE_AMD64)
+    return NULL;
+  nb_secs = read_u16(data + 2);
+  sym_ptr = read_u32(data + 8) + read_u32(data + 12) * COFF_SYM_SIZE;
+  sh = data + COFF_HEADER_SIZE + read_u16(data + 16);
+  if ((size_t)(sh - data) + (size_t)nb_secs * COFF_SECTION_HEADER_SIZE > size)
+    return NULL;
+  for (i = 0; i < nb_secs; i++, sh += COFF_SECTION_HEADER_SIZE) {
+    uint32_t off = read_u32(sh + 20), n = read_u32(sh + 16);
+
+    coff_name(sh, 1, (const char *)data + sym_ptr,
+              sym_ptr < size ? (uint32_t)(size - sym_ptr) : 0, buf,
+              sizeof(buf));
+    if (strcmp(buf, name) == 0 && off <= size && n <= size - off) {
+      *len = n;
+      return data + off;
+    }
+  }
+  return NULL;
+}
+
+/* Link section for an input section with these characteristics */
+static Section *coff_dest(TCCState *s, uint32_t flags) {
+  if (flags & IMAGE_SCN_CNT_CODE)
+    return s->text_section;
+  if (flags & IMAGE_SCN_CNT_UNINITIALIZED_DATA)
+    return s->bss_section;
+  if (flags & IMAGE_SCN_MEM_WRITE)
+    return s->data_section;
+  if (!s->rdata_section)
+    s->rdata_section = new_section(s, ".rdata", 1, 0);
+  return s->rdata_section;
+}
+
+static int coff_reloc_supported(int type) {
+  return type == IMAGE_REL_AMD64_ADDR64 || type == IMAGE_REL_AMD64_ADDR32 ||
+         type == IMAGE_REL_AMD64_ADDR32NB ||
+         (type >= IMAGE_REL_AMD64_REL32 && type <= IMAGE_REL_AMD64_REL32_5) ||
+         type == IMAGE_REL_AMD64_SECREL;
+}
+
+/* Merge the object file in data into the link s: its sections are
+ * appended to the link's, its external symbols defined in or looked up
+ * from the link's symbol table, and its relocations recorded for
+ * link_relocate() */
+int coff_load(TCCState *s, const char *filename, const uint8_t *data,
+              size_t size) {
+  CoffInSection *secs = NULL;
+  CoffInSym *syms = NULL;
+  const uint8_t *sh, *sp;
+  const char *strs;
+  uint32_t nb_secs, nb_syms, sym_ptr, strs_size;
+  char name[256];
+  int comdat = 0; /* COMDAT section whose symbol comes next */
+  uint32_t i, j;
+  int ret = -1;
+
+  if (size < COFF_HEADER_SIZE || read_u16(data) != IMAGE_FILE_MACHINE_AMD64) {
+    tcc_error(s, "'%s' is not an AMD64 object file", filename);
+    return -1;
+  }
+  nb_secs = read_u16(data + 2);
+  sym_ptr = read_u32(data + 8);
+  nb_syms = read_u32(data + 12);
+  sh = data + COFF_HEADER_SIZE + read_u16(data + 16);
+  if ((size_t)(sh - data) + (size_t)nb_secs * COFF_SECTION_HEADER_SIZE > size ||
+      sym_ptr > size ||
+      (size - sym_ptr) / COFF_SYM_SIZE < nb_syms ||
+      size - sym_ptr - (size_t)nb_syms * COFF_SYM_SIZE < 4) {
+    tcc_error(s, "'%s' is truncated", filename);
+    return -1;
+  }
+  sp = data + sym_ptr;
+  strs = (const char *)sp + nb_syms * COFF_SYM_SIZE;
+  strs_size = (uint32_t)(size - sym_ptr - nb_syms * COFF_SYM_SIZE);
+  if (read_u32((const uint8_t *)strs) < strs_size)
+    strs_size = read_u32((const uint8_t *)strs);
+
+  secs = tcc_malloc((nb_secs + 1) * sizeof(CoffInSection));
+  memset(secs, 0, (nb_secs + 1) * sizeof(CoffInSection));
+  syms = tcc_malloc((nb_syms + 1) * sizeof(CoffInSym));
+  memset(syms, 0, (nb_syms + 1) * sizeof(CoffInSym));
+
+  /* Sections kept: not debug information or linker directives */
+  for (i = 1; i <= nb_secs; i++) {
+    const uint8_t *h = sh + (i - 1) * COFF_SECTION_HEADER_SIZE;
+    uint32_t flags = read_u32(h + 36);
+    secs[i].header = h;
+    coff_name(h, 1, strs, strs_size, name, sizeof(name));
+    if ((flags & (IMAGE_SCN_LNK_INFO | IMAGE_SCN_LNK_REMOVE)) ||
+        strncmp(name, ".debug", 6) == 0)
+      continue;
+    if (!(flags & IMAGE_SCN_CNT_UNINITIALIZED_DATA) &&
+        (read_u32(h + 20) > size || read_u32(h + 16) > size - read_u32(h + 20))) {
+      tcc_error(s, "'%s' is truncated", filename);
+      goto done;
+    }
+    secs[i].dest = coff_dest(s, flags);
+  }
+
+  /* A COMDAT section is dropped when its symbol, the first one after the
+     section's own, is defined already; the sections associated with it
+     go with it */
+  for (i = 0; i < nb_syms; i += 1 + sp[i * COFF_SYM_SIZE + 17]) {
+    const uint8_t *p = sp + i * COFF_SYM_SIZE;
+    int secnum = (int16_t)read_u16(p + 12);
+    Sym *sym;
+
+    if (secnum <= 0 || (uint32_t)secnum > nb_secs ||
+        !(read_u32(secs[secnum].header + 36) & IMAGE_SCN_LNK_COMDAT))
+      continue;
+    if (p[16] == IMAGE_SYM_CLASS_STATIC && p[17] > 0 && read_u32(p + 8) == 0 &&
+        comdat != secnum) {
+      const uint8_t *aux = p + COFF_SYM_SIZE;
+      if (aux[14] == IMAGE_COMDAT_SELECT_ASSOCIATIVE)
+        secs[secnum].assoc = read_u16(aux + 12);
+      else
+        comdat = secnum;
+      continue;
+    }
+    if (comdat == secnum) {
+      coff_name(p, 0, strs, strs_size, name, sizeof(name));
+      sym = global_sym_find2(s, name);
+      if (sym && sym->sec)
+        secs[secnum].dest = NULL;
+      comdat = 0;
+    }
+  }
+  for (i = 1; i <= nb_secs; i++) {
+    if (secs[i].assoc > 0 && (uint32_t)secs[i].assoc <= nb_secs &&
+        !secs[secs[i].assoc].dest)
+      secs[i].dest = NULL;
+  }
+
+  /* Append the kept sections at their alignment */
+  for (i = 1; i <= nb_secs; i++) {
+    const uint8_t *h = secs[i].header;
+    uint32_t flags = read_u32(h + 36), len = read_u32(h + 16);
+    uint32_t align = 16;
+    Section *dest = secs[i].dest;
+
+    if (!dest)
+      continue;
+    if (flags & IMAGE_SCN_ALIGN_MASK)
+      align = 1u << (((flags & IMAGE_SCN_ALIGN_MASK) >> 20) - 1);
+    while (dest->data_size & (align - 1))
+      *(uint8_t *)section_ptr_add(dest, 1) = dest == s->text_section ? 0xcc : 0;
+    secs[i].base = (uint32_t)dest->data_size;
+    if (flags & IMAGE_SCN_CNT_UNINITIALIZED_DATA)
+      memset(section_ptr_add(dest, len), 0, len);
+    else
+      section_add(dest, data + read_u32(h + 20), len);
+  }
+
+  /* Symbols: externals go to the link's table */
+  for (i = 0; i < nb_syms; i += 1 + sp[i * COFF_SYM_SIZE + 17]) {
+    const uint8_t *p = sp + i * COFF_SYM_SIZE;
+    int secnum = (int16_t)read_u16(p + 12);
+    int sclass = p[16];
+    int func = (read_u16(p + 14) & 0x30) == IMAGE_SYM_DTYPE_FUNCTION;
+    uint32_t value = read_u32(p + 8);
+    int external =
+        sclass == IMAGE_SYM_CLASS_EXTERNAL || sclass == IMAGE_SYM_CLASS_WEAK_EXTERNAL;
+
+    coff_name(p, 0, strs, strs_size, name, sizeof(name));
+    if (secnum > 0 && (uint32_t)secnum <= nb_secs) {
+      if (!secs[secnum].dest) {
+        /* In a dropped COMDAT: the copy kept elsewhere stands for it */
+        if (external) {
+          syms[i].sym = link_sym(s, name);
+          syms[i].valid = 1;
+        }
+        continue;
+      }
+      syms[i].sec = secs[secnum].dest;
+      syms[i].value = secs[secnum].base + value;
+      syms[i].valid = 1;
+      if (external) {
+        syms[i].sym = link_define(s, name, syms[i].sec, syms[i].value, func);
+        if (!syms[i].sym)
+          goto done;
+      }
+    } else if (secnum == 0 && external) {
+      syms[i].sym = link_sym(s, name);
+      syms[i].valid = 1;
+      if (value > 0)
+        link_common(syms[i].sym, value);
+    } else if (secnum == IMAGE_SYM_ABSOLUTE) {
+      syms[i].value = value;
+      syms[i].valid = 1;
+    }
+  }
+
+  /* Relocations of the kept sections, against those symbols */
+  for (i = 1; i <= nb_secs; i++) {
+    const uint8_t *h = secs[i].header, *r;
+    uint32_t nb_relocs = read_u16(h + 32), ptr = read_u32(h + 24);
+
+    if (!secs[i].dest || nb_relocs == 0)
+      continue;
+    if (ptr > size || size - ptr < COFF_RELOC_SIZE) {
+      tcc_error(s, "'%s' is truncated", filename);
+      goto done;
+    }
+    if (read_u32(h + 36) & IMAGE_SCN_LNK_NRELOC_OVFL) {
+      nb_relocs = read_u32(data + ptr) - 1;
+      ptr += COFF_RELOC_SIZE;
+    }
+    if ((size - ptr) / COFF_RELOC_SIZE < nb_relocs) {
+      tcc_error(s, "'%s' is truncated", filename);
+      goto done;
+    }
+    for (j = 0, r = data + ptr; j < nb_relocs; j++, r += COFF_RELOC_SIZE) {
+      uint32_t offset = read_u32(r) - read_u32(h + 12);
+      uint32_t index = read_u32(r + 4);
+      int type = read_u16(r + 8);
+      CoffInSym *target = index < nb_syms ? &syms[index] : NULL;
+
+      if (type == IMAGE_REL_AMD64_ABSOLUTE)
+        continue;
+      if (!coff_reloc_supported(type)) {
+        tcc_error(s, "'%s': unsupported relocation type %d", filename, type);
+        goto done;
+      }
+      if (!target || !target->valid) {
+        tcc_error(s, "'%s': relocation against a dropped or unknown symbol",
+                  filename);
+        goto done;
+      }
+      if (offset > read_u32(h + 16) ||
+          read_u32(h + 16) - offset < (type == IMAGE_REL_AMD64_ADDR64 ? 8u : 4u)) {
+        tcc_error(s, "'%s': relocation outside its section", filename);
+        goto done;
+      }
+      link_add_reloc(s, secs[i].dest, secs[i].base + offset, type,
+                     target->sym, target->sec, target->value);
+    }
+  }
+  ret = 0;
+
+done:
+  tcc_free(secs);
+  tcc_free(syms);
+  return ret;
+}
@@ -0,0 +1,769 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Compile-time evaluation of calls: a call whose arguments are all
+ * constants becomes a constant when the function can be run here.
+ *
+ * The body of a small integer function is kept as its token stream once
+ * it is compiled. A call runs the stream in an interpreter that knows
+ * integer locals and parameters, the operators the parser turns into
+ * gen_op() calls, if, while, for, return and calls to other kept
+ * functions. The operators are applied with fold_op(), the arithmetic of
+ * constant folding, and values are truncated where the compiled code
+ * stores them, so the result is the one the call would return at run
+ * time. Anything else (globals, pointers, other calls, an uninitialized
+ * local), a fault such as a division by zero, or running out of steps
+ * ends the evaluation and the call is compiled as usual. Such a function
+ * has no effect the caller could see, so pure functions are found by
+ * trying; those marked __attribute__((const)) or ((pure)) may be longer
+ * and run longer.
+ */
+
+#include "tcc.h"
+
+#define EVAL_MAX_TOKENS 512        /* longest body kept */
+#define EVAL_MAX_TOKENS_CONST 4096 /* for a function marked const */
+#define EVAL_MAX_STEPS (1 << 18)   /* per evaluation */
+#define EVAL_MAX_STEPS_CONST (1 << 24)
+#define EVAL_MAX_VARS 64
+#define EVAL_MAX_DEPTH 64
+
+typedef struct {
+  int64_t v;
+  int t;
+} EvalValue;
+
+typedef struct {
+  const char *name;
+  int t;
+  int set; /* assigned a value */
+  int64_t v;
+} EvalVar;
+
+/* One evaluation, across the calls it makes */
+typedef struct {
+  TCCState *s;
+  int steps;
+  int depth;
+  int failed;
+} EvalRun;
+
+/* One call being evaluated */
+typedef struct {
+  EvalRun *run;
+  EvalFunc *f;
+  int pos; /* current token */
+  EvalVar vars[EVAL_MAX_VARS];
+  int nb_vars;
+  int returned;
+  int64_t ret;
+} EvalFrame;
+
+static int eval_func(EvalRun *run, EvalFunc *f, const int64_t *args,
+                     int64_t *ret);
+
+/*============================================================
+ * Keeping Function Bodies
+ *============================================================*/
+
+static int eval_int_type(int t) {
+  t &= VT_BTYPE;
+  return t == VT_INT || t == VT_LLONG;
+}
+
+static void eval_free_func(EvalFunc *f) {
+  int i;
+
+  if (f->shared)
+    return;
+  for (i = 0; i < f->nb_toks; i++)
+    tcc_free(f->toks[i].str);
+  tcc_free(f->toks);
+  for (i = 0; i < f->nb_params; i++)
+    tcc_free(f->param_name[i]);
+}
+
+/* Keep the body of sym, about to be compiled from the current '{', if
+ * it may be evaluated: integer result and parameters, and short enough.
+ * The parameters are the nb_params locals above params. */
+void eval_record(TCCState *s, Sym *sym, int ret_type, Sym *params,
+                 int nb_params, int is_const) {
+  int max = is_const ? EVAL_MAX_TOKENS_CONST : EVAL_MAX_TOKENS;
+  int i, depth = 0, ok = 1;
+  TokenPos body;
+  EvalFunc f;
+  Sym *p;
+
+  if (!eval_int_type(ret_type) || nb_params > EVAL_MAX_PARAMS)
+    return;
+  memset(&f, 0, sizeof(f));
+  for (p = s->local_stack.top; p != params; p = p->prev) {
+    if (!eval_int_type(p->t))
+      return;
+    f.nb_params++;
+  }
+  if (f.nb_params != nb_params)
+    return; /* unnamed parameters */
+  i = f.nb_params;
+  for (p = s->local_stack.top; p != params; p = p->prev) {
+    i--;
+    f.param_type[i] = p->t;
+    f.param_name[i] = tcc_strdup(p->name);
+  }
+  f.func = sym;
+  f.is_const = is_const;
+  f.file = s->lto_file;
+
+  /* Read the body ahead up to its '}', then go back to the '{' */
+  tok_save(s, &body);
+  f.toks = tcc_malloc(max * sizeof(EvalToken));
+  do {
+    if (s->tok == '{')
+      depth++;
+    else if (s->tok == '}')
+      depth--;
+    if (f.nb_toks == max || s->tok == TOK_STR)
+      ok = 0;
+    if (ok) {
+      EvalToken *et = &f.toks[f.nb_toks++];
+      et->tok = s->tok;
+      et->i = s->tok == TOK_NUM ? s->tokc.i : 0;
+      et->str = s->tok == TOK_IDENT ? s->tokc.str : NULL;
+    } else if (s->tok == TOK_IDENT || s->tok == TOK_STR) {
+      tcc_free(s->tokc.str);
+    }
+    next(s);
+  } while (depth > 0 && s->tok != TOK_EOF);
+  tok_restore(s, &body);
+
+  if (!ok || depth > 0) {
+    eval_free_func(&f);
+    return;
+  }
+  s->eval_funcs =
+      tcc_realloc(s->eval_funcs, (s->nb_eval_funcs + 1) * sizeof(EvalFunc));
+  s->eval_funcs[s->nb_eval_funcs++] = f;
+}
+
+/* The outline state's record f of the function that is sym here */
+void eval_share(TCCState *s, Sym *sym, const EvalFunc *f) {
+  int i;
+
+  for (i = 0; i < s->nb_eval_funcs; i++) {
+    if (s->eval_funcs[i].func == sym)
+      return; /* a call found it already */
+  }
+  s->eval_funcs =
+      tcc_realloc(s->eval_funcs, (s->nb_eval_funcs + 1) * sizeof(EvalFunc));
+  s->eval_funcs[s->nb_eval_funcs] = *f;
+  s->eval_funcs[s->nb_eval_funcs].func = sym;
+  s->eval_funcs[s->nb_eval_funcs++].shared = 1;
+}
+
+void eval_free(TCCState *s) {
+  int i;
+
+  for (i = 0; i < s->nb_eval_funcs; i++)
+    eval_free_func(&s->eval_funcs[i]);
+  tcc_free(s->eval_funcs);
+  s->eval_funcs = NULL;
+  s->nb_eval_funcs = 0;
+}
+
+static EvalFunc *eval_find(TCCState *s, Sym *sym) {
+  EvalFunc *f;
+  int i;
+
+  for (i = 0; i < s->nb_eval_funcs; i++) {
+    if (s->eval_funcs[i].func == sym)
+      return &s->eval_funcs[i];
+  }
+
+  /* -flto: defined further on, maybe in another file */
+  f = lto_eval_find(s, sym->name, s->lto_file);
+  if (f) {
+    eval_share(s, sym, f);
+    return &s->eval_funcs[s->nb_eval_funcs - 1];
+  }
+  return NULL;
+}
+
+/*============================================================
+ * Interpreter
+ *============================================================*/
+
+/* Every parse function takes run: 0 only steps over the tokens, as for
+ * the branch not taken */
+
+static int ev_tok(EvalFrame *e) {
+  return e->pos < e->f->nb_toks ? e->f->toks[e->pos].tok : TOK_EOF;
+}
+
+static int ev_peek(EvalFrame *e, int n) {
+  return e->pos + n < e->f->nb_toks ? e->f->toks[e->pos + n].tok : TOK_EOF;
+}
+
+static void ev_fail(EvalFrame *e) { e->run->failed = 1; }
+
+static int ev_ok(EvalFrame *e) { return !e->run->failed && !e->returned; }
+
+/* Once returned, the rest of the body is not looked at */
+static void ev_skip(EvalFrame *e, int tok) {
+  if (!ev_ok(e))
+    return;
+  if (ev_tok(e) != tok)
+    ev_fail(e);
+  else
+    e->pos++;
+}
+
+static int ev_step(EvalFrame *e) {
+  int max = e->f->is_const ? EVAL_MAX_STEPS_CONST : EVAL_MAX_STEPS;
+
+  if (++e->run->steps > max)
+    ev_fail(e);
+  return !e->run->failed;
+}
+
+/* The value a local of type t holds after v is stored to it, as the
+ * load of it extends it again */
+static int64_t ev_extend(int t, int64_t v) {
+  if ((t & VT_BTYPE) == VT_LLONG)
+    return v;
+  return (t & VT_UNSIGNED) ? (int64_t)(uint32_t)v : (int64_t)(int32_t)v;
+}
+
+static EvalVar *ev_var(EvalFrame *e, const char *name) {
+  int i;
+
+  for (i = e->nb_vars - 1; i >= 0; i--) {
+    if (strcmp(e->vars[i].name, name) == 0)
+      return &e->vars[i];
+  }
+  ev_fail(e);
+  return NULL;
+}
+
+static void ev_expr(EvalFrame *e, int run, EvalValue *v);
+static void ev_cond(EvalFrame *e, int run, EvalValue *v);
+
+/* Call of a kept function with the arguments at the current '(' */
+static void ev_call(EvalFrame *e, int run, const char *name, EvalValue *v) {
+  int64_t args[EVAL_MAX_PARAMS];
+  EvalFunc *f = NULL;
+  EvalValue a;
+  Sym *sym;
+  int n = 0;
+
+  if (run) {
+    int i;
+    for (i = 0; i < e->nb_vars && strcmp(e->vars[i].name, name); i++)
+      ;
+    if (e->run->s->unit_mode == UNIT_MODULE) {
+      /* -flto: the names in the body are those of its own file */
+      f = i == e->nb_vars ? lto_eval_find(e->run->s, name, e->f->file) : NULL;
+    } else {
+      sym = global_sym_find2(e->run->s, name);
+      f = sym && i == e->nb_vars ? eval_find(e->run->s, sym) : NULL;
+    }
+    if (!f)
+      ev_fail(e);
+  }
+  ev_skip(e, '(');
+  while (ev_ok(e) && ev_tok(e) != ')') {
+    ev_cond(e, run, &a);
+    if (n == EVAL_MAX_PARAMS)
+      ev_fail(e);
+    else
+      args[n++] = a.v;
+    if (ev_tok(e) != ',')
+      break;
+    e->pos++;
+  }
+  ev_skip(e, ')');
+
+  v->t = VT_INT; /* as gfunc_call() leaves it */
+  v->v = 0;
+  if (run && ev_ok(e)) {
+    if (n != f->nb_params)
+      ev_fail(e);
+    else if (!eval_func(e->run, f, args, &v->v))
+      ev_fail(e);
+  }
+}
+
+static void ev_primary(EvalFrame *e, int run, EvalValue *v) {
+  EvalToken *et;
+  EvalVar *var;
+
+  v->t = VT_INT;
+  v->v = 0;
+  if (!ev_step(e))
+    return;
+  et = &e->f->toks[e->pos < e->f->nb_toks ? e->pos : 0];
+  switch (ev_tok(e)) {
+  case TOK_NUM:
+    v->v = et->i;
+    e->pos++;
+    break;
+  case '(':
+    e->pos++;
+    if (ev_tok(e) >= TOK_INT && ev_tok(e) <= TOK_DOUBLE) {
+      ev_fail(e); /* cast */
+      return;
+    }
+    ev_expr(e, run, v);
+    ev_skip(e, ')');
+    break;
+  case TOK_IDENT:
+    e->pos++;
+    if (ev_tok(e) == '(') {
+      ev_call(e, run, et->str, v);
+      break;
+    }
+    if (!run)
+      break;
+    var = ev_var(e, et->str);
+    if (!var || !var->set) {
+      ev_fail(e);
+      return;
+    }
+    v->t = var->t;
+    v->v = var->v;
+    break;
+  default:
+    ev_fail(e);
+    break;
+  }
+}
+
+/* x = x + 1 (x - 1), yielding the sum */
+static void ev_incdec(EvalFrame *e, int run, const char *name, int op,
+                      EvalValue *v) {
+  EvalVar *var;
+
+  if (!run)
+    return;
+  var = ev_var(e, name);
+  if (!var || !var->set || !fold_op(op, var->v, 1, var->t & VT_UNSIGNED,
+                                    &v->v)) {
+    ev_fail(e);
+    return;
+  }
+  v->t = var->t;
+  var->v = ev_extend(var->t, v->v);
+}
+
+static void ev_postfix(EvalFrame *e, int run, EvalValue *v) {
+  int start = e->pos, op;
+
+  ev_primary(e, run, v);
+  op = ev_tok(e);
+  if (op == TOK_INC || op == TOK_DEC) {
+    if (e->f->toks[start].tok != TOK_IDENT || e->pos != start + 1) {
+      ev_fail(e);
+      return;
+    }
+    e->pos++;
+    ev_incdec(e, run, e->f->toks[start].str, op == TOK_INC ? '+' : '-', v);
+    if (run && ev_ok(e))
+      fold_op(op == TOK_INC ? '-' : '+', v->v, 1, v->t & VT_UNSIGNED, &v->v);
+  } else if (op == '[' || op == '.' || op == TOK_ARROW) {
+    ev_fail(e);
+  }
+}
+
+static void ev_unary(EvalFrame *e, int run, EvalValue *v) {
+  int op = ev_tok(e);
+
+  switch (op) {
+  case '-':
+    e->pos++;
+    ev_unary(e, run, v);
+    if (run && !fold_op('-', 0, v->v, 0, &v->v))
+      ev_fail(e);
+    v->t = VT_INT; /* 0 - x */
+    break;
+  case '+':
+    e->pos++;
+    ev_unary(e, run, v);
+    break;
+  case '!':
+  case '~':
+    e->pos++;
+    ev_unary(e, run, v);
+    v->v = op == '!' ? !v->v : ~v->v;
+    if (op == '!')
+      v->t = VT_INT;
+    break;
+  case TOK_INC:
+  case TOK_DEC:
+    e->pos++;
+    if (ev_tok(e) != TOK_IDENT) {
+      ev_fail(e);
+      return;
+    }
+    e->pos++;
+    ev_incdec(e, run, e->f->toks[e->pos - 1].str, op == TOK_INC ? '+' : '-',
+              v);
+    break;
+  case TOK_IDENT:
+  case TOK_NUM:
+  case '(':
+    ev_postfix(e, run, v);
+    break;
+  default:
+    ev_fail(e); /* *, &, sizeof */
+    break;
+  }
+}
+
+/* Binary operators from the tightest, as in parse.c */
+static int ev_level(int tok) {
+  switch (tok) {
+  case '*':
+  case '/':
+  case '%':
+    return 8;
+  case '+':
+  case '-':
+    return 7;
+  case TOK_SHL:
+  case TOK_SHR:
+    return 6;
+  case '<':
+  case '>':
+  case TOK_LE:
+  case TOK_GE:
+  case TOK_EQ:
+  case TOK_NE:
+    return 5;
+  case '&':
+    return 4;
+  case '^':
+    return 3;
+  case '|':
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+static void ev_binary(EvalFrame *e, int run, int level, EvalValue *v) {
+  EvalValue r;
+  int op;
+
+  if (level > 8) {
+    ev_unary(e, run, v);
+    return;
+  }
+  ev_binary(e, run, level + 1, v);
+  while (ev_ok(e) && ev_level(op = ev_tok(e)) == level) {
+    e->pos++;
+    ev_binary(e, run, level + 1, &r);
+    if (run && ev_ok(e) &&
+        !fold_op(op, v->v, r.v, v->t & VT_UNSIGNED, &v->v))
+      ev_fail(e); /* a fault left to run time */
+    if (level == 5)
+      v->t = VT_INT;
+  }
+}
+
+/* c ? a : b, with the type of the wider arm as expr_cond() gives it */
+static void ev_cond(EvalFrame *e, int run, EvalValue *v) {
+  EvalValue a, b;
+  int c;
+
+  ev_binary(e, run, 2, v);
+  if (ev_tok(e) == TOK_AND || ev_tok(e) == TOK_OR) {
+    ev_fail(e);
+    return;
+  }
+  if (ev_tok(e) != '?')
+    return;
+  e->pos++;
+  c = v->v != 0;
+  ev_expr(e, run && c, &a);
+  ev_skip(e, ':');
+  ev_cond(e, run && !c, &b);
+  *v = c ? a : b;
+  if (type_size(b.t) > type_size(a.t))
+    v->t = b.t;
+}
+
+/* Assignment: the local gets the value as stored, the expression keeps
+ * the value assigned */
+static void ev_expr(EvalFrame *e, int run, EvalValue *v) {
+  EvalVar *var;
+  int tok = ev_peek(e, 1);
+
+  if (tok >= TOK_ADD_ASSIGN && tok <= TOK_SHR_ASSIGN) {
+    ev_fail(e);
+    return;
+  }
+  if (ev_tok(e) != TOK_IDENT || tok != '=') {
+    ev_cond(e, run, v);
+    return;
+  }
+  var = run ? ev_var(e, e->f->toks[e->pos].str) : NULL;
+  e->pos += 2;
+  ev_expr(e, run, v);
+  if (var && ev_ok(e)) {
+    var->v = ev_extend(var->t, v->v);
+    var->set = 1;
+    v->t = var->t;
+  }
+}
+
+/* int, long long, unsigned: the types of locals kept in 4 or 8 bytes */
+static int ev_type(EvalFrame *e) {
+  int t = VT_INT, found = 0;
+
+  while (1) {
+    switch (ev_tok(e)) {
+    case TOK_INT:
+    case TOK_SIGNED:
+    case TOK_CONST:
+      break;
+    case TOK_LONG:
+      t = (t & ~VT_BTYPE) | VT_LLONG;
+      break;
+    case TOK_UNSIGNED:
+      t |= VT_UNSIGNED;
+      break;
+    case TOK_CHAR:
+    case TOK_SHORT:
+    case TOK_VOID:
+    case TOK_FLOAT:
+    case TOK_DOUBLE:
+    case TOK_STATIC:
+    case TOK_EXTERN:
+      ev_fail(e);
+      return t;
+    default:
+      if (!found)
+        ev_fail(e);
+      return t;
+    }
+    found = 1;
+    e->pos++;
+  }
+}
+
+static void ev_decl(EvalFrame *e, int run) {
+  int t = ev_type(e);
+  EvalValue v;
+  EvalVar *var;
+
+  while (ev_ok(e)) {
+    if (ev_tok(e) != TOK_IDENT || e->nb_vars == EVAL_MAX_VARS) {
+      ev_fail(e);
+      return;
+    }
+    var = &e->vars[e->nb_vars++];
+    var->name = e->f->toks[e->pos++].str;
+    var->t = t;
+    var->set = 0;
+    if (ev_tok(e) == '=') {
+      e->pos++;
+      ev_expr(e, run, &v);
+      var->v = ev_extend(t, v.v);
+      var->set = 1;
+    }
+    if (ev_tok(e) != ',')
+      break;
+    e->pos++;
+  }
+  ev_skip(e, ';');
+}
+
+static int ev_is_decl(int tok) {
+  return tok == TOK_INT || tok == TOK_CHAR || tok == TOK_VOID ||
+         tok == TOK_SHORT || tok == TOK_LONG || tok == TOK_FLOAT ||
+         tok == TOK_DOUBLE || tok == TOK_STATIC || tok == TOK_EXTERN ||
+         tok == TOK_CONST || tok == TOK_UNSIGNED || tok == TOK_SIGNED;
+}
+
+static void ev_stmt(EvalFrame *e, int run) {
+  EvalValue v, inc;
+  int start, step, vars;
+
+  if (!ev_step(e))
+    return;
+  switch (ev_tok(e)) {
+  case '{':
+    e->pos++;
+    vars = e->nb_vars;
+    while (ev_ok(e) && ev_tok(e) != '}') {
+      if (ev_tok(e) == TOK_EOF)
+        ev_fail(e);
+      else if (ev_is_decl(ev_tok(e)))
+        ev_decl(e, run);
+      else
+        ev_stmt(e, run);
+    }
+    ev_skip(e, '}');
+    e->nb_vars = vars;
+    break;
+
+  case TOK_IF:
+    e->pos++;
+    ev_skip(e, '(');
+    ev_expr(e, run, &v);
+    ev_skip(e, ')');
+    start = v.v != 0;
+    ev_stmt(e, run && start);
+    if (ev_ok(e) && ev_tok(e) == TOK_ELSE) {
+      e->pos++;
+      ev_stmt(e, run && !start);
+    }
+    break;
+
+  case TOK_WHILE:
+    e->pos++;
+    ev_skip(e, '(');
+    start = e->pos;
+    while (ev_ok(e)) {
+      e->pos = start;
+      ev_expr(e, run, &v);
+      ev_skip(e, ')');
+      if (!run || !v.v) {
+        ev_stmt(e, 0);
+        break;
+      }
+      ev_stmt(e, run);
+    }
+    break;
+
+  case TOK_FOR:
+    e->pos++;
+    ev_skip(e, '(');
+    if (ev_tok(e) != ';')
+      ev_expr(e, run, &v);
+    ev_skip(e, ';');
+    start = e->pos;
+    while (ev_ok(e)) {
+      e->pos = start;
+      v.v = 1;
+      if (ev_tok(e) != ';')
+        ev_expr(e, run, &v);
+      ev_skip(e, ';');
+      step = e->pos;
+      if (ev_tok(e) != ')')
+        ev_expr(e, 0, &inc);
+      ev_skip(e, ')');
+      if (!run || !v.v) {
+        ev_stmt(e, 0);
+        break;
+      }
+      ev_stmt(e, run);
+      if (!ev_ok(e))
+        break;
+      e->pos = step;
+      if (ev_tok(e) != ')')
+        ev_expr(e, run, &inc);
+    }
+    break;
+
+  case TOK_RETURN:
+    e->pos++;
+    v.v = 0;
+    if (ev_tok(e) == ';') {
+      if (run)
+        ev_fail(e); /* no value to fold */
+    } else {
+      ev_expr(e, run, &v);
+    }
+    ev_skip(e, ';');
+    if (run && ev_ok(e)) {
+      e->returned = 1;
+      e->ret = v.v;
+    }
+    break;
+
+  case ';':
+    e->pos++;
+    break;
+
+  case TOK_IDENT:
+  case TOK_NUM:
+  case TOK_INC:
+  case TOK_DEC:
+  case '(':
+  case '-':
+  case '!':
+  case '~':
+    ev_expr(e, run, &v);
+    ev_skip(e, ';');
+    break;
+
+  default:
+    /* do, break, continue, switch, and declarations out of a block
+       are compiled in ways the interpreter does not follow */
+    ev_fail(e);
+    break;
+  }
+}
+
+/* Run f on args; 0 if it could not be run to a return */
+static int eval_func(EvalRun *run, EvalFunc *f, const int64_t *args,
+                     int64_t *ret) {
+  EvalFrame *e;
+  int i, ok;
+
+  if (run->depth == EVAL_MAX_DEPTH)
+    return 0;
+  e = tcc_malloc(sizeof(EvalFrame));
+  memset(e, 0, sizeof(*e));
+  e->run = run;
+  e->f = f;
+  for (i = 0; i < f->nb_params; i++) {
+    e->vars[i].name = f->param_name[i];
+    e->vars[i].t = f->param_type[i];
+    e->vars[i].set = 1;
+    e->vars[i].v = ev_extend(f->param_type[i], args[i]);
+  }
+  e->nb_vars = f->nb_params;
+
+  run->depth++;
+  ev_stmt(e, 1);
+  run->depth--;
+  ok = !run->failed && e->returned;
+  *ret = e->ret;
+  tcc_free(e);
+  return ok;
+}
+
+/*============================================================
+ * Folding Calls
+ *============================================================*/
+
+/* The call of vtop[-nb_args] on the nb_args values above it, replaced
+ * by its result if the arguments are constants and the function can be
+ * evaluated on them. Returns 1 when it was. */
+int eval_call(TCCState *s, int nb_args) {
+  int64_t args[EVAL_MAX_PARAMS], v;
+  SValue *func = s->vtop - nb_args;
+  EvalRun run;
+  EvalFunc *f;
+  int i;
+
+  if ((func->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != (VT_CONST | VT_SYM) ||
+      !func->sym || !(f = eval_find(s, func->sym)) || f->nb_params != nb_args)
+    return 0;
+  for (i = 0; i < nb_args; i++) {
+    SValue *sv = func + 1 + i;
+    if ((sv->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST)
+      return 0;
+    args[i] = sv->c.i;
+  }
+
+  memset(&run, 0, sizeof(run));
+  run.s = s;
+  if (!eval_func(&run, f, args, &v))
+    return 0;
+
+  s->vtop = func - 1;
+  vset(s, VT_INT, VT_CONST, v); /* as gfunc_call() leaves it */
+  return 1;
+}
@@ -29,6 +29,7 @@ void gen_init(TCCState *s) {
 
 /* Push a typed constant onto the value stack */
 void vsetc(TCCState *s, int t, int r, CValue *vc) {
+  vcheck_cmp(s);
   s->vtop++;
   if (s->vtop >= s->vstack + VSTACK_SIZE) {
     tcc_error(s, "value stack overflow");
@@ -52,6 +53,7 @@ void vset(TCCState *s, int t, int r, int64_t v) {
 
 /* Duplicate the top of stack */
 void vpush(TCCState *s) {
+  vcheck_cmp(s);
   s->vtop++;
   if (s->vtop >= s->vstack + VSTACK_SIZE) {
     tcc_error(s, "value stack overflow");
@@ -96,24 +98,104 @@ void save_reg(TCCState *s, int r) {
       /* Allocate stack slot (8 bytes aligned) */
       s->loc = (s->loc - 8) & ~7;
 
-      /* Store register r to this slot */
+      /* Store register r to this slot; for an lvalue r holds its
+         address */
       SValue spill_sv;
-      spill_sv.t = sv->t;
+      spill_sv.t = (sv->r & VT_LVAL) ? VT_PTR : sv->t;
       spill_sv.r = VT_LOCAL | VT_LVAL;
       spill_sv.c.i = s->loc;
 
       store(s, r, &spill_sv);
 
       /* Update stack value to point to this slot */
-      sv->r = VT_LOCAL | VT_LVAL;
+      sv->r = (sv->r & VT_LVAL) ? VT_LLOCAL | VT_LVAL : VT_LOCAL | VT_LVAL;
       sv->c.i = s->loc;
     }
   }
 }
 
+/* The flags do not survive the code of the next value: a comparison
+ * still held in them (VT_CMP) goes to a register first */
+void vcheck_cmp(TCCState *s) {
+  if (s->vtop >= s->vstack && (s->vtop->r & VT_VALMASK) == VT_CMP)
+    gv(s, RC_INT);
+}
+
+/* Registers handed out for values, in order of preference. All are
+   caller-saved, so the prologue has nothing to preserve. */
+static const int reg_pool[] = {REG_RAX, REG_RCX, REG_RDX, REG_R8,
+                               REG_R9,  REG_R10, REG_R11};
+#define NB_POOL_REGS (int)(sizeof(reg_pool) / sizeof(reg_pool[0]))
+
+/* The one register class rc names, -1 for any pool register */
+static int class_reg(int rc) {
+  static const struct {
+    int rc, r;
+  } fixed[] = {{RC_RAX, REG_RAX}, {RC_RCX, REG_RCX}, {RC_RDX, REG_RDX},
+               {RC_R8, REG_R8},   {RC_R9, REG_R9},   {RC_R10, REG_R10},
+               {RC_R11, REG_R11}};
+  int i;
+
+  for (i = 0; i < (int)(sizeof(fixed) / sizeof(fixed[0])); i++) {
+    if (rc & fixed[i].rc)
+      return fixed[i].r;
+  }
+  return -1;
+}
+
+/* Bit r set for each register a value on the stack occupies */
+static unsigned used_regs(TCCState *s) {
+  unsigned used = 0;
+  SValue *sv;
+
+  for (sv = s->vstack; sv <= s->vtop; sv++) {
+    if ((sv->r & VT_VALMASK) < NB_REGS)
+      used |= 1u << (sv->r & VT_VALMASK);
+  }
+  return used;
+}
+
+/* Number of registers the values on the stack occupy */
+int nb_used_regs(TCCState *s) {
+  unsigned used = used_regs(s);
+  int n;
+
+  for (n = 0; used; used &= used - 1)
+    n++;
+  return n;
+}
+
+/* Register for a value of class rc: the fixed one, or a free pool
+ * register, avoiding those in avoid if possible. With none free, the
+ * register of the value deepest in the stack, used last, is spilled. */
+static int get_reg(TCCState *s, int rc, unsigned avoid) {
+  unsigned used = used_regs(s);
+  SValue *sv;
+  int i, r = class_reg(rc);
+
+  if (r >= 0)
+    return r;
+  for (i = 0; i < NB_POOL_REGS; i++) {
+    if (!(used & (1u << reg_pool[i])) && !(avoid & (1u << reg_pool[i])))
+      return reg_pool[i];
+  }
+  for (i = 0; i < NB_POOL_REGS; i++) {
+    if (!(used & (1u << reg_pool[i])))
+      return reg_pool[i];
+  }
+  for (sv = s->vstack; sv < s->vtop; sv++) {
+    r = sv->r & VT_VALMASK;
+    for (i = 0; i < NB_POOL_REGS; i++) {
+      if (reg_pool[i] == r)
+        return r;
+    }
+  }
+  return REG_RAX;
+}
+
 /* Get value into register of class rc */
 int gv(TCCState *s, int rc) {
-  int r;
+  int r, n, fixed;
 
   if (s->vtop < s->vstack) {
     tcc_error(s, "nothing on value stack");
@@ -122,30 +204,13 @@ int gv(TCCState *s, int rc) {
 
   /* If already in a suitable register, return */
   r = s->vtop->r & 0x00ff;
-  if (r < NB_REGS) {
-    int match = 1;
-    if ((rc & RC_RAX) && r != REG_RAX)
-      match = 0;
-    else if ((rc & RC_RCX) && r != REG_RCX)
-      match = 0;
-    else if ((rc & RC_RDX) && r != REG_RDX)
-      match = 0;
-
-    if (match)
-      return r;
-  }
+  fixed = class_reg(rc);
+  if (r < NB_REGS && !(s->vtop->r & VT_LVAL) && (fixed < 0 || r == fixed))
+    return r;
 
-  /* Need to load into register */
-  if (rc & RC_RAX) {
-    r = REG_RAX;
-  } else if (rc & RC_RCX) {
-    r = REG_RCX;
-  } else if (rc & RC_RDX) {
-    r = REG_RDX;
-  } else {
-    /* Default to RAX */
-    r = REG_RAX;
-  }
+  /* A comparison result is best made in a register its compare does
+   * not read, which can be cleared before the compare */
+  r = get_reg(s, rc, r == VT_CMP ? (unsigned)s->cmp_regs : 0);
 
   /* Spill register if it is in use */
   save_reg(s, r);
@@ -153,16 +218,19 @@ int gv(TCCState *s, int rc) {
   load(s, r, s->vtop);
   s->vtop->r = r;
 
+  n = nb_used_regs(s);
+  if (n > s->reg_peak)
+    s->reg_peak = n;
+
   return r;
 }
 
-/* Get two values into registers (ensures different registers) */
+/* Get vtop[-1] into a register of class rc1 and vtop into one of class
+   rc2, different registers */
 void gv2(TCCState *s, int rc1, int rc2) {
-  /* Load second operand into RCX */
-  gv(s, RC_RCX);
+  gv(s, rc2);
   vswap(s);
-  /* Load first operand into RAX */
-  gv(s, RC_RAX);
+  gv(s, rc1);
   vswap(s);
 }
 
@@ -170,6 +238,185 @@ void gv2(TCCState *s, int rc1, int rc2) {
  * Code Generation Operations
  *============================================================*/
 
+/* Bytes an object of type t takes */
+int type_size(int t) {
+  switch (t & VT_BTYPE) {
+  case VT_BYTE:
+  case VT_BOOL:
+    return 1;
+  case VT_SHORT:
+    return 2;
+  case VT_PTR:
+  case VT_LLONG:
+  case VT_LONG:
+  case VT_DOUBLE:
+    return 8;
+  default:
+    return 4;
+  }
+}
+
+/* Type a pointer (or array) type points to: parse_pointer() keeps it in
+   the upper bits */
+int pointed_type(int t) { return (int)(((unsigned)t >> 16) & 0xffff); }
+
+/* Replace the pointer on top of the stack by the object it points to.
+ * A frame address stays a stack slot; any other pointer is loaded into
+ * a register first. */
+void indir(TCCState *s) {
+  if ((s->vtop->t & VT_BTYPE) != VT_PTR) {
+    tcc_error(s, "pointer expected");
+    return;
+  }
+  if ((s->vtop->r & (VT_VALMASK | VT_LVAL)) != VT_LOCAL)
+    gv(s, RC_INT);
+  s->vtop->t = pointed_type(s->vtop->t);
+  s->vtop->r |= VT_LVAL;
+}
+
+/* Plain compile-time constant: no symbol, not an lvalue */
+static int is_const(SValue *sv) {
+  return (sv->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
+}
+
+/* Pointer arithmetic: an integer added to or subtracted from a pointer
+ * counts elements, and so does the difference of two pointers. A
+ * constant offset from a frame address stays a frame address. Returns
+ * 0 if neither operand is a pointer. */
+static int gen_ptr_op(TCCState *s, int op) {
+  int t1 = s->vtop[-1].t, t2 = s->vtop->t, size, shift;
+
+  if ((t2 & VT_BTYPE) == VT_PTR && (t1 & VT_BTYPE) != VT_PTR) {
+    if (op != '+')
+      return 0;
+    vswap(s);
+    t1 = t2;
+  } else if ((t1 & VT_BTYPE) != VT_PTR) {
+    return 0;
+  }
+  size = type_size(pointed_type(t1));
+  for (shift = 0; (1 << shift) < size; shift++)
+    ;
+
+  if ((s->vtop->t & VT_BTYPE) == VT_PTR) {
+    /* (p - q) / size */
+    s->vtop[-1].t = VT_LLONG;
+    s->vtop->t = VT_LLONG;
+    gen_opi(s, '-');
+    if (shift) {
+      vset(s, VT_LLONG, VT_CONST, shift);
+      gen_op(s, TOK_SHR);
+    }
+    return 1;
+  }
+
+  /* A narrower index in memory is loaded, and so extended, at its own
+     width before it takes part in 64-bit address arithmetic */
+  if ((s->vtop->r & VT_LVAL) && type_size(s->vtop->t) < 8)
+    gv(s, RC_INT);
+  if (shift) {
+    vset(s, VT_LLONG, VT_CONST, shift);
+    gen_op(s, TOK_SHL);
+  }
+  if ((s->vtop[-1].r & (VT_VALMASK | VT_LVAL)) == VT_LOCAL &&
+      is_const(s->vtop)) {
+    s->vtop[-1].c.i += op == '+' ? s->vtop->c.i : -s->vtop->c.i;
+    vpop(s);
+  } else {
+    s->vtop->t = VT_LLONG;
+    gen_opi(s, op);
+  }
+  s->vtop->t = t1 & ~VT_ARRAY;
+  return 1;
+}
+
+/* Apply binary op to constants a and b as the code gen_opi emits for
+ * it would, 64 bits wide, unsigned if uns. Returns 0 for an operator
+ * it does not know or a division that would fault. */
+int fold_op(int op, int64_t a, int64_t b, int uns, int64_t *res) {
+  int64_t v;
+
+  switch (op) {
+  case '+':
+    v = (int64_t)((uint64_t)a + (uint64_t)b);
+    break;
+  case '-':
+    v = (int64_t)((uint64_t)a - (uint64_t)b);
+    break;
+  case '*':
+    v = (int64_t)((uint64_t)a * (uint64_t)b);
+    break;
+  case '/':
+  case '%':
+    /* Leave the fault to run time */
+    if (b == 0 || (a == INT64_MIN && b == -1))
+      return 0;
+    v = op == '/' ? a / b : a % b;
+    break;
+  case '&':
+    v = a & b;
+    break;
+  case '|':
+    v = a | b;
+    break;
+  case '^':
+    v = a ^ b;
+    break;
+  case TOK_SHL:
+    v = (int64_t)((uint64_t)a << (b & 63));
+    break;
+  case TOK_SHR:
+    v = uns ? (int64_t)((uint64_t)a >> (b & 63)) : a >> (b & 63);
+    break;
+  case TOK_EQ:
+    v = a == b;
+    break;
+  case TOK_NE:
+    v = a != b;
+    break;
+  case '<':
+    v = uns ? (uint64_t)a < (uint64_t)b : a < b;
+    break;
+  case '>':
+    v = uns ? (uint64_t)a > (uint64_t)b : a > b;
+    break;
+  case TOK_LE:
+    v = uns ? (uint64_t)a <= (uint64_t)b : a <= b;
+    break;
+  case TOK_GE:
+    v = uns ? (uint64_t)a >= (uint64_t)b : a >= b;
+    break;
+  default:
+    return 0;
+  }
+
+  *res = v;
+  return 1;
+}
+
+/* Constant folding: evaluate op now if its operands are constants.
+ * Returns 1 when the result replaced the operands. */
+static int gen_fold(TCCState *s, int op) {
+  int64_t v;
+
+  if (!s->pass[PASS_FOLD_CONSTANTS] || !is_const(s->vtop))
+    return 0;
+
+  if (op == '!' || op == '~') {
+    s->vtop->c.i = op == '!' ? !s->vtop->c.i : ~s->vtop->c.i;
+    return 1;
+  }
+
+  if (s->vtop < s->vstack + 1 || !is_const(s->vtop - 1) ||
+      !fold_op(op, s->vtop[-1].c.i, s->vtop[0].c.i,
+               (s->vtop[-1].t & VT_UNSIGNED) != 0, &v))
+    return 0;
+
+  vpop(s);
+  s->vtop->c.i = v;
+  return 1;
+}
+
 /* Generate operation on top two stack values */
 void gen_op(TCCState *s, int op) {
   if (s->vtop < s->vstack) {
@@ -177,6 +424,11 @@ void gen_op(TCCState *s, int op) {
     return;
   }
 
+  if ((op == '+' || op == '-') && s->vtop > s->vstack && gen_ptr_op(s, op))
+    return;
+  if (op != '=' && gen_fold(s, op))
+    return;
+
   switch (op) {
   case '=':
     /* Assignment */
@@ -185,9 +437,24 @@ void gen_op(TCCState *s, int op) {
       return;
     }
     {
+      int r, t;
+
+      /* A destination address that was spilled goes back to a register */
+      if ((s->vtop[-1].r & VT_VALMASK) == VT_LLOCAL) {
+        vswap(s);
+        t = s->vtop->t;
+        s->vtop->t = VT_PTR;
+        s->vtop->r = VT_LOCAL | VT_LVAL;
+        gv(s, RC_INT);
+        s->vtop->r |= VT_LVAL;
+        s->vtop->t = t;
+        vswap(s);
+      }
+
       /* Load source into register */
-      int r = gv(s, RC_INT);
+      r = gv(s, RC_INT);
       vpop(s);
+      s->nb_effects++;
 
       /* Store to destination */
       store(s, r, s->vtop);
@@ -221,7 +488,6 @@ void gen_op(TCCState *s, int op) {
 
   case '!':
     /* Logical NOT */
-    gv(s, RC_INT);
     gen_opi(s, '!');
     break;
 
@@ -270,5 +536,7 @@ Sym *gind(TCCState *s) {
   sym = tcc_malloc(sizeof(Sym));
   memset(sym, 0, sizeof(Sym));
   sym->c = -1;
+  sym->prev = s->anon_labels;
+  s->anon_labels = sym;
   return sym;
 }
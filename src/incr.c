@@ -0,0 +1,415 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Incremental linking (-incremental). Every function of the executable
+ * gets a slot in .text with room to grow, and .text room for functions
+ * to come. The slots and a hash of each are kept in a database next to
+ * the image (app.exe -> app.ilk). The next link puts every function
+ * back in its slot, unless it outgrew it: a function that did, or a new
+ * one, goes to free space. If nothing else in the image changed and
+ * the file is still the one the last link wrote, only the slots whose
+ * hash changed are written into it. Otherwise, or when .text has no
+ * space left, the image is written in full with fresh slots.
+ */
+
+#include "tcc.h"
+
+#define INCR_MAGIC 0x49434354 /* "TCCI" */
+#define INCR_HEADER_SIZE 32
+
+/* Room for a function of size bytes to grow */
+static uint32_t incr_slot(uint32_t size) {
+  return (size + size / 4 + 16 + 15) & ~15u;
+}
+
+static uint32_t incr_hash(uint32_t h, const uint8_t *p, uint32_t len) {
+  while (len-- > 0)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+/*============================================================
+ * Database
+ *============================================================*/
+
+/* Read the slots of the last link, if there is one whose database
+   makes sense */
+static void incr_read(TCCState *s, IncrLink *l) {
+  uint32_t header[INCR_HEADER_SIZE / 4];
+  uint32_t *recs;
+  char *names, *p;
+  int i, n;
+  FILE *f;
+
+  f = fopen(l->db, "rb");
+  if (!f)
+    return;
+  if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+      header[0] != INCR_MAGIC) {
+    tcc_warning(s, "'%s' is not an incremental link database", l->db);
+    fclose(f);
+    return;
+  }
+  n = (int)header[1];
+  recs = tcc_malloc((n + 1) * 3 * sizeof(uint32_t));
+  names = tcc_malloc(header[2] + 1);
+  names[header[2]] = '\0';
+  if (fread(recs, 3 * sizeof(uint32_t), n, f) != (size_t)n ||
+      fread(names, 1, header[2], f) != header[2]) {
+    tcc_warning(s, "'%s' is truncated", l->db);
+    n = 0;
+  }
+  fclose(f);
+
+  l->old = tcc_malloc((n + 1) * sizeof(IncrFunc));
+  p = names;
+  for (i = 0; i < n; i++) {
+    l->old[i].name = tcc_strdup(p);
+    l->old[i].offset = recs[3 * i];
+    l->old[i].slot = recs[3 * i + 1];
+    l->old[i].hash = recs[3 * i + 2];
+    l->old[i].old = -1;
+    p += strlen(p);
+    if (p < names + header[2])
+      p++;
+  }
+  l->nb_old = n;
+  l->old_used = tcc_malloc(n + 1);
+  memset(l->old_used, 0, n + 1);
+  l->text_size = header[3];
+  l->image_size = header[4];
+  l->rest_hash = header[5];
+  l->image_hash = header[6];
+  tcc_free(names);
+  tcc_free(recs);
+}
+
+static int incr_write_db(TCCState *s, IncrLink *l) {
+  uint32_t header[INCR_HEADER_SIZE / 4];
+  uint32_t names_size = 0;
+  FILE *f;
+  int i;
+
+  for (i = 0; i < l->nb_funcs; i++)
+    names_size += (uint32_t)strlen(l->funcs[i].name) + 1;
+  memset(header, 0, sizeof(header));
+  header[0] = INCR_MAGIC;
+  header[1] = (uint32_t)l->nb_funcs;
+  header[2] = names_size;
+  header[3] = l->text_size;
+  header[4] = l->image_size;
+  header[5] = l->rest_hash;
+  header[6] = l->image_hash;
+
+  f = fopen(l->db, "wb");
+  if (!f) {
+    tcc_error(s, "cannot create '%s'", l->db);
+    return -1;
+  }
+  fwrite(header, 1, sizeof(header), f);
+  for (i = 0; i < l->nb_funcs; i++) {
+    uint32_t rec[3];
+    rec[0] = l->funcs[i].offset;
+    rec[1] = l->funcs[i].slot;
+    rec[2] = l->funcs[i].hash;
+    fwrite(rec, sizeof(rec), 1, f);
+  }
+  for (i = 0; i < l->nb_funcs; i++)
+    fwrite(l->funcs[i].name, 1, strlen(l->funcs[i].name) + 1, f);
+  fclose(f);
+  return 0;
+}
+
+void incr_free(IncrLink *l) {
+  int i;
+
+  if (!l)
+    return;
+  for (i = 0; i < l->nb_funcs; i++)
+    tcc_free(l->funcs[i].name);
+  for (i = 0; i < l->nb_old; i++)
+    tcc_free(l->old[i].name);
+  tcc_free(l->funcs);
+  tcc_free(l->old);
+  tcc_free(l->old_used);
+  tcc_free(l->db);
+  tcc_free(l);
+}
+
+/*============================================================
+ * Slots
+ *============================================================*/
+
+/* The first free space of size bytes in .text of size end, where the
+   nb functions sorted by offset are placed; -1 if there is none */
+static int64_t incr_find_space(IncrFunc **placed, int nb, uint32_t size,
+                               uint32_t end) {
+  uint32_t pos = 0;
+  int i;
+
+  for (i = 0; i <= nb; i++) {
+    uint32_t next = i < nb ? placed[i]->offset : end;
+    if (next >= pos && next - pos >= size)
+      return pos;
+    if (i < nb)
+      pos = placed[i]->offset + placed[i]->slot;
+  }
+  return -1;
+}
+
+static int incr_offset_cmp(const void *a, const void *b) {
+  const IncrFunc *fa = *(IncrFunc *const *)a, *fb = *(IncrFunc *const *)b;
+  return fa->offset < fb->offset ? -1 : fa->offset > fb->offset;
+}
+
+/* Put the functions back in the slots of the last link, and those that
+   do not fit theirs in free space; 0 if .text has no room for them */
+static int incr_keep_slots(IncrLink *l, const uint32_t *size) {
+  IncrFunc **placed;
+  int nb_placed = 0;
+  int i, j, ok = 1;
+
+  placed = tcc_malloc((l->nb_funcs + 1) * sizeof(IncrFunc *));
+  for (i = 0; i < l->nb_funcs; i++) {
+    IncrFunc *f = &l->funcs[i];
+    f->old = -1;
+    for (j = 0; j < l->nb_old; j++) {
+      if (!l->old_used[j] && strcmp(l->old[j].name, f->name) == 0)
+        break;
+    }
+    if (j < l->nb_old) {
+      l->old_used[j] = 1;
+      f->old = j;
+      if (size[i] <= l->old[j].slot) {
+        f->offset = l->old[j].offset;
+        f->slot = l->old[j].slot;
+        placed[nb_placed++] = f;
+      }
+    }
+  }
+
+  for (i = 0; i < l->nb_funcs && ok; i++) {
+    IncrFunc *f = &l->funcs[i];
+    int64_t pos;
+    if (f->old >= 0 && size[i] <= l->old[f->old].slot)
+      continue;
+    qsort(placed, nb_placed, sizeof(IncrFunc *), incr_offset_cmp);
+    f->slot = incr_slot(size[i]);
+    pos = incr_find_space(placed, nb_placed, f->slot, l->text_size);
+    if (pos < 0) {
+      /* Take what there is if the padding does not fit */
+      f->slot = size[i];
+      pos = incr_find_space(placed, nb_placed, f->slot, l->text_size);
+    }
+    if (pos < 0)
+      ok = 0;
+    f->offset = (uint32_t)pos;
+    placed[nb_placed++] = f;
+  }
+  tcc_free(placed);
+  return ok;
+}
+
+/* Fresh slots in layout order, with a quarter more for new code */
+static void incr_new_slots(IncrLink *l, const uint32_t *size) {
+  uint32_t pos = 0;
+  int i;
+
+  for (i = 0; i < l->nb_funcs; i++) {
+    l->funcs[i].offset = pos;
+    l->funcs[i].slot = incr_slot(size[i]);
+    pos += l->funcs[i].slot;
+  }
+  l->text_size = (pos + pos / 4 + 15) & ~15u;
+  memset(l->old_used, 0, l->nb_old + 1);
+}
+
+/* Called once the layout is final: give each function of .text its
+ * slot for the link into filename, and move the code there */
+int incr_layout(TCCState *s, const char *filename) {
+  IncrLink *l;
+  Sym **funcs;
+  uint32_t *size, *start;
+  int *order, *sorted;
+  const char *ext;
+  size_t len;
+  int i, j, n, nb_unnamed = 0;
+
+  l = tcc_malloc(sizeof(IncrLink));
+  memset(l, 0, sizeof(IncrLink));
+  s->incr = l;
+
+  /* app.exe -> app.ilk */
+  ext = strrchr(filename, '.');
+  len = ext && !strpbrk(ext, "/\\") ? (size_t)(ext - filename)
+                                    : strlen(filename);
+  l->db = tcc_malloc(len + 5);
+  memcpy(l->db, filename, len);
+  strcpy(l->db + len, ".ilk");
+  incr_read(s, l);
+  if (!l->old_used) {
+    l->old_used = tcc_malloc(1);
+    l->old_used[0] = 0;
+  }
+
+  /* The functions in layout order, with all of their chunks */
+  n = s->nb_text_chunks;
+  funcs = tcc_malloc((n + 1) * sizeof(Sym *));
+  size = tcc_malloc((n + 1) * sizeof(uint32_t));
+  l->funcs = tcc_malloc((n + 1) * sizeof(IncrFunc));
+  for (i = 0; i < n; i++) {
+    Sym *f = s->text_chunks[i].func;
+    uint32_t end = i + 1 < n ? s->text_chunks[i + 1].start
+                             : (uint32_t)s->text_section->data_size;
+    for (j = 0; j < l->nb_funcs && funcs[j] != f; j++)
+      ;
+    if (j == l->nb_funcs) {
+      char name[32];
+      funcs[j] = f;
+      size[j] = 0;
+      if (f && f->name) {
+        l->funcs[j].name = tcc_strdup(f->name);
+      } else {
+        snprintf(name, sizeof(name), "#%d", nb_unnamed++);
+        l->funcs[j].name = tcc_strdup(name);
+      }
+      l->funcs[j].hash = 0;
+      l->funcs[j].old = -1;
+      l->nb_funcs++;
+    }
+    size[j] += end - s->text_chunks[i].start;
+  }
+
+  l->patch = l->nb_old > 0 && incr_keep_slots(l, size);
+  if (!l->patch)
+    incr_new_slots(l, size);
+
+  /* Each function's chunks go to its slot, in slot order */
+  sorted = tcc_malloc((l->nb_funcs + 1) * sizeof(int));
+  for (i = 0; i < l->nb_funcs; i++)
+    sorted[i] = i;
+  for (i = 1; i < l->nb_funcs; i++) {
+    int f = sorted[i];
+    for (j = i; j > 0 && l->funcs[sorted[j - 1]].offset > l->funcs[f].offset;
+         j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = f;
+  }
+  order = tcc_malloc((n + 1) * sizeof(int));
+  start = tcc_malloc((n + 1) * sizeof(uint32_t));
+  for (i = 0, j = 0; i < l->nb_funcs; i++) {
+    IncrFunc *f = &l->funcs[sorted[i]];
+    uint32_t pos = f->offset;
+    int c;
+    for (c = 0; c < n; c++) {
+      if (s->text_chunks[c].func != funcs[sorted[i]])
+        continue;
+      order[j] = c;
+      start[j++] = pos;
+      pos += (c + 1 < n ? s->text_chunks[c + 1].start
+                        : (uint32_t)s->text_section->data_size) -
+             s->text_chunks[c].start;
+    }
+  }
+  text_place(s, order, start, j, l->text_size);
+
+  if (s->verbose)
+    printf("Incremental link: %s slots for %d functions\n",
+           l->patch ? "kept" : "new", l->nb_funcs);
+
+  tcc_free(start);
+  tcc_free(order);
+  tcc_free(sorted);
+  tcc_free(size);
+  tcc_free(funcs);
+  return 0;
+}
+
+/*============================================================
+ * Output
+ *============================================================*/
+
+/* Whether f still holds the image the last link wrote, size bytes
+   that hash to hash, and not one some other link put in its place */
+static int incr_on_disk(FILE *f, uint32_t size, uint32_t hash) {
+  uint8_t *data;
+  int same;
+
+  fseek(f, 0, SEEK_END);
+  if (ftell(f) != (long)size)
+    return 0;
+  fseek(f, 0, SEEK_SET);
+  data = tcc_malloc(size + 1);
+  same = fread(data, 1, size, f) == size &&
+         incr_hash(2166136261u, data, size) == hash;
+  tcc_free(data);
+  return same;
+}
+
+/* Write image, whose .text is at text_pos, to filename: as a patch of
+ * the slots that changed if the last link left the rest as it is */
+int incr_write(TCCState *s, const char *filename, const uint8_t *image,
+               uint32_t size, uint32_t text_pos) {
+  IncrLink *l = s->incr;
+  const uint8_t *text = image + text_pos;
+  uint32_t rest;
+  int i, nb_written = 0;
+  FILE *f = NULL;
+
+  for (i = 0; i < l->nb_funcs; i++)
+    l->funcs[i].hash =
+        incr_hash(2166136261u, text + l->funcs[i].offset, l->funcs[i].slot);
+  rest = incr_hash(2166136261u, image, text_pos);
+  rest = incr_hash(rest, text + l->text_size, size - text_pos - l->text_size);
+
+  if (l->patch && size == l->image_size && rest == l->rest_hash) {
+    f = fopen(filename, "r+b");
+    if (f && !incr_on_disk(f, size, l->image_hash)) {
+      fclose(f);
+      f = NULL;
+    }
+  }
+
+  if (f) {
+    /* Slots whose code changed, and the ones given up */
+    for (i = 0; i < l->nb_funcs; i++) {
+      IncrFunc *fn = &l->funcs[i];
+      if (fn->old >= 0 && l->old[fn->old].offset == fn->offset &&
+          l->old[fn->old].slot == fn->slot && l->old[fn->old].hash == fn->hash)
+        continue;
+      fseek(f, (long)(text_pos + fn->offset), SEEK_SET);
+      fwrite(text + fn->offset, 1, fn->slot, f);
+      nb_written++;
+    }
+    for (i = 0; i < l->nb_old; i++) {
+      IncrFunc *fn = &l->old[i];
+      int kept = 0, j;
+      for (j = 0; j < l->nb_funcs && !kept; j++)
+        kept = l->funcs[j].old == i && l->funcs[j].offset == fn->offset &&
+               l->funcs[j].slot == fn->slot;
+      if (kept)
+        continue;
+      fseek(f, (long)(text_pos + fn->offset), SEEK_SET);
+      fwrite(text + fn->offset, 1, fn->slot, f);
+    }
+    fclose(f);
+  } else {
+    f = fopen(filename, "wb");
+    if (!f) {
+      tcc_error(s, "cannot create output file '%s'", filename);
+      return -1;
+    }
+    fwrite(image, 1, size, f);
+    fclose(f);
+    nb_written = l->nb_funcs;
+  }
+
+  if (s->verbose)
+    printf("Incremental link: %d of %d functions written\n", nb_written,
+           l->nb_funcs);
+
+  l->image_size = size;
+  l->rest_hash = rest;
+  l->image_hash = incr_hash(2166136261u, image, size);
+  return incr_write_db(s, l);
+}
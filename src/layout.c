@@ -0,0 +1,895 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Text layout - moves chunks of generated code around in .text
+ * and repatches the rel32 branches and calls between them. With
+ * -fgc-sections the functions and global variables nothing refers to
+ * are left out on the way.
+ */
+
+#include "tcc.h"
+
+/*============================================================
+ * Recording
+ *============================================================*/
+
+/* Remember a rel32 field whose target lies in .text; sym is the callee
+   for direct calls, which are bound when the layout runs */
+void text_add_reloc(TCCState *s, uint32_t offset, Sym *sym) {
+  TextReloc *rel;
+
+  if (s->nb_text_relocs >= s->text_relocs_alloc) {
+    s->text_relocs_alloc = s->text_relocs_alloc ? s->text_relocs_alloc * 2 : 64;
+    s->text_relocs = tcc_realloc(s->text_relocs,
+                                 s->text_relocs_alloc * sizeof(TextReloc));
+  }
+  rel = &s->text_relocs[s->nb_text_relocs++];
+  rel->offset = offset;
+  rel->sym = sym;
+  rel->sec = NULL;
+  rel->count = sym ? prof_block_count(s) : 0;
+  rel->abi = 0;
+}
+
+/* Remember a rel32 field holding an offset into another section, to be
+   turned into a RIP-relative displacement once addresses are known */
+void text_add_sec_reloc(TCCState *s, uint32_t offset, Section *sec) {
+  text_add_reloc(s, offset, NULL);
+  s->text_relocs[s->nb_text_relocs - 1].sec = sec;
+}
+
+/* Remember a rel32 reference to the address of function sym: bound
+   like a call to its ABI entry, but it adds no weight to the call graph */
+void text_add_addr_reloc(TCCState *s, uint32_t offset, Sym *sym) {
+  text_add_reloc(s, offset, sym);
+  s->text_relocs[s->nb_text_relocs - 1].count = 0;
+  s->text_relocs[s->nb_text_relocs - 1].abi = 1;
+}
+
+static void chunk_push(TCCState *s, uint32_t start, int cold, Sym *func) {
+  TextChunk *c;
+
+  if (s->nb_text_chunks >= s->text_chunks_alloc) {
+    s->text_chunks_alloc = s->text_chunks_alloc ? s->text_chunks_alloc * 2 : 32;
+    s->text_chunks = tcc_realloc(s->text_chunks,
+                                 s->text_chunks_alloc * sizeof(TextChunk));
+  }
+  c = &s->text_chunks[s->nb_text_chunks++];
+  c->start = start;
+  c->cold = cold;
+  c->func = func;
+}
+
+/* Start a new chunk at the current code position */
+void text_begin_chunk(TCCState *s, int cold) {
+  cold |= s->func_cold;
+
+  /* Code emitted before the first explicit chunk is hot */
+  if (s->nb_text_chunks == 0 && s->ind > 0)
+    chunk_push(s, 0, 0, NULL);
+
+  /* An empty chunk is simply retagged */
+  if (s->nb_text_chunks > 0 &&
+      s->text_chunks[s->nb_text_chunks - 1].start == (uint32_t)s->ind) {
+    s->text_chunks[s->nb_text_chunks - 1].cold = cold;
+    s->text_chunks[s->nb_text_chunks - 1].func = s->func_sym;
+    return;
+  }
+
+  chunk_push(s, (uint32_t)s->ind, cold, s->func_sym);
+}
+
+/* Whether the code being emitted goes to the cold region */
+int text_chunk_cold(TCCState *s) {
+  return s->func_cold ||
+         (s->nb_text_chunks > 0 && s->text_chunks[s->nb_text_chunks - 1].cold);
+}
+
+/*============================================================
+ * Layout
+ *============================================================*/
+
+static uint32_t chunk_end(TCCState *s, int i) {
+  if (i + 1 < s->nb_text_chunks)
+    return s->text_chunks[i + 1].start;
+  return (uint32_t)s->text_section->data_size;
+}
+
+/* Index of the chunk holding offset; a chunk boundary belongs to the
+   chunk that starts there */
+static int chunk_find(TCCState *s, uint32_t offset) {
+  int lo = 0, hi = s->nb_text_chunks - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (s->text_chunks[mid].start <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+#define CHUNK_DROPPED 0xffffffff
+
+/* Rewrite .text with the nb_order chunks of order, in that order: at
+   the offsets start (increasing, gaps filled with int3) or, with start
+   NULL, each after the previous one. .text is then size bytes, or just
+   holds the chunks if that is less. The chunks left out are dropped
+   with the calls and branches they make. */
+void text_place(TCCState *s, const int *order, const uint32_t *start,
+                int nb_order, uint32_t size) {
+  Section *text = s->text_section;
+  int n = s->nb_text_chunks;
+  uint32_t *new_start;
+  uint8_t *data;
+  uint32_t pos, alloc;
+  TextChunk *chunks;
+  Sym *sym;
+  int i, j;
+
+  /* The chunks take no more than they did, past the last start */
+  alloc = (uint32_t)text->data_alloc;
+  pos = nb_order > 0 && start && start[nb_order - 1] > size
+            ? start[nb_order - 1]
+            : size;
+  while (alloc < pos + text->data_size)
+    alloc *= 2;
+  new_start = tcc_malloc(n * sizeof(uint32_t));
+  data = tcc_malloc(alloc);
+  for (i = 0; i < n; i++)
+    new_start[i] = CHUNK_DROPPED;
+
+  pos = 0;
+  for (i = 0; i < nb_order; i++) {
+    int c = order[i];
+    uint32_t len = chunk_end(s, c) - s->text_chunks[c].start;
+    if (start) {
+      memset(data + pos, 0xcc, start[i] - pos);
+      pos = start[i];
+    }
+    new_start[c] = pos;
+    memcpy(data + pos, text->data + s->text_chunks[c].start, len);
+    pos += len;
+  }
+  if (size > pos) {
+    memset(data + pos, 0xcc, size - pos);
+    pos = size;
+  }
+
+#define MAP(off)                                                               \
+  (new_start[chunk_find(s, (off))] +                                           \
+   ((off) - s->text_chunks[chunk_find(s, (off))].start))
+
+  /* Repatch every branch and call against the new positions; references
+     to other sections only move */
+  for (i = 0, j = 0; i < s->nb_text_relocs; i++) {
+    uint32_t site = s->text_relocs[i].offset;
+    int32_t disp = *(int32_t *)(text->data + site);
+    uint32_t target = (uint32_t)(site + 4 + disp);
+    uint32_t new_site;
+    if (new_start[chunk_find(s, site)] == CHUNK_DROPPED)
+      continue;
+    new_site = MAP(site);
+    if (!s->text_relocs[i].sec && (!s->text_relocs[i].sym ||
+                                   s->text_relocs[i].sym->sec == text))
+      *(int32_t *)(data + new_site) = (int32_t)(MAP(target) - (new_site + 4));
+    s->text_relocs[j] = s->text_relocs[i];
+    s->text_relocs[j++].offset = new_site;
+  }
+  s->nb_text_relocs = j;
+
+  /* Move function symbols along with their code; those of dropped code
+     are no longer defined */
+  for (sym = s->global_stack.top; sym; sym = sym->prev) {
+    if (sym->sec != text || (uint32_t)sym->c > text->data_size)
+      continue;
+    if (new_start[chunk_find(s, (uint32_t)sym->c)] == CHUNK_DROPPED) {
+      sym->sec = NULL;
+      sym->c = 0;
+    } else {
+      sym->c = MAP((uint32_t)sym->c);
+    }
+  }
+
+#undef MAP
+
+  /* Chunks now follow the new order */
+  chunks = tcc_malloc(n * sizeof(TextChunk));
+  for (i = 0; i < nb_order; i++) {
+    chunks[i] = s->text_chunks[order[i]];
+    chunks[i].start = new_start[order[i]];
+  }
+  memcpy(s->text_chunks, chunks, nb_order * sizeof(TextChunk));
+  s->nb_text_chunks = nb_order;
+  tcc_free(chunks);
+
+  tcc_free(text->data);
+  text->data = data;
+  text->data_alloc = alloc;
+  text->data_size = pos;
+  tcc_free(new_start);
+}
+
+static void text_reorder(TCCState *s, const int *order, int nb_order) {
+  text_place(s, order, NULL, nb_order, 0);
+}
+
+/* Point every direct call at its callee's final definition; in an
+   object file calls of functions defined elsewhere are left to the link */
+static int text_bind_calls(TCCState *s) {
+  int i;
+
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    if (!rel->sym)
+      continue;
+    if (!rel->sym->sec && s->output_type == TCC_OUTPUT_OBJ)
+      continue;
+    if (rel->sym->sec != s->text_section) {
+      tcc_error(s, "undefined function '%s'", rel->sym->name);
+      return -1;
+    }
+    *(int32_t *)(s->text_section->data + rel->offset) =
+        (int32_t)(rel->sym->c - (rel->offset + 4));
+  }
+  return 0;
+}
+
+static int func_index(Sym **funcs, int nb_funcs, Sym *sym) {
+  int i;
+  for (i = 0; i < nb_funcs; i++) {
+    if (funcs[i] == sym)
+      return i;
+  }
+  return -1;
+}
+
+/* The functions of the chunks in source order, index 0 for code outside
+   any function, with the size of their hot chunks; returns how many */
+static int text_funcs(TCCState *s, Sym **funcs, uint32_t *size) {
+  int nb_funcs = 0;
+  int i, j;
+
+  funcs[nb_funcs] = NULL;
+  size[nb_funcs++] = 0;
+  for (i = 0; i < s->nb_text_chunks; i++) {
+    Sym *f = s->text_chunks[i].func;
+    j = func_index(funcs, nb_funcs, f);
+    if (j < 0) {
+      j = nb_funcs++;
+      funcs[j] = f;
+      size[j] = 0;
+    }
+    if (!s->text_chunks[i].cold)
+      size[j] += chunk_end(s, i) - s->text_chunks[i].start;
+  }
+  return nb_funcs;
+}
+
+/*------------------------------------------------------------
+ * Unreferenced code and data (-fgc-sections)
+ *
+ * The roots are the code outside any function, the entry point and, in
+ * an object file, whatever other files can name. A function is kept if
+ * a call or an address reference from kept code reaches it, a global
+ * variable if kept code refers to it; the rest is left out of the image.
+ *------------------------------------------------------------*/
+
+static int gc_root(TCCState *s, Sym *sym) {
+  if (!sym)
+    return 1;
+  if (!sym->name)
+    return 0;
+  if (strcmp(sym->name, s->entry_name) == 0)
+    return 1;
+  return s->output_type == TCC_OUTPUT_OBJ &&
+         (!(sym->t & VT_STATIC) || s->unit_prefix);
+}
+
+static int var_cmp(const void *a, const void *b) {
+  const Sym *va = *(Sym *const *)a, *vb = *(Sym *const *)b;
+  return va->c < vb->c ? -1 : va->c > vb->c;
+}
+
+/* Where offset in .data moves once the dead variables, sorted by
+   position, are taken out */
+static uint32_t data_shift(Sym **dead, int nb_dead, uint32_t offset) {
+  int i;
+
+  for (i = 0; i < nb_dead && (uint32_t)dead[i]->c < offset; i++)
+    ;
+  return offset - 8 * i;
+}
+
+/* Take the global variables no kept code refers to out of .data. Each
+   is 8 bytes; other data (profile counters, ...) stays as it is */
+static int data_gc(TCCState *s) {
+  Section *data = s->data_section;
+  uint8_t *text = s->text_section->data;
+  Sym **vars, **dead, *sym;
+  char *live;
+  uint32_t pos;
+  int nb_vars = 0, nb_dead = 0;
+  int i, lo, hi;
+
+  if (!data)
+    return 0;
+  for (sym = s->global_stack.top; sym; sym = sym->prev) {
+    if (sym->name && sym->sec == data)
+      nb_vars++;
+  }
+  if (nb_vars == 0)
+    return 0;
+  vars = tcc_malloc(nb_vars * sizeof(Sym *));
+  nb_vars = 0;
+  for (sym = s->global_stack.top; sym; sym = sym->prev) {
+    if (sym->name && sym->sec == data)
+      vars[nb_vars++] = sym;
+  }
+  qsort(vars, nb_vars, sizeof(Sym *), var_cmp);
+
+  live = tcc_malloc(nb_vars);
+  for (i = 0; i < nb_vars; i++)
+    live[i] = (char)gc_root(s, vars[i]);
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    uint32_t offset;
+    if (s->text_relocs[i].sec != data)
+      continue;
+    offset = read_u32(text + s->text_relocs[i].offset);
+    lo = 0;
+    hi = nb_vars - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if ((uint32_t)vars[mid]->c <= offset)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    if ((uint32_t)vars[lo]->c <= offset && offset < (uint32_t)vars[lo]->c + 8)
+      live[lo] = 1;
+  }
+
+  dead = tcc_malloc(nb_vars * sizeof(Sym *));
+  for (i = 0; i < nb_vars; i++) {
+    if (!live[i])
+      dead[nb_dead++] = vars[i];
+  }
+
+  if (nb_dead > 0) {
+    /* References first, while the old positions are still there */
+    for (i = 0; i < s->nb_text_relocs; i++) {
+      uint8_t *field = text + s->text_relocs[i].offset;
+      if (s->text_relocs[i].sec == data)
+        write_u32(field, data_shift(dead, nb_dead, read_u32(field)));
+    }
+    for (i = 0; i < nb_vars; i++) {
+      if (live[i])
+        vars[i]->c = data_shift(dead, nb_dead, (uint32_t)vars[i]->c);
+    }
+    pos = 0;
+    for (i = 0; i <= nb_dead; i++) {
+      uint32_t from = i > 0 ? (uint32_t)dead[i - 1]->c + 8 : 0;
+      uint32_t to = i < nb_dead ? (uint32_t)dead[i]->c
+                                : (uint32_t)data->data_size;
+      memmove(data->data + pos, data->data + from, to - from);
+      pos += to - from;
+    }
+    data->data_size = pos;
+    for (i = 0; i < nb_dead; i++) {
+      dead[i]->sec = NULL;
+      dead[i]->c = 0;
+    }
+  }
+
+  tcc_free(dead);
+  tcc_free(live);
+  tcc_free(vars);
+  return nb_dead;
+}
+
+/* Drop the functions the roots do not reach, then the variables */
+static void text_gc(TCCState *s) {
+  Sym **funcs;
+  uint32_t *size;
+  int *chunk_func, *caller, *callee, *order;
+  char *live;
+  int nb_funcs, nb_edges = 0, nb_order = 0, nb_dead = 0, nb_vars;
+  int i, changed;
+
+  funcs = tcc_malloc((s->nb_text_chunks + 1) * sizeof(Sym *));
+  size = tcc_malloc((s->nb_text_chunks + 1) * sizeof(uint32_t));
+  nb_funcs = text_funcs(s, funcs, size);
+  chunk_func = tcc_malloc(s->nb_text_chunks * sizeof(int));
+  for (i = 0; i < s->nb_text_chunks; i++)
+    chunk_func[i] = func_index(funcs, nb_funcs, s->text_chunks[i].func);
+
+  /* Edges from the function of each reference to the one holding its
+     target */
+  caller = tcc_malloc((s->nb_text_relocs + 1) * sizeof(int));
+  callee = tcc_malloc((s->nb_text_relocs + 1) * sizeof(int));
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    Sym *sym = s->text_relocs[i].sym;
+    if (!sym || sym->sec != s->text_section)
+      continue;
+    caller[nb_edges] = chunk_func[chunk_find(s, s->text_relocs[i].offset)];
+    callee[nb_edges++] = chunk_func[chunk_find(s, (uint32_t)sym->c)];
+  }
+
+  live = tcc_malloc(nb_funcs);
+  for (i = 0; i < nb_funcs; i++)
+    live[i] = (char)gc_root(s, funcs[i]);
+  do {
+    changed = 0;
+    for (i = 0; i < nb_edges; i++) {
+      if (live[caller[i]] && !live[callee[i]]) {
+        live[callee[i]] = 1;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  for (i = 0; i < nb_funcs; i++)
+    nb_dead += !live[i];
+  if (nb_dead > 0) {
+    order = tcc_malloc(s->nb_text_chunks * sizeof(int));
+    for (i = 0; i < s->nb_text_chunks; i++) {
+      if (live[chunk_func[i]])
+        order[nb_order++] = i;
+    }
+    text_reorder(s, order, nb_order);
+    tcc_free(order);
+  }
+  nb_vars = data_gc(s);
+
+  if (s->verbose && (nb_dead || nb_vars))
+    printf("Dropped %d unreferenced functions and %d variables\n", nb_dead,
+           nb_vars);
+
+  tcc_free(live);
+  tcc_free(caller);
+  tcc_free(callee);
+  tcc_free(chunk_func);
+  tcc_free(size);
+  tcc_free(funcs);
+}
+
+/*------------------------------------------------------------
+ * Identical code folding (-ficf)
+ *
+ * Functions whose code is byte for byte the same, calls and address
+ * references aside, start in one class. A class is split while its
+ * members refer to functions of different classes, so that a set of
+ * functions calling each other folds onto a matching set. All members
+ * of a class then share the first one's code: their symbols move to it
+ * and the references to them follow. Pointers to two folded functions
+ * compare equal, which is why the pass is never enabled by -O.
+ *------------------------------------------------------------*/
+
+typedef struct {
+  int func;    /* function index, -1 if not a candidate */
+  int rel;     /* text reloc index */
+  uint32_t at; /* offset in the function */
+} IcfReloc;
+
+typedef struct {
+  TCCState *s;
+  Sym **funcs;
+  int nb_funcs;
+  int *chunk_func; /* function of each chunk */
+  int *chunk;      /* the single chunk of a candidate, else -1 */
+  int *first;      /* IcfReloc range of each function */
+  IcfReloc *relocs;
+  int *cls;        /* class of each function: its first member */
+} IcfState;
+
+static int icf_reloc_cmp(const void *a, const void *b) {
+  const IcfReloc *ra = a, *rb = b;
+  if (ra->func != rb->func)
+    return ra->func - rb->func;
+  return ra->at < rb->at ? -1 : ra->at > rb->at;
+}
+
+/* FNV-1a of the code of candidate f, symbol fields left out */
+static uint32_t icf_hash(IcfState *st, int f) {
+  TCCState *s = st->s;
+  const uint8_t *code = s->text_section->data + s->text_chunks[st->chunk[f]].start;
+  uint32_t len = chunk_end(s, st->chunk[f]) - s->text_chunks[st->chunk[f]].start;
+  uint32_t h = 2166136261u, pos = 0, end;
+  int i;
+
+  for (i = st->first[f]; i <= st->first[f + 1]; i++) {
+    if (i < st->first[f + 1]) {
+      if (!s->text_relocs[st->relocs[i].rel].sym)
+        continue;
+      end = st->relocs[i].at;
+    } else {
+      end = len;
+    }
+    for (; pos < end; pos++)
+      h = (h ^ code[pos]) * 16777619u;
+    pos = end + 4;
+  }
+  return h;
+}
+
+/* Where sym points: the class of its function and the offset in it */
+static void icf_target(IcfState *st, Sym *sym, int *cls, uint32_t *offset) {
+  TCCState *s = st->s;
+  int c;
+
+  if (sym->sec != s->text_section) {
+    *cls = -1;
+    *offset = 0;
+    return;
+  }
+  c = chunk_find(s, (uint32_t)sym->c);
+  *cls = st->cls[st->chunk_func[c]];
+  *offset = (uint32_t)sym->c - s->text_chunks[c].start;
+}
+
+/* Do candidates a and b have the same code and refer to the same
+   classes? */
+static int icf_equal(IcfState *st, int a, int b) {
+  TCCState *s = st->s;
+  uint32_t sa = s->text_chunks[st->chunk[a]].start;
+  uint32_t sb = s->text_chunks[st->chunk[b]].start;
+  uint32_t len = chunk_end(s, st->chunk[a]) - sa;
+  uint32_t pos = 0;
+  int i, j;
+
+  if (chunk_end(s, st->chunk[b]) - sb != len ||
+      st->first[a + 1] - st->first[a] != st->first[b + 1] - st->first[b])
+    return 0;
+
+  for (i = st->first[a], j = st->first[b]; i < st->first[a + 1]; i++, j++) {
+    TextReloc *ra = &s->text_relocs[st->relocs[i].rel];
+    TextReloc *rb = &s->text_relocs[st->relocs[j].rel];
+    uint32_t at = st->relocs[i].at;
+
+    if (at != st->relocs[j].at || ra->sec != rb->sec || ra->abi != rb->abi ||
+        !ra->sym != !rb->sym)
+      return 0;
+    if (!ra->sym)
+      continue;
+    if (ra->sym != rb->sym) {
+      int ca, cb;
+      uint32_t oa, ob;
+      icf_target(st, ra->sym, &ca, &oa);
+      icf_target(st, rb->sym, &cb, &ob);
+      if (ca < 0 || ca != cb || oa != ob)
+        return 0;
+    }
+    /* The bytes up to the field, which holds a bound displacement */
+    if (memcmp(s->text_section->data + sa + pos,
+               s->text_section->data + sb + pos, at - pos) != 0)
+      return 0;
+    pos = at + 4;
+  }
+  return memcmp(s->text_section->data + sa + pos,
+                s->text_section->data + sb + pos, len - pos) == 0;
+}
+
+/* Fold identical functions; returns how many were folded */
+static int text_icf(TCCState *s) {
+  IcfState st;
+  uint32_t *size, *hash;
+  int *next_cls, *order, *folded;
+  int nb_relocs = 0, nb_folded = 0, nb_order = 0;
+  int i, j, f, changed;
+
+  memset(&st, 0, sizeof(st));
+  st.s = s;
+  st.funcs = tcc_malloc((s->nb_text_chunks + 1) * sizeof(Sym *));
+  size = tcc_malloc((s->nb_text_chunks + 1) * sizeof(uint32_t));
+  st.nb_funcs = text_funcs(s, st.funcs, size);
+  st.chunk_func = tcc_malloc(s->nb_text_chunks * sizeof(int));
+  st.chunk = tcc_malloc(st.nb_funcs * sizeof(int));
+  for (f = 0; f < st.nb_funcs; f++)
+    st.chunk[f] = -1;
+
+  /* Candidates are named functions in one hot chunk, entered at its
+     start */
+  for (i = 0; i < s->nb_text_chunks; i++) {
+    f = func_index(st.funcs, st.nb_funcs, s->text_chunks[i].func);
+    st.chunk_func[i] = f;
+    st.chunk[f] = st.chunk[f] == -1 ? i : -2;
+  }
+  for (f = 0; f < st.nb_funcs; f++) {
+    Sym *sym = st.funcs[f];
+    if (st.chunk[f] < 0 || !sym || !sym->name ||
+        s->text_chunks[st.chunk[f]].cold ||
+        (uint32_t)sym->c != s->text_chunks[st.chunk[f]].start)
+      st.chunk[f] = -1;
+  }
+
+  /* References of each candidate in code order */
+  st.relocs = tcc_malloc((s->nb_text_relocs + 1) * sizeof(IcfReloc));
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    int c = chunk_find(s, s->text_relocs[i].offset);
+    f = st.chunk_func[c];
+    if (st.chunk[f] < 0)
+      continue;
+    st.relocs[nb_relocs].func = f;
+    st.relocs[nb_relocs].rel = i;
+    st.relocs[nb_relocs++].at =
+        s->text_relocs[i].offset - s->text_chunks[c].start;
+  }
+  qsort(st.relocs, nb_relocs, sizeof(IcfReloc), icf_reloc_cmp);
+  st.first = tcc_malloc((st.nb_funcs + 1) * sizeof(int));
+  for (f = 0, j = 0; f <= st.nb_funcs; f++) {
+    while (j < nb_relocs && st.relocs[j].func < f)
+      j++;
+    st.first[f] = j;
+  }
+
+  /* First classes by size and hash; other functions are alone */
+  st.cls = tcc_malloc(st.nb_funcs * sizeof(int));
+  next_cls = tcc_malloc(st.nb_funcs * sizeof(int));
+  hash = tcc_malloc(st.nb_funcs * sizeof(uint32_t));
+  for (f = 0; f < st.nb_funcs; f++) {
+    st.cls[f] = f;
+    if (st.chunk[f] < 0)
+      continue;
+    hash[f] = icf_hash(&st, f);
+    for (j = 0; j < f; j++) {
+      if (st.chunk[j] >= 0 && st.cls[j] == j && hash[j] == hash[f] &&
+          size[j] == size[f]) {
+        st.cls[f] = j;
+        break;
+      }
+    }
+  }
+
+  /* Split classes until their members agree on what they refer to */
+  do {
+    changed = 0;
+    for (f = 0; f < st.nb_funcs; f++) {
+      next_cls[f] = f;
+      if (st.chunk[f] < 0 || st.cls[f] == f)
+        continue;
+      /* Join the first earlier member of the class it still matches */
+      for (j = st.cls[f]; j < f; j++) {
+        if (st.cls[j] == st.cls[f] && next_cls[j] == j &&
+            icf_equal(&st, j, f)) {
+          next_cls[f] = j;
+          break;
+        }
+      }
+    }
+    for (f = 0; f < st.nb_funcs; f++) {
+      if (next_cls[f] != st.cls[f])
+        changed = 1;
+    }
+    memcpy(st.cls, next_cls, st.nb_funcs * sizeof(int));
+  } while (changed);
+
+  /* References to folded functions go to the one kept */
+  folded = tcc_malloc(st.nb_funcs * sizeof(int));
+  for (f = 0; f < st.nb_funcs; f++) {
+    folded[f] = st.cls[f] != f;
+    nb_folded += folded[f];
+  }
+  if (nb_folded > 0) {
+    for (i = 0; i < s->nb_text_relocs; i++) {
+      TextReloc *rel = &s->text_relocs[i];
+      if (!rel->sym || rel->sym->sec != s->text_section)
+        continue;
+      f = st.chunk_func[chunk_find(s, (uint32_t)rel->sym->c)];
+      if (!folded[f])
+        continue;
+      rel->sym = st.funcs[st.cls[f]];
+      *(int32_t *)(s->text_section->data + rel->offset) =
+          (int32_t)(rel->sym->c - (rel->offset + 4));
+    }
+
+    order = tcc_malloc(s->nb_text_chunks * sizeof(int));
+    for (i = 0; i < s->nb_text_chunks; i++) {
+      if (!folded[st.chunk_func[i]])
+        order[nb_order++] = i;
+    }
+    text_reorder(s, order, nb_order);
+    tcc_free(order);
+
+    /* The folded symbols are still defined, at their copy */
+    for (f = 0; f < st.nb_funcs; f++) {
+      if (!folded[f])
+        continue;
+      st.funcs[f]->sec = s->text_section;
+      st.funcs[f]->c = st.funcs[st.cls[f]]->c;
+    }
+  }
+
+  tcc_free(folded);
+  tcc_free(hash);
+  tcc_free(next_cls);
+  tcc_free(st.cls);
+  tcc_free(st.first);
+  tcc_free(st.relocs);
+  tcc_free(st.chunk);
+  tcc_free(st.chunk_func);
+  tcc_free(size);
+  tcc_free(st.funcs);
+  return nb_folded;
+}
+
+/*------------------------------------------------------------
+ * Call-graph ordering
+ *
+ * Edges weigh the number of call sites, or with a profile the number
+ * of calls made. Functions are merged into clusters along the heaviest
+ * edges first, appending the callee's cluster after the caller's (C3),
+ * as long as the result still fits in a page. Clusters are then placed
+ * in source order of their first function.
+ *------------------------------------------------------------*/
+
+#define CLUSTER_MAX_SIZE 4096
+
+typedef struct {
+  int caller;     /* function indexes */
+  int callee;
+  int64_t weight; /* call sites, or calls made in the profile */
+} CallEdge;
+
+static int edge_cmp(const void *a, const void *b) {
+  const CallEdge *ea = a, *eb = b;
+  if (ea->weight != eb->weight)
+    return eb->weight > ea->weight ? 1 : -1;
+  if (ea->caller != eb->caller)
+    return ea->caller - eb->caller;
+  return ea->callee - eb->callee;
+}
+
+/* Fill func_order with function indexes, callers next to their callees */
+static void order_functions(TCCState *s, Sym **funcs, int nb_funcs,
+                            const uint32_t *size, int *func_order) {
+  CallEdge *edges;
+  int nb_edges = 0;
+  int *cluster, *next, *tail, *csize;
+  int i, j, n;
+
+  /* Static call graph from the direct call sites */
+  edges = tcc_malloc((s->nb_text_relocs + 1) * sizeof(CallEdge));
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    int caller, callee;
+    if (!rel->sym)
+      continue;
+    caller = func_index(
+        funcs, nb_funcs, s->text_chunks[chunk_find(s, rel->offset)].func);
+    callee = func_index(funcs, nb_funcs, rel->sym);
+    if (caller < 0 || callee < 0 || caller == callee)
+      continue;
+    for (j = 0; j < nb_edges; j++) {
+      if (edges[j].caller == caller && edges[j].callee == callee)
+        break;
+    }
+    if (j == nb_edges) {
+      edges[nb_edges].caller = caller;
+      edges[nb_edges].callee = callee;
+      edges[nb_edges].weight = 0;
+      nb_edges++;
+    }
+    edges[j].weight += rel->count;
+  }
+  qsort(edges, nb_edges, sizeof(CallEdge), edge_cmp);
+
+  /* Every function starts as its own cluster */
+  cluster = tcc_malloc(nb_funcs * sizeof(int));
+  next = tcc_malloc(nb_funcs * sizeof(int));
+  tail = tcc_malloc(nb_funcs * sizeof(int));
+  csize = tcc_malloc(nb_funcs * sizeof(int));
+  for (i = 0; i < nb_funcs; i++) {
+    cluster[i] = i;
+    next[i] = -1;
+    tail[i] = i;
+    csize[i] = (int)size[i];
+  }
+
+  for (i = 0; i < nb_edges; i++) {
+    int a = cluster[edges[i].caller];
+    int b = cluster[edges[i].callee];
+    if (a == b || edges[i].weight == 0 ||
+        csize[a] + csize[b] > CLUSTER_MAX_SIZE)
+      continue;
+    /* Append cluster b after cluster a */
+    next[tail[a]] = b;
+    tail[a] = tail[b];
+    csize[a] += csize[b];
+    for (j = b; j != -1; j = next[j])
+      cluster[j] = a;
+  }
+
+  /* Emit clusters in source order of their first member */
+  n = 0;
+  for (i = 0; i < nb_funcs; i++) {
+    int c = cluster[i];
+    if (c < 0)
+      continue;
+    for (j = c; j != -1; j = next[j]) {
+      func_order[n++] = j;
+      cluster[j] = -1;
+    }
+  }
+
+  tcc_free(edges);
+  tcc_free(cluster);
+  tcc_free(next);
+  tcc_free(tail);
+  tcc_free(csize);
+}
+
+/* Final placement of code in .text, run once before the image is written.
+ * Unreferenced functions and variables go first with -fgc-sections,
+ * then with -ficf the copies of identical functions.
+ * Chunks are grouped by function (in call-graph order when enabled), and
+ * with hot/cold splitting all cold chunks go after the hot ones. Cold
+ * chunks are not valid where they were emitted, so the reorder always
+ * happens once any have been recorded. */
+int text_layout(TCCState *s) {
+  Sym **funcs;
+  uint32_t *size;
+  int *func_order, *order;
+  int nb_funcs;
+  int i, j, n, nb_cold = 0;
+
+  if (!s->text_section || s->nb_text_chunks == 0)
+    return 0;
+
+  if (text_bind_calls(s) < 0)
+    return -1;
+
+  if (s->pass[PASS_GC_SECTIONS])
+    text_gc(s);
+  if (s->pass[PASS_ICF]) {
+    int nb_folded = text_icf(s);
+    if (s->verbose && nb_folded)
+      printf("Folded %d identical functions\n", nb_folded);
+  }
+
+  for (i = 0; i < s->nb_text_chunks; i++) {
+    if (s->text_chunks[i].cold)
+      nb_cold++;
+  }
+  if (!nb_cold && !s->pass[PASS_REORDER_FUNCTIONS])
+    return 0;
+
+  /* Functions in source order, index 0 for code outside any function */
+  funcs = tcc_malloc((s->nb_text_chunks + 1) * sizeof(Sym *));
+  size = tcc_malloc((s->nb_text_chunks + 1) * sizeof(uint32_t));
+  nb_funcs = text_funcs(s, funcs, size);
+
+  func_order = tcc_malloc(nb_funcs * sizeof(int));
+  if (s->pass[PASS_REORDER_FUNCTIONS]) {
+    order_functions(s, funcs, nb_funcs, size, func_order);
+  } else {
+    for (i = 0; i < nb_funcs; i++)
+      func_order[i] = i;
+  }
+
+  /* Hot chunks function by function, then the cold ones */
+  order = tcc_malloc(s->nb_text_chunks * sizeof(int));
+  n = 0;
+  for (i = 0; i < nb_funcs; i++) {
+    for (j = 0; j < s->nb_text_chunks; j++) {
+      if (!s->text_chunks[j].cold && s->text_chunks[j].func == funcs[func_order[i]])
+        order[n++] = j;
+    }
+  }
+  for (i = 0; i < nb_funcs; i++) {
+    for (j = 0; j < s->nb_text_chunks; j++) {
+      if (s->text_chunks[j].cold && s->text_chunks[j].func == funcs[func_order[i]])
+        order[n++] = j;
+    }
+  }
+  text_reorder(s, order, n);
+
+  if (s->verbose && nb_cold)
+    printf("Moved %d cold chunks after the hot text\n", nb_cold);
+
+  tcc_free(order);
+  tcc_free(func_order);
+  tcc_free(size);
+  tcc_free(funcs);
+  return 0;
+}
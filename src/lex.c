@@ -42,9 +42,6 @@ static const Keyword keywords[] = {{"int", TOK_INT},
                                    {"double", TOK_DOUBLE},
                                    {NULL, 0}};
 
-/* Identifier/string buffer */
-static char tok_buf[STRING_MAX_SIZE];
-
 /*============================================================
  * File I/O
  *============================================================*/
@@ -79,6 +76,27 @@ void tcc_open(TCCState *s, const char *filename) {
   s->include_depth++;
 }
 
+/* Read text, held in memory, as if it were the file filename */
+void tcc_open_mem(TCCState *s, const char *filename, const char *text,
+                  size_t size) {
+  BufferedFile *bf;
+
+  bf = tcc_malloc(sizeof(BufferedFile));
+  memset(bf, 0, sizeof(BufferedFile));
+  strncpy(bf->filename, filename, sizeof(bf->filename) - 1);
+  bf->line_num = 1;
+
+  /* The whole text is the buffer, which is never refilled */
+  bf->buffer = tcc_malloc(size + 1);
+  memcpy(bf->buffer, text, size);
+  bf->buf_ptr = bf->buffer;
+  bf->buf_end = bf->buffer + size;
+
+  bf->prev = s->file;
+  s->file = bf;
+  s->include_depth++;
+}
+
 void tcc_close(TCCState *s) {
   BufferedFile *bf = s->file;
 
@@ -88,11 +106,27 @@ void tcc_close(TCCState *s) {
   s->file = bf->prev;
   s->include_depth--;
 
-  fclose(bf->file);
+  if (bf->file)
+    fclose(bf->file);
   tcc_free(bf->buffer);
   tcc_free(bf);
 }
 
+/* Read the next block of the file, 0 at its end */
+static int fill_buffer(BufferedFile *bf) {
+  size_t len;
+
+  if (!bf->file)
+    return 0;
+  len = fread(bf->buffer, 1, BUFFER_SIZE, bf->file);
+  if (len == 0)
+    return 0;
+  bf->buf_offset += bf->buf_end - bf->buffer;
+  bf->buf_ptr = bf->buffer;
+  bf->buf_end = bf->buffer + len;
+  return 1;
+}
+
 /* Get next character from input */
 int tcc_inp(TCCState *s) {
   BufferedFile *bf = s->file;
@@ -100,15 +134,8 @@ int tcc_inp(TCCState *s) {
   if (!bf)
     return EOF;
 
-  if (bf->buf_ptr >= bf->buf_end) {
-    /* Read more data */
-    size_t len = fread(bf->buffer, 1, BUFFER_SIZE, bf->file);
-    if (len == 0) {
-      return EOF;
-    }
-    bf->buf_ptr = bf->buffer;
-    bf->buf_end = bf->buffer + len;
-  }
+  if (bf->buf_ptr >= bf->buf_end && !fill_buffer(bf))
+    return EOF;
 
   return *bf->buf_ptr++;
 }
@@ -120,14 +147,8 @@ static int peek_char(TCCState *s) {
   if (!bf)
     return EOF;
 
-  if (bf->buf_ptr >= bf->buf_end) {
-    size_t len = fread(bf->buffer, 1, BUFFER_SIZE, bf->file);
-    if (len == 0) {
-      return EOF;
-    }
-    bf->buf_ptr = bf->buffer;
-    bf->buf_end = bf->buffer + len;
-  }
+  if (bf->buf_ptr >= bf->buf_end && !fill_buffer(bf))
+    return EOF;
 
   return *bf->buf_ptr;
 }
@@ -182,7 +203,7 @@ static int lookup_keyword(const char *name) {
 
 /* Parse a number */
 static void parse_number(TCCState *s, int c) {
-  char *p = tok_buf;
+  char *p = s->tok_buf;
   int64_t value = 0;
   int base = 10;
   int is_float = 0;
@@ -258,7 +279,7 @@ static void parse_number(TCCState *s, int c) {
   s->tok = TOK_NUM;
   if (is_float) {
     *p = '\0';
-    s->tokc.d = strtod(tok_buf, NULL);
+    s->tokc.d = strtod(s->tok_buf, NULL);
   } else {
     s->tokc.i = value;
   }
@@ -306,7 +327,7 @@ static int parse_escape(TCCState *s) {
 
 /* Parse string literal */
 static void parse_string(TCCState *s, int quote) {
-  char *p = tok_buf;
+  char *p = s->tok_buf;
   int c;
 
   while (1) {
@@ -320,7 +341,7 @@ static void parse_string(TCCState *s, int quote) {
     if (c == '\\') {
       c = parse_escape(s);
     }
-    if (p - tok_buf < STRING_MAX_SIZE - 1) {
+    if (p - s->tok_buf < STRING_MAX_SIZE - 1) {
       *p++ = (char)c;
     }
   }
@@ -328,11 +349,11 @@ static void parse_string(TCCState *s, int quote) {
 
   if (quote == '"') {
     s->tok = TOK_STR;
-    s->tokc.str = tcc_strdup(tok_buf);
+    s->tokc.str = tcc_strdup(s->tok_buf);
   } else {
     /* Character constant */
     s->tok = TOK_NUM;
-    s->tokc.i = tok_buf[0];
+    s->tokc.i = s->tok_buf[0];
   }
 }
 
@@ -394,6 +415,11 @@ void next_nomacro(TCCState *s) {
 
   skip_whitespace(s);
 
+  if (s->file) {
+    s->file->tok_offset =
+        s->file->buf_offset + (long)(s->file->buf_ptr - s->file->buffer);
+    s->file->tok_line = s->file->line_num;
+  }
   c = tcc_inp(s);
 
   if (c == EOF) {
@@ -403,11 +429,11 @@ void next_nomacro(TCCState *s) {
 
   /* Identifier or keyword */
   if (is_ident_start(c)) {
-    char *p = tok_buf;
+    char *p = s->tok_buf;
     int kw;
 
     while (is_ident_char(c)) {
-      if (p - tok_buf < STRING_MAX_SIZE - 1) {
+      if (p - s->tok_buf < STRING_MAX_SIZE - 1) {
         *p++ = (char)c;
       }
       c = tcc_inp(s);
@@ -417,12 +443,12 @@ void next_nomacro(TCCState *s) {
       unget_char(s);
 
     /* Check if keyword */
-    kw = lookup_keyword(tok_buf);
+    kw = lookup_keyword(s->tok_buf);
     if (kw) {
       s->tok = kw;
     } else {
       s->tok = TOK_IDENT;
-      s->tokc.str = tcc_strdup(tok_buf);
+      s->tokc.str = tcc_strdup(s->tok_buf);
     }
     return;
   }
@@ -610,6 +636,29 @@ void next_nomacro(TCCState *s) {
 /* Main tokenizer with macro expansion (simplified) */
 void next(TCCState *s) { next_nomacro(s); }
 
+/* Remember where the current token starts, to parse from it again */
+void tok_save(TCCState *s, TokenPos *pos) {
+  pos->offset = s->file->tok_offset;
+  pos->line_num = s->file->tok_line;
+}
+
+/* Go back to a saved token and read it again */
+void tok_restore(TCCState *s, const TokenPos *pos) {
+  BufferedFile *bf = s->file;
+
+  if (s->tok == TOK_IDENT || s->tok == TOK_STR)
+    tcc_free(s->tokc.str);
+  if (bf->file) {
+    fseek(bf->file, pos->offset, SEEK_SET);
+    bf->buf_offset = pos->offset;
+    bf->buf_ptr = bf->buf_end = bf->buffer;
+  } else {
+    bf->buf_ptr = bf->buffer + pos->offset;
+  }
+  bf->line_num = pos->line_num;
+  next(s);
+}
+
 /* Expect a specific token */
 void expect(TCCState *s, int tok) {
   if (s->tok != tok) {
@@ -0,0 +1,177 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Linking several object files into one image. Each object is merged
+ * into the link's TCCState by coff_load(): its sections are appended to
+ * the link's .text, .data, .rdata and .bss, and its external symbols
+ * go to the link's global symbol table, which is hashed by name. A
+ * symbol referenced before its definition is pushed undefined and
+ * defined in place when the definition is read.
+ *
+ * The relocations are applied by link_relocate() once pe_output_file()
+ * has given the sections their addresses. Each writes only its own
+ * field, so they are split between worker threads in equal ranges.
+ */
+
+#include "tcc.h"
+
+#define LINK_RELOCS_PER_THREAD 4096
+
+/*============================================================
+ * Symbols
+ *============================================================*/
+
+/* The link's symbol for name, pushed undefined on first reference */
+Sym *link_sym(TCCState *s, const char *name) {
+  Sym *sym = global_sym_find2(s, name);
+
+  if (!sym)
+    sym = global_sym_push2(s, name, VT_INT, VT_CONST, 0);
+  return sym;
+}
+
+/* Define name at value in sec; NULL if an earlier object defined it */
+Sym *link_define(TCCState *s, const char *name, Section *sec, uint32_t value,
+                 int func) {
+  Sym *sym = link_sym(s, name);
+
+  if (sym->sec) {
+    tcc_error(s, "multiple definition of '%s'", name);
+    return NULL;
+  }
+  sym->sec = sec;
+  sym->c = value;
+  sym->flags &= ~SYM_COMMON;
+  if (func)
+    sym->t = VT_FUNC | VT_INT;
+  return sym;
+}
+
+/* A tentative definition of size bytes, placed in .bss unless some
+   object defines the symbol */
+void link_common(Sym *sym, uint32_t size) {
+  if (sym->sec)
+    return;
+  sym->flags |= SYM_COMMON;
+  if ((int64_t)size > sym->c)
+    sym->c = size;
+}
+
+/* Give every symbol a place once all objects are read: tentative
+ * definitions go to .bss and __imp_name to the import table slot of
+ * name. Anything else still undefined is an error. */
+int link_resolve(TCCState *s) {
+  Sym *sym;
+  int ret = 0;
+
+  for (sym = s->global_stack.top; sym; sym = sym->prev) {
+    if (sym->sec || !sym->name)
+      continue;
+    if (sym->flags & SYM_COMMON) {
+      uint32_t align = sym->c >= 16 ? 16 : 8;
+      uint32_t size = (uint32_t)sym->c;
+      while (s->bss_section->data_size & (align - 1))
+        *(uint8_t *)section_ptr_add(s->bss_section, 1) = 0;
+      sym->c = s->bss_section->data_size;
+      sym->sec = s->bss_section;
+      sym->flags &= ~SYM_COMMON;
+      memset(section_ptr_add(s->bss_section, size), 0, size);
+    } else if (strncmp(sym->name, "__imp_", 6) == 0 && sym->name[6]) {
+      sym->c = pe_import(s, sym->name + 6);
+      sym->sec = s->idata_section;
+    } else {
+      tcc_error(s, "undefined symbol '%s'", sym->name);
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/*============================================================
+ * Relocations
+ *============================================================*/
+
+void link_add_reloc(TCCState *s, Section *sec, uint32_t offset, int type,
+                    Sym *sym, Section *target, uint32_t value) {
+  LinkReloc *rel;
+
+  if (s->nb_link_relocs >= s->link_relocs_alloc) {
+    s->link_relocs_alloc = s->link_relocs_alloc ? s->link_relocs_alloc * 2 : 256;
+    s->link_relocs =
+        tcc_realloc(s->link_relocs, s->link_relocs_alloc * sizeof(LinkReloc));
+  }
+  rel = &s->link_relocs[s->nb_link_relocs++];
+  rel->sec = sec;
+  rel->offset = offset;
+  rel->type = type;
+  rel->sym = sym;
+  rel->target = target;
+  rel->value = value;
+  if (type == IMAGE_REL_AMD64_ADDR64 || type == IMAGE_REL_AMD64_ADDR32)
+    s->link_absolute = 1;
+}
+
+typedef struct {
+  TCCState *s;
+  uint64_t image_base;
+  int nb_workers;
+} LinkJob;
+
+/* The worker's share of the relocations, in order */
+static void link_relocate_range(void *arg, int worker) {
+  LinkJob *job = arg;
+  TCCState *s = job->s;
+  int start = (int)((int64_t)s->nb_link_relocs * worker / job->nb_workers);
+  int end = (int)((int64_t)s->nb_link_relocs * (worker + 1) / job->nb_workers);
+  int i;
+
+  for (i = start; i < end; i++) {
+    LinkReloc *rel = &s->link_relocs[i];
+    uint8_t *p = rel->sec->data + rel->offset;
+    uint32_t place = rel->sec->sh_addr + rel->offset;
+    Section *sec = rel->sym ? rel->sym->sec : rel->target;
+    uint32_t value = rel->sym ? (uint32_t)rel->sym->c : rel->value;
+    uint32_t rva = sec ? sec->sh_addr + value : value;
+    uint64_t va = sec ? job->image_base + rva : value;
+
+    switch (rel->type) {
+    case IMAGE_REL_AMD64_ADDR64:
+      write_u64(p, read_u64(p) + va);
+      break;
+    case IMAGE_REL_AMD64_ADDR32:
+      write_u32(p, read_u32(p) + (uint32_t)va);
+      break;
+    case IMAGE_REL_AMD64_ADDR32NB:
+      write_u32(p, read_u32(p) + rva);
+      break;
+    case IMAGE_REL_AMD64_SECREL:
+      write_u32(p, read_u32(p) + value);
+      break;
+    default: /* REL32 to REL32_5: the field is that far from the end */
+      write_u32(p, read_u32(p) + rva -
+                       (place + 4 + (rel->type - IMAGE_REL_AMD64_REL32)));
+      break;
+    }
+  }
+}
+
+/* Patch the fields of all relocations, now that every section has its
+ * address; image_base is added for absolute ones */
+void link_relocate(TCCState *s, uint64_t image_base) {
+  LinkJob job;
+  int cpus = tcc_nb_cpus();
+
+  job.s = s;
+  job.image_base = image_base;
+  job.nb_workers =
+      (s->nb_link_relocs + LINK_RELOCS_PER_THREAD - 1) / LINK_RELOCS_PER_THREAD;
+  if (job.nb_workers > cpus)
+    job.nb_workers = cpus;
+  if (job.nb_workers < 1)
+    job.nb_workers = 1;
+  tcc_parallel(job.nb_workers, link_relocate_range, &job);
+
+  if (s->verbose)
+    printf("Applied %d relocations on %d threads\n", s->nb_link_relocs,
+           job.nb_workers);
+}
@@ -0,0 +1,291 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Link-time optimization (-flto). With -c a source file is not compiled
+ * but kept as its token text, comments and layout stripped, in the
+ * .tcclto section of an object the link recognizes. The link parses all
+ * such files as one module:
+ *
+ * - an outline pass over every file notes each function body and the
+ *   identifiers it uses, without compiling it;
+ * - lto_mark() walks those uses from the entry point and from what the
+ *   other objects of the link refer to. Functions it does not reach are
+ *   dropped, and those only the module calls are made static, for the
+ *   private calling convention;
+ * - the module is compiled as one file, whose calls may be folded with
+ *   the body of a function of any file (eval.c) and whose functions are
+ *   placed along the whole call graph (layout.c).
+ *
+ * The files keep their scopes: the statics of a file are out of sight
+ * once it is parsed.
+ */
+
+#include "tcc.h"
+
+#define LTO_SECTION ".tcclto"
+
+/*============================================================
+ * Token Text
+ *============================================================*/
+
+static void lto_buf_init(Section *buf) {
+  memset(buf, 0, sizeof(*buf));
+  buf->data_alloc = 256;
+  buf->data = tcc_malloc(buf->data_alloc);
+}
+
+/* The text of a source file with its comments taken out and blanks
+ * squeezed to one, in out. Line breaks are kept so that diagnostics
+ * give the lines of the source. */
+static void lto_compact(const char *p, size_t size, Section *out) {
+  const char *end = p + size;
+  int blank = 0;
+
+  while (p < end) {
+    char c = *p;
+
+    if (c == '/' && p + 1 < end && p[1] == '/') {
+      while (p < end && *p != '\n')
+        p++;
+    } else if (c == '/' && p + 1 < end && p[1] == '*') {
+      for (p += 2; p < end && !(*p == '*' && p + 1 < end && p[1] == '/'); p++) {
+        if (*p == '\n')
+          *(char *)section_ptr_add(out, 1) = '\n';
+      }
+      p += 2;
+      blank = 1;
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+      p++;
+      blank = 1;
+    } else if (c == '\n') {
+      *(char *)section_ptr_add(out, 1) = *p++;
+      blank = 0;
+    } else {
+      if (blank && out->data_size > 0 && out->data[out->data_size - 1] != '\n')
+        *(char *)section_ptr_add(out, 1) = ' ';
+      blank = 0;
+      if (c == '"' || c == '\'') {
+        /* A literal as it is, up to its closing quote */
+        const char *q = p + 1;
+        while (q < end && *q != c && *q != '\n')
+          q += *q == '\\' && q + 1 < end ? 2 : 1;
+        if (q < end && *q == c)
+          q++;
+        section_add(out, p, q - p);
+        p = q;
+      } else {
+        *(char *)section_ptr_add(out, 1) = *p++;
+      }
+    }
+  }
+}
+
+/* Read filename for the module: the text of a source file, or of an
+ * object written by -flto -c. Returns 1 with f filled in, 0 if it is an
+ * ordinary object and -1 on an error. */
+int lto_read(TCCState *s, const char *filename, int source, LtoFile *f) {
+  const uint8_t *text;
+  uint8_t *data;
+  uint32_t len;
+  size_t size;
+  Section out;
+
+  data = tcc_read_file(s, filename, &size);
+  if (!data)
+    return -1;
+  if (source) {
+    lto_buf_init(&out);
+    lto_compact((const char *)data, size, &out);
+    f->name = tcc_strdup(filename);
+  } else {
+    /* The source file name, then its text */
+    text = coff_find_section(data, size, LTO_SECTION, &len);
+    if (!text) {
+      tcc_free(data);
+      return 0;
+    }
+    if (!memchr(text, '\0', len)) {
+      tcc_error(s, "'%s': bad %s section", filename, LTO_SECTION);
+      tcc_free(data);
+      return -1;
+    }
+    f->name = tcc_strdup((const char *)text);
+    len -= (uint32_t)strlen(f->name) + 1;
+    lto_buf_init(&out);
+    section_add(&out, text + strlen(f->name) + 1, len);
+  }
+  tcc_free(data);
+  f->text = (char *)out.data;
+  f->size = out.data_size;
+  return 1;
+}
+
+void lto_free_file(LtoFile *f) {
+  tcc_free(f->name);
+  tcc_free(f->text);
+}
+
+/* -flto -c: the object for filename is its token text */
+int lto_write_object(TCCState *s, const char *filename, const char *outfile) {
+  LtoFile f;
+  Section text, obj;
+  FILE *fp;
+  int ret = 0;
+
+  if (lto_read(s, filename, 1, &f) < 0)
+    return -1;
+  lto_buf_init(&text);
+  section_add(&text, f.name, strlen(f.name) + 1);
+  section_add(&text, f.text, f.size);
+  coff_build_info(&obj, LTO_SECTION, text.data, text.data_size);
+
+  fp = fopen(outfile, "wb");
+  if (!fp) {
+    tcc_error(s, "cannot create output file '%s'", outfile);
+    ret = -1;
+  } else {
+    fwrite(obj.data, 1, obj.data_size, fp);
+    fclose(fp);
+  }
+  tcc_free(obj.data);
+  tcc_free(text.data);
+  lto_free_file(&f);
+  return ret;
+}
+
+/*============================================================
+ * The Module
+ *============================================================*/
+
+/* Parse the files in turn into s, as the outline or the module */
+int lto_parse(TCCState *s, const LtoFile *files, int nb_files) {
+  Sym *mark, *sym;
+  int i;
+
+  gen_init(s);
+  s->lto = 1;
+  for (i = 0; i < nb_files; i++) {
+    mark = s->global_stack.top;
+    s->lto_file = i;
+    tcc_open_mem(s, files[i].name, files[i].text, files[i].size);
+    next(s);
+    parse_file(s);
+    tcc_close(s);
+
+    /* The file's statics are not seen from the next ones */
+    for (sym = s->global_stack.top; sym != mark; sym = sym->prev) {
+      if ((sym->t & VT_STATIC) && !(sym->flags & SYM_INTERNAL))
+        sym_unlink(&s->global_stack, sym);
+    }
+  }
+  return s->nb_errors ? -1 : 0;
+}
+
+/* Outline: name, an identifier in the body of the last function, which
+   the list takes over */
+void lto_add_ref(TCCState *s, char *name) {
+  LtoRef *ref;
+
+  s->lto_refs =
+      tcc_realloc(s->lto_refs, (s->nb_lto_refs + 1) * sizeof(LtoRef));
+  ref = &s->lto_refs[s->nb_lto_refs++];
+  ref->func = s->nb_func_ranges - 1;
+  ref->name = name;
+}
+
+/* The function of the outline o that name means in file: a static of
+   that file, or else the one with external linkage; -1 if none */
+static int lto_find(TCCState *o, const char *name, int file) {
+  int i, found = -1;
+
+  for (i = 0; i < o->nb_func_ranges; i++) {
+    FuncRange *r = &o->func_ranges[i];
+    if (strcmp(r->name, name) != 0)
+      continue;
+    if (r->local && r->file == file)
+      return i;
+    if (!r->local && found < 0)
+      found = i;
+  }
+  return found;
+}
+
+/* Decide which functions of the outline o the module compiles and which
+ * become static. The roots are the entry point and the names the
+ * objects already read into the link ls (if any) leave undefined. */
+void lto_mark(TCCState *o, TCCState *ls) {
+  int n = o->nb_func_ranges;
+  int *work, *first;
+  int i, j, nb_work = 0, nb_live = 0, nb_internal = 0;
+
+  work = tcc_malloc((n + 1) * sizeof(int));
+  first = tcc_malloc((n + 1) * sizeof(int));
+
+  /* The uses are recorded function by function */
+  for (i = 0, j = 0; i <= n; i++) {
+    while (j < o->nb_lto_refs && o->lto_refs[j].func < i)
+      j++;
+    first[i] = j;
+  }
+
+  for (i = 0; i < n; i++) {
+    FuncRange *r = &o->func_ranges[i];
+    Sym *ext = ls ? global_sym_find2(ls, r->name) : NULL;
+
+    r->live = 0;
+    r->internal = !r->local;
+    if (!r->local &&
+        (strcmp(r->name, o->entry_name) == 0 || (ext && !ext->sec))) {
+      r->internal = 0;
+      r->live = 1;
+      work[nb_work++] = i;
+    }
+  }
+  while (nb_work > 0) {
+    int f = work[--nb_work];
+    for (j = first[f]; j < first[f + 1]; j++) {
+      int callee = lto_find(o, o->lto_refs[j].name, o->func_ranges[f].file);
+      if (callee >= 0 && !o->func_ranges[callee].live) {
+        o->func_ranges[callee].live = 1;
+        work[nb_work++] = callee;
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    nb_live += o->func_ranges[i].live;
+    nb_internal += o->func_ranges[i].live && o->func_ranges[i].internal;
+  }
+  if (o->verbose)
+    printf("LTO: %d of %d functions kept, %d made static\n", nb_live, n,
+           nb_internal);
+  tcc_free(work);
+  tcc_free(first);
+}
+
+/* A function of the module declared as sym: static if only the module
+   calls it, whichever file it is defined in */
+void lto_declare(TCCState *s, Sym *sym) {
+  int i;
+
+  if (s->unit_mode != UNIT_MODULE || (sym->t & VT_STATIC))
+    return;
+  i = lto_find(s->outline, sym->name, -1);
+  if (i >= 0 && s->outline->func_ranges[i].internal) {
+    sym->t |= VT_STATIC;
+    sym->flags |= SYM_INTERNAL;
+  }
+}
+
+/* The outline's record of the function name means in file, to fold a
+   call of a function whatever file defines it */
+EvalFunc *lto_eval_find(TCCState *s, const char *name, int file) {
+  int i;
+
+  if (s->unit_mode != UNIT_MODULE)
+    return NULL;
+  i = lto_find(s->outline, name, file);
+  if (i < 0 || s->outline->func_ranges[i].eval < 0)
+    return NULL;
+  return &s->outline->eval_funcs[s->outline->func_ranges[i].eval];
+}
@@ -8,6 +8,7 @@
 
 /* Forward declarations */
 static void expr_eq(TCCState *s);
+static void expr_cond(TCCState *s);
 static void expr_or(TCCState *s);
 static void expr_and(TCCState *s);
 static void expr_bitor(TCCState *s);
@@ -37,12 +38,12 @@ int parse_type(TCCState *s) {
   while (1) {
     switch (s->tok) {
     case TOK_VOID:
-      t = VT_VOID;
+      t = (t & ~VT_BTYPE) | VT_VOID;
       type_found = 1;
       next(s);
       break;
     case TOK_CHAR:
-      t = VT_BYTE;
+      t = (t & ~VT_BTYPE) | VT_BYTE;
       type_found = 1;
       next(s);
       break;
@@ -52,7 +53,7 @@ int parse_type(TCCState *s) {
       next(s);
       break;
     case TOK_INT:
-      t = VT_INT;
+      t = (t & ~VT_BTYPE) | VT_INT;
       type_found = 1;
       next(s);
       break;
@@ -65,12 +66,12 @@ int parse_type(TCCState *s) {
       next(s);
       break;
     case TOK_FLOAT:
-      t = VT_FLOAT;
+      t = (t & ~VT_BTYPE) | VT_FLOAT;
       type_found = 1;
       next(s);
       break;
     case TOK_DOUBLE:
-      t = VT_DOUBLE;
+      t = (t & ~VT_BTYPE) | VT_DOUBLE;
       type_found = 1;
       next(s);
       break;
@@ -142,6 +143,504 @@ static int parse_pointer(TCCState *s, int t) {
   return t;
 }
 
+/*============================================================
+ * Operand Order
+ *============================================================*/
+
+/* Operands are parsed, and their code emitted, left to right. When the
+ * right operand of a commutative operator needs more registers than the
+ * left one and spilled the left result doing so, the code of both is
+ * dropped and they are parsed again right first (Sethi-Ullman order).
+ * Only operands without calls, stores or literals, which parsing again
+ * would repeat, are reordered, and only the first operator of a chain
+ * such as a + b + c, whose left operand is a single one. */
+#define MAX_REORDER_DEPTH 4
+
+/* Where an operand starts, with the generator state to go back to */
+typedef struct {
+  TokenPos pos;
+  SValue *vtop;
+  size_t text_size;
+  int ind, loc;
+  int cmp_start, cmp_end, cmp_regs, sched_start;
+  int nb_text_relocs, nb_effects, nb_errors, nb_warnings;
+  int base;    /* registers in use at the start */
+  int peak;    /* reg_peak of the enclosing code */
+  int need;    /* registers the operand needed on top of base */
+  int chained; /* an operator was applied to it already */
+} OperandMark;
+
+static void operand_begin(TCCState *s, OperandMark *m) {
+  tok_save(s, &m->pos);
+  m->vtop = s->vtop;
+  m->text_size = s->text_section->data_size;
+  m->ind = s->ind;
+  m->loc = s->loc;
+  m->cmp_start = s->cmp_start;
+  m->cmp_end = s->cmp_end;
+  m->cmp_regs = s->cmp_regs;
+  m->sched_start = s->sched_start;
+  m->nb_text_relocs = s->nb_text_relocs;
+  m->nb_effects = s->nb_effects;
+  m->nb_errors = s->nb_errors;
+  m->nb_warnings = s->nb_warnings;
+  m->base = nb_used_regs(s);
+  m->peak = s->reg_peak;
+  m->chained = 0;
+  s->reg_peak = m->base;
+}
+
+static void operand_end(TCCState *s, OperandMark *m) {
+  m->need = s->reg_peak - m->base;
+  if (m->peak > s->reg_peak)
+    s->reg_peak = m->peak;
+}
+
+/* Whether the right operand, just parsed, spilled the left one that
+ * starts at left, and both may be parsed again in the other order */
+static int operand_reorder(TCCState *s, OperandMark *left, OperandMark *right,
+                           int op) {
+  SValue *sv;
+
+  if (!s->pass[PASS_ORDER_OPERANDS] || left->chained ||
+      s->reorder_depth >= MAX_REORDER_DEPTH)
+    return 0;
+  if (op != '+' && op != '*' && op != '&' && op != '|' && op != '^')
+    return 0;
+  if (s->nb_effects != left->nb_effects || s->nb_errors != left->nb_errors ||
+      s->nb_warnings != left->nb_warnings || right->need <= left->need)
+    return 0;
+  /* Nor across a label or branch, such as those of ?:, which flushed the
+   * scheduler between the marks */
+  if (s->sched_start != left->sched_start)
+    return 0;
+
+  /* The left result went to a new stack slot, values below it did not */
+  sv = s->vtop - 1;
+  if ((sv->r & (VT_VALMASK | VT_LVAL)) != (VT_LOCAL | VT_LVAL) ||
+      sv->c.i >= left->loc)
+    return 0;
+  for (sv = s->vstack; sv <= left->vtop; sv++) {
+    if ((sv->r & VT_VALMASK) == VT_LOCAL && sv->c.i < left->loc)
+      return 0;
+  }
+  return 1;
+}
+
+/* Parse the right operand of op with the parser of the next level and
+ * apply op; left marks where the left operand starts */
+static void expr_right(TCCState *s, OperandMark *left, int op,
+                       void (*operand)(TCCState *)) {
+  OperandMark right;
+  TokenPos end;
+
+  operand_begin(s, &right);
+  operand(s);
+  operand_end(s, &right);
+
+  /* The scheduler may have moved code across left->ind already */
+  if (operand_reorder(s, left, &right, op) && left->ind >= s->sched_barrier) {
+    tok_save(s, &end);
+    s->vtop = left->vtop;
+    s->text_section->data_size = left->text_size;
+    s->ind = left->ind;
+    s->loc = left->loc;
+    s->cmp_start = left->cmp_start;
+    s->cmp_end = left->cmp_end;
+    s->cmp_regs = left->cmp_regs;
+    s->sched_start = left->sched_start;
+    s->nb_text_relocs = left->nb_text_relocs;
+    s->reg_peak = left->peak;
+    reg_content_clear(s);
+
+    s->reorder_depth++;
+    tok_restore(s, &right.pos);
+    operand(s);
+    tok_restore(s, &left->pos);
+    operand(s);
+    s->reorder_depth--;
+    tok_restore(s, &end);
+    vswap(s);
+  }
+  left->chained = 1;
+  gen_op(s, op);
+}
+
+/*============================================================
+ * Expression Idioms
+ *============================================================*/
+
+/* Portable spellings of single instructions are recognised by their
+ * tokens before the expression is parsed as usual:
+ *   (x << 8) | (x >> 24), x << k | x >> (32 - k)    rol, ror
+ *   shifts and masks that reverse the bytes of x     bswap, movbe
+ *   (x ^ (x >> 31)) - (x >> 31)                      neg, cmovs
+ *   a < b ? a : b                                    cmp, cmov
+ * The operands are locals or constants, so parsing them costs nothing
+ * when the shape does not match, and the token after an idiom must not
+ * bind tighter than its operator. */
+
+static int idiom_skip(TCCState *s, int tok) {
+  if (s->tok != tok)
+    return 0;
+  next(s);
+  return 1;
+}
+
+/* The local the next identifier names, NULL for anything else */
+static Sym *idiom_local(TCCState *s) {
+  Sym *sym;
+
+  if (s->tok != TOK_IDENT)
+    return NULL;
+  sym = sym_find2(s, s->tokc.str);
+  tcc_free(s->tokc.str);
+  next(s);
+  if (!sym || sym->r != VT_LOCAL)
+    return NULL;
+  return sym;
+}
+
+static int idiom_int(int t) {
+  t &= VT_BTYPE;
+  return t == VT_INT || t == VT_BYTE || t == VT_SHORT || t == VT_LLONG;
+}
+
+static void idiom_value(SValue *sv, Sym *sym) {
+  sv->t = sym->t;
+  sv->r = (sym->t & VT_ARRAY) ? sym->r : sym->r | VT_LVAL;
+  sv->c.i = sym->c;
+  sv->sym = sym;
+}
+
+/* Integer constant, or integer local other than i */
+static int idiom_operand(TCCState *s, SValue *sv, Sym *i) {
+  Sym *sym;
+
+  if (s->tok == TOK_NUM) {
+    sv->t = s->tokc.i == (int32_t)s->tokc.i ? VT_INT : VT_LLONG;
+    sv->r = VT_CONST;
+    sv->c.i = s->tokc.i;
+    sv->sym = NULL;
+    next(s);
+    return 1;
+  }
+  sym = idiom_local(s);
+  if (!sym || sym == i || !idiom_int(sym->t))
+    return 0;
+  idiom_value(sv, sym);
+  return 1;
+}
+
+/* Operator precedence of the current token, 0 for one that ends any
+ * expression and a large value for one that cannot follow an operand */
+static int idiom_prec(TCCState *s) {
+  switch (s->tok) {
+  case '*':
+  case '/':
+  case '%':
+    return 11;
+  case '+':
+  case '-':
+    return 10;
+  case TOK_SHL:
+  case TOK_SHR:
+    return 9;
+  case '<':
+  case '>':
+  case TOK_LE:
+  case TOK_GE:
+    return 8;
+  case TOK_EQ:
+  case TOK_NE:
+    return 7;
+  case '&':
+    return 6;
+  case '^':
+    return 5;
+  case '|':
+    return 4;
+  case TOK_AND:
+    return 3;
+  case TOK_OR:
+    return 2;
+  case '?':
+    return 1;
+  case ';':
+  case ')':
+  case ',':
+  case ']':
+  case '}':
+  case ':':
+  case '=':
+  case TOK_EOF:
+    return 0;
+  default:
+    if (s->tok >= TOK_ADD_ASSIGN && s->tok <= TOK_SHR_ASSIGN)
+      return 0;
+    return 100;
+  }
+}
+
+static void idiom_push(TCCState *s, SValue *sv) {
+  vsetc(s, sv->t, sv->r, &sv->c);
+  s->vtop->sym = sv->sym;
+}
+
+/* The local x an idiom works on: integer of 4 or 8 bytes */
+static int idiom_word(Sym *x) {
+  return x && idiom_int(x->t) && type_size(x->t) >= 4;
+}
+
+/* Where each bit of a shift and mask expression of x comes from */
+typedef struct {
+  int is_const;
+  int64_t c;
+  int8_t bit[64]; /* bit of x, -1 for zero */
+} IdiomBits;
+
+static int bits_or(TCCState *s, Sym **x, IdiomBits *v);
+
+static int bits_primary(TCCState *s, Sym **x, IdiomBits *v) {
+  Sym *sym;
+  int i;
+
+  if (idiom_skip(s, '('))
+    return bits_or(s, x, v) && idiom_skip(s, ')');
+  if (s->tok == TOK_NUM) {
+    v->is_const = 1;
+    v->c = s->tokc.i;
+    next(s);
+    return 1;
+  }
+  sym = idiom_local(s);
+  if (!*x && idiom_word(sym))
+    *x = sym;
+  if (!sym || sym != *x)
+    return 0;
+  v->is_const = 0;
+  for (i = 0; i < 64; i++)
+    v->bit[i] = i < type_size(sym->t) * 8 ? i : -1;
+  return 1;
+}
+
+/* x << n, x >> n by constants; >> of a signed x copies the sign bit */
+static int bits_shift(TCCState *s, Sym **x, IdiomBits *v) {
+  int width, n, i, op;
+
+  if (!bits_primary(s, x, v))
+    return 0;
+  while (s->tok == TOK_SHL || s->tok == TOK_SHR) {
+    op = s->tok;
+    next(s);
+    if (v->is_const || s->tok != TOK_NUM)
+      return 0;
+    width = type_size((*x)->t) * 8;
+    n = (int)s->tokc.i;
+    if (s->tokc.i < 1 || s->tokc.i >= width)
+      return 0;
+    next(s);
+    if (op == TOK_SHL) {
+      for (i = width - 1; i >= 0; i--)
+        v->bit[i] = i >= n ? v->bit[i - n] : -1;
+    } else {
+      int fill = ((*x)->t & VT_UNSIGNED) ? -1 : v->bit[width - 1];
+      for (i = 0; i < width; i++)
+        v->bit[i] = i + n < width ? v->bit[i + n] : fill;
+    }
+  }
+  return 1;
+}
+
+static int bits_and(TCCState *s, Sym **x, IdiomBits *v) {
+  IdiomBits m;
+  int i;
+
+  if (!bits_shift(s, x, v))
+    return 0;
+  while (idiom_skip(s, '&')) {
+    if (!bits_shift(s, x, &m) || v->is_const == m.is_const)
+      return 0;
+    if (v->is_const) {
+      IdiomBits mask = *v;
+      *v = m;
+      m = mask;
+    }
+    for (i = 0; i < 64; i++) {
+      if (!((uint64_t)m.c >> i & 1))
+        v->bit[i] = -1;
+    }
+  }
+  return 1;
+}
+
+/* Bits of x combined by |: each bit may come from one side only */
+static int bits_or(TCCState *s, Sym **x, IdiomBits *v) {
+  IdiomBits m;
+  int i;
+
+  if (!bits_and(s, x, v))
+    return 0;
+  while (idiom_skip(s, '|')) {
+    if (!bits_and(s, x, &m) || v->is_const || m.is_const)
+      return 0;
+    for (i = 0; i < 64; i++) {
+      if (v->bit[i] >= 0 && m.bit[i] >= 0)
+        return 0;
+      if (m.bit[i] >= 0)
+        v->bit[i] = m.bit[i];
+    }
+  }
+  return 1;
+}
+
+/* A shift of x by a local k or by width - k, for a variable rotate */
+static int rotate_term(TCCState *s, Sym **x, int *op, Sym **k, int *width) {
+  int paren = idiom_skip(s, '('), inner;
+
+  *x = idiom_local(s);
+  *op = s->tok;
+  if (!idiom_word(*x) || (*op != TOK_SHL && *op != TOK_SHR))
+    return 0;
+  next(s);
+  inner = idiom_skip(s, '(');
+  *width = 0;
+  if (s->tok == TOK_NUM) {
+    *width = (int)s->tokc.i;
+    next(s);
+    if (!idiom_skip(s, '-'))
+      return 0;
+  }
+  *k = idiom_local(s);
+  return *k && idiom_int((*k)->t) && (!inner || idiom_skip(s, ')')) &&
+         (!paren || idiom_skip(s, ')'));
+}
+
+/* Rotate or byte swap of an unsigned x (or a 64-bit one) at the start
+ * of a | chain */
+static int idiom_bits(TCCState *s) {
+  TokenPos pos;
+  IdiomBits v;
+  SValue sv;
+  Sym *x = NULL, *x2, *k, *k2;
+  int width, i, n, op, op2, w, w2;
+
+  tok_save(s, &pos);
+  if (bits_or(s, &x, &v) && !v.is_const && idiom_prec(s) <= 4 &&
+      (type_size(x->t) == 8 || (x->t & VT_UNSIGNED))) {
+    width = type_size(x->t) * 8;
+    idiom_value(&sv, x);
+
+    /* Byte i of x to byte width / 8 - 1 - i */
+    for (i = 0; i < width; i++) {
+      if (v.bit[i] != (width / 8 - 1 - i / 8) * 8 + i % 8)
+        break;
+    }
+    if (i == width) {
+      idiom_push(s, &sv);
+      gen_bitop(s, BITOP_BSWAP, width == 64);
+      s->vtop->t = x->t;
+      return 1;
+    }
+
+    /* Bit i of x to bit i + n */
+    n = v.bit[0] < 0 ? 0 : (width - v.bit[0]) % width;
+    for (i = 0; n && i < width; i++) {
+      if (v.bit[i] != (i - n + width) % width)
+        break;
+    }
+    if (n && i == width) {
+      idiom_push(s, &sv);
+      vset(s, VT_INT, VT_CONST, n);
+      gen_rotate(s, 0, width == 64);
+      return 1;
+    }
+  }
+
+  tok_restore(s, &pos);
+  if (rotate_term(s, &x, &op, &k, &w) && idiom_skip(s, '|') &&
+      rotate_term(s, &x2, &op2, &k2, &w2) && idiom_prec(s) <= 4 &&
+      x == x2 && k == k2 && op != op2 && !w != !w2 &&
+      w + w2 == type_size(x->t) * 8 && (x->t & VT_UNSIGNED)) {
+    /* x << k | x >> (32 - k) is a left rotate, with k and 32 - k the
+       other way round a right one; of a signed x, >> fills with the
+       sign */
+    idiom_value(&sv, x);
+    idiom_push(s, &sv);
+    idiom_value(&sv, k);
+    idiom_push(s, &sv);
+    gen_rotate(s, (op == TOK_SHL) == (w != 0), type_size(x->t) == 8);
+    return 1;
+  }
+  tok_restore(s, &pos);
+  return 0;
+}
+
+/* x >> 31 (63) of a signed x */
+static int abs_sign(TCCState *s, Sym *x) {
+  int paren = idiom_skip(s, '(');
+
+  return idiom_local(s) == x && idiom_skip(s, TOK_SHR) && s->tok == TOK_NUM &&
+         s->tokc.i == type_size(x->t) * 8 - 1 && idiom_skip(s, TOK_NUM) &&
+         (!paren || idiom_skip(s, ')'));
+}
+
+/* (x ^ (x >> 31)) - (x >> 31) at the start of a + chain */
+static int idiom_abs(TCCState *s) {
+  TokenPos pos;
+  SValue sv;
+  Sym *x;
+
+  tok_save(s, &pos);
+  if (idiom_skip(s, '(') && idiom_word(x = idiom_local(s)) &&
+      !(x->t & VT_UNSIGNED) && idiom_skip(s, '^') && abs_sign(s, x) &&
+      idiom_skip(s, ')') && idiom_skip(s, '-') && s->tok == '(' &&
+      abs_sign(s, x) && idiom_prec(s) <= 10) {
+    idiom_value(&sv, x);
+    idiom_push(s, &sv);
+    gen_abs(s);
+    return 1;
+  }
+  tok_restore(s, &pos);
+  return 0;
+}
+
+static int idiom_same(SValue *a, SValue *b) {
+  if (a->sym || b->sym)
+    return a->sym == b->sym;
+  return a->c.i == b->c.i;
+}
+
+/* a op b ? a : b, or ? b : a, as a whole conditional expression */
+static int idiom_select(TCCState *s) {
+  TokenPos pos;
+  SValue a, b, x, y;
+  int op;
+
+  tok_save(s, &pos);
+  if (!idiom_operand(s, &a, NULL))
+    goto fail;
+  op = s->tok;
+  if (op != '<' && op != '>' && op != TOK_LE && op != TOK_GE)
+    goto fail;
+  next(s);
+  if (!idiom_operand(s, &b, NULL) || !(a.sym || b.sym) ||
+      !idiom_skip(s, '?') || !idiom_operand(s, &x, NULL) ||
+      !idiom_skip(s, ':') || !idiom_operand(s, &y, NULL) ||
+      idiom_prec(s) != 0)
+    goto fail;
+  if ((idiom_same(&x, &a) && idiom_same(&y, &b)) ||
+      (idiom_same(&x, &b) && idiom_same(&y, &a))) {
+    idiom_push(s, &a);
+    idiom_push(s, &b);
+    gen_select(s, op, !idiom_same(&x, &a));
+    return 1;
+  }
+fail:
+  tok_restore(s, &pos);
+  return 0;
+}
+
 /*============================================================
  * Expression Parsing (Operator Precedence)
  *============================================================*/
@@ -151,7 +650,7 @@ static void expr_eq(TCCState *s) {
   SValue lval;
   int op;
 
-  expr_or(s);
+  expr_cond(s);
 
   if (s->tok == '=' || (s->tok >= TOK_ADD_ASSIGN && s->tok <= TOK_SHR_ASSIGN)) {
     op = s->tok;
@@ -173,6 +672,48 @@ static void expr_eq(TCCState *s) {
   }
 }
 
+/* Conditional expression: both arms end in the same register */
+static void expr_cond(TCCState *s) {
+  Sym *l_else, *l_end;
+  int i, r, t;
+
+  if (s->pass[PASS_EXPR_IDIOMS] && idiom_select(s))
+    return;
+  expr_or(s);
+  if (s->tok != '?')
+    return;
+
+  /* Values computed before must be in the same place after either arm:
+   * a call or division in one would spill them on its path only, so
+   * spill the ones in registers before the paths split */
+  for (i = 0; i < s->vtop - s->vstack; i++) {
+    r = s->vstack[i].r & VT_VALMASK;
+    if (r < NB_REGS)
+      save_reg(s, r);
+  }
+
+  next(s);
+  l_else = gind(s);
+  l_end = gind(s);
+  gtst(s, 1, l_else);
+  expr(s);
+  r = gv(s, RC_INT);
+  t = s->vtop->t;
+  vpop(s);
+  gjmp(s, l_end);
+
+  glabel(s, l_else);
+  skip(s, ':');
+  expr_cond(s);
+  if (gv(s, RC_INT) != r)
+    load(s, r, s->vtop);
+  if (type_size(s->vtop->t) > type_size(t))
+    t = s->vtop->t;
+  vpop(s);
+  glabel(s, l_end);
+  vset(s, t, r, 0);
+}
+
 /* Logical OR */
 static void expr_or(TCCState *s) {
   expr_and(s);
@@ -195,31 +736,43 @@ static void expr_and(TCCState *s) {
 
 /* Bitwise OR */
 static void expr_bitor(TCCState *s) {
-  expr_xor(s);
+  OperandMark left;
+
+  operand_begin(s, &left);
+  if (s->pass[PASS_EXPR_IDIOMS] && idiom_bits(s))
+    left.chained = 1; /* not to be parsed again as a single operand */
+  else
+    expr_xor(s);
+  operand_end(s, &left);
   while (s->tok == '|') {
     next(s);
-    expr_xor(s);
-    gen_op(s, '|');
+    expr_right(s, &left, '|', expr_xor);
   }
 }
 
 /* Bitwise XOR */
 static void expr_xor(TCCState *s) {
+  OperandMark left;
+
+  operand_begin(s, &left);
   expr_bitand(s);
+  operand_end(s, &left);
   while (s->tok == '^') {
     next(s);
-    expr_bitand(s);
-    gen_op(s, '^');
+    expr_right(s, &left, '^', expr_bitand);
   }
 }
 
 /* Bitwise AND */
 static void expr_bitand(TCCState *s) {
+  OperandMark left;
+
+  operand_begin(s, &left);
   expr_cmp(s);
+  operand_end(s, &left);
   while (s->tok == '&') {
     next(s);
-    expr_cmp(s);
-    gen_op(s, '&');
+    expr_right(s, &left, '&', expr_cmp);
   }
 }
 
@@ -252,27 +805,34 @@ static void expr_shift(TCCState *s) {
 
 /* Addition/Subtraction */
 static void expr_add(TCCState *s) {
+  OperandMark left;
   int op;
 
-  expr_mult(s);
+  operand_begin(s, &left);
+  if (s->pass[PASS_EXPR_IDIOMS] && idiom_abs(s))
+    left.chained = 1;
+  else
+    expr_mult(s);
+  operand_end(s, &left);
   while (s->tok == '+' || s->tok == '-') {
     op = s->tok;
     next(s);
-    expr_mult(s);
-    gen_op(s, op);
+    expr_right(s, &left, op, expr_mult);
   }
 }
 
 /* Multiplication/Division/Modulo */
 static void expr_mult(TCCState *s) {
+  OperandMark left;
   int op;
 
+  operand_begin(s, &left);
   expr_unary(s);
+  operand_end(s, &left);
   while (s->tok == '*' || s->tok == '/' || s->tok == '%') {
     op = s->tok;
     next(s);
-    expr_unary(s);
-    gen_op(s, op);
+    expr_right(s, &left, op, expr_unary);
   }
 }
 
@@ -311,8 +871,7 @@ static void expr_unary(TCCState *s) {
     /* Dereference */
     next(s);
     expr_unary(s);
-    /* Mark as lvalue */
-    s->vtop->r |= VT_LVAL;
+    indir(s);
     break;
 
   case '&':
@@ -324,10 +883,14 @@ static void expr_unary(TCCState *s) {
 
   case TOK_INC:
   case TOK_DEC:
+    /* ++x  ->  x = x + 1 */
     op = s->tok;
     next(s);
     expr_unary(s);
+    vpush(s);
+    vset(s, VT_INT, VT_CONST, 1);
     gen_op(s, op == TOK_INC ? '+' : '-');
+    gen_op(s, '=');
     break;
 
   case TOK_SIZEOF:
@@ -406,14 +969,15 @@ static void expr_postfix(TCCState *s) {
       }
       skip(s, ')');
 
-      gfunc_call(s, nb_args);
+      if (!s->pass[PASS_FOLD_CALLS] || !eval_call(s, nb_args))
+        gfunc_call(s, nb_args);
     } else if (s->tok == '[') {
       /* Array indexing */
       next(s);
       expr(s);
       skip(s, ']');
       gen_op(s, '+');
-      s->vtop->r |= VT_LVAL;
+      indir(s);
     } else if (s->tok == '.') {
       /* Struct member */
       next(s);
@@ -431,16 +995,45 @@ static void expr_postfix(TCCState *s) {
       /* TODO: implement pointer member access */
       next(s);
     } else if (s->tok == TOK_INC || s->tok == TOK_DEC) {
-      /* Post-increment/decrement */
+      /* Post-increment/decrement: x = x + 1, yielding the sum less 1 */
       int op = s->tok;
       next(s);
+      vpush(s);
+      vset(s, VT_INT, VT_CONST, 1);
       gen_op(s, op == TOK_INC ? '+' : '-');
+      gen_op(s, '=');
+      vset(s, VT_INT, VT_CONST, 1);
+      gen_op(s, op == TOK_INC ? '-' : '+');
     } else {
       break;
     }
   }
 }
 
+/* Bit manipulation builtins, expanded by gen_bitop() */
+typedef struct {
+  const char *name; /* after "__builtin_" */
+  int op;           /* BITOP_* */
+  int wide;         /* 64-bit operand */
+} BitopBuiltin;
+
+static const BitopBuiltin bitop_builtins[] = {
+    {"popcount", BITOP_POPCOUNT, 0}, {"popcountll", BITOP_POPCOUNT, 1},
+    {"clz", BITOP_CLZ, 0},           {"clzll", BITOP_CLZ, 1},
+    {"ctz", BITOP_CTZ, 0},           {"ctzll", BITOP_CTZ, 1},
+    {"bswap32", BITOP_BSWAP, 0},     {"bswap64", BITOP_BSWAP, 1},
+};
+
+static const BitopBuiltin *find_bitop(const char *name) {
+  int i;
+  for (i = 0; i < (int)(sizeof(bitop_builtins) / sizeof(bitop_builtins[0]));
+       i++) {
+    if (strcmp(bitop_builtins[i].name, name) == 0)
+      return &bitop_builtins[i];
+  }
+  return NULL;
+}
+
 /* Primary expressions (literals, identifiers) */
 static void expr_primary(TCCState *s) {
   Sym *sym;
@@ -464,6 +1057,7 @@ static void expr_primary(TCCState *s) {
 
       offset = section_add(s->rdata_section, s->tokc.str, len);
       tcc_free(s->tokc.str);
+      s->nb_effects++;
 
       /* Push address of string */
       CValue cv;
@@ -474,10 +1068,46 @@ static void expr_primary(TCCState *s) {
     break;
 
   case TOK_IDENT:
+    if (strncmp(s->tokc.str, "__builtin_", 10) == 0 &&
+        find_bitop(s->tokc.str + 10)) {
+      /* __builtin_popcount(x) and friends */
+      const BitopBuiltin *b = find_bitop(s->tokc.str + 10);
+      tcc_free(s->tokc.str);
+      next(s);
+      skip(s, '(');
+      expr_eq(s);
+      skip(s, ')');
+      gen_bitop(s, b->op, b->wide);
+      break;
+    }
+    if (strcmp(s->tokc.str, "__builtin_expect") == 0) {
+      /* __builtin_expect(exp, c): value of exp, c is a branch hint for
+         the if whose whole condition it is, and for no other */
+      int whole = s->expect_whole, hint = 0;
+      s->expect_whole = 0;
+      tcc_free(s->tokc.str);
+      next(s);
+      skip(s, '(');
+      expr_eq(s);
+      skip(s, ',');
+      expr_eq(s);
+      if ((s->vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST) {
+        tcc_error(s, "__builtin_expect hint must be a constant");
+      } else {
+        hint = s->vtop->c.i ? 1 : -1;
+      }
+      vpop(s);
+      skip(s, ')');
+      if (whole && s->tok == ')')
+        s->branch_hint = hint;
+      break;
+    }
+
     sym = sym_find2(s, s->tokc.str);
     if (!sym) {
-      /* Implicit function declaration */
-      sym = sym_push2(s, s->tokc.str, VT_FUNC | VT_INT, VT_CONST, 0);
+      /* Implicit function declaration, visible for the rest of the file */
+      sym = global_sym_push2(s, s->tokc.str, VT_FUNC | VT_INT, VT_CONST, 0);
+      lto_declare(s, sym);
     }
 
     if ((sym->t & VT_BTYPE) == VT_FUNC) {
@@ -487,10 +1117,10 @@ static void expr_primary(TCCState *s) {
       vsetc(s, sym->t, VT_CONST | VT_SYM, &cv);
       s->vtop->sym = sym;
     } else {
-      /* Variable reference */
+      /* Variable reference; an array stands for its address */
       CValue cv;
       cv.i = sym->c;
-      vsetc(s, sym->t, sym->r | VT_LVAL, &cv);
+      vsetc(s, sym->t, (sym->t & VT_ARRAY) ? sym->r : sym->r | VT_LVAL, &cv);
       s->vtop->sym = sym;
     }
     tcc_free(s->tokc.str);
@@ -507,6 +1137,138 @@ static void expr_primary(TCCState *s) {
 /* Main expression entry point */
 void expr(TCCState *s) { expr_eq(s); }
 
+/*============================================================
+ * Loop Idioms
+ *============================================================*/
+
+/* Loops that only copy, fill or scan memory are recognised by their
+ * tokens and compiled to string instructions:
+ *   for (i = 0; i < n; i++) a[i] = b[i];     rep movsb
+ *   for (i = 0; i < n; i++) a[i] = v;        rep stos
+ *   while (*p) p++;                          SSE2 scan for the NUL
+ * where i, n, v and p are locals or constants and a and b local arrays or
+ * pointers. Scalars never have their address taken, so the stores to a[]
+ * cannot change i, n or v; a forward string copy gives the same result
+ * as the loop even where a and b overlap. Anything else is parsed again
+ * as a plain loop. */
+
+/* i++, ++i or i = i + 1 */
+static int idiom_step(TCCState *s, Sym *i) {
+  if (idiom_skip(s, TOK_INC))
+    return idiom_local(s) == i;
+  if (idiom_local(s) != i)
+    return 0;
+  if (idiom_skip(s, TOK_INC))
+    return 1;
+  return idiom_skip(s, '=') && idiom_local(s) == i && idiom_skip(s, '+') &&
+         s->tok == TOK_NUM && s->tokc.i == 1 && idiom_skip(s, TOK_NUM);
+}
+
+/* a[i] for an array or pointer a of integers */
+static Sym *idiom_elem(TCCState *s, Sym *a, Sym *i) {
+  if (!a || (a->t & VT_BTYPE) != VT_PTR || !idiom_int(pointed_type(a->t)) ||
+      !idiom_skip(s, '[') || idiom_local(s) != i || !idiom_skip(s, ']'))
+    return NULL;
+  return a;
+}
+
+static int loop_idiom_for(TCCState *s) {
+  SValue index, count, dst, src;
+  Sym *i, *a, *b;
+  int braces, size;
+
+  next(s);
+  if (!idiom_skip(s, '('))
+    return 0;
+  i = idiom_local(s);
+  if (!i || !idiom_int(i->t) || type_size(i->t) < 4 ||
+      (i->t & VT_UNSIGNED) || !idiom_skip(s, '=') || s->tok != TOK_NUM ||
+      s->tokc.i != 0 || !idiom_skip(s, TOK_NUM) || !idiom_skip(s, ';') ||
+      idiom_local(s) != i || !idiom_skip(s, '<') ||
+      !idiom_operand(s, &count, i) || (count.t & VT_UNSIGNED) ||
+      !idiom_skip(s, ';') || !idiom_step(s, i) || !idiom_skip(s, ')'))
+    return 0;
+
+  braces = idiom_skip(s, '{');
+  a = idiom_elem(s, idiom_local(s), i);
+  if (!a || !idiom_skip(s, '='))
+    return 0;
+  size = type_size(pointed_type(a->t));
+  b = NULL;
+  if (s->tok == TOK_IDENT) {
+    b = idiom_local(s);
+    if (!b)
+      return 0;
+    if ((b->t & VT_BTYPE) == VT_PTR) {
+      if (!idiom_elem(s, b, i) ||
+          (pointed_type(b->t) & VT_BTYPE) != (pointed_type(a->t) & VT_BTYPE))
+        return 0;
+      idiom_value(&src, b);
+    } else {
+      if (b == i || !idiom_int(b->t))
+        return 0;
+      idiom_value(&src, b);
+      b = NULL;
+    }
+  } else if (!idiom_operand(s, &src, i)) {
+    return 0;
+  }
+  if (!idiom_skip(s, ';') || (braces && !idiom_skip(s, '}')))
+    return 0;
+
+  idiom_value(&index, i);
+  idiom_value(&dst, a);
+  if (b)
+    gen_loop_copy(s, &dst, &src, &count, &index, size);
+  else
+    gen_loop_fill(s, &dst, &src, &count, &index, size);
+  return 1;
+}
+
+static int loop_idiom_while(TCCState *s) {
+  SValue ptr;
+  Sym *p;
+  int braces;
+
+  next(s);
+  if (!idiom_skip(s, '(') || !idiom_skip(s, '*'))
+    return 0;
+  p = idiom_local(s);
+  if (!p || (p->t & (VT_BTYPE | VT_ARRAY)) != VT_PTR ||
+      (pointed_type(p->t) & VT_BTYPE) != VT_BYTE)
+    return 0;
+  if (idiom_skip(s, TOK_NE) &&
+      !(s->tok == TOK_NUM && s->tokc.i == 0 && idiom_skip(s, TOK_NUM)))
+    return 0;
+  if (!idiom_skip(s, ')'))
+    return 0;
+  braces = idiom_skip(s, '{');
+  if (!idiom_step(s, p) || !idiom_skip(s, ';') ||
+      (braces && !idiom_skip(s, '}')))
+    return 0;
+
+  idiom_value(&ptr, p);
+  gen_strlen_scan(s, &ptr);
+  return 1;
+}
+
+/* Compile the for or while loop at the current token as an idiom if it
+ * is one; the loop body still gets its profile counter so that the
+ * numbering does not depend on the pass */
+static int loop_idiom(TCCState *s) {
+  TokenPos pos;
+  int ok;
+
+  tok_save(s, &pos);
+  ok = s->tok == TOK_FOR ? loop_idiom_for(s) : loop_idiom_while(s);
+  if (!ok) {
+    tok_restore(s, &pos);
+    return 0;
+  }
+  prof_new_counter(s);
+  return 1;
+}
+
 /*============================================================
  * Statement Parsing
  *============================================================*/
@@ -542,30 +1304,80 @@ static void statement(TCCState *s) {
 
   case TOK_IF: {
     Sym *l1, *l2;
+    int then_id, else_id, block;
     next(s);
     skip(s, '(');
+    s->branch_hint = 0;
+    s->expect_whole = s->tok == TOK_IDENT &&
+                      strcmp(s->tokc.str, "__builtin_expect") == 0;
     expr(s);
+    s->expect_whole = 0;
     skip(s, ')');
 
+    /* Edge counters for both outcomes; a then part that the profile
+     * saw much less often than the fallthrough is treated as unlikely */
+    block = s->prof_block;
+    then_id = prof_new_counter(s);
+    else_id = prof_new_counter(s);
+    if (s->branch_hint == 0 && s->prof_counts &&
+        prof_count(s, then_id) * 8 < prof_count(s, else_id)) {
+      s->branch_hint = -1;
+    }
+
+    if (s->pass[PASS_SPLIT_COLD] && s->branch_hint < 0 &&
+        !text_chunk_cold(s)) {
+      /* Unlikely body goes to a cold chunk; the hot path falls through
+       * to the else part, or to the code after the if. Within cold code
+       * the body stays in line: the cold chunks keep their order, so
+       * the code around it could not fall through past it. */
+      l1 = gind(s);
+      l2 = gind(s);
+      gtst(s, 0, l1); /* Jump if true */
+      text_begin_chunk(s, 1);
+      glabel(s, l1);
+      prof_enter_block(s, then_id);
+      statement(s);
+      gjmp(s, l2);
+      text_begin_chunk(s, 0);
+      prof_enter_block(s, else_id);
+      if (s->tok == TOK_ELSE) {
+        next(s);
+        statement(s);
+      }
+      glabel(s, l2);
+      s->prof_block = block;
+      break;
+    }
+
     l1 = gind(s);
     gtst(s, 1, l1); /* Jump if false */
 
+    prof_enter_block(s, then_id);
     statement(s);
 
-    if (s->tok == TOK_ELSE) {
+    if (s->tok == TOK_ELSE || s->prof_generate) {
+      /* An instrumented if without else still needs a block on the
+       * false edge for its counter */
       l2 = gind(s);
       gjmp(s, l2); /* Jump over else */
       glabel(s, l1);
-      next(s);
-      statement(s);
+      prof_enter_block(s, else_id);
+      if (s->tok == TOK_ELSE) {
+        next(s);
+        statement(s);
+      }
       glabel(s, l2);
     } else {
       glabel(s, l1);
     }
+    s->prof_block = block;
   } break;
 
   case TOK_WHILE: {
     Sym *l1, *l2;
+    int block;
+    if (s->pass[PASS_LOOP_IDIOMS] && loop_idiom(s))
+      break;
     l1 = gind(s);
     l2 = gind(s);
 
@@ -578,17 +1390,23 @@ static void statement(TCCState *s) {
 
     gtst(s, 1, l2); /* Jump to end if false */
 
+    block = s->prof_block;
+    prof_enter_block(s, prof_new_counter(s));
     statement(s);
+    s->prof_block = block;
 
     gjmp(s, l1);   /* Loop */
     glabel(s, l2); /* End */
   } break;
 
   case TOK_FOR: {
+    if (s->pass[PASS_LOOP_IDIOMS] && loop_idiom(s))
+      break;
     Sym *l_cond = gind(s);
     Sym *l_end = gind(s);
     Sym *l_update = gind(s);
     Sym *l_body = gind(s);
+    int block;
 
     next(s);
     skip(s, '(');
@@ -616,7 +1434,10 @@ static void statement(TCCState *s) {
     skip(s, ')');
 
     glabel(s, l_body);
+    block = s->prof_block;
+    prof_enter_block(s, prof_new_counter(s));
     statement(s);
+    s->prof_block = block;
     gjmp(s, l_update);
 
     glabel(s, l_end);
@@ -678,11 +1499,262 @@ static void statement(TCCState *s) {
  * Declaration Parsing
  *============================================================*/
 
+/* Attributes given with __attribute__((...)) before a declaration */
+typedef struct {
+  int nb_clones;                      /* target_clones("...") */
+  char clone_names[MAX_CLONES][32];
+  unsigned clone_features[MAX_CLONES];
+  int is_const; /* const or pure: calls may be evaluated */
+} AttributeDef;
+
+static int popcount32(unsigned v) {
+  int n = 0;
+  for (; v; v &= v - 1)
+    n++;
+  return n;
+}
+
+static void add_clone(TCCState *s, AttributeDef *ad, const char *name) {
+  unsigned features;
+
+  if (x86_target_features(name, &features) < 0 ||
+      strlen(name) >= sizeof(ad->clone_names[0])) {
+    tcc_error(s, "unknown target_clones target '%s'", name);
+  } else if (ad->nb_clones >= MAX_CLONES) {
+    tcc_error(s, "too many target_clones targets");
+  } else {
+    strcpy(ad->clone_names[ad->nb_clones], name);
+    ad->clone_features[ad->nb_clones++] = features;
+  }
+}
+
+/* __attribute__((name, name(args), ...)), possibly repeated */
+static void parse_attributes(TCCState *s, AttributeDef *ad) {
+  memset(ad, 0, sizeof(*ad));
+
+  while (s->tok == TOK_IDENT && strcmp(s->tokc.str, "__attribute__") == 0) {
+    tcc_free(s->tokc.str);
+    next(s);
+    skip(s, '(');
+    skip(s, '(');
+    while (s->tok == TOK_IDENT || s->tok == TOK_CONST) {
+      char *name = s->tok == TOK_CONST ? tcc_strdup("const") : s->tokc.str;
+      next(s);
+      if (strcmp(name, "const") == 0 || strcmp(name, "__const__") == 0 ||
+          strcmp(name, "pure") == 0 || strcmp(name, "__pure__") == 0) {
+        ad->is_const = 1;
+      } else if (strcmp(name, "target_clones") == 0) {
+        /* Targets as separate strings or comma-separated in one */
+        skip(s, '(');
+        while (s->tok == TOK_STR) {
+          char *p = s->tokc.str, *comma;
+          while ((comma = strchr(p, ',')) != NULL) {
+            *comma = '\0';
+            add_clone(s, ad, p);
+            p = comma + 1;
+          }
+          add_clone(s, ad, p);
+          tcc_free(s->tokc.str);
+          next(s);
+          if (s->tok != ',')
+            break;
+          next(s);
+        }
+        skip(s, ')');
+      } else {
+        int depth = 0;
+        tcc_warning(s, "attribute '%s' ignored", name);
+        do {
+          if (s->tok == '(')
+            depth++;
+          else if (s->tok == ')')
+            depth--;
+          if (depth > 0 || s->tok == ')')
+            next(s);
+        } while (depth > 0 && s->tok != TOK_EOF);
+      }
+      tcc_free(name);
+      if (s->tok != ',')
+        break;
+      next(s);
+    }
+    skip(s, ')');
+    skip(s, ')');
+  }
+}
+
+/* Compile the body of function sym; the current token is its '{' */
+static void func_body(TCCState *s, Sym *sym, int ret_type, int nb_params) {
+  int entry_id;
+
+  sym->c = s->ind;
+  sym->sec = s->text_section;
+  s->func_ret_type = ret_type;
+  s->func_sym = sym;
+
+  /* Functions the profile never saw run are cold as a whole */
+  entry_id = prof_new_counter(s);
+  s->func_cold = s->pass[PASS_SPLIT_COLD] && s->prof_counts &&
+                 prof_count(s, entry_id) == 0;
+  text_begin_chunk(s, 0);
+
+  /* Generate prologue */
+  gfunc_prolog(s, ret_type, nb_params);
+  prof_enter_block(s, entry_id);
+
+  /* Parse body */
+  statement(s);
+
+  /* Falling off the end returns, and never runs into the next
+   * function wherever the layout places it */
+  gfunc_epilog(s);
+  s->func_sym = NULL;
+  s->func_cold = 0;
+  s->prof_block = -1;
+}
+
+/* target_clones: compile the body once per target as "name.target",
+ * then make sym a stub jumping through a slot that the start-up code
+ * points at the best variant for the CPU it runs on */
+static void func_clones(TCCState *s, Sym *sym, AttributeDef *ad,
+                        int ret_type, int nb_params) {
+  unsigned base = s->cpu_features;
+  CloneSet *cs;
+  TokenPos pos;
+  int i, j, has_default = 0;
+
+  for (i = 0; i < ad->nb_clones; i++) {
+    if (ad->clone_features[i] == 0)
+      has_default = 1;
+  }
+  if (!has_default) {
+    tcc_error(s, "target_clones of '%s' needs a \"default\" target",
+              sym->name);
+    return;
+  }
+
+  s->clone_sets = tcc_realloc(s->clone_sets,
+                              (s->nb_clone_sets + 1) * sizeof(CloneSet));
+  cs = &s->clone_sets[s->nb_clone_sets++];
+  memset(cs, 0, sizeof(*cs));
+  cs->func = sym;
+
+  tok_save(s, &pos);
+  for (i = 0; i < ad->nb_clones; i++) {
+    char *vname = tcc_malloc(strlen(sym->name) + strlen(ad->clone_names[i]) + 2);
+    char *p;
+    Sym *v;
+
+    sprintf(vname, "%s.%s", sym->name, ad->clone_names[i]);
+    for (p = vname + strlen(sym->name) + 1; *p; p++) {
+      if (!isalnum((unsigned char)*p))
+        *p = '_';
+    }
+    v = global_sym_push2(s, vname, sym->t, VT_CONST, 0);
+    v->flags = sym->flags & SYM_PRIVATE;
+    tcc_free(vname);
+
+    if (i > 0)
+      tok_restore(s, &pos);
+    s->cpu_features = base | ad->clone_features[i];
+    func_body(s, v, ret_type, nb_params);
+    s->cpu_features = base;
+
+    /* Keep the variants ordered by how much they ask of the CPU */
+    for (j = cs->nb_variants;
+         j > 0 && popcount32(cs->features[j - 1]) <
+                      popcount32(ad->clone_features[i]);
+         j--) {
+      cs->variant[j] = cs->variant[j - 1];
+      cs->features[j] = cs->features[j - 1];
+    }
+    cs->variant[j] = v;
+    cs->features[j] = ad->clone_features[i];
+    cs->nb_variants++;
+  }
+
+  sym->c = s->ind;
+  sym->sec = s->text_section;
+  s->func_sym = sym;
+  text_begin_chunk(s, 0);
+  gen_clone_stub(s, cs);
+  s->func_sym = NULL;
+}
+
+/* The body at the current '{' in a -fparallel-codegen state. The outline
+ * records where it ends and steps over it; a code unit compiles it if it
+ * is one of the unit's definitions and otherwise seeks past it to where
+ * the outline saw it end. Either way calls of it may still be folded.
+ * Returns 0 in an ordinary state, which compiles the body itself. */
+static int unit_body(TCCState *s, Sym *sym, AttributeDef *ad, int ret_type,
+                     Sym *params, int nb_params) {
+  int index = s->nb_func_defs++;
+  FuncRange *r;
+
+  if (s->unit_mode == UNIT_OUTLINE) {
+    TokenPos start;
+    int nb_evals = s->nb_eval_funcs, depth = 0;
+
+    /* The dispatch start-up code needs the whole file's link, and the
+       units are objects */
+    if (ad->nb_clones && !s->lto)
+      tcc_error(s, "target_clones is not supported with -fparallel-codegen");
+    if (s->pass[PASS_FOLD_CALLS] && !ad->nb_clones)
+      eval_record(s, sym, ret_type, params, nb_params, ad->is_const);
+    s->func_ranges = tcc_realloc(s->func_ranges,
+                                 (s->nb_func_ranges + 1) * sizeof(FuncRange));
+    r = &s->func_ranges[s->nb_func_ranges++];
+    memset(r, 0, sizeof(*r));
+    r->eval = s->nb_eval_funcs > nb_evals ? nb_evals : -1;
+    r->live = 1;
+    if (s->lto) {
+      r->name = tcc_strdup(sym->name);
+      r->file = s->lto_file;
+      r->local = (sym->t & VT_STATIC) != 0;
+    }
+    tok_save(s, &start);
+    do {
+      if (s->tok == '{')
+        depth++;
+      else if (s->tok == '}')
+        depth--;
+      else if (s->tok == TOK_IDENT && s->lto)
+        lto_add_ref(s, s->tokc.str);
+      else if (s->tok == TOK_IDENT || s->tok == TOK_STR)
+        tcc_free(s->tokc.str);
+      next(s);
+    } while (depth > 0 && s->tok != TOK_EOF);
+    tok_save(s, &r->end);
+    r->size = (uint32_t)(r->end.offset - start.offset);
+    return 1;
+  }
+
+  if (s->unit_mode != UNIT_CODE && s->unit_mode != UNIT_MODULE)
+    return 0;
+  if (index >= s->outline->nb_func_ranges) {
+    tcc_error(s, "'%s' was not seen by the outline pass", sym->name);
+    return 1;
+  }
+  r = &s->outline->func_ranges[index];
+  if (r->eval >= 0)
+    eval_share(s, sym, &s->outline->eval_funcs[r->eval]);
+  if (!r->live || index < s->unit_first || index >= s->unit_last)
+    tok_restore(s, &r->end);
+  else if (ad->nb_clones)
+    func_clones(s, sym, ad, ret_type, nb_params);
+  else
+    func_body(s, sym, ret_type, nb_params);
+  return 1;
+}
+
 void decl(TCCState *s, int flags) {
+  AttributeDef ad;
   int t, pt;
   char *name;
   Sym *sym;
 
+  parse_attributes(s, &ad);
+
   /* Parse type */
   t = parse_type(s);
   if (t < 0) {
@@ -709,13 +1781,21 @@ void decl(TCCState *s, int flags) {
       /* Function declaration/definition */
       next(s);
 
-      /* Create function symbol */
-      sym = sym_push2(s, name, pt | VT_FUNC, VT_CONST,
-                      s->text_section ? s->text_section->data_size : 0);
-      sym->sec = s->text_section;
+      /* Create function symbol, or reuse the one from an earlier
+       * declaration so that calls made before the definition bind to it */
+      sym = global_sym_find2(s, name);
+      if (!sym || sym->sec == s->data_section ||
+          (s->lto && (pt & VT_STATIC) &&
+           (!(sym->t & VT_STATIC) || (sym->flags & SYM_INTERNAL)))) {
+        /* With -flto, a static may have the name of a function of
+           another file */
+        sym = sym_push2(s, name, pt | VT_FUNC, VT_CONST, 0);
+        lto_declare(s, sym);
+      }
 
       /* Parse parameters */
       s->local_scope++;
+      Sym *params = s->local_stack.top;
       int param_count = 0;
       int stack_param_offset =
           48; /* After return address, saved RBP, and shadow space (16+32) */
@@ -743,6 +1823,7 @@ void decl(TCCState *s, int flags) {
             stack_param_offset += 8;
           }
           sym_push2(s, param_name, param_t, VT_LOCAL, offset);
+          tcc_free(param_name);
         }
 
         param_count++;
@@ -757,13 +1838,35 @@ void decl(TCCState *s, int flags) {
       /* Check for definition vs declaration */
       if (s->tok == '{') {
         /* Function definition */
-        s->func_ret_type = pt;
-
-        /* Generate prologue */
-        gfunc_prolog(s, pt);
+        if (sym->sec == s->text_section) {
+          tcc_error(s, "redefinition of '%s'", name);
+        }
 
-        /* Parse body */
-        statement(s);
+        /* With the private convention every parameter arrives in a
+         * register and is homed below the frame pointer */
+        if (gfunc_private(s, sym, param_count)) {
+          Sym *p;
+          sym->flags |= SYM_PRIVATE;
+          if (param_count > 4)
+            sym->flags |= SYM_ABI_THUNK;
+          for (p = s->local_stack.top; p != params; p = p->prev) {
+            if (p->c > 0)
+              p->c = -(4 + (p->c - 48) / 8 + 1) * 8;
+          }
+        }
+        if (unit_body(s, sym, &ad, pt, params, param_count)) {
+          /* -fparallel-codegen took care of it */
+        } else if (ad.nb_clones) {
+          func_clones(s, sym, &ad, pt, param_count);
+        } else {
+          CacheMark mark;
+          if (s->pass[PASS_FOLD_CALLS])
+            eval_record(s, sym, pt, params, param_count, ad.is_const);
+          if (!cache_begin(s, sym, pt, params, param_count, &mark)) {
+            func_body(s, sym, pt, param_count);
+            cache_end(s, sym, &mark);
+          }
+        }
 
         s->local_scope--;
       } else {
@@ -771,6 +1874,7 @@ void decl(TCCState *s, int flags) {
         s->local_scope--;
         skip(s, ';');
       }
+      tcc_free(name);
       return;
     } else if (s->tok == '[') {
       /* Array declaration */
@@ -782,21 +1886,27 @@ void decl(TCCState *s, int flags) {
       }
       skip(s, ']');
 
-      /* Create array type */
-      pt |= VT_ARRAY;
+      /* An array is a pointer to its first element that is not itself
+         stored anywhere */
+      int elem_size = type_size(pt);
+      pt = VT_PTR | VT_ARRAY | (pt << 16);
 
       /* Allocate local variable */
-      s->loc -= array_size * 8; /* Simplified: assume 8 bytes per element */
+      s->loc -= (array_size * elem_size + 7) & ~7;
       sym = sym_push2(s, name, pt, VT_LOCAL, s->loc);
     } else {
       /* Variable declaration */
       if (s->local_scope == 0) {
-        /* Global variable */
-        sym = sym_push2(s, name, pt, VT_SYM, 0);
-        if (s->data_section) {
-          sym->c = s->data_section->data_size;
-          sym->sec = s->data_section;
-          section_ptr_add(s->data_section, 8); /* 8 bytes for 64-bit */
+        /* Global variable; with -flto a later file of the module
+           declares the same one again */
+        sym = s->lto && !(pt & VT_STATIC) ? global_sym_find2(s, name) : NULL;
+        if (!sym || (sym->t & VT_BTYPE) == VT_FUNC || (sym->t & VT_STATIC)) {
+          sym = sym_push2(s, name, pt, VT_SYM, 0);
+          if (s->data_section && s->unit_mode != UNIT_CODE) {
+            sym->c = s->data_section->data_size;
+            sym->sec = s->data_section;
+            memset(section_ptr_add(s->data_section, 8), 0, 8); /* 8 bytes for 64-bit */
+          }
         }
       } else {
         /* Local variable */
@@ -827,6 +1937,7 @@ void decl(TCCState *s, int flags) {
         vpop(s);
       }
     }
+    tcc_free(name);
 
     if (s->tok == ',') {
       next(s);
@@ -102,7 +102,7 @@ typedef struct {
  * Constants
  *============================================================*/
 
-#define IMAGE_FILE_MACHINE_AMD64 0x8664
+#define IMAGE_FILE_RELOCS_STRIPPED 0x0001
 #define IMAGE_FILE_EXECUTABLE_IMAGE 0x0002
 #define IMAGE_FILE_LARGE_ADDRESS_AWARE 0x0020
 
@@ -116,10 +116,15 @@ typedef struct {
 #define IMAGE_SCN_MEM_READ 0x40000000
 #define IMAGE_SCN_MEM_WRITE 0x80000000
 
-#define PE_HEADER_SIZE 0x200      /* Size of all headers (aligned) */
+#define IMAGE_DIRECTORY_ENTRY_IMPORT 1
+#define IMAGE_DIRECTORY_ENTRY_IAT 12
+
+#define PE_HEADER_SIZE 0x400      /* Size of all headers (aligned) */
 #define SECTION_ALIGNMENT 0x1000  /* Section alignment in memory */
 #define FILE_ALIGNMENT 0x200      /* Section alignment in file */
 #define IMAGE_BASE 0x140000000ULL /* Default image base for x64 */
+#define MAX_PE_SECTIONS 8         /* Section headers that fit in the header */
+#define PE_IMPORT_DLL "kernel32.dll"
 
 /*============================================================
  * Helper Functions
@@ -129,45 +134,156 @@ static uint32_t align_up(uint32_t value, uint32_t alignment) {
   return (value + alignment - 1) & ~(alignment - 1);
 }
 
-static void write_u16(uint8_t *p, uint16_t v) {
+void write_u16(uint8_t *p, uint16_t v) {
   p[0] = v & 0xff;
   p[1] = (v >> 8) & 0xff;
 }
 
-static void write_u32(uint8_t *p, uint32_t v) {
+void write_u32(uint8_t *p, uint32_t v) {
   p[0] = v & 0xff;
   p[1] = (v >> 8) & 0xff;
   p[2] = (v >> 16) & 0xff;
   p[3] = (v >> 24) & 0xff;
 }
 
-static void write_u64(uint8_t *p, uint64_t v) {
+void write_u64(uint8_t *p, uint64_t v) {
   write_u32(p, (uint32_t)v);
   write_u32(p + 4, (uint32_t)(v >> 32));
 }
 
+uint16_t read_u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+uint32_t read_u32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint64_t read_u64(const uint8_t *p) {
+  return read_u32(p) | (uint64_t)read_u32(p + 4) << 32;
+}
+
+/*============================================================
+ * Imports
+ *============================================================*/
+
+/* Import a function from kernel32.dll (the only DLL the runtime needs)
+ * and return the offset of its IAT slot in .idata. The IAT comes first
+ * in .idata, so slot offsets are fixed as soon as they are handed out. */
+uint32_t pe_import(TCCState *s, const char *name) {
+  int i;
+
+  for (i = 0; i < s->nb_imports; i++) {
+    if (strcmp(s->imports[i], name) == 0)
+      return i * 8;
+  }
+
+  if (!s->idata_section)
+    s->idata_section = new_section(s, ".idata", 1, 3);
+  s->imports = tcc_realloc(s->imports, (s->nb_imports + 1) * sizeof(char *));
+  s->imports[s->nb_imports] = tcc_strdup(name);
+  return s->nb_imports++ * 8;
+}
+
+/* Lay out the import tables in .idata:
+ *   IAT, lookup table, descriptors, hint/name entries, DLL name.
+ * RVAs are stored relative to the section and rebased by pe_rebase_idata
+ * once its address is known. */
+static void pe_build_idata(TCCState *s) {
+  Section *sec = s->idata_section;
+  uint32_t table_size = (s->nb_imports + 1) * 8;
+  uint32_t iat = 0, ilt = table_size, desc = 2 * table_size;
+  uint32_t names, dll;
+  int i;
+
+  section_ptr_add(sec, desc + 2 * 20);
+  memset(sec->data, 0, sec->data_size);
+
+  for (i = 0; i < s->nb_imports; i++) {
+    size_t len = strlen(s->imports[i]) + 1;
+    names = (uint32_t)sec->data_size;
+    write_u64(sec->data + iat + i * 8, names);
+    write_u64(sec->data + ilt + i * 8, names);
+    memset(section_ptr_add(sec, 2), 0, 2); /* hint */
+    section_add(sec, s->imports[i], len);
+    if (sec->data_size & 1)
+      memset(section_ptr_add(sec, 1), 0, 1);
+  }
+  dll = (uint32_t)section_add(sec, PE_IMPORT_DLL, sizeof(PE_IMPORT_DLL));
+
+  write_u32(sec->data + desc, ilt);     /* OriginalFirstThunk */
+  write_u32(sec->data + desc + 12, dll); /* Name */
+  write_u32(sec->data + desc + 16, iat); /* FirstThunk */
+}
+
+static void pe_rebase_idata(TCCState *s) {
+  Section *sec = s->idata_section;
+  uint32_t rva = sec->sh_addr;
+  uint32_t table_size = (s->nb_imports + 1) * 8;
+  uint32_t desc = 2 * table_size;
+  int i;
+
+  for (i = 0; i < s->nb_imports; i++) {
+    write_u64(sec->data + i * 8, *(uint64_t *)(sec->data + i * 8) + rva);
+    write_u64(sec->data + table_size + i * 8,
+              *(uint64_t *)(sec->data + table_size + i * 8) + rva);
+  }
+  write_u32(sec->data + desc, *(uint32_t *)(sec->data + desc) + rva);
+  write_u32(sec->data + desc + 12, *(uint32_t *)(sec->data + desc + 12) + rva);
+  write_u32(sec->data + desc + 16, *(uint32_t *)(sec->data + desc + 16) + rva);
+}
+
+/*============================================================
+ * Relocation
+ *============================================================*/
+
+/* Resolve RIP-relative references from .text into other sections; the
+ * rel32 field holds the offset in the target section until now */
+static void pe_relocate_text(TCCState *s) {
+  Section *text = s->text_section;
+  int i;
+
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    uint8_t *p;
+    if (!rel->sec)
+      continue;
+    p = text->data + rel->offset;
+    write_u32(p, rel->sec->sh_addr + *(uint32_t *)p -
+                     (text->sh_addr + rel->offset + 4));
+  }
+}
+
 /*============================================================
  * PE Output
  *============================================================*/
 
+/* Characteristics of a section, in the image or an object */
+uint32_t pe_section_flags(Section *sec) {
+  uint32_t flags = IMAGE_SCN_MEM_READ;
+
+  if (sec->sh_flags & 4)
+    flags |= IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE;
+  else if (sec->sh_type == 8)
+    flags |= IMAGE_SCN_CNT_UNINITIALIZED_DATA;
+  else
+    flags |= IMAGE_SCN_CNT_INITIALIZED_DATA;
+  if (sec->sh_flags & 1)
+    flags |= IMAGE_SCN_MEM_WRITE;
+  return flags;
+}
+
 int pe_output_file(TCCState *s, const char *filename) {
   FILE *f;
   uint8_t header[PE_HEADER_SIZE];
+  uint8_t *image;
+  Section *secs[MAX_PE_SECTIONS];
+  Section *candidates[5];
   int num_sections = 0;
-  uint32_t file_offset, virtual_addr;
-
-  /* Count sections */
-  if (s->text_section && s->text_section->data_size > 0)
-    num_sections++;
-  if (s->data_section && s->data_section->data_size > 0)
-    num_sections++;
-  if (s->rdata_section && s->rdata_section->data_size > 0)
-    num_sections++;
-  if (s->bss_section && s->bss_section->data_size > 0)
-    num_sections++;
-
-  /* Default to 1 section if we have any code */
-  if (num_sections == 0 && s->text_section) {
+  uint32_t file_offset, virtual_addr, text_pos = 0, pos;
+  uint32_t size_of_code = 0, size_of_init_data = 0, size_of_uninit_data = 0;
+  int i, ret = 0;
+
+  /* Default to a minimal main if we have no code */
+  if (s->text_section && s->text_section->data_size == 0) {
     /* Create a minimal main that returns 0 */
     /* push rbp */
     g(s, 0x55);
@@ -182,7 +298,20 @@ int pe_output_file(TCCState *s, const char *filename) {
     g(s, 0x5d);
     /* ret */
     g(s, 0xc3);
-    num_sections = 1;
+  }
+
+  if (s->idata_section)
+    pe_build_idata(s);
+
+  /* Sections in image order; empty ones are left out */
+  candidates[0] = s->text_section;
+  candidates[1] = s->data_section;
+  candidates[2] = s->rdata_section;
+  candidates[3] = s->idata_section;
+  candidates[4] = s->bss_section;
+  for (i = 0; i < 5; i++) {
+    if (candidates[i] && candidates[i]->data_size > 0)
+      secs[num_sections++] = candidates[i];
   }
 
   memset(header, 0, sizeof(header));
@@ -208,42 +337,70 @@ int pe_output_file(TCCState *s, const char *filename) {
   write_u32(header + 0x8c, 0);   /* Symbol table pointer */
   write_u32(header + 0x90, 0);   /* Number of symbols */
   write_u16(header + 0x94, 240); /* Size of optional header (PE32+) */
+  /* There is no .reloc section: linked absolute addresses pin the base */
   write_u16(header + 0x96,
-            IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_LARGE_ADDRESS_AWARE);
+            IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_LARGE_ADDRESS_AWARE |
+                (s->link_absolute ? IMAGE_FILE_RELOCS_STRIPPED : 0));
 
   /* Optional Header at 0x98 */
   write_u16(header + 0x98, 0x20b); /* PE32+ magic */
   header[0x9a] = 1;                /* Linker major version */
   header[0x9b] = 0;                /* Linker minor version */
 
-  /* Calculate sizes */
-  uint32_t size_of_code =
-      s->text_section
-          ? align_up((uint32_t)s->text_section->data_size, FILE_ALIGNMENT)
-          : 0;
-  uint32_t size_of_init_data = 0;
-  if (s->data_section)
-    size_of_init_data +=
-        align_up((uint32_t)s->data_section->data_size, FILE_ALIGNMENT);
-  if (s->rdata_section)
-    size_of_init_data +=
-        align_up((uint32_t)s->rdata_section->data_size, FILE_ALIGNMENT);
+  /* Section headers start at offset 0x188 */
+  /* Assign addresses: sections follow each other in file and memory */
+  file_offset = PE_HEADER_SIZE;
+  virtual_addr = SECTION_ALIGNMENT; /* Start after headers */
+  for (i = 0; i < num_sections; i++) {
+    Section *sec = secs[i];
+    uint8_t *sh = header + 0x188 + i * 40;
+    uint32_t size = (uint32_t)sec->data_size;
+    uint32_t flags = pe_section_flags(sec);
+    uint32_t raw_size = sec->sh_type == 8 ? 0 : align_up(size, FILE_ALIGNMENT);
+
+    memcpy(sh, sec->name, strlen(sec->name) < 8 ? strlen(sec->name) : 8);
+    write_u32(sh + 8, size);
+    write_u32(sh + 12, virtual_addr);
+    write_u32(sh + 16, raw_size);
+    write_u32(sh + 20, raw_size ? file_offset : 0);
+    write_u32(sh + 36, flags);
+
+    if (flags & IMAGE_SCN_CNT_CODE)
+      size_of_code += raw_size;
+    else if (flags & IMAGE_SCN_CNT_UNINITIALIZED_DATA)
+      size_of_uninit_data += size;
+    else
+      size_of_init_data += raw_size;
+
+    if (sec == s->text_section)
+      text_pos = file_offset;
+    sec->sh_addr = virtual_addr;
+    file_offset += raw_size;
+    virtual_addr += align_up(size, SECTION_ALIGNMENT);
+  }
+
+  /* Addresses are final: patch cross-section references */
+  if (s->idata_section)
+    pe_rebase_idata(s);
+  pe_relocate_text(s);
+  if (s->nb_link_relocs)
+    link_relocate(s, IMAGE_BASE);
 
   write_u32(header + 0x9c, size_of_code);
   write_u32(header + 0xa0, size_of_init_data);
-  write_u32(header + 0xa4,
-            s->bss_section ? (uint32_t)s->bss_section->data_size : 0);
+  write_u32(header + 0xa4, size_of_uninit_data);
   /* Entry point RVA */
   uint32_t entry_point = SECTION_ALIGNMENT;
-  Sym *main_sym = sym_find2(s, "main");
-  if (main_sym) {
+  Sym *main_sym = global_sym_find2(s, s->entry_name);
+  if (main_sym && main_sym->sec == s->text_section) {
     entry_point += (uint32_t)main_sym->c;
     if (s->verbose)
-      printf("Entry point set to 'main' at RVA %08x\n", entry_point);
+      printf("Entry point set to '%s' at RVA %08x\n", s->entry_name,
+             entry_point);
   } else {
     if (s->verbose)
-      printf("Entry point set to start of .text at RVA %08x (main not found)\n",
-             entry_point);
+      printf("Entry point set to start of .text at RVA %08x (%s not found)\n",
+             entry_point, s->entry_name);
   }
   write_u32(header + 0xa8, entry_point);
 
@@ -259,30 +416,12 @@ int pe_output_file(TCCState *s, const char *filename) {
   write_u16(header + 0xca, 0); /* Subsystem minor version */
   write_u32(header + 0xcc, 0); /* Win32 version value */
 
-  /* Calculate size of image */
-  virtual_addr = SECTION_ALIGNMENT; /* Start after headers */
-  if (s->text_section && s->text_section->data_size > 0) {
-    virtual_addr +=
-        align_up((uint32_t)s->text_section->data_size, SECTION_ALIGNMENT);
-  }
-  if (s->data_section && s->data_section->data_size > 0) {
-    virtual_addr +=
-        align_up((uint32_t)s->data_section->data_size, SECTION_ALIGNMENT);
-  }
-  if (s->rdata_section && s->rdata_section->data_size > 0) {
-    virtual_addr +=
-        align_up((uint32_t)s->rdata_section->data_size, SECTION_ALIGNMENT);
-  }
-  if (s->bss_section && s->bss_section->data_size > 0) {
-    virtual_addr +=
-        align_up((uint32_t)s->bss_section->data_size, SECTION_ALIGNMENT);
-  }
-
   write_u32(header + 0xd0, virtual_addr);                /* Size of image */
   write_u32(header + 0xd4, PE_HEADER_SIZE);              /* Size of headers */
   write_u32(header + 0xd8, 0);                           /* Checksum */
   write_u16(header + 0xdc, IMAGE_SUBSYSTEM_WINDOWS_CUI); /* Console app */
-  write_u16(header + 0xde, 0x8160);   /* DLL characteristics (NX, ASLR, etc.) */
+  /* DLL characteristics (NX, ASLR, etc.) */
+  write_u16(header + 0xde, s->link_absolute ? 0x8100 : 0x8160);
   write_u64(header + 0xe0, 0x100000); /* Stack reserve */
   write_u64(header + 0xe8, 0x1000);   /* Stack commit */
   write_u64(header + 0xf0, 0x100000); /* Heap reserve */
@@ -291,126 +430,45 @@ int pe_output_file(TCCState *s, const char *filename) {
   write_u32(header + 0x104, 16);      /* Number of data directories */
 
   /* Data directories (16 entries, 8 bytes each = 128 bytes) */
-  /* All zeros for now (no imports/exports) */
-
-  /* Section headers start at offset 0x188 */
-  int section_offset = 0x188;
-  file_offset = PE_HEADER_SIZE;
-  virtual_addr = SECTION_ALIGNMENT;
-
-  /* .text section */
-  if (s->text_section && s->text_section->data_size > 0) {
-    memcpy(header + section_offset, ".text\0\0\0", 8);
-    write_u32(header + section_offset + 8,
-              (uint32_t)s->text_section->data_size);
-    write_u32(header + section_offset + 12, virtual_addr);
-    write_u32(header + section_offset + 16,
-              align_up((uint32_t)s->text_section->data_size, FILE_ALIGNMENT));
-    write_u32(header + section_offset + 20, file_offset);
-    write_u32(header + section_offset + 36,
-              IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ);
-
-    s->text_section->sh_addr = virtual_addr;
-    file_offset +=
-        align_up((uint32_t)s->text_section->data_size, FILE_ALIGNMENT);
-    virtual_addr +=
-        align_up((uint32_t)s->text_section->data_size, SECTION_ALIGNMENT);
-    section_offset += 40;
-  }
-
-  /* .data section */
-  if (s->data_section && s->data_section->data_size > 0) {
-    memcpy(header + section_offset, ".data\0\0\0", 8);
-    write_u32(header + section_offset + 8,
-              (uint32_t)s->data_section->data_size);
-    write_u32(header + section_offset + 12, virtual_addr);
-    write_u32(header + section_offset + 16,
-              align_up((uint32_t)s->data_section->data_size, FILE_ALIGNMENT));
-    write_u32(header + section_offset + 20, file_offset);
-    write_u32(header + section_offset + 36, IMAGE_SCN_CNT_INITIALIZED_DATA |
-                                                IMAGE_SCN_MEM_READ |
-                                                IMAGE_SCN_MEM_WRITE);
-
-    s->data_section->sh_addr = virtual_addr;
-    file_offset +=
-        align_up((uint32_t)s->data_section->data_size, FILE_ALIGNMENT);
-    virtual_addr +=
-        align_up((uint32_t)s->data_section->data_size, SECTION_ALIGNMENT);
-    section_offset += 40;
-  }
-
-  /* .rdata section */
-  if (s->rdata_section && s->rdata_section->data_size > 0) {
-    memcpy(header + section_offset, ".rdata\0\0", 8);
-    write_u32(header + section_offset + 8,
-              (uint32_t)s->rdata_section->data_size);
-    write_u32(header + section_offset + 12, virtual_addr);
-    write_u32(header + section_offset + 16,
-              align_up((uint32_t)s->rdata_section->data_size, FILE_ALIGNMENT));
-    write_u32(header + section_offset + 20, file_offset);
-    write_u32(header + section_offset + 36,
-              IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ);
-
-    s->rdata_section->sh_addr = virtual_addr;
-    file_offset +=
-        align_up((uint32_t)s->rdata_section->data_size, FILE_ALIGNMENT);
-    virtual_addr +=
-        align_up((uint32_t)s->rdata_section->data_size, SECTION_ALIGNMENT);
-    section_offset += 40;
+  if (s->idata_section) {
+    uint32_t table_size = (s->nb_imports + 1) * 8;
+    uint8_t *dir = header + 0x108;
+    write_u32(dir + IMAGE_DIRECTORY_ENTRY_IMPORT * 8,
+              s->idata_section->sh_addr + 2 * table_size);
+    write_u32(dir + IMAGE_DIRECTORY_ENTRY_IMPORT * 8 + 4, 2 * 20);
+    write_u32(dir + IMAGE_DIRECTORY_ENTRY_IAT * 8, s->idata_section->sh_addr);
+    write_u32(dir + IMAGE_DIRECTORY_ENTRY_IAT * 8 + 4, table_size);
   }
 
-  /* Write the file */
-  f = fopen(filename, "wb");
-  if (!f) {
-    tcc_error(s, "cannot create output file '%s'", filename);
-    return -1;
+  /* The image: headers, then the sections padded to the file alignment */
+  image = tcc_malloc(file_offset);
+  memset(image, 0, file_offset);
+  memcpy(image, header, PE_HEADER_SIZE);
+  pos = PE_HEADER_SIZE;
+  for (i = 0; i < num_sections; i++) {
+    Section *sec = secs[i];
+    if (sec->sh_type == 8)
+      continue;
+    memcpy(image + pos, sec->data, sec->data_size);
+    pos += align_up((uint32_t)sec->data_size, FILE_ALIGNMENT);
   }
 
-  /* Write headers */
-  fwrite(header, 1, PE_HEADER_SIZE, f);
-
-  /* Write sections */
-  if (s->text_section && s->text_section->data_size > 0) {
-    fwrite(s->text_section->data, 1, s->text_section->data_size, f);
-    /* Pad to file alignment */
-    uint32_t padding =
-        align_up((uint32_t)s->text_section->data_size, FILE_ALIGNMENT) -
-        (uint32_t)s->text_section->data_size;
-    if (padding > 0) {
-      uint8_t *pad = tcc_malloc(padding);
-      memset(pad, 0, padding);
-      fwrite(pad, 1, padding, f);
-      tcc_free(pad);
-    }
-  }
-
-  if (s->data_section && s->data_section->data_size > 0) {
-    fwrite(s->data_section->data, 1, s->data_section->data_size, f);
-    uint32_t padding =
-        align_up((uint32_t)s->data_section->data_size, FILE_ALIGNMENT) -
-        (uint32_t)s->data_section->data_size;
-    if (padding > 0) {
-      uint8_t *pad = tcc_malloc(padding);
-      memset(pad, 0, padding);
-      fwrite(pad, 1, padding, f);
-      tcc_free(pad);
-    }
-  }
-
-  if (s->rdata_section && s->rdata_section->data_size > 0) {
-    fwrite(s->rdata_section->data, 1, s->rdata_section->data_size, f);
-    uint32_t padding =
-        align_up((uint32_t)s->rdata_section->data_size, FILE_ALIGNMENT) -
-        (uint32_t)s->rdata_section->data_size;
-    if (padding > 0) {
-      uint8_t *pad = tcc_malloc(padding);
-      memset(pad, 0, padding);
-      fwrite(pad, 1, padding, f);
-      tcc_free(pad);
+  /* Write the file, or with -incremental what changed in it */
+  if (s->incr) {
+    ret = incr_write(s, filename, image, file_offset, text_pos);
+  } else {
+    f = fopen(filename, "wb");
+    if (!f) {
+      tcc_error(s, "cannot create output file '%s'", filename);
+      ret = -1;
+    } else {
+      fwrite(image, 1, file_offset, f);
+      fclose(f);
     }
   }
-
-  fclose(f);
+  tcc_free(image);
+  if (ret < 0)
+    return -1;
 
   if (s->verbose) {
     printf("PE file created: %s\n", filename);
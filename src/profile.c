@@ -0,0 +1,284 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * Profile-guided optimization: block counters for instrumented builds
+ * (-fprofile-generate) and reading the counts back (-fprofile-use).
+ *
+ * Counters are numbered in the order the parser creates them, so a
+ * build of the same source with -fprofile-use finds each count under
+ * the same number; indirect call sites are numbered the same way. The
+ * profile file is
+ *   "TCCP", counter count, layout checksum, call site count,
+ *   function count, name bytes, 0, 0            (8 x uint32)
+ *   one uint64 count per counter
+ *   one ProfValueSite per indirect call site
+ *   the names of the functions the sites refer to, NUL terminated
+ * and is written by the instrumented program itself when main returns.
+ */
+
+#include "tcc.h"
+
+#define PROF_MAGIC 0x50434354 /* "TCCP" */
+#define PROF_HEADER_SIZE 32
+#define PROF_DOMINANT_PERCENT 80
+
+/*============================================================
+ * Counters
+ *============================================================*/
+
+/* FNV-1a over the owning function names, so that a profile taken
+   from different source is noticed */
+static void prof_hash(TCCState *s, uint8_t kind) {
+  const char *p = s->func_sym ? s->func_sym->name : "";
+
+  while (*p)
+    s->prof_checksum = (s->prof_checksum ^ (uint8_t)*p++) * 16777619u;
+  s->prof_checksum = (s->prof_checksum ^ kind) * 16777619u;
+}
+
+/* Hand out the next counter number */
+int prof_new_counter(TCCState *s) {
+  prof_hash(s, 0xff);
+  return s->nb_prof_counters++;
+}
+
+/* Code from here on belongs to the block of counter id */
+void prof_enter_block(TCCState *s, int id) {
+  s->prof_block = id;
+  if (!s->prof_generate)
+    return;
+
+  if (!s->prof_section)
+    s->prof_section = new_section(s, ".prof", 1, 3);
+  while (s->prof_section->data_size < (size_t)(id + 1) * 8)
+    memset(section_ptr_add(s->prof_section, 8), 0, 8);
+  gen_prof_inc(s, id * 8);
+}
+
+/* Count recorded for counter id, 0 without a profile */
+uint64_t prof_count(TCCState *s, int id) {
+  if (!s->prof_counts || id < 0 || id >= s->nb_prof_counts)
+    return 0;
+  return s->prof_counts[id];
+}
+
+/* How often the current block ran: the weight of a call made from it */
+int64_t prof_block_count(TCCState *s) {
+  if (!s->prof_counts)
+    return 1;
+  return (int64_t)prof_count(s, s->prof_block);
+}
+
+/*============================================================
+ * Indirect Call Targets
+ *============================================================*/
+
+/* Hand out the next indirect call site number */
+int prof_new_value_site(TCCState *s) {
+  prof_hash(s, 0xfe);
+  return s->nb_prof_values++;
+}
+
+/* The function that took at least PROF_DOMINANT_PERCENT of the calls at
+ * site id in the profile, if it is declared here; NULL otherwise */
+Sym *prof_dominant_target(TCCState *s, int id, uint64_t *count) {
+  ProfValueSite *site;
+  uint64_t total;
+  uint32_t func;
+  Sym *sym;
+  int best;
+
+  if (!s->prof_sites || id < 0 || id >= s->nb_prof_sites)
+    return NULL;
+
+  site = &s->prof_sites[id];
+  best = site->slot[1].count > site->slot[0].count;
+  total = site->slot[0].count + site->slot[1].count + site->other;
+  func = site->slot[best].func;
+  *count = site->slot[best].count;
+  if (*count == 0 || func == 0 || func > (uint32_t)s->nb_prof_funcs ||
+      *count * 100 < total * PROF_DOMINANT_PERCENT)
+    return NULL;
+
+  sym = global_sym_find2(s, s->prof_funcs[func - 1]);
+  if (!sym || (sym->t & VT_BTYPE) != VT_FUNC)
+    return NULL;
+  return sym;
+}
+
+/*============================================================
+ * Profile Files
+ *============================================================*/
+
+int prof_load(TCCState *s, const char *filename) {
+  uint32_t header[PROF_HEADER_SIZE / 4];
+  char *names, *p;
+  int i;
+  FILE *f;
+
+  f = fopen(filename, "rb");
+  if (!f) {
+    tcc_error(s, "cannot open profile '%s'", filename);
+    return -1;
+  }
+  if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+      header[0] != PROF_MAGIC) {
+    tcc_error(s, "'%s' is not a profile", filename);
+    fclose(f);
+    return -1;
+  }
+
+  s->nb_prof_counts = (int)header[1];
+  s->prof_use_checksum = header[2];
+  s->prof_counts = tcc_malloc((s->nb_prof_counts + 1) * sizeof(uint64_t));
+  s->nb_prof_sites = (int)header[3];
+  s->prof_sites = tcc_malloc((s->nb_prof_sites + 1) * sizeof(ProfValueSite));
+  s->nb_prof_funcs = (int)header[4];
+  s->prof_funcs = tcc_malloc((s->nb_prof_funcs + 1) * sizeof(char *));
+  names = tcc_malloc(header[5] + 1);
+  names[header[5]] = '\0';
+  s->prof_funcs[0] = names;
+  if (fread(s->prof_counts, sizeof(uint64_t), s->nb_prof_counts, f) !=
+          (size_t)s->nb_prof_counts ||
+      fread(s->prof_sites, sizeof(ProfValueSite), s->nb_prof_sites, f) !=
+          (size_t)s->nb_prof_sites ||
+      fread(names, 1, header[5], f) != header[5]) {
+    tcc_error(s, "profile '%s' is truncated", filename);
+    s->nb_prof_funcs = 0;
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  /* prof_funcs[0] owns the name block */
+  p = names;
+  for (i = 0; i < s->nb_prof_funcs; i++) {
+    s->prof_funcs[i] = p;
+    p += strlen(p);
+    if (p < names + header[5])
+      p++;
+  }
+  return 0;
+}
+
+/* Move the rel32 references into the scratch section from into .data,
+   where it now starts at offset base */
+static void prof_rebase(TCCState *s, Section *from, uint32_t base) {
+  int i;
+
+  if (!from)
+    return;
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    if (rel->sec != from)
+      continue;
+    *(uint32_t *)(s->text_section->data + rel->offset) += base;
+    rel->sec = s->data_section;
+  }
+}
+
+/* Called before the layout: check the profile in use against the
+ * counters just created, or emit the counter block and the start-up
+ * code that dumps it for an instrumented build */
+int prof_finish(TCCState *s, const char *outfile) {
+  uint32_t header[PROF_HEADER_SIZE / 4];
+  uint32_t data, name, size, values;
+  const char *ext;
+  char *file;
+  size_t len;
+  Sym *main_sym, *start, **funcs;
+  int i, j, nb_funcs;
+
+  if (s->prof_counts && (s->nb_prof_counts != s->nb_prof_counters ||
+                         s->nb_prof_sites != s->nb_prof_values ||
+                         s->prof_use_checksum != s->prof_checksum)) {
+    tcc_warning(s, "profile does not match the source, layout may be poor");
+  }
+
+  if (!s->prof_generate)
+    return 0;
+
+  main_sym = global_sym_find2(s, "main");
+  if (!main_sym || main_sym->sec != s->text_section) {
+    tcc_error(s, "-fprofile-generate needs a main function");
+    return -1;
+  }
+
+  /* Call targets are recorded as numbers into the functions defined
+     so far, in source order */
+  funcs = tcc_malloc((s->nb_text_chunks + 1) * sizeof(Sym *));
+  nb_funcs = 0;
+  header[5] = 0;
+  for (i = 0; i < s->nb_text_chunks; i++) {
+    Sym *f = s->text_chunks[i].func;
+    if (!f)
+      continue;
+    for (j = 0; j < nb_funcs && funcs[j] != f; j++)
+      ;
+    if (j == nb_funcs) {
+      funcs[nb_funcs++] = f;
+      header[5] += (uint32_t)strlen(f->name) + 1;
+    }
+  }
+
+  /* Header, counters, call sites and names go to .data, where the
+     program can write them out in one piece */
+  while (s->data_section->data_size & 7)
+    *(uint8_t *)section_ptr_add(s->data_section, 1) = 0;
+  header[0] = PROF_MAGIC;
+  header[1] = (uint32_t)s->nb_prof_counters;
+  header[2] = s->prof_checksum;
+  header[3] = (uint32_t)s->nb_prof_values;
+  header[4] = (uint32_t)nb_funcs;
+  header[6] = 0;
+  header[7] = 0;
+  data = (uint32_t)section_add(s->data_section, header, sizeof(header));
+  memset(section_ptr_add(s->data_section, s->nb_prof_counters * 8), 0,
+         s->nb_prof_counters * 8);
+  values = (uint32_t)s->data_section->data_size;
+  memset(section_ptr_add(s->data_section,
+                         s->nb_prof_values * sizeof(ProfValueSite)),
+         0, s->nb_prof_values * sizeof(ProfValueSite));
+  for (i = 0; i < nb_funcs; i++)
+    section_add(s->data_section, funcs[i]->name, strlen(funcs[i]->name) + 1);
+  size = (uint32_t)s->data_section->data_size - data;
+  prof_rebase(s, s->prof_section, data + PROF_HEADER_SIZE);
+  prof_rebase(s, s->prof_value_section, values);
+
+  /* Profile name: given, or the output name with a .prof extension */
+  if (s->prof_file) {
+    file = tcc_strdup(s->prof_file);
+  } else {
+    ext = strrchr(outfile, '.');
+    len = ext ? (size_t)(ext - outfile) : strlen(outfile);
+    file = tcc_malloc(len + 6);
+    memcpy(file, outfile, len);
+    strcpy(file + len, ".prof");
+  }
+  if (!s->rdata_section)
+    s->rdata_section = new_section(s, ".rdata", 1, 0);
+  name = (uint32_t)section_add(s->rdata_section, file, strlen(file) + 1);
+  tcc_free(file);
+
+  /* The helper the instrumented indirect calls go through */
+  if (s->prof_value_sym) {
+    s->prof_value_sym->c = s->ind;
+    s->prof_value_sym->sec = s->text_section;
+    s->func_sym = s->prof_value_sym;
+    text_begin_chunk(s, 0);
+    gen_prof_value_helper(s, funcs, nb_funcs);
+  }
+  tcc_free(funcs);
+
+  /* The start-up code calls main, then dumps the counters */
+  start = global_sym_push2(s, "__tcc_profile_start", VT_FUNC | VT_INT,
+                           VT_CONST, s->ind);
+  start->sec = s->text_section;
+  s->func_sym = start;
+  text_begin_chunk(s, 0);
+  gen_prof_start(s, main_sym, name, data, size);
+  s->func_sym = NULL;
+  s->entry_name = "__tcc_profile_start";
+
+  return 0;
+}
@@ -79,6 +79,17 @@ Sym *sym_push2(TCCState *s, const char *name, int t, int r, int64_t c) {
   return sym;
 }
 
+/* Push a symbol at file scope, whatever scope is being parsed */
+Sym *global_sym_push2(TCCState *s, const char *name, int t, int r, int64_t c) {
+  int scope = s->local_scope;
+  Sym *sym;
+
+  s->local_scope = 0;
+  sym = sym_push2(s, name, t, r, c);
+  s->local_scope = scope;
+  return sym;
+}
+
 /* Backward compatible wrapper - treats v as string pointer */
 Sym *sym_push(TCCState *s, int v, int t, int r, int64_t c) {
   /* v is typically a cast pointer to string name */
@@ -115,6 +126,21 @@ void sym_pop(SymStack *st, Sym *b) {
   }
 }
 
+/* Take sym out of the lookup by name; it stays on the stack, and in
+   use by whatever refers to it */
+void sym_unlink(SymStack *st, Sym *sym) {
+  Sym **p;
+
+  if (!sym->name)
+    return;
+  for (p = &st->hash_table[str_hash(sym->name)]; *p; p = &(*p)->prev_tok) {
+    if (*p == sym) {
+      *p = sym->prev_tok;
+      break;
+    }
+  }
+}
+
 /* Find symbol by name in local then global scope */
 Sym *sym_find2(TCCState *s, const char *name) {
   Sym *sym;
@@ -141,6 +167,19 @@ Sym *sym_find2(TCCState *s, const char *name) {
   return NULL;
 }
 
+/* Find symbol by name in global scope only */
+Sym *global_sym_find2(TCCState *s, const char *name) {
+  Sym *sym = s->global_stack.hash_table[str_hash(name)];
+
+  while (sym) {
+    if (sym->name && strcmp(sym->name, name) == 0) {
+      return sym;
+    }
+    sym = sym->prev_tok;
+  }
+  return NULL;
+}
+
 /* Backward compatible wrapper */
 Sym *sym_find(TCCState *s, int v) {
   /* v is typically a cast pointer to string name */
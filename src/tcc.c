@@ -6,8 +6,64 @@
 
 #include "tcc.h"
 
-/* Global compiler state */
-TCCState *tcc_state = NULL;
+/*============================================================
+ * Optimization Passes
+ *============================================================*/
+
+typedef struct
+{
+    const char *name; /* -f<name> / -fno-<name> */
+    int level;        /* lowest -O level that enables it */
+    int size;         /* also enabled by -Os */
+} TCCPass;
+
+/* Level of the passes only -f<pass> enables */
+#define PASS_LEVEL_NONE 3
+
+static const TCCPass tcc_passes[NB_PASSES] = {
+    [PASS_FOLD_CONSTANTS] = {"fold-constants", 1, 1},
+    [PASS_PRIVATE_CALLS] = {"private-calls", 1, 1},
+    [PASS_SPLIT_COLD] = {"split-cold", 2, 0},
+    [PASS_REORDER_FUNCTIONS] = {"reorder-functions", 2, 1},
+    [PASS_SCHEDULE] = {"schedule", 2, 0},
+    [PASS_PEEPHOLE] = {"peephole", 1, 1},
+    [PASS_ORDER_OPERANDS] = {"order-operands", 1, 1},
+    [PASS_FORWARD_LOADS] = {"forward-loads", 1, 1},
+    [PASS_LOOP_IDIOMS] = {"loop-idioms", 2, 1},
+    [PASS_EXPR_IDIOMS] = {"expr-idioms", 1, 1},
+    [PASS_FOLD_CALLS] = {"fold-calls", 1, 1},
+    [PASS_GC_SECTIONS] = {"gc-sections", 1, 1},
+    [PASS_ICF] = {"icf", PASS_LEVEL_NONE, 0},
+};
+
+/* Enable the passes of an -O level; size selects -Os */
+void tcc_set_opt_level(TCCState *s, int level, int size)
+{
+    int i;
+    
+    s->opt_level = level;
+    s->opt_size = size;
+    for (i = 0; i < NB_PASSES; i++)
+    {
+        if (size)
+            s->pass[i] = tcc_passes[i].size;
+        else
+            s->pass[i] = level >= tcc_passes[i].level;
+    }
+}
+
+/* Pass number for an -f option name, -1 if there is none */
+int tcc_find_pass(const char *name)
+{
+    int i;
+    
+    for (i = 0; i < NB_PASSES; i++)
+    {
+        if (strcmp(tcc_passes[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
 
 /*============================================================
  * Compiler State Management
@@ -31,12 +87,19 @@ TCCState *tcc_new(void)
     
     /* Default output type */
     s->output_type = TCC_OUTPUT_EXE;
+    s->entry_name = "main";
+    
+    /* No block being generated */
+    s->prof_block = -1;
+    s->prof_values = 1;
     
     return s;
 }
 
 void tcc_delete(TCCState *s)
 {
+    int i;
+    
     if (!s) return;
     
     /* Free symbol tables */
@@ -44,6 +107,11 @@ void tcc_delete(TCCState *s)
     sym_free(&s->global_stack);
     sym_free(&s->local_stack);
     sym_free(&s->label_stack);
+    while (s->anon_labels) {
+        Sym *prev = s->anon_labels->prev;
+        tcc_free(s->anon_labels);
+        s->anon_labels = prev;
+    }
     
     /* Free sections */
     Section *sec = s->sections;
@@ -54,6 +122,36 @@ void tcc_delete(TCCState *s)
         sec = next;
     }
     
+    /* Free text layout records */
+    tcc_free(s->text_relocs);
+    tcc_free(s->text_chunks);
+    
+    /* Free profiling and import data */
+    tcc_free(s->prof_file);
+    tcc_free(s->prof_counts);
+    tcc_free(s->prof_sites);
+    if (s->prof_funcs)
+    {
+        tcc_free(s->prof_funcs[0]);
+        tcc_free(s->prof_funcs);
+    }
+    for (i = 0; i < s->nb_imports; i++)
+        tcc_free(s->imports[i]);
+    tcc_free(s->imports);
+    tcc_free(s->clone_sets);
+    tcc_free(s->link_relocs);
+    for (i = 0; i < s->nb_func_ranges; i++)
+        tcc_free(s->func_ranges[i].name);
+    tcc_free(s->func_ranges);
+    for (i = 0; i < s->nb_lto_refs; i++)
+        tcc_free(s->lto_refs[i].name);
+    tcc_free(s->lto_refs);
+    incr_free(s->incr);
+    tcc_free(s->code_cache);
+    tcc_free(s->cache_keys);
+    tcc_free(s->unit_prefix);
+    eval_free(s);
+    
     /* Free output filename */
     if (s->outfile) {
         tcc_free(s->outfile);
@@ -68,8 +166,6 @@ void tcc_delete(TCCState *s)
 
 int tcc_compile(TCCState *s, const char *filename)
 {
-    tcc_state = s;
-    
     /* Initialize code generation */
     gen_init(s);
     
@@ -88,40 +184,578 @@ int tcc_compile(TCCState *s, const char *filename)
     return s->nb_errors ? -1 : 0;
 }
 
+/* Steps that need all of a file's code, before it is written out */
+static int tcc_output_prepare(TCCState *s, const char *filename)
+{
+    /* Start-up code runs before the entry point, which only the link
+       knows */
+    if (s->output_type == TCC_OUTPUT_OBJ &&
+        (s->prof_generate || s->nb_clone_sets))
+    {
+        tcc_error(s, "%s needs the entry point, not an object file",
+                  s->prof_generate ? "-fprofile-generate" : "target_clones");
+        return -1;
+    }
+
+    /* Profile start-up code and counters */
+    if (prof_finish(s, filename) < 0)
+        return -1;
+
+    /* CPU dispatch for target_clones, run before the entry point */
+    if (gen_clone_resolver(s) < 0)
+        return -1;
+
+    /* Entry points for pointers to private functions */
+    gen_abi_thunks(s);
+
+    if (s->verbose && s->code_cache)
+        printf("Code cache: %d of %d functions copied in\n",
+               s->nb_cache_hits, s->nb_cache_keys);
+
+    /* Final placement of code before the image is laid out */
+    if (text_layout(s) < 0)
+        return -1;
+
+    /* -incremental: the slots of the last link */
+    if (s->incremental && s->output_type == TCC_OUTPUT_EXE)
+        return incr_layout(s, filename);
+    return 0;
+}
+
 int tcc_output_file(TCCState *s, const char *filename)
 {
+    if (tcc_output_prepare(s, filename) < 0)
+        return -1;
+    if (s->output_type == TCC_OUTPUT_OBJ)
+        return coff_output_file(s, filename);
     return pe_output_file(s, filename);
 }
 
+/* Compile filename to an object file built in obj, for the link; the
+   caller frees obj->data */
+int tcc_compile_object(TCCState *s, const char *filename, Section *obj)
+{
+    obj->data = NULL;
+    s->output_type = TCC_OUTPUT_OBJ;
+    if (tcc_compile(s, filename) < 0 || tcc_output_prepare(s, NULL) < 0)
+        return -1;
+    return coff_build(s, obj);
+}
+
+/* Compile the files of an -flto module, parsed into the outline
+   s->outline already */
+int tcc_compile_module(TCCState *s, const LtoFile *files, int nb_files)
+{
+    s->unit_mode = UNIT_MODULE;
+    s->unit_first = 0;
+    s->unit_last = s->outline->nb_func_ranges;
+    return lto_parse(s, files, nb_files);
+}
+
+/* The contents of filename, which the caller frees; NULL after an error */
+uint8_t *tcc_read_file(TCCState *s, const char *filename, size_t *size)
+{
+    FILE *f;
+    uint8_t *data;
+    long len;
+
+    f = fopen(filename, "rb");
+    if (!f)
+    {
+        tcc_error(s, "cannot open '%s'", filename);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = tcc_malloc(len > 0 ? len : 1);
+    if (len < 0 || fread(data, 1, len, f) != (size_t)len)
+    {
+        tcc_error(s, "cannot read '%s'", filename);
+        tcc_free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = (size_t)len;
+    return data;
+}
+
+/* Merge an object file from disk into the link state ls */
+int tcc_add_object(TCCState *ls, const char *filename)
+{
+    uint8_t *data;
+    size_t size;
+    int ret;
+
+    data = tcc_read_file(ls, filename, &size);
+    if (!data)
+        return -1;
+    ret = coff_load(ls, filename, data, size);
+    tcc_free(data);
+    return ret;
+}
+
+/* TCC_NO_MAIN builds the compiler without its driver, to be embedded */
+#ifndef TCC_NO_MAIN
+
 /*============================================================
  * Command Line Interface
  *============================================================*/
 
 static void print_usage(void)
 {
+    int i;
+    
     printf("Tiny C Compiler %s\n", TCC_VERSION);
     printf("Usage: tcc [options] infile...\n");
     printf("\n");
     printf("Options:\n");
     printf("  -o outfile     Set output filename\n");
     printf("  -c             Compile only, don't link\n");
+    printf("  -j N           Compile N source files at a time\n");
+    printf("  -fparallel-codegen  Also split files into function units for -j\n");
+    printf("  -flto          Optimize the sources as one program at the link\n");
+    printf("  -incremental   Write only the functions that changed since the last link\n");
+    printf("  -fcode-cache=dir  Keep the code of each function in dir for later builds\n");
+    printf("  -O0 -O1 -O2 -Os  Optimization level (default -O0)\n");
+    printf("  -f<pass>, -fno-<pass>  Enable or disable one pass:\n");
+    for (i = 0; i < NB_PASSES; i++) {
+        if (tcc_passes[i].level == PASS_LEVEL_NONE)
+            printf("                 %s (-f only)\n", tcc_passes[i].name);
+        else
+            printf("                 %s (-O%d)\n", tcc_passes[i].name,
+                   tcc_passes[i].level);
+    }
+    printf("  -march=cpu     x86-64, x86-64-v2, x86-64-v3 or native\n");
+    printf("  -mtune=cpu     generic, intel, amd, atom or native\n");
+    printf("  -fprofile-generate[=file]  Instrument; write counts at exit\n");
+    printf("  -fprofile-use=file   Lay out code using recorded counts\n");
+    printf("  -fno-profile-values  Do not record indirect call targets\n");
     printf("  -v             Show version\n");
     printf("  -h             Show this help\n");
 }
 
+/* Command line settings, applied to the state of each source file */
+typedef struct
+{
+    int opt_level;
+    int opt_size;
+    signed char pass_set[NB_PASSES];
+    int profile_generate;
+    int profile_values;
+    const char *profile_file;
+    const char *profile_use;
+    const char *march;
+    const char *mtune;
+    int parallel_codegen; /* split source files into function units */
+    int lto;              /* optimize the program as a whole at the link */
+    int incremental;      /* patch the last executable */
+    const char *code_cache; /* directory of the machine code cache */
+} TCCOptions;
+
+/* A compiler state set up from the options; NULL after an error */
+static TCCState *tcc_new_options(const TCCOptions *o)
+{
+    TCCState *s;
+    int i;
+
+    s = tcc_new();
+    tcc_set_opt_level(s, o->opt_level, o->opt_size);
+    /* -march=native also tunes for the host, unless -mtune says otherwise */
+    if (o->march && x86_set_arch(s, o->march) < 0) {
+        fprintf(stderr, "tcc: unknown -march '%s'\n", o->march);
+        tcc_delete(s);
+        return NULL;
+    }
+    if (o->mtune && x86_set_tune(s, o->mtune) < 0) {
+        fprintf(stderr, "tcc: unknown -mtune '%s'\n", o->mtune);
+        tcc_delete(s);
+        return NULL;
+    }
+    s->prof_generate = o->profile_generate;
+    s->prof_values = o->profile_values;
+    s->incremental = o->incremental;
+    if (o->code_cache) {
+        s->code_cache = tcc_strdup(o->code_cache);
+    }
+    if (o->profile_file) {
+        s->prof_file = tcc_strdup(o->profile_file);
+    }
+    if (o->profile_use) {
+        /* A profile drives block and function layout */
+        if (prof_load(s, o->profile_use) < 0) {
+            tcc_delete(s);
+            return NULL;
+        }
+        s->pass[PASS_SPLIT_COLD] = 1;
+        s->pass[PASS_REORDER_FUNCTIONS] = 1;
+    }
+    for (i = 0; i < NB_PASSES; i++) {
+        if (o->pass_set[i] >= 0)
+            s->pass[i] = o->pass_set[i];
+    }
+    return s;
+}
+
+/* An input is an object file if it is named .obj or .o */
+static int is_object_file(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+
+    return ext && (strcmp(ext, ".obj") == 0 || strcmp(ext, ".o") == 0);
+}
+
+/* infile with its extension replaced by ext */
+static void default_output(char *buf, size_t size, const char *infile,
+                           const char *ext)
+{
+    const char *p = strrchr(infile, '.');
+    size_t len = p ? (size_t)(p - infile) : strlen(infile);
+
+    if (len > size - 5) {
+        len = size - 5;
+    }
+    memcpy(buf, infile, len);
+    strcpy(buf + len, ext);
+}
+
+/* Source bytes of function bodies in one -fparallel-codegen unit; the
+   split depends on the source only, not on -j */
+#define TCC_UNIT_SIZE 2048
+
+/* A run of function definitions of one source file, compiled into an
+   object of its own */
+typedef struct
+{
+    int input;
+    int first;
+    int last;
+    Section obj;
+    int status;
+} TCCUnit;
+
+/* The source files of one invocation, compiled on a pool of workers */
+typedef struct
+{
+    const TCCOptions *o;
+    const char **infiles;
+    int nb_infiles;
+    int nb_workers;
+    const char *outfile; /* -c -o name, for a single input */
+    Section *objs;       /* objects built for the link; NULL with -c */
+    int *status;         /* per input, 0 when compiled */
+    TCCState **outlines; /* -fparallel-codegen: outline of each input */
+    TCCUnit *units;      /* and their code units, in link order */
+    int nb_units;
+} TCCBuild;
+
+/* Worker w takes inputs w, w + n, w + 2n..., each in its own state */
+static void compile_worker(void *arg, int worker)
+{
+    TCCBuild *b = arg;
+    char name[256];
+    TCCState *s;
+    int i;
+
+    for (i = worker; i < b->nb_infiles; i += b->nb_workers) {
+        /* -flto: the link compiles the sources as one module */
+        if (is_object_file(b->infiles[i]) || (b->o->lto && b->objs))
+            continue;
+        s = tcc_new_options(b->o);
+        if (!s) {
+            b->status[i] = -1;
+            continue;
+        }
+        if (b->outlines) {
+            /* The declarations and data; the units compile the code */
+            snprintf(name, sizeof(name), "$%d$", i);
+            s->unit_mode = UNIT_OUTLINE;
+            s->unit_prefix = tcc_strdup(name);
+            b->status[i] = tcc_compile_object(s, b->infiles[i], &b->objs[i]);
+            b->outlines[i] = s;
+            continue;
+        }
+        if (b->objs) {
+            b->status[i] = tcc_compile_object(s, b->infiles[i], &b->objs[i]);
+        } else {
+            if (!b->outfile) {
+                default_output(name, sizeof(name), b->infiles[i], ".obj");
+            }
+            s->output_type = TCC_OUTPUT_OBJ;
+            if (b->o->lto)
+                b->status[i] = lto_write_object(s, b->infiles[i],
+                                                b->outfile ? b->outfile : name);
+            else if (tcc_compile(s, b->infiles[i]) == -1)
+                b->status[i] = -1;
+            else
+                b->status[i] =
+                    tcc_output_file(s, b->outfile ? b->outfile : name);
+        }
+        tcc_delete(s);
+    }
+}
+
+/* Cut the function bodies of each outlined input into units */
+static void split_units(TCCBuild *b)
+{
+    int i, j, first, size;
+
+    for (i = 0; i < b->nb_infiles; i++) {
+        TCCState *o = b->outlines[i];
+
+        if (!o || b->status[i] < 0)
+            continue;
+        for (first = 0; first < o->nb_func_ranges; first = j) {
+            TCCUnit *u;
+
+            size = 0;
+            for (j = first; j < o->nb_func_ranges && size < TCC_UNIT_SIZE; j++)
+                size += o->func_ranges[j].size;
+            b->units = tcc_realloc(b->units,
+                                   (b->nb_units + 1) * sizeof(TCCUnit));
+            u = &b->units[b->nb_units++];
+            memset(u, 0, sizeof(*u));
+            u->input = i;
+            u->first = first;
+            u->last = j;
+        }
+    }
+}
+
+/* Compile one unit against the outline of its file */
+static void unit_worker(void *arg, int task, int worker)
+{
+    TCCBuild *b = arg;
+    TCCUnit *u = &b->units[task];
+    TCCState *o = b->outlines[u->input];
+    TCCState *s;
+
+    (void)worker;
+    s = tcc_new_options(b->o);
+    if (!s) {
+        u->status = -1;
+        return;
+    }
+    s->unit_mode = UNIT_CODE;
+    s->outline = o;
+    s->unit_first = u->first;
+    s->unit_last = u->last;
+    s->unit_prefix = tcc_strdup(o->unit_prefix);
+    u->status = tcc_compile_object(s, b->infiles[u->input], &u->obj);
+    tcc_delete(s);
+}
+
+/* Compile the source files on up to nb_jobs threads */
+static void compile_files(TCCBuild *b, int nb_jobs)
+{
+    int i, nb_sources = 0;
+
+    for (i = 0; i < b->nb_infiles; i++) {
+        if (!is_object_file(b->infiles[i]))
+            nb_sources++;
+    }
+    b->nb_workers = nb_jobs < nb_sources ? nb_jobs : nb_sources;
+    if (b->nb_workers < 1)
+        b->nb_workers = 1;
+    tcc_parallel(b->nb_workers, compile_worker, b);
+}
+
+/* Compile each source file of -c to its own object file */
+static int compile_objects(const TCCOptions *o, const char **infiles,
+                           int nb_infiles, const char *outfile, int nb_jobs)
+{
+    char name[256];
+    TCCBuild b;
+    int i, ret = 0;
+
+    if (outfile && nb_infiles > 1) {
+        fprintf(stderr, "tcc: -o with -c needs a single input file\n");
+        return 1;
+    }
+    memset(&b, 0, sizeof(b));
+    b.o = o;
+    b.infiles = infiles;
+    b.nb_infiles = nb_infiles;
+    b.outfile = outfile;
+    b.status = tcc_malloc(nb_infiles * sizeof(int));
+    memset(b.status, 0, nb_infiles * sizeof(int));
+    compile_files(&b, nb_jobs);
+
+    for (i = 0; i < nb_infiles; i++) {
+        if (is_object_file(infiles[i])) {
+            fprintf(stderr, "tcc: warning: '%s' is not compiled with -c\n",
+                    infiles[i]);
+        } else if (b.status[i] < 0) {
+            ret = 1;
+        } else {
+            default_output(name, sizeof(name), infiles[i], ".obj");
+            printf("Output: %s\n", outfile ? outfile : name);
+        }
+    }
+    tcc_free(b.status);
+    return ret;
+}
+
+/* Compile the -flto module of files and add it to the link ls, once
+   every other object is in, as it keeps only what they refer to. With
+   no other objects (ls NULL) the module is the program, written to
+   outfile. */
+static int link_module(const TCCOptions *o, TCCState *ls, LtoFile *files,
+                       int nb_files, const char *outfile)
+{
+    TCCState *outline, *s = NULL;
+    Section obj;
+    int ret = -1;
+
+    obj.data = NULL;
+    outline = tcc_new_options(o);
+    if (outline) {
+        outline->unit_mode = UNIT_OUTLINE;
+        if (lto_parse(outline, files, nb_files) == 0)
+            s = tcc_new_options(o);
+    }
+    if (s) {
+        lto_mark(outline, ls);
+        s->outline = outline;
+        s->output_type = ls ? TCC_OUTPUT_OBJ : TCC_OUTPUT_EXE;
+        if (tcc_compile_module(s, files, nb_files) < 0)
+            ret = -1;
+        else if (!ls)
+            ret = tcc_output_file(s, outfile);
+        else if (tcc_output_prepare(s, NULL) == 0 && coff_build(s, &obj) == 0)
+            ret = coff_load(ls, "-flto module", obj.data, obj.data_size);
+        tcc_delete(s);
+    }
+    if (outline)
+        tcc_delete(outline);
+    tcc_free(obj.data);
+    return ret;
+}
+
+/* Compile the source files and link them with the object files; the
+   objects are merged in command line order whatever order they were
+   compiled in, so the image does not depend on -j */
+static int link_files(const TCCOptions *o, const char **infiles,
+                      int nb_infiles, const char *outfile, int nb_jobs)
+{
+    TCCState *ls;
+    TCCBuild b;
+    LtoFile *files;
+    int i, u, nb_files = 0, ret = 0;
+
+    /* Start-up code is generated by the link of a single file */
+    if (o->profile_generate) {
+        fprintf(stderr, "tcc: -fprofile-generate needs a single source file\n");
+        return 1;
+    }
+    memset(&b, 0, sizeof(b));
+    b.o = o;
+    b.infiles = infiles;
+    b.nb_infiles = nb_infiles;
+    b.objs = tcc_malloc(nb_infiles * sizeof(Section));
+    memset(b.objs, 0, nb_infiles * sizeof(Section));
+    b.status = tcc_malloc(nb_infiles * sizeof(int));
+    memset(b.status, 0, nb_infiles * sizeof(int));
+    if (o->parallel_codegen) {
+        b.outlines = tcc_malloc(nb_infiles * sizeof(TCCState *));
+        memset(b.outlines, 0, nb_infiles * sizeof(TCCState *));
+    }
+    compile_files(&b, nb_jobs);
+    if (o->parallel_codegen) {
+        split_units(&b);
+        tcc_parallel_tasks(b.nb_units, nb_jobs, unit_worker, &b);
+    }
+
+    ls = tcc_new();
+    gen_init(ls);
+    files = tcc_malloc(nb_infiles * sizeof(LtoFile));
+    for (i = 0, u = 0; i < nb_infiles; i++) {
+        int source = !is_object_file(infiles[i]);
+
+        if (b.status[i] < 0)
+            ret = -1;
+        else if (ret < 0)
+            continue;
+        else if (!source || o->lto) {
+            /* Objects of -flto -c are read into the module as well */
+            ret = lto_read(ls, infiles[i], source, &files[nb_files]);
+            if (ret > 0) {
+                nb_files++;
+                ret = 0;
+            } else if (ret == 0) {
+                ret = tcc_add_object(ls, infiles[i]);
+            }
+        } else
+            ret = coff_load(ls, infiles[i], b.objs[i].data,
+                            b.objs[i].data_size);
+        for (; u < b.nb_units && b.units[u].input == i; u++) {
+            if (b.units[u].status < 0)
+                ret = -1;
+            else if (ret == 0)
+                ret = coff_load(ls, infiles[i], b.units[u].obj.data,
+                                b.units[u].obj.data_size);
+        }
+    }
+    if (nb_files == nb_infiles) {
+        /* Nothing but the module */
+        if (ret == 0)
+            ret = link_module(o, NULL, files, nb_files, outfile);
+    } else {
+        if (ret == 0 && nb_files > 0)
+            ret = link_module(o, ls, files, nb_files, NULL);
+        if (ret == 0)
+            ret = link_resolve(ls);
+        /* The objects' code is merged whole, not function by function */
+        if (ret == 0 && o->incremental)
+            fprintf(stderr, "tcc: warning: -incremental needs a single "
+                            "source file or -flto; linking in full\n");
+        if (ret == 0)
+            ret = pe_output_file(ls, outfile);
+    }
+    tcc_delete(ls);
+    for (i = 0; i < nb_files; i++)
+        lto_free_file(&files[i]);
+    tcc_free(files);
+    for (i = 0; i < nb_infiles; i++) {
+        tcc_free(b.objs[i].data);
+        if (b.outlines)
+            tcc_delete(b.outlines[i]);
+    }
+    for (u = 0; u < b.nb_units; u++)
+        tcc_free(b.units[u].obj.data);
+    tcc_free(b.objs);
+    tcc_free(b.status);
+    tcc_free(b.outlines);
+    tcc_free(b.units);
+    if (ret < 0)
+        return 1;
+    printf("Output: %s\n", outfile);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     TCCState *s;
+    TCCOptions o;
     const char *outfile = NULL;
-    const char *infile = NULL;
-    int i;
+    const char **infiles;
+    char default_outfile[256];
+    int nb_infiles = 0;
+    int i, ret;
     int compile_only = 0;
+    int nb_jobs = 1;
     
     if (argc < 2) {
         print_usage();
         return 1;
     }
     
+    memset(&o, 0, sizeof(o));
+    o.profile_values = 1;
+    /* -f/-fno- choices override the level whatever their order */
+    memset(o.pass_set, -1, sizeof(o.pass_set));
+    infiles = tcc_malloc(argc * sizeof(char *));
+    
     /* Parse arguments */
     for (i = 1; i < argc; i++) {
         if (argv[i][0] == '-') {
@@ -133,6 +767,61 @@ int main(int argc, char **argv)
                 outfile = argv[i];
             } else if (strcmp(argv[i], "-c") == 0) {
                 compile_only = 1;
+            } else if (strncmp(argv[i], "-j", 2) == 0) {
+                /* -j N or -jN; -j alone is one job per processor */
+                const char *n = argv[i] + 2;
+                if (!*n && i + 1 < argc && argv[i + 1][0] >= '0' &&
+                    argv[i + 1][0] <= '9')
+                    n = argv[++i];
+                nb_jobs = *n ? atoi(n) : tcc_nb_cpus();
+                if (nb_jobs < 1) {
+                    fprintf(stderr, "tcc: invalid -j '%s'\n", n);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-O") == 0 ||
+                       (argv[i][1] == 'O' && argv[i][2] >= '0' &&
+                        argv[i][2] <= '3' && argv[i][3] == '\0')) {
+                /* -O is -O1, -O3 is -O2 until there is more to enable */
+                o.opt_level = argv[i][2] ? argv[i][2] - '0' : 1;
+                if (o.opt_level > 2)
+                    o.opt_level = 2;
+                o.opt_size = 0;
+            } else if (strcmp(argv[i], "-Os") == 0) {
+                o.opt_level = 2;
+                o.opt_size = 1;
+            } else if (strncmp(argv[i], "-march=", 7) == 0) {
+                o.march = argv[i] + 7;
+            } else if (strncmp(argv[i], "-mtune=", 7) == 0) {
+                o.mtune = argv[i] + 7;
+            } else if (strcmp(argv[i], "-fprofile-generate") == 0) {
+                o.profile_generate = 1;
+            } else if (strncmp(argv[i], "-fprofile-generate=", 19) == 0) {
+                o.profile_generate = 1;
+                o.profile_file = argv[i] + 19;
+            } else if (strcmp(argv[i], "-fno-profile-values") == 0) {
+                o.profile_values = 0;
+            } else if (strncmp(argv[i], "-fprofile-use=", 14) == 0) {
+                o.profile_use = argv[i] + 14;
+            } else if (strcmp(argv[i], "-fparallel-codegen") == 0) {
+                o.parallel_codegen = 1;
+            } else if (strcmp(argv[i], "-fno-parallel-codegen") == 0) {
+                o.parallel_codegen = 0;
+            } else if (strcmp(argv[i], "-flto") == 0) {
+                o.lto = 1;
+            } else if (strcmp(argv[i], "-fno-lto") == 0) {
+                o.lto = 0;
+            } else if (strcmp(argv[i], "-incremental") == 0) {
+                o.incremental = 1;
+            } else if (strncmp(argv[i], "-fcode-cache=", 13) == 0) {
+                o.code_cache = argv[i] + 13;
+            } else if (strcmp(argv[i], "-fno-code-cache") == 0) {
+                o.code_cache = NULL;
+            } else if (strncmp(argv[i], "-fno-", 5) == 0 &&
+                       tcc_find_pass(argv[i] + 5) >= 0) {
+                o.pass_set[tcc_find_pass(argv[i] + 5)] = 0;
+            } else if (strncmp(argv[i], "-f", 2) == 0 &&
+                       tcc_find_pass(argv[i] + 2) >= 0) {
+                o.pass_set[tcc_find_pass(argv[i] + 2)] = 1;
             } else if (strcmp(argv[i], "-v") == 0) {
                 printf("tcc version %s\n", TCC_VERSION);
                 return 0;
@@ -144,50 +833,92 @@ int main(int argc, char **argv)
                 return 1;
             }
         } else {
-            infile = argv[i];
+            infiles[nb_infiles++] = argv[i];
         }
     }
     
-    if (!infile) {
+    if (!nb_infiles) {
         fprintf(stderr, "tcc: no input file\n");
+        tcc_free(infiles);
         return 1;
     }
     
-    /* Create compiler state */
-    s = tcc_new();
+    /* Create compiler state; this also checks the options once before
+       the workers apply them to their own states */
+    s = tcc_new_options(&o);
+    if (!s) {
+        tcc_free(infiles);
+        return 1;
+    }
     
-    /* Set output type */
-    if (compile_only) {
-        s->output_type = TCC_OUTPUT_OBJ;
+    /* Units count profile blocks from 0, not from where the whole file
+       would have reached */
+    if (o.parallel_codegen && (compile_only || o.profile_use)) {
+        fprintf(stderr, "tcc: warning: -fparallel-codegen is ignored with %s\n",
+                compile_only ? "-c" : "-fprofile-use");
+        o.parallel_codegen = 0;
     }
     
-    /* Compile */
-    if (tcc_compile(s, infile) == -1) {
+    /* The profile counters of a module would not match those of its
+       files, and the module is compiled as a whole */
+    if (o.lto && (o.profile_generate || o.profile_use)) {
+        fprintf(stderr, "tcc: warning: -flto is ignored with %s\n",
+                o.profile_generate ? "-fprofile-generate" : "-fprofile-use");
+        o.lto = 0;
+    }
+    if (o.lto && o.parallel_codegen) {
+        fprintf(stderr,
+                "tcc: warning: -fparallel-codegen is ignored with -flto\n");
+        o.parallel_codegen = 0;
+    }
+    
+    if (o.incremental && compile_only) {
+        fprintf(stderr, "tcc: warning: -incremental is ignored with -c\n");
+        o.incremental = 0;
+    }
+    
+    if (compile_only) {
         tcc_delete(s);
-        return 1;
+        ret = compile_objects(&o, infiles, nb_infiles, outfile, nb_jobs);
+        tcc_free(infiles);
+        return ret;
     }
     
-    /* Generate output */
+    /* Default output name */
     if (!outfile) {
-        /* Default output name */
-        static char default_outfile[256];
-        const char *p = strrchr(infile, '.');
-        size_t len = p ? (size_t)(p - infile) : strlen(infile);
-        if (len > sizeof(default_outfile) - 5) {
-            len = sizeof(default_outfile) - 5;
-        }
-        memcpy(default_outfile, infile, len);
-        strcpy(default_outfile + len, compile_only ? ".obj" : ".exe");
+        default_output(default_outfile, sizeof(default_outfile), infiles[0],
+                       ".exe");
         outfile = default_outfile;
     }
     
+    /* Several inputs, or objects, go through the linker */
+    if (nb_infiles > 1 || is_object_file(infiles[0]) || o.parallel_codegen ||
+        o.lto) {
+        tcc_delete(s);
+        ret = link_files(&o, infiles, nb_infiles, outfile, nb_jobs);
+        tcc_free(infiles);
+        return ret;
+    }
+    
+    /* Compile */
+    if (tcc_compile(s, infiles[0]) == -1) {
+        tcc_delete(s);
+        tcc_free(infiles);
+        return 1;
+    }
+    
+    /* Generate output */
     if (tcc_output_file(s, outfile) == -1) {
         tcc_delete(s);
+        tcc_free(infiles);
         return 1;
     }
     
     printf("Output: %s\n", outfile);
     
     tcc_delete(s);
+    tcc_free(infiles);
     return 0;
 }
+
+#endif /* TCC_NO_MAIN */
@@ -188,9 +188,15 @@ typedef enum {
 #define RC_RDX 0x0010   /* specifically RDX */
 #define RC_R8 0x0020    /* specifically R8 */
 #define RC_R9 0x0040    /* specifically R9 */
+#define RC_R10 0x0080   /* specifically R10 */
+#define RC_R11 0x0100   /* specifically R11 */
 
-/* Number of available temp registers */
-#define NB_REGS 6
+/* Registers below this number can hold values (gen.c has the pool of
+   those actually handed out) */
+#define NB_REGS 12
+
+/* Argument registers of the private convention (RCX, RDX, R8-R11) */
+#define PRIVATE_NB_REG_ARGS 6
 
 /*============================================================
  * Data Structures
@@ -207,6 +213,9 @@ struct BufferedFile {
   char *buf_ptr;      /* current position in buffer */
   char *buf_end;      /* end of buffer */
   char *buffer;       /* allocated buffer */
+  long buf_offset;    /* file offset of buffer[0] */
+  long tok_offset;    /* file offset where the current token starts */
+  int tok_line;       /* and its line */
   int line_num;       /* current line number */
   char filename[256]; /* filename */
   FILE *file;         /* file handle */
@@ -232,8 +241,123 @@ struct Sym {
   Sym *prev_tok;   /* previous definition of this token */
   Section *sec;    /* section for this symbol */
   char *asm_label; /* assembly label if any */
+  int flags;       /* SYM_* */
 };
 
+/* Sym.flags */
+#define SYM_PRIVATE 0x0001   /* defined with the private calling convention */
+#define SYM_ABI_THUNK 0x0002 /* ABI callers must go through a thunk */
+#define SYM_COMMON 0x0004    /* link: tentative definition, c is the size */
+#define SYM_INTERNAL 0x0008  /* -flto: made static, but seen by every file */
+
+/* Lexer position saved by tok_save() */
+typedef struct {
+  long offset;  /* file offset of the current token */
+  int line_num;
+} TokenPos;
+
+/* -fparallel-codegen: an outline pass over the file skips function
+   bodies, each code unit then compiles a run of them into an object of
+   its own, and the link puts the objects back in source order */
+#define UNIT_OUTLINE 1
+#define UNIT_CODE 2
+#define UNIT_MODULE 3 /* -flto: the whole program, from its outline */
+
+typedef struct {
+  TokenPos end;  /* token after the closing '}' */
+  uint32_t size; /* bytes of source */
+  int eval;      /* index in the outline's eval_funcs, or -1 */
+  char *name;    /* -flto: the function, */
+  int file;      /* the module file defining it, */
+  int local;     /* static in that file, */
+  int live;      /* reachable from the entry point or other objects, */
+  int internal;  /* and called from the module only */
+} FuncRange;
+
+/* -flto: an identifier used in the body of function func */
+typedef struct {
+  int func;
+  char *name;
+} LtoRef;
+
+/* -flto: a translation unit as its compacted token text */
+typedef struct {
+  char *name;
+  char *text;
+  size_t size;
+} LtoFile;
+
+/* -incremental: the place of a function in .text */
+typedef struct {
+  char *name;      /* the function, "#n" for the nth unnamed code */
+  uint32_t offset; /* start of its slot */
+  uint32_t slot;   /* bytes reserved, the code and room to grow */
+  uint32_t hash;   /* FNV-1a of the slot in the image */
+  int old;         /* its record in the last link, -1 if none */
+} IncrFunc;
+
+/* -incremental: this link and the last one, from its database */
+typedef struct {
+  char *db;             /* database file, next to the image */
+  IncrFunc *funcs;      /* this link */
+  int nb_funcs;
+  IncrFunc *old;        /* the last link */
+  int nb_old;
+  char *old_used;       /* old records taken over */
+  uint32_t text_size;   /* .text, including the room to grow */
+  uint32_t image_size;  /* of the last link */
+  uint32_t rest_hash;   /* of its image outside .text */
+  uint32_t image_hash;  /* of its whole image */
+  int patch;            /* the last link's slots were kept */
+} IncrLink;
+
+/* -fcode-cache: the key of a function compiled or copied in */
+typedef struct {
+  Sym *func;
+  uint64_t key;
+} CacheKey;
+
+/* -fcode-cache: the state before the body of a function to keep */
+typedef struct {
+  uint64_t key;    /* 0 if it is not kept */
+  uint32_t start;  /* of its code */
+  int nb_relocs;   /* text relocs before it */
+  uint32_t rdata;  /* .rdata size before it */
+  uint32_t data;   /* .data size before it */
+  int nb_warnings;
+} CacheMark;
+
+/* Function compiled once per target of target_clones, called through
+   a slot the start-up code fills with the best variant for the CPU */
+#define MAX_CLONES 8
+typedef struct {
+  Sym *func;                     /* dispatch stub */
+  uint32_t slot;                 /* .data offset of the variant pointer */
+  int nb_variants;               /* most specific first, default last */
+  Sym *variant[MAX_CLONES];
+  unsigned features[MAX_CLONES]; /* CPU_* each variant needs */
+} CloneSet;
+
+/* Body of a function kept to evaluate calls of it at compile time */
+#define EVAL_MAX_PARAMS 8
+typedef struct {
+  int tok;
+  int64_t i;  /* value of a TOK_NUM */
+  char *str;  /* name of a TOK_IDENT */
+} EvalToken;
+
+typedef struct {
+  Sym *func;
+  int is_const;  /* __attribute__((const)) or ((pure)) */
+  int shared;    /* toks and param_name belong to the outline state */
+  int file;      /* -flto: module file the body is in */
+  int nb_params;
+  int param_type[EVAL_MAX_PARAMS];
+  char *param_name[EVAL_MAX_PARAMS];
+  EvalToken *toks; /* from '{' to '}' */
+  int nb_toks;
+} EvalFunc;
+
 /* Value on the value stack */
 typedef struct {
   int t;    /* type */
@@ -257,12 +381,98 @@ struct Section {
   uint32_t sh_addr;  /* virtual address */
 };
 
+/* rel32 branch/call site in .text, repatched when code is moved */
+typedef struct {
+  uint32_t offset; /* offset of the rel32 field */
+  Sym *sym;        /* callee of a direct call, NULL for jumps */
+  Section *sec;    /* target section of a RIP-relative data reference */
+  int64_t count;   /* times a call ran in the profile (1 without one) */
+  int abi;         /* refers to sym's Win64 ABI entry point */
+} TextReloc;
+
+/* Reference found by the link in an input object, patched once the
+   sections have their addresses */
+typedef struct {
+  Section *sec;    /* section holding the field */
+  uint32_t offset; /* of the field in sec */
+  int type;        /* IMAGE_REL_AMD64_* */
+  Sym *sym;        /* external target, or NULL: */
+  Section *target; /*   a place in a section (NULL: absolute value) */
+  uint32_t value;
+} LinkReloc;
+
+/* Targets seen at one indirect call site of an instrumented build */
+typedef struct {
+  struct {
+    uint32_t func;  /* profile function number + 1, 0 while unused */
+    uint32_t pad;
+    uint64_t count; /* calls that went to it */
+  } slot[2];
+  uint64_t other;   /* calls to any further target */
+} ProfValueSite;
+
+/* Copy of a local that a register still holds, recorded by load() and
+   store() within a block */
+typedef struct {
+  int size; /* low bytes of the register equal to the slot's, 0 if none */
+  int slot; /* rbp offset of the local */
+  int ext;  /* rest of the register: REG_EXT_* */
+} RegContent;
+
+#define REG_EXT_NONE 0 /* unknown */
+#define REG_EXT_SIGN 1 /* as loaded by movsx/movsxd */
+#define REG_EXT_ZERO 2 /* as loaded by movzx/mov r32 */
+
+/* Contiguous run of code that the text layout moves as a unit */
+typedef struct {
+  uint32_t start; /* offset of the first byte */
+  int cold;       /* placed after all hot code when splitting */
+  Sym *func;      /* function the code belongs to */
+} TextChunk;
+
 /* Symbol table */
 typedef struct {
   Sym **hash_table; /* hash table */
   Sym *top;         /* top of scope stack */
 } SymStack;
 
+/* CPU features the code generator may use, chosen by -march */
+#define CPU_POPCNT 0x0001 /* popcnt */
+#define CPU_LZCNT 0x0002  /* lzcnt */
+#define CPU_BMI1 0x0004   /* tzcnt, andn */
+#define CPU_BMI2 0x0008   /* shlx/sarx/shrx, bzhi */
+#define CPU_MOVBE 0x0010  /* movbe */
+#define CPU_AVX2 0x0020   /* 256-bit integer vectors */
+
+/* Cores the generated code is tuned for, chosen by -mtune */
+enum { TUNE_GENERIC, TUNE_INTEL, TUNE_AMD, TUNE_ATOM, NB_TUNES };
+
+/* Operations of gen_bitop() */
+#define BITOP_POPCOUNT 0
+#define BITOP_CLZ 1
+#define BITOP_CTZ 2
+#define BITOP_BSWAP 3
+
+/* Optimization passes, enabled by -O level or -f<name>/-fno-<name>
+   (the registry with names and levels is in tcc.c) */
+enum {
+  PASS_FOLD_CONSTANTS,    /* evaluate operators on constants */
+  PASS_PRIVATE_CALLS,     /* private calling convention for statics */
+  PASS_SPLIT_COLD,        /* move unlikely blocks after all hot code */
+  PASS_REORDER_FUNCTIONS, /* place callers next to their callees */
+  PASS_SCHEDULE,          /* list-schedule straight-line code */
+  PASS_PEEPHOLE,          /* -mtune instruction selection: flags kept
+                             for jcc, zero idioms, cheaper division */
+  PASS_ORDER_OPERANDS,    /* Sethi-Ullman order for commutative operands */
+  PASS_FORWARD_LOADS,     /* reuse a register that holds a local's value */
+  PASS_LOOP_IDIOMS,       /* copy, fill and strlen loops as string code */
+  PASS_EXPR_IDIOMS,       /* rotate, byte swap, abs and min/max idioms */
+  PASS_FOLD_CALLS,        /* evaluate calls of pure functions on constants */
+  PASS_GC_SECTIONS,       /* drop unreferenced functions and variables */
+  PASS_ICF,               /* fold functions with identical code */
+  NB_PASSES
+};
+
 /* Compiler state */
 struct TCCState {
   /* Input */
@@ -272,6 +482,7 @@ struct TCCState {
   /* Current token */
   int tok;     /* current token type */
   CValue tokc; /* current token value */
+  char tok_buf[STRING_MAX_SIZE]; /* identifier/string being read */
 
   /* Symbol tables */
   SymStack define_stack; /* macros */
@@ -294,16 +505,103 @@ struct TCCState {
   /* Code generation state */
   int ind;           /* current code position */
   int loc;           /* local variable offset */
+  int frame_patch;   /* prologue's sub rsp immediate, set by the epilogue */
+  int frame_pushed;  /* bytes the prologue pushes below rbp */
+  Sym *anon_labels;  /* gind() labels, chained by prev until tcc_delete */
   int func_ret_type; /* return type of current function */
   int func_vc;       /* return value location */
+  int branch_hint;   /* -1 unlikely, 1 likely, from __builtin_expect */
+  int expect_whole;  /* the if condition starts with __builtin_expect */
+  Sym *func_sym;     /* function being generated */
+  int func_cold;     /* whole function goes to the cold region */
+  int cmp_start;     /* code of the compare whose flags a VT_CMP */
+  int cmp_end;       /*   value refers to, -1 once gone */
+  int cmp_regs;      /* registers that compare reads */
+  int sched_start;   /* code not yet seen by the scheduler */
+  int sched_barrier; /* code before it was rescheduled: never cut back */
+  int reg_peak;      /* most registers held at once so far */
+  int nb_effects;    /* calls, stores and literals, which parsing the
+                        same tokens again would repeat */
+  int reorder_depth; /* operands being parsed again, nested */
+  RegContent reg_content[NB_REGS]; /* locals the registers hold copies of */
+
+  /* Text layout */
+  TextReloc *text_relocs; /* rel32 sites in .text */
+  int nb_text_relocs;
+  int text_relocs_alloc;
+  TextChunk *text_chunks; /* chunk boundaries in .text */
+  int nb_text_chunks;
+  int text_chunks_alloc;
+
+  /* Profiling */
+  int prof_generate;      /* count blocks and dump the counts at exit */
+  char *prof_file;        /* profile to write, or the one being used */
+  Section *prof_section;  /* counters, moved into .data at output */
+  int nb_prof_counters;   /* counters handed out so far */
+  int prof_block;         /* counter of the block being generated */
+  uint32_t prof_checksum; /* identifies the counter layout */
+  uint64_t *prof_counts;  /* counts from -fprofile-use */
+  int nb_prof_counts;
+  uint32_t prof_use_checksum;
+  int prof_values;            /* also record indirect call targets */
+  Section *prof_value_section; /* ProfValueSite records, moved like counters */
+  int nb_prof_values;         /* indirect call sites so far */
+  Sym *prof_value_sym;        /* run-time helper recording a target */
+  ProfValueSite *prof_sites;  /* call targets from -fprofile-use */
+  int nb_prof_sites;
+  char **prof_funcs;          /* names the target numbers refer to */
+  int nb_prof_funcs;
 
   /* Output */
-  char *outfile;   /* output filename */
-  int output_type; /* executable, dll, obj */
+  char *outfile;          /* output filename */
+  int output_type;        /* executable, dll, obj */
+  const char *entry_name; /* entry point symbol */
+  Section *idata_section; /* import tables */
+  char **imports;         /* functions imported from kernel32.dll */
+  int nb_imports;
 
   /* Options */
   int verbose;  /* verbosity level */
   int warn_all; /* all warnings enabled */
+  int opt_level;          /* -O level (-Os counts as 2) */
+  int opt_size;           /* -Os: prefer smaller code */
+  char pass[NB_PASSES];   /* enabled optimization passes */
+  unsigned cpu_features;  /* CPU_* the target is known to have */
+  int tune;               /* TUNE_* */
+  CloneSet *clone_sets;   /* target_clones functions */
+  int nb_clone_sets;
+  EvalFunc *eval_funcs;   /* functions calls may be evaluated of */
+  int nb_eval_funcs;
+  LinkReloc *link_relocs; /* link: relocations of the input objects */
+  int nb_link_relocs;
+  int link_relocs_alloc;
+  int link_absolute;      /* link: some refer to absolute addresses */
+
+  /* Function units (-fparallel-codegen) */
+  int unit_mode;          /* UNIT_* */
+  FuncRange *func_ranges; /* outline: each function body */
+  int nb_func_ranges;
+  int nb_func_defs;       /* function definitions parsed so far */
+  TCCState *outline;      /* code: outline state of the same file */
+  int unit_first;         /* code: definitions compiled here */
+  int unit_last;
+  char *unit_prefix;      /* statics are shared between the objects */
+
+  /* Link-time optimization (-flto) */
+  int lto;                /* parsing the files of a module in turn */
+  int lto_file;           /* the one being parsed */
+  LtoRef *lto_refs;       /* outline: identifiers used by each body */
+  int nb_lto_refs;
+
+  /* Incremental linking (-incremental) */
+  int incremental;        /* patch the functions that changed */
+  IncrLink *incr;         /* slots of this link and the last */
+
+  /* Machine code cache (-fcode-cache) */
+  char *code_cache;       /* directory of the kept functions */
+  CacheKey *cache_keys;   /* functions defined so far */
+  int nb_cache_keys;
+  int nb_cache_hits;      /* copied in from the cache */
 
   /* Error handling */
   int nb_errors;   /* number of errors */
@@ -315,11 +613,16 @@ struct TCCState {
 #define TCC_OUTPUT_DLL 1 /* shared library */
 #define TCC_OUTPUT_OBJ 2 /* object file */
 
-/*============================================================
- * Global State
- *============================================================*/
+#define IMAGE_FILE_MACHINE_AMD64 0x8664
 
-extern TCCState *tcc_state;
+/* COFF relocation types */
+#define IMAGE_REL_AMD64_ABSOLUTE 0x0000
+#define IMAGE_REL_AMD64_ADDR64 0x0001
+#define IMAGE_REL_AMD64_ADDR32 0x0002
+#define IMAGE_REL_AMD64_ADDR32NB 0x0003 /* image-relative */
+#define IMAGE_REL_AMD64_REL32 0x0004    /* REL32_1..5: 1 to 5 bytes follow */
+#define IMAGE_REL_AMD64_REL32_5 0x0009
+#define IMAGE_REL_AMD64_SECREL 0x000b
 
 /*============================================================
  * Function Declarations - tcc.c
@@ -329,6 +632,12 @@ TCCState *tcc_new(void);
 void tcc_delete(TCCState *s);
 int tcc_compile(TCCState *s, const char *filename);
 int tcc_output_file(TCCState *s, const char *filename);
+int tcc_compile_object(TCCState *s, const char *filename, Section *obj);
+int tcc_add_object(TCCState *ls, const char *filename);
+uint8_t *tcc_read_file(TCCState *s, const char *filename, size_t *size);
+int tcc_compile_module(TCCState *s, const LtoFile *files, int nb_files);
+void tcc_set_opt_level(TCCState *s, int level, int size);
+int tcc_find_pass(const char *name);
 
 /*============================================================
  * Function Declarations - lex.c
@@ -341,6 +650,10 @@ void next(TCCState *s);
 void next_nomacro(TCCState *s);
 void expect(TCCState *s, int tok);
 void skip(TCCState *s, int tok);
+void tok_save(TCCState *s, TokenPos *pos);
+void tok_restore(TCCState *s, const TokenPos *pos);
+void tcc_open_mem(TCCState *s, const char *filename, const char *text,
+                  size_t size);
 
 /*============================================================
  * Function Declarations - parse.c
@@ -364,6 +677,9 @@ void sym_pop(SymStack *st, Sym *b);
 Sym *sym_find(TCCState *s, int v);
 Sym *sym_find2(TCCState *s, const char *name);
 Sym *global_sym_find(TCCState *s, int v);
+Sym *global_sym_find2(TCCState *s, const char *name);
+Sym *global_sym_push2(TCCState *s, const char *name, int t, int r, int64_t c);
+void sym_unlink(SymStack *st, Sym *sym);
 
 /*============================================================
  * Function Declarations - gen.c
@@ -375,8 +691,15 @@ void vset(TCCState *s, int t, int r, int64_t v);
 void vpush(TCCState *s);
 void vpop(TCCState *s);
 void vswap(TCCState *s);
+void save_reg(TCCState *s, int r);
+void vcheck_cmp(TCCState *s);
 int gv(TCCState *s, int rc);
+int nb_used_regs(TCCState *s);
 void gv2(TCCState *s, int rc1, int rc2);
+int type_size(int t);
+int pointed_type(int t);
+void indir(TCCState *s);
+int fold_op(int op, int64_t a, int64_t b, int uns, int64_t *res);
 void gen_op(TCCState *s, int op);
 void gen_cast(TCCState *s, int t);
 Sym *gind(TCCState *s);
@@ -393,13 +716,41 @@ void gen_le32(TCCState *s, uint32_t v);
 void gen_le64(TCCState *s, uint64_t v);
 void load(TCCState *s, int r, SValue *sv);
 void store(TCCState *s, int r, SValue *sv);
+void reg_content_clear(TCCState *s);
 void gen_opi(TCCState *s, int op);
 void gen_opf(TCCState *s, int op);
-void gfunc_prolog(TCCState *s, int t);
+void gfunc_prolog(TCCState *s, int t, int nb_params);
 void gfunc_epilog(TCCState *s);
 void gfunc_call(TCCState *s, int nb_args);
+int gfunc_private(TCCState *s, Sym *func, int nb_args);
+void gen_abi_thunks(TCCState *s);
+void gen_bitop(TCCState *s, int op, int wide);
+void gen_rotate(TCCState *s, int right, int wide);
+void gen_abs(TCCState *s);
+void gen_select(TCCState *s, int op, int inv);
+int x86_set_arch(TCCState *s, const char *name);
+int x86_set_tune(TCCState *s, const char *name);
+int x86_target_features(const char *name, unsigned *features);
+void gen_clone_stub(TCCState *s, CloneSet *cs);
+int gen_clone_resolver(TCCState *s);
 void gen_cvt_itof(TCCState *s, int t);
 void gen_cvt_ftoi(TCCState *s, int t);
+void gen_rip_ref(TCCState *s, Section *sec, uint32_t offset);
+void gen_prof_inc(TCCState *s, uint32_t offset);
+void gen_prof_start(TCCState *s, Sym *main_sym, uint32_t name,
+                    uint32_t data, uint32_t size);
+void gen_prof_value_helper(TCCState *s, Sym **funcs, int nb_funcs);
+void gen_loop_copy(TCCState *s, SValue *dst, SValue *src, SValue *count,
+                   SValue *index, int size);
+void gen_loop_fill(TCCState *s, SValue *dst, SValue *val, SValue *count,
+                   SValue *index, int size);
+void gen_strlen_scan(TCCState *s, SValue *p);
+
+/*============================================================
+ * Function Declarations - x86_64-sched.c
+ *============================================================*/
+
+void sched_flush(TCCState *s, int end);
 
 /*============================================================
  * Function Declarations - section.c
@@ -410,11 +761,111 @@ void section_realloc(Section *sec, size_t new_size);
 size_t section_add(Section *sec, const void *data, size_t size);
 void *section_ptr_add(Section *sec, size_t size);
 
+/*============================================================
+ * Function Declarations - layout.c
+ *============================================================*/
+
+void text_add_reloc(TCCState *s, uint32_t offset, Sym *sym);
+void text_add_sec_reloc(TCCState *s, uint32_t offset, Section *sec);
+void text_add_addr_reloc(TCCState *s, uint32_t offset, Sym *sym);
+void text_begin_chunk(TCCState *s, int cold);
+int text_chunk_cold(TCCState *s);
+void text_place(TCCState *s, const int *order, const uint32_t *start,
+                int nb_order, uint32_t size);
+int text_layout(TCCState *s);
+
+/*============================================================
+ * Function Declarations - profile.c
+ *============================================================*/
+
+int prof_new_counter(TCCState *s);
+void prof_enter_block(TCCState *s, int id);
+uint64_t prof_count(TCCState *s, int id);
+int64_t prof_block_count(TCCState *s);
+int prof_new_value_site(TCCState *s);
+Sym *prof_dominant_target(TCCState *s, int id, uint64_t *count);
+int prof_load(TCCState *s, const char *filename);
+int prof_finish(TCCState *s, const char *outfile);
+
+/*============================================================
+ * Function Declarations - eval.c
+ *============================================================*/
+
+void eval_record(TCCState *s, Sym *sym, int ret_type, Sym *params,
+                 int nb_params, int is_const);
+void eval_share(TCCState *s, Sym *sym, const EvalFunc *f);
+void eval_free(TCCState *s);
+int eval_call(TCCState *s, int nb_args);
+
 /*============================================================
  * Function Declarations - pe.c
  *============================================================*/
 
 int pe_output_file(TCCState *s, const char *filename);
+uint32_t pe_import(TCCState *s, const char *name);
+uint32_t pe_section_flags(Section *sec);
+void write_u16(uint8_t *p, uint16_t v);
+void write_u32(uint8_t *p, uint32_t v);
+void write_u64(uint8_t *p, uint64_t v);
+uint16_t read_u16(const uint8_t *p);
+uint32_t read_u32(const uint8_t *p);
+uint64_t read_u64(const uint8_t *p);
+
+/*============================================================
+ * Function Declarations - coff.c
+ *============================================================*/
+
+int coff_build(TCCState *s, Section *out);
+int coff_output_file(TCCState *s, const char *filename);
+int coff_load(TCCState *s, const char *filename, const uint8_t *data,
+              size_t size);
+int coff_build_info(Section *out, const char *name, const void *data,
+                    size_t size);
+const uint8_t *coff_find_section(const uint8_t *data, size_t size,
+                                 const char *name, uint32_t *len);
+
+/*============================================================
+ * Function Declarations - lto.c
+ *============================================================*/
+
+int lto_read(TCCState *s, const char *filename, int source, LtoFile *f);
+void lto_free_file(LtoFile *f);
+int lto_write_object(TCCState *s, const char *filename, const char *outfile);
+int lto_parse(TCCState *s, const LtoFile *files, int nb_files);
+void lto_add_ref(TCCState *s, char *name);
+void lto_mark(TCCState *o, TCCState *ls);
+void lto_declare(TCCState *s, Sym *sym);
+EvalFunc *lto_eval_find(TCCState *s, const char *name, int file);
+
+/*============================================================
+ * Function Declarations - incr.c
+ *============================================================*/
+
+int incr_layout(TCCState *s, const char *filename);
+int incr_write(TCCState *s, const char *filename, const uint8_t *image,
+               uint32_t size, uint32_t text_pos);
+void incr_free(IncrLink *l);
+
+/*============================================================
+ * Function Declarations - cache.c
+ *============================================================*/
+
+int cache_begin(TCCState *s, Sym *sym, int ret_type, Sym *params,
+                int nb_params, CacheMark *m);
+void cache_end(TCCState *s, Sym *sym, const CacheMark *m);
+
+/*============================================================
+ * Function Declarations - link.c
+ *============================================================*/
+
+Sym *link_sym(TCCState *s, const char *name);
+Sym *link_define(TCCState *s, const char *name, Section *sec, uint32_t value,
+                 int func);
+void link_common(Sym *sym, uint32_t size);
+void link_add_reloc(TCCState *s, Section *sec, uint32_t offset, int type,
+                    Sym *sym, Section *target, uint32_t value);
+int link_resolve(TCCState *s);
+void link_relocate(TCCState *s, uint64_t image_base);
 
 /*============================================================
  * Function Declarations - utils.c
@@ -426,5 +877,11 @@ char *tcc_strdup(const char *s);
 void tcc_free(void *ptr);
 void tcc_error(TCCState *s, const char *fmt, ...);
 void tcc_warning(TCCState *s, const char *fmt, ...);
+typedef void (*TCCWorkFn)(void *arg, int worker);
+int tcc_nb_cpus(void);
+int tcc_mkdir(const char *path);
+void tcc_parallel(int n, TCCWorkFn fn, void *arg);
+typedef void (*TCCTaskFn)(void *arg, int task, int worker);
+void tcc_parallel_tasks(int nb_tasks, int nb_workers, TCCTaskFn fn, void *arg);
 
 #endif /* TCC_H */
@@ -1,11 +1,19 @@
 /*
  * TCC - Tiny C Compiler
  * 
- * Utility functions: memory management, error handling.
+ * Utility functions: memory management, error handling, threads, files.
  */
 
 #include "tcc.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*============================================================
  * Memory Management
  *============================================================*/
@@ -48,22 +56,42 @@ void tcc_free(void *ptr)
  * Error Handling
  *============================================================*/
 
-void tcc_error(TCCState *s, const char *fmt, ...)
+/* Print one diagnostic with a single write, so that it does not
+   interleave with those of compilations on other threads */
+static void tcc_report(TCCState *s, const char *kind, const char *fmt,
+                       va_list ap)
 {
-    va_list ap;
+    char buf[1024];
+    int len, n;
     
     if (s && s->file) {
-        fprintf(stderr, "%s:%d: error: ", s->file->filename, s->file->line_num);
+        len = snprintf(buf, sizeof(buf), "%s:%d: %s: ", s->file->filename,
+                       s->file->line_num, kind);
     } else {
-        fprintf(stderr, "tcc: error: ");
+        len = snprintf(buf, sizeof(buf), "tcc: %s: ", kind);
     }
+    if (len < 0 || len > (int)sizeof(buf) - 2)
+        len = (int)sizeof(buf) - 2;
+    
+    n = vsnprintf(buf + len, sizeof(buf) - 1 - len, fmt, ap);
+    if (n > 0)
+        len += n;
+    if (len > (int)sizeof(buf) - 2)
+        len = (int)sizeof(buf) - 2;
+    
+    buf[len] = '\n';
+    buf[len + 1] = '\0';
+    fputs(buf, stderr);
+}
+
+void tcc_error(TCCState *s, const char *fmt, ...)
+{
+    va_list ap;
     
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    tcc_report(s, "error", fmt, ap);
     va_end(ap);
     
-    fprintf(stderr, "\n");
-    
     if (s) {
         s->nb_errors++;
     }
@@ -73,19 +101,217 @@ void tcc_warning(TCCState *s, const char *fmt, ...)
 {
     va_list ap;
     
-    if (s && s->file) {
-        fprintf(stderr, "%s:%d: warning: ", s->file->filename, s->file->line_num);
-    } else {
-        fprintf(stderr, "tcc: warning: ");
-    }
-    
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    tcc_report(s, "warning", fmt, ap);
     va_end(ap);
     
-    fprintf(stderr, "\n");
-    
     if (s) {
         s->nb_warnings++;
     }
 }
+
+/*============================================================
+ * Threads
+ *============================================================*/
+
+typedef struct
+{
+    TCCWorkFn fn;
+    void *arg;
+    int worker;
+} TCCWorker;
+
+#ifdef _WIN32
+static DWORD WINAPI tcc_worker_main(LPVOID p)
+#else
+static void *tcc_worker_main(void *p)
+#endif
+{
+    TCCWorker *w = p;
+    w->fn(w->arg, w->worker);
+    return 0;
+}
+
+/* Number of processors to spread work over */
+int tcc_nb_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* Create directory path unless it is there; 0 on success */
+int tcc_mkdir(const char *path)
+{
+#ifdef _WIN32
+    if (CreateDirectoryA(path, NULL))
+        return 0;
+    return GetLastError() == ERROR_ALREADY_EXISTS ? 0 : -1;
+#else
+    struct stat st;
+    if (mkdir(path, 0777) == 0)
+        return 0;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+#endif
+}
+
+/* Run fn(arg, i) for i = 0..n-1 on n threads, the caller being worker
+ * 0, and return once all are done. A thread that cannot be started
+ * runs its share on the caller. */
+void tcc_parallel(int n, TCCWorkFn fn, void *arg)
+{
+    TCCWorker *w;
+    int *started;
+    int i;
+#ifdef _WIN32
+    HANDLE *threads;
+#else
+    pthread_t *threads;
+#endif
+
+    if (n <= 1)
+    {
+        fn(arg, 0);
+        return;
+    }
+
+    w = tcc_malloc(n * sizeof(TCCWorker));
+    started = tcc_malloc(n * sizeof(int));
+    threads = tcc_malloc(n * sizeof(*threads));
+    for (i = 1; i < n; i++)
+    {
+        w[i].fn = fn;
+        w[i].arg = arg;
+        w[i].worker = i;
+#ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, tcc_worker_main, &w[i], 0, NULL);
+        started[i] = threads[i] != NULL;
+#else
+        started[i] = pthread_create(&threads[i], NULL, tcc_worker_main,
+                                    &w[i]) == 0;
+#endif
+    }
+
+    fn(arg, 0);
+    for (i = 1; i < n; i++)
+    {
+        if (!started[i])
+        {
+            fn(arg, i);
+            continue;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+
+    tcc_free(threads);
+    tcc_free(started);
+    tcc_free(w);
+}
+
+/*============================================================
+ * Work-Stealing Task Pool
+ *============================================================*/
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION TCCMutex;
+#define tcc_mutex_init(m) InitializeCriticalSection(m)
+#define tcc_mutex_lock(m) EnterCriticalSection(m)
+#define tcc_mutex_unlock(m) LeaveCriticalSection(m)
+#define tcc_mutex_destroy(m) DeleteCriticalSection(m)
+#else
+typedef pthread_mutex_t TCCMutex;
+#define tcc_mutex_init(m) pthread_mutex_init(m, NULL)
+#define tcc_mutex_lock(m) pthread_mutex_lock(m)
+#define tcc_mutex_unlock(m) pthread_mutex_unlock(m)
+#define tcc_mutex_destroy(m) pthread_mutex_destroy(m)
+#endif
+
+/* A worker's tasks, next..end-1: its owner takes them from the front,
+   other workers steal from the back once their own run out */
+typedef struct
+{
+    TCCMutex lock;
+    int next;
+    int end;
+} TCCTaskQueue;
+
+typedef struct
+{
+    TCCTaskFn fn;
+    void *arg;
+    TCCTaskQueue *queues;
+    int nb_workers;
+} TCCTaskPool;
+
+/* Next task for worker, -1 when there are none left anywhere */
+static int tcc_task_take(TCCTaskPool *pool, int worker)
+{
+    TCCTaskQueue *q = &pool->queues[worker];
+    int task = -1;
+    int i;
+
+    tcc_mutex_lock(&q->lock);
+    if (q->next < q->end)
+        task = q->next++;
+    tcc_mutex_unlock(&q->lock);
+
+    for (i = 1; task < 0 && i < pool->nb_workers; i++)
+    {
+        q = &pool->queues[(worker + i) % pool->nb_workers];
+        tcc_mutex_lock(&q->lock);
+        if (q->next < q->end)
+            task = --q->end;
+        tcc_mutex_unlock(&q->lock);
+    }
+    return task;
+}
+
+static void tcc_task_worker(void *arg, int worker)
+{
+    TCCTaskPool *pool = arg;
+    int task;
+
+    while ((task = tcc_task_take(pool, worker)) >= 0)
+        pool->fn(pool->arg, task, worker);
+}
+
+/* Run fn(arg, task, worker) for task = 0..nb_tasks-1 on nb_workers
+ * threads. Each worker starts on an equal run of consecutive tasks and
+ * then steals from the others, so uneven tasks still keep all busy. */
+void tcc_parallel_tasks(int nb_tasks, int nb_workers, TCCTaskFn fn, void *arg)
+{
+    TCCTaskPool pool;
+    int i;
+
+    if (nb_workers > nb_tasks)
+        nb_workers = nb_tasks;
+    if (nb_workers < 1)
+        return;
+
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.nb_workers = nb_workers;
+    pool.queues = tcc_malloc(nb_workers * sizeof(TCCTaskQueue));
+    for (i = 0; i < nb_workers; i++)
+    {
+        tcc_mutex_init(&pool.queues[i].lock);
+        pool.queues[i].next = (int)((int64_t)nb_tasks * i / nb_workers);
+        pool.queues[i].end = (int)((int64_t)nb_tasks * (i + 1) / nb_workers);
+    }
+
+    tcc_parallel(nb_workers, tcc_task_worker, &pool);
+
+    for (i = 0; i < nb_workers; i++)
+        tcc_mutex_destroy(&pool.queues[i].lock);
+    tcc_free(pool.queues);
+}
@@ -8,6 +8,12 @@
 
 #include "tcc.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
 /*============================================================
  * x86-64 Instruction Encoding Helpers
  *============================================================*/
@@ -58,6 +64,15 @@ static void gen_modrm(TCCState *s, int mod, int reg, int rm) {
   g(s, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
 }
 
+/* Emit a 3-byte VEX prefix: map 1 = 0F, 2 = 0F38; pp 0 = none,
+ * 1 = 66, 2 = F3, 3 = F2; v is the extra source register */
+static void gen_vex3(TCCState *s, int map, int w, int r, int b, int v,
+                     int pp) {
+  g(s, 0xc4);
+  g(s, ((r > 7) ? 0 : 0x80) | 0x40 | ((b > 7) ? 0 : 0x20) | map);
+  g(s, (w << 7) | ((~v & 15) << 3) | pp);
+}
+
 /* Emit ModRM with displacement for local variable */
 static void gen_modrm_local(TCCState *s, int reg, int offset) {
   /* Use RBP-relative addressing */
@@ -70,13 +85,221 @@ static void gen_modrm_local(TCCState *s, int reg, int offset) {
   }
 }
 
+/*============================================================
+ * Tuning (-mtune)
+ *============================================================*/
+
+#define X86_SLOW_LEA3 1  /* base + index + disp lea takes 3 cycles */
+#define X86_SLOW_DIV64 2 /* 64-bit idiv is far slower than 32-bit */
+
+static const unsigned x86_tuning[NB_TUNES] = {
+    [TUNE_GENERIC] = X86_SLOW_LEA3 | X86_SLOW_DIV64,
+    [TUNE_INTEL] = X86_SLOW_LEA3 | X86_SLOW_DIV64,
+    [TUNE_AMD] = 0,
+    [TUNE_ATOM] = X86_SLOW_LEA3 | X86_SLOW_DIV64,
+};
+
+/* X86_* tuning flags in effect, none without the peephole pass */
+static unsigned x86_tune_flags(TCCState *s) {
+  return s->pass[PASS_PEEPHOLE] ? x86_tuning[s->tune] : 0;
+}
+
+/* Condition code of a comparison: setcc is 0F 90+cc, jcc 0F 80+cc,
+ * and cc ^ 1 is the opposite condition */
+static int cmp_cc(int op, int uns) {
+  switch (op) {
+  case TOK_EQ:
+    return 0x4; /* e */
+  case TOK_NE:
+    return 0x5; /* ne */
+  case '<':
+    return uns ? 0x2 : 0xc; /* b/l */
+  case '>':
+    return uns ? 0x7 : 0xf; /* a/g */
+  case TOK_LE:
+    return uns ? 0x6 : 0xe; /* be/le */
+  default:
+    return uns ? 0x3 : 0xd; /* ae/ge */
+  }
+}
+
+/* Condition cc as 0 or 1 in r. Straight after the compare that set
+ * the flags, and with r not one of its operands, r is cleared with a
+ * zero idiom in front of the compare, so that setcc writes into a
+ * register with no stale upper bits; otherwise setcc is followed by
+ * movzx */
+static void gen_setcc(TCCState *s, int r, int cc) {
+  int zeroed = 0;
+
+  if (s->ind == s->cmp_end && !(s->cmp_regs & (1 << r))) {
+    int n = r > 7 ? 3 : 2;
+    uint8_t *p;
+
+    section_ptr_add(s->text_section, n);
+    p = s->text_section->data + s->cmp_start;
+    memmove(p + n, p, s->cmp_end - s->cmp_start);
+    /* xor r32, r32 */
+    if (r > 7)
+      *p++ = 0x45;
+    *p++ = 0x31;
+    *p = (uint8_t)(0xc0 | (r & 7) << 3 | (r & 7));
+    s->ind += n;
+    zeroed = 1;
+  }
+  s->cmp_end = -1;
+
+  /* setcc r8 */
+  if (r >= 4)
+    g(s, r > 7 ? 0x41 : 0x40);
+  g(s, 0x0f);
+  g(s, 0x90 + cc);
+  gen_modrm(s, 3, 0, r);
+
+  if (!zeroed) {
+    /* movzx r32, r8 */
+    if (r >= 4)
+      g(s, r > 7 ? 0x45 : 0x40);
+    g(s, 0x0f);
+    g(s, 0xb6);
+    gen_modrm(s, 3, r, r);
+  }
+}
+
+/*============================================================
+ * Register Contents
+ *============================================================*/
+
+/* Within a block, load() and store() note which local a register still
+ * holds a copy of, so that loading the local again becomes a move or
+ * extension from that register, or nothing at all. Whatever writes a
+ * register drops its note; labels and calls drop them all. */
+
+void reg_content_clear(TCCState *s) {
+  memset(s->reg_content, 0, sizeof(s->reg_content));
+}
+
+static void reg_content_kill(TCCState *s, int r) {
+  if (r >= 0 && r < NB_REGS)
+    s->reg_content[r].size = 0;
+}
+
+static void reg_content_set(TCCState *s, int r, int slot, int size, int ext) {
+  if (!s->pass[PASS_FORWARD_LOADS])
+    return;
+  s->reg_content[r].size = size;
+  s->reg_content[r].slot = slot;
+  s->reg_content[r].ext = ext;
+}
+
+/* The size bytes at [rbp + slot] are written */
+static void reg_content_store(TCCState *s, int slot, int size) {
+  int r;
+
+  for (r = 0; r < NB_REGS; r++) {
+    RegContent *c = &s->reg_content[r];
+    if (c->size && c->slot < slot + size && slot < c->slot + c->size)
+      c->size = 0;
+  }
+}
+
+/* Bytes a local of basic type t occupies */
+static int local_size(int t) {
+  return t == VT_BYTE ? 1 : t == VT_SHORT ? 2 : t == VT_INT ? 4 : 8;
+}
+
+/* A register whose low size bytes are those at [rbp + slot], r itself
+ * if it qualifies; -1 if there is none */
+static int reg_content_find(TCCState *s, int r, int slot, int size) {
+  int q, found = -1;
+
+  for (q = 0; q < NB_REGS; q++) {
+    RegContent *c = &s->reg_content[q];
+    if (c->size >= size && c->slot == slot && (found < 0 || q == r))
+      found = q;
+  }
+  return found;
+}
+
 /*============================================================
  * Load Value into Register
  *============================================================*/
 
+/* Prefix and opcode loading a value of type t into r, from memory
+ * addressed by base or from register base; ModRM follows */
+static void gen_load_insn(TCCState *s, int r, int t, int base) {
+  int size = local_size(t & VT_BTYPE);
+
+  if (size == 1) {
+    /* movzx r, byte ptr [rbp + offset] */
+    gen_rex(s, 0, r, 0, base);
+    g(s, 0x0f);
+    g(s, (t & VT_UNSIGNED) ? 0xb6 : 0xbe);
+  } else if (size == 2) {
+    /* movzx/movsx r, word ptr [rbp + offset] */
+    gen_rex(s, 0, r, 0, base);
+    g(s, 0x0f);
+    g(s, (t & VT_UNSIGNED) ? 0xb7 : 0xbf);
+  } else if (size == 4) {
+    /* mov r32, [rbp + offset] or movsxd for signed */
+    if (t & VT_UNSIGNED) {
+      gen_rex(s, 0, r, 0, base);
+      g(s, 0x8b);
+    } else {
+      gen_rex(s, 1, r, 0, base);
+      g(s, 0x63); /* movsxd */
+    }
+  } else {
+    /* mov r64, [rbp + offset] */
+    gen_rex(s, 1, r, 0, base);
+    g(s, 0x8b);
+  }
+}
+
+/* ModRM (and SIB) for memory at [base] */
+static void gen_modrm_ind(TCCState *s, int reg, int base) {
+  if ((base & 7) == REG_RBP) {
+    gen_modrm(s, 1, reg, base);
+    g(s, 0);
+  } else {
+    gen_modrm(s, 0, reg, base);
+    if ((base & 7) == REG_RSP)
+      g(s, 0x24);
+  }
+}
+
 void load(TCCState *s, int r, SValue *sv) {
   int t = sv->t & VT_BTYPE;
   int fr = sv->r;
+  RegContent held = {0, 0, 0};
+  int q = -1;
+
+  /* A local some register holds is taken from there */
+  if ((fr & (VT_VALMASK | VT_LVAL)) == (VT_LOCAL | VT_LVAL)) {
+    q = reg_content_find(s, r, (int)sv->c.i, local_size(t));
+    if (q >= 0)
+      held = s->reg_content[q];
+  }
+  reg_content_kill(s, r);
+
+  /* Comparison result still in the flags */
+  if ((fr & VT_VALMASK) == VT_CMP) {
+    gen_setcc(s, r, (int)sv->c.i);
+    return;
+  }
+
+  /* Address of a function or string literal: lea r, [rip + disp32] */
+  if ((fr & (VT_VALMASK | VT_LVAL | VT_SYM)) == (VT_CONST | VT_SYM)) {
+    gen_rex(s, 1, r, 0, 0);
+    g(s, 0x8d);
+    gen_modrm(s, 0, r, REG_RBP);
+    if (sv->sym) {
+      gen_le32(s, 0);
+      text_add_addr_reloc(s, s->ind - 4, sv->sym);
+    } else {
+      gen_rip_ref(s, s->rdata_section, (uint32_t)sv->c.i);
+    }
+    return;
+  }
 
   /* Constant value */
   if ((fr & 0x00ff) == VT_CONST) {
@@ -112,32 +335,23 @@ void load(TCCState *s, int r, SValue *sv) {
       size = 4;
 
     if (fr & VT_LVAL) {
-      /* Load from memory */
-      if (size == 1) {
-        /* movzx r, byte ptr [rbp + offset] */
-        gen_rex(s, 0, r, 0, REG_RBP);
-        g(s, 0x0f);
-        g(s, (sv->t & VT_UNSIGNED) ? 0xb6 : 0xbe);
-      } else if (size == 2) {
-        /* movzx/movsx r, word ptr [rbp + offset] */
-        gen_rex(s, 0, r, 0, REG_RBP);
-        g(s, 0x0f);
-        g(s, (sv->t & VT_UNSIGNED) ? 0xb7 : 0xbf);
-      } else if (size == 4) {
-        /* mov r32, [rbp + offset] or movsxd for signed */
-        if (sv->t & VT_UNSIGNED) {
-          gen_rex(s, 0, r, 0, REG_RBP);
-          g(s, 0x8b);
-        } else {
-          gen_rex(s, 1, r, 0, REG_RBP);
-          g(s, 0x63); /* movsxd */
-        }
-      } else {
-        /* mov r64, [rbp + offset] */
-        gen_rex(s, 1, r, 0, REG_RBP);
-        g(s, 0x8b);
+      /* Load from memory, or the same instruction from register q
+       * holding the local, unless q is r and already in that form */
+      int ext = (sv->t & VT_UNSIGNED) ? REG_EXT_ZERO : REG_EXT_SIGN;
+      int base = q >= 0 ? q : REG_RBP;
+
+      if (size == 8)
+        ext = REG_EXT_NONE;
+      if (q == r && held.size == size && held.ext == ext) {
+        reg_content_set(s, r, (int)sv->c.i, size, ext);
+        return;
       }
-      gen_modrm_local(s, r, (int)sv->c.i);
+      gen_load_insn(s, r, sv->t, base);
+      if (q >= 0)
+        gen_modrm(s, 3, r, q);
+      else
+        gen_modrm_local(s, r, (int)sv->c.i);
+      reg_content_set(s, r, (int)sv->c.i, size, ext);
     } else {
       /* LEA - load address */
       gen_rex(s, 1, r, 0, REG_RBP);
@@ -147,6 +361,20 @@ void load(TCCState *s, int r, SValue *sv) {
     return;
   }
 
+  /* Through a pointer: in a register, or spilled to a stack slot */
+  if ((fr & VT_VALMASK) == VT_LLOCAL) {
+    /* mov r, [rbp + offset] */
+    gen_rex(s, 1, r, 0, REG_RBP);
+    g(s, 0x8b);
+    gen_modrm_local(s, r, (int)sv->c.i);
+    fr = r | VT_LVAL;
+  }
+  if ((fr & VT_LVAL) && (fr & VT_VALMASK) < NB_REGS) {
+    gen_load_insn(s, r, sv->t, fr & VT_VALMASK);
+    gen_modrm_ind(s, r, fr & VT_VALMASK);
+    return;
+  }
+
   /* Value already in a register */
   if ((fr & 0x00ff) < NB_REGS) {
     int fr_reg = fr & 0x00ff;
@@ -155,6 +383,7 @@ void load(TCCState *s, int r, SValue *sv) {
       gen_rex(s, 1, fr_reg, 0, r);
       g(s, 0x89);
       gen_modrm(s, 3, fr_reg, r);
+      s->reg_content[r] = s->reg_content[fr_reg];
     }
   }
 }
@@ -163,40 +392,48 @@ void load(TCCState *s, int r, SValue *sv) {
  * Store Register to Memory
  *============================================================*/
 
+/* Prefix and opcode storing r as a value of type t to memory addressed
+ * by base; ModRM follows */
+static void gen_store_insn(TCCState *s, int r, int t, int base) {
+  int size = local_size(t & VT_BTYPE);
+
+  if (size == 1) {
+    /* mov byte ptr [rbp + offset], r8 */
+    gen_rex(s, 0, r, 0, base);
+    g(s, 0x88);
+  } else if (size == 2) {
+    /* mov word ptr [rbp + offset], r16 */
+    g(s, 0x66); /* Operand size prefix */
+    gen_rex(s, 0, r, 0, base);
+    g(s, 0x89);
+  } else if (size == 4) {
+    /* mov dword ptr [rbp + offset], r32 */
+    gen_rex(s, 0, r, 0, base);
+    g(s, 0x89);
+  } else {
+    /* mov qword ptr [rbp + offset], r64 */
+    gen_rex(s, 1, r, 0, base);
+    g(s, 0x89);
+  }
+}
+
 void store(TCCState *s, int r, SValue *sv) {
   int t = sv->t & VT_BTYPE;
   int fr = sv->r;
 
   /* Local variable - check if r field indicates VT_LOCAL (0xf2) */
   if ((fr & 0x00ff) == VT_LOCAL || (fr & 0x00ff) == (VT_LOCAL & 0xff)) {
-    int size = 8;
+    int size = local_size(t);
 
-    if (t == VT_BYTE)
-      size = 1;
-    else if (t == VT_SHORT)
-      size = 2;
-    else if (t == VT_INT)
-      size = 4;
-
-    if (size == 1) {
-      /* mov byte ptr [rbp + offset], r8 */
-      gen_rex(s, 0, r, 0, REG_RBP);
-      g(s, 0x88);
-    } else if (size == 2) {
-      /* mov word ptr [rbp + offset], r16 */
-      g(s, 0x66); /* Operand size prefix */
-      gen_rex(s, 0, r, 0, REG_RBP);
-      g(s, 0x89);
-    } else if (size == 4) {
-      /* mov dword ptr [rbp + offset], r32 */
-      gen_rex(s, 0, r, 0, REG_RBP);
-      g(s, 0x89);
-    } else {
-      /* mov qword ptr [rbp + offset], r64 */
-      gen_rex(s, 1, r, 0, REG_RBP);
-      g(s, 0x89);
-    }
+    gen_store_insn(s, r, t, REG_RBP);
     gen_modrm_local(s, r, (int)sv->c.i);
+    reg_content_store(s, (int)sv->c.i, size);
+    reg_content_set(s, r, (int)sv->c.i, size, REG_EXT_NONE);
+  } else if ((fr & VT_LVAL) && (fr & VT_VALMASK) < NB_REGS) {
+    /* Through a pointer: any local may have changed */
+    gen_store_insn(s, r, t, fr & VT_VALMASK);
+    gen_modrm_ind(s, r, fr & VT_VALMASK);
+    reg_content_clear(s);
   }
 }
 
@@ -204,6 +441,109 @@ void store(TCCState *s, int r, SValue *sv) {
  * Integer Operations
  *============================================================*/
 
+/* Plain constant usable as a sign-extended imm32 */
+static int is_imm32(SValue *sv) {
+  return (sv->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST &&
+         sv->c.i == (int32_t)sv->c.i;
+}
+
+/* 64-bit operand: long long or pointer */
+static int is_wide(int t) {
+  t &= VT_BTYPE;
+  return t == VT_LLONG || t == VT_LONG || t == VT_PTR;
+}
+
+/* Peephole comparison: the result stays in the flags (VT_CMP), so
+ * that gtst can branch right after the cmp, where the pair fuses into
+ * one uop, and a value is only made by load() when it is needed. A
+ * constant operand is compared as an immediate, zero with test r, r. */
+static void gen_cmp(TCCState *s, int op) {
+  int uns = (s->vtop[-1].t & VT_UNSIGNED) != 0;
+  int r, fr;
+
+  if (is_imm32(s->vtop)) {
+    int32_t c = (int32_t)s->vtop->c.i;
+
+    vpop(s);
+    r = s->vtop->r & VT_VALMASK;
+    if (r >= NB_REGS || (s->vtop->r & VT_LVAL))
+      r = gv(s, RC_INT);
+    s->cmp_start = s->ind;
+    s->cmp_regs = 1 << r;
+    if (c == 0) {
+      /* test r, r */
+      gen_rex(s, 1, r, 0, r);
+      g(s, 0x85);
+      gen_modrm(s, 3, r, r);
+    } else if (c >= -128 && c <= 127) {
+      /* cmp r, imm8 */
+      gen_rex(s, 1, 0, 0, r);
+      g(s, 0x83);
+      gen_modrm(s, 3, 7, r);
+      g(s, c);
+    } else {
+      /* cmp r, imm32 */
+      gen_rex(s, 1, 0, 0, r);
+      g(s, 0x81);
+      gen_modrm(s, 3, 7, r);
+      gen_le32(s, (uint32_t)c);
+    }
+  } else {
+    gv2(s, RC_INT, RC_INT);
+    r = s->vtop[-1].r & 0xff;
+    fr = s->vtop[0].r & 0xff;
+    vpop(s);
+
+    /* cmp r, fr */
+    s->cmp_start = s->ind;
+    s->cmp_regs = 1 << r | 1 << fr;
+    gen_rex(s, 1, fr, 0, r);
+    g(s, 0x39);
+    gen_modrm(s, 3, fr, r);
+  }
+  s->cmp_end = s->ind;
+
+  s->vtop->r = VT_CMP;
+  s->vtop->t = VT_INT;
+  s->vtop->c.i = cmp_cc(op, uns);
+}
+
+/* Peephole division: unsigned operands clear RDX with a zero idiom
+ * instead of sign-extending into it and use div; int operands divide
+ * in 32 bits where the core's 64-bit divider is slow */
+static void gen_div(TCCState *s, int fr) {
+  int uns = ((s->vtop[-1].t | s->vtop[0].t) & VT_UNSIGNED) != 0;
+  int w = is_wide(s->vtop[-1].t) || is_wide(s->vtop[0].t);
+
+  if (!w && !uns && !(x86_tune_flags(s) & X86_SLOW_DIV64))
+    w = 1;
+
+  if (uns) {
+    /* xor edx, edx */
+    g(s, 0x31);
+    gen_modrm(s, 3, REG_RDX, REG_RDX);
+  } else {
+    /* cqo, or cdq */
+    gen_rex(s, w, 0, 0, 0);
+    g(s, 0x99);
+  }
+
+  /* div/idiv fr */
+  gen_rex(s, w, 0, 0, fr);
+  g(s, 0xf7);
+  gen_modrm(s, 3, uns ? 6 : 7, fr);
+
+  if (!w && !uns) {
+    /* movsxd rax, eax; movsxd rdx, edx: back to 64-bit values */
+    gen_rex(s, 1, REG_RAX, 0, REG_RAX);
+    g(s, 0x63);
+    gen_modrm(s, 3, REG_RAX, REG_RAX);
+    gen_rex(s, 1, REG_RDX, 0, REG_RDX);
+    g(s, 0x63);
+    gen_modrm(s, 3, REG_RDX, REG_RDX);
+  }
+}
+
 void gen_opi(TCCState *s, int op) {
   int r, fr;
 
@@ -219,7 +559,7 @@ void gen_opi(TCCState *s, int op) {
     fr = s->vtop[0].r & 0xff;
 
     /* add r, fr */
-    gen_rex(s, 1, r, 0, fr);
+    gen_rex(s, 1, fr, 0, r);
     g(s, 0x01);
     gen_modrm(s, 3, fr, r);
 
@@ -232,7 +572,7 @@ void gen_opi(TCCState *s, int op) {
     fr = s->vtop[0].r & 0xff;
 
     /* sub r, fr */
-    gen_rex(s, 1, r, 0, fr);
+    gen_rex(s, 1, fr, 0, r);
     g(s, 0x29);
     gen_modrm(s, 3, fr, r);
 
@@ -240,42 +580,39 @@ void gen_opi(TCCState *s, int op) {
     break;
 
   case '*':
-    gv2(s, RC_RAX, RC_INT);
+    gv2(s, RC_INT, RC_INT);
+    r = s->vtop[-1].r & 0xff;
     fr = s->vtop[0].r & 0xff;
 
-    /* imul rax, fr */
-    gen_rex(s, 1, REG_RAX, 0, fr);
+    /* imul r, fr */
+    gen_rex(s, 1, r, 0, fr);
     g(s, 0x0f);
     g(s, 0xaf);
-    gen_modrm(s, 3, REG_RAX, fr);
+    gen_modrm(s, 3, r, fr);
 
     vpop(s);
-    s->vtop->r = REG_RAX;
     break;
 
   case '/':
   case '%':
-    gv2(s, RC_RAX, RC_INT);
+    /* Dividend in RAX, divisor in RCX; RDX is written too */
+    gv2(s, RC_RAX, RC_RCX);
     fr = s->vtop[0].r & 0xff;
+    save_reg(s, REG_RDX);
 
-    /* Need to use RCX to avoid clobbering RDX */
-    if (fr == REG_RDX) {
-      /* mov rcx, rdx */
-      gen_rex(s, 1, REG_RCX, 0, REG_RDX);
-      g(s, 0x89);
-      gen_modrm(s, 3, REG_RDX, REG_RCX);
-      fr = REG_RCX;
+    if (s->pass[PASS_PEEPHOLE]) {
+      gen_div(s, fr);
+    } else {
+      /* cqo - sign extend rax to rdx:rax */
+      gen_rex(s, 1, 0, 0, 0);
+      g(s, 0x99);
+
+      /* idiv fr */
+      gen_rex(s, 1, 0, 0, fr);
+      g(s, 0xf7);
+      gen_modrm(s, 3, 7, fr);
     }
 
-    /* cqo - sign extend rax to rdx:rax */
-    gen_rex(s, 1, 0, 0, 0);
-    g(s, 0x99);
-
-    /* idiv fr */
-    gen_rex(s, 1, 0, 0, fr);
-    g(s, 0xf7);
-    gen_modrm(s, 3, 7, fr);
-
     vpop(s);
     if (op == '%') {
       s->vtop->r = REG_RDX; /* Remainder in RDX */
@@ -290,7 +627,7 @@ void gen_opi(TCCState *s, int op) {
     fr = s->vtop[0].r & 0xff;
 
     /* and r, fr */
-    gen_rex(s, 1, r, 0, fr);
+    gen_rex(s, 1, fr, 0, r);
     g(s, 0x21);
     gen_modrm(s, 3, fr, r);
 
@@ -303,7 +640,7 @@ void gen_opi(TCCState *s, int op) {
     fr = s->vtop[0].r & 0xff;
 
     /* or r, fr */
-    gen_rex(s, 1, r, 0, fr);
+    gen_rex(s, 1, fr, 0, r);
     g(s, 0x09);
     gen_modrm(s, 3, fr, r);
 
@@ -316,7 +653,7 @@ void gen_opi(TCCState *s, int op) {
     fr = s->vtop[0].r & 0xff;
 
     /* xor r, fr */
-    gen_rex(s, 1, r, 0, fr);
+    gen_rex(s, 1, fr, 0, r);
     g(s, 0x31);
     gen_modrm(s, 3, fr, r);
 
@@ -324,28 +661,42 @@ void gen_opi(TCCState *s, int op) {
     break;
 
   case TOK_SHL:
-    gv2(s, RC_INT, RC_RCX);
-    r = s->vtop[-1].r & 0xff;
-
-    /* shl r, cl */
-    gen_rex(s, 1, 0, 0, r);
-    g(s, 0xd3);
-    gen_modrm(s, 3, 4, r);
-
-    vpop(s);
-    break;
+  case TOK_SHR: {
+    /* shl, or sar (shr for unsigned) */
+    int ext = op == TOK_SHL ? 4 : (s->vtop[-1].t & VT_UNSIGNED) ? 5 : 7;
+
+    if ((s->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+      /* shl r, imm8 */
+      int n = (int)(s->vtop->c.i & 63);
+      vpop(s);
+      r = gv(s, RC_INT);
+      gen_rex(s, 1, 0, 0, r);
+      g(s, 0xc1);
+      gen_modrm(s, 3, ext, r);
+      g(s, n);
+      break;
+    }
 
-  case TOK_SHR:
-    gv2(s, RC_INT, RC_RCX);
+    /* The count goes in CL, unless shlx takes any register */
+    gv2(s, RC_INT, (s->cpu_features & CPU_BMI2) ? RC_INT : RC_RCX);
     r = s->vtop[-1].r & 0xff;
+    fr = s->vtop[0].r & 0xff;
 
-    /* sar r, cl (or shr for unsigned) */
-    gen_rex(s, 1, 0, 0, r);
-    g(s, 0xd3);
-    gen_modrm(s, 3, (s->vtop[-1].t & VT_UNSIGNED) ? 5 : 7, r);
+    if (s->cpu_features & CPU_BMI2) {
+      /* shlx/sarx/shrx r, r, fr: the count may be in any register */
+      gen_vex3(s, 2, 1, r, r, fr, ext == 4 ? 1 : ext == 7 ? 2 : 3);
+      g(s, 0xf7);
+      gen_modrm(s, 3, r, r);
+    } else {
+      /* shl r, cl */
+      gen_rex(s, 1, 0, 0, r);
+      g(s, 0xd3);
+      gen_modrm(s, 3, ext, r);
+    }
 
     vpop(s);
     break;
+  }
 
   case TOK_EQ:
   case TOK_NE:
@@ -353,56 +704,26 @@ void gen_opi(TCCState *s, int op) {
   case '>':
   case TOK_LE:
   case TOK_GE:
+    if (s->pass[PASS_PEEPHOLE]) {
+      gen_cmp(s, op);
+      break;
+    }
+
     gv2(s, RC_INT, RC_INT);
     r = s->vtop[-1].r & 0xff;
     fr = s->vtop[0].r & 0xff;
 
     /* cmp r, fr */
-    gen_rex(s, 1, r, 0, fr);
+    gen_rex(s, 1, fr, 0, r);
     g(s, 0x39);
     gen_modrm(s, 3, fr, r);
 
     vpop(s);
 
-    /* setcc al */
-    {
-      int setcc_op;
-      switch (op) {
-      case TOK_EQ:
-        setcc_op = 0x94;
-        break; /* sete */
-      case TOK_NE:
-        setcc_op = 0x95;
-        break; /* setne */
-      case '<':
-        setcc_op = (s->vtop->t & VT_UNSIGNED) ? 0x92 : 0x9c;
-        break; /* setb/setl */
-      case '>':
-        setcc_op = (s->vtop->t & VT_UNSIGNED) ? 0x97 : 0x9f;
-        break; /* seta/setg */
-      case TOK_LE:
-        setcc_op = (s->vtop->t & VT_UNSIGNED) ? 0x96 : 0x9e;
-        break; /* setbe/setle */
-      case TOK_GE:
-        setcc_op = (s->vtop->t & VT_UNSIGNED) ? 0x93 : 0x9d;
-        break; /* setae/setge */
-      default:
-        setcc_op = 0x94;
-        break;
-      }
+    /* setcc r8; movzx r, r8 */
+    s->cmp_end = -1;
+    gen_setcc(s, r, cmp_cc(op, (s->vtop->t & VT_UNSIGNED) != 0));
 
-      g(s, 0x0f);
-      g(s, setcc_op);
-      gen_modrm(s, 3, 0, REG_RAX);
-
-      /* movzx rax, al */
-      gen_rex(s, 1, REG_RAX, 0, REG_RAX);
-      g(s, 0x0f);
-      g(s, 0xb6);
-      gen_modrm(s, 3, REG_RAX, REG_RAX);
-    }
-
-    s->vtop->r = REG_RAX;
     s->vtop->t = VT_INT;
     break;
 
@@ -416,27 +737,34 @@ void gen_opi(TCCState *s, int op) {
     break;
 
   case '!':
+    if ((s->vtop->r & VT_VALMASK) == VT_CMP) {
+      /* Opposite condition */
+      s->vtop->c.i ^= 1;
+      break;
+    }
+    if (s->pass[PASS_PEEPHOLE]) {
+      vset(s, VT_INT, VT_CONST, 0);
+      gen_cmp(s, TOK_EQ);
+      break;
+    }
+
     r = gv(s, RC_INT);
 
-    /* test r, r */
+    /* test r, r; sete r8; movzx r, r8 */
     gen_rex(s, 1, r, 0, r);
     g(s, 0x85);
     gen_modrm(s, 3, r, r);
-
-    /* sete al */
-    g(s, 0x0f);
-    g(s, 0x94);
-    gen_modrm(s, 3, 0, REG_RAX);
-
-    /* movzx rax, al */
-    gen_rex(s, 1, REG_RAX, 0, REG_RAX);
-    g(s, 0x0f);
-    g(s, 0xb6);
-    gen_modrm(s, 3, REG_RAX, REG_RAX);
-
-    s->vtop->r = REG_RAX;
+    s->cmp_end = -1;
+    gen_setcc(s, r, 0x4);
     break;
   }
+
+  /* The registers written now hold the result */
+  reg_content_kill(s, s->vtop->r & VT_VALMASK);
+  if (op == '/' || op == '%') {
+    reg_content_kill(s, REG_RAX);
+    reg_content_kill(s, REG_RDX);
+  }
 }
 
 /*============================================================
@@ -458,14 +786,233 @@ void gen_cvt_ftoi(TCCState *s, int t) {
   tcc_warning(s, "float to integer conversion not implemented");
 }
 
+/*============================================================
+ * Bit Manipulation Builtins
+ *============================================================*/
+
+/* Replace the value on top of the stack by popcount, clz, ctz or
+ * byte swap of its low 32 bits (or all 64 if wide), using the
+ * instructions -march allows */
+void gen_bitop(TCCState *s, int op, int wide) {
+  SValue *sv = s->vtop;
+  int r;
+
+  /* movbe r, [rbp + offset] swaps while loading */
+  if (op == BITOP_BSWAP && (s->cpu_features & CPU_MOVBE) &&
+      (sv->r & (VT_VALMASK | VT_LVAL)) == (VT_LOCAL | VT_LVAL) &&
+      ((sv->t & VT_BTYPE) == VT_INT) == !wide) {
+    int off = (int)sv->c.i;
+    save_reg(s, REG_RAX);
+    gen_rex(s, wide, 0, 0, REG_RBP);
+    g(s, 0x0f);
+    g(s, 0x38);
+    g(s, 0xf0);
+    gen_modrm_local(s, REG_RAX, off);
+    reg_content_kill(s, REG_RAX);
+    sv->r = REG_RAX;
+    sv->t = (wide ? VT_LLONG : VT_INT) | VT_UNSIGNED;
+    return;
+  }
+
+  r = gv(s, RC_RAX);
+
+  switch (op) {
+  case BITOP_POPCOUNT:
+    if (s->cpu_features & CPU_POPCNT) {
+      /* popcnt rax, rax */
+      g(s, 0xf3);
+      gen_rex(s, wide, 0, 0, 0);
+      g(s, 0x0f);
+      g(s, 0xb8);
+      gen_modrm(s, 3, r, r);
+    } else {
+      /* Clear the lowest set bit until none is left:
+       *   xor ecx, ecx; (mov eax, eax;) test rax, rax; jz done
+       *   loop: lea rdx, [rax - 1]; inc ecx; and rax, rdx; jnz loop
+       *   done: mov eax, ecx */
+      save_reg(s, REG_RCX);
+      save_reg(s, REG_RDX);
+      g(s, 0x31);
+      gen_modrm(s, 3, REG_RCX, REG_RCX);
+      if (!wide) {
+        g(s, 0x89);
+        gen_modrm(s, 3, REG_RAX, REG_RAX);
+      }
+      gen_rex(s, 1, 0, 0, 0);
+      g(s, 0x85);
+      gen_modrm(s, 3, REG_RAX, REG_RAX);
+      g(s, 0x74);
+      g(s, 11);
+      gen_rex(s, 1, 0, 0, 0);
+      g(s, 0x8d);
+      gen_modrm(s, 1, REG_RDX, REG_RAX);
+      g(s, 0xff);
+      g(s, 0xff);
+      gen_modrm(s, 3, 0, REG_RCX);
+      gen_rex(s, 1, 0, 0, 0);
+      g(s, 0x21);
+      gen_modrm(s, 3, REG_RDX, REG_RAX);
+      g(s, 0x75);
+      g(s, (uint8_t)-11);
+      g(s, 0x89);
+      gen_modrm(s, 3, REG_RCX, REG_RAX);
+    }
+    sv->t = VT_INT;
+    break;
+
+  case BITOP_CLZ:
+    if (s->cpu_features & CPU_LZCNT) {
+      /* lzcnt rax, rax */
+      g(s, 0xf3);
+      gen_rex(s, wide, 0, 0, 0);
+      g(s, 0x0f);
+      g(s, 0xbd);
+      gen_modrm(s, 3, r, r);
+    } else {
+      /* bsr rax, rax; xor eax, 63 (31): the index of the top bit
+       * counted from the other end */
+      gen_rex(s, wide, 0, 0, 0);
+      g(s, 0x0f);
+      g(s, 0xbd);
+      gen_modrm(s, 3, r, r);
+      g(s, 0x83);
+      gen_modrm(s, 3, 6, r);
+      g(s, wide ? 63 : 31);
+    }
+    sv->t = VT_INT;
+    break;
+
+  case BITOP_CTZ:
+    /* tzcnt rax, rax, or bsf, which agrees for non-zero values */
+    if (s->cpu_features & CPU_BMI1)
+      g(s, 0xf3);
+    gen_rex(s, wide, 0, 0, 0);
+    g(s, 0x0f);
+    g(s, 0xbc);
+    gen_modrm(s, 3, r, r);
+    sv->t = VT_INT;
+    break;
+
+  case BITOP_BSWAP:
+    /* bswap rax */
+    gen_rex(s, wide, 0, 0, 0);
+    g(s, 0x0f);
+    g(s, 0xc8 + r);
+    sv->t = (wide ? VT_LLONG : VT_INT) | VT_UNSIGNED;
+    break;
+  }
+  reg_content_kill(s, REG_RAX);
+  reg_content_kill(s, REG_RCX);
+  reg_content_kill(s, REG_RDX);
+}
+
+/*============================================================
+ * Expression Idioms
+ *============================================================*/
+
+/* Rotate vtop[-1] left (right) by vtop: rol r, imm8 or rol r, cl. A
+ * 32-bit rotate zero-extends, as an unsigned int is kept. */
+void gen_rotate(TCCState *s, int right, int wide) {
+  int r;
+
+  if (is_imm32(s->vtop)) {
+    int n = (int)(s->vtop->c.i & (wide ? 63 : 31));
+
+    vpop(s);
+    r = gv(s, RC_INT);
+    gen_rex(s, wide, 0, 0, r);
+    g(s, 0xc1);
+    gen_modrm(s, 3, right, r);
+    g(s, n);
+  } else {
+    gv2(s, RC_INT, RC_RCX);
+    r = s->vtop[-1].r & VT_VALMASK;
+    vpop(s);
+    gen_rex(s, wide, 0, 0, r);
+    g(s, 0xd3);
+    gen_modrm(s, 3, right, r);
+  }
+  reg_content_kill(s, r);
+}
+
+/* |vtop| as mov t, r; neg r; cmovs r, t, on the sign-extended value */
+void gen_abs(TCCState *s) {
+  int r, fr;
+
+  vpush(s);
+  gv2(s, RC_INT, RC_INT);
+  r = s->vtop[-1].r & VT_VALMASK;
+  fr = s->vtop->r & VT_VALMASK;
+  vpop(s);
+
+  /* neg r */
+  gen_rex(s, 1, 0, 0, r);
+  g(s, 0xf7);
+  gen_modrm(s, 3, 3, r);
+  /* cmovs r, fr */
+  gen_rex(s, 1, r, 0, fr);
+  g(s, 0x0f);
+  g(s, 0x48);
+  gen_modrm(s, 3, r, fr);
+  reg_content_kill(s, r);
+}
+
+/* vtop[-1] op vtop ? vtop[-1] : vtop, or the other way round with inv,
+ * without a branch: cmp r, fr; cmovcc r, fr */
+void gen_select(TCCState *s, int op, int inv) {
+  int uns = (s->vtop[-1].t & VT_UNSIGNED) != 0;
+  int t = s->vtop[-1].t;
+  int r, fr;
+
+  if (is_wide(s->vtop->t) && !is_wide(t))
+    t = s->vtop->t;
+  gv2(s, RC_INT, RC_INT);
+  r = s->vtop[-1].r & VT_VALMASK;
+  fr = s->vtop->r & VT_VALMASK;
+  vpop(s);
+
+  /* cmp r, fr */
+  gen_rex(s, 1, fr, 0, r);
+  g(s, 0x39);
+  gen_modrm(s, 3, fr, r);
+  /* cmov r, fr where the condition picks the second operand */
+  gen_rex(s, 1, r, 0, fr);
+  g(s, 0x0f);
+  g(s, 0x40 + (cmp_cc(op, uns) ^ !inv));
+  gen_modrm(s, 3, r, fr);
+  reg_content_kill(s, r);
+  s->vtop->t = t;
+}
+
 /*============================================================
  * Function Prologue and Epilogue
  *============================================================*/
 
-void gfunc_prolog(TCCState *s, int t) {
+/* Argument registers, in order; the Win64 ABI uses the first 4 */
+static const int arg_regs[PRIVATE_NB_REG_ARGS] = {REG_RCX, REG_RDX, REG_R8,
+                                                  REG_R9,  REG_R10, REG_R11};
+static const int arg_classes[PRIVATE_NB_REG_ARGS] = {
+    RC_RCX, RC_RDX, RC_R8, RC_R9, RC_R10, RC_R11};
+
+/* sub rsp, size: at least size, more if the locals end up taking more
+ * than that. The prologue is kept out of the scheduler so that the
+ * immediate stays where gfunc_epilog() patches it. */
+static void gen_frame(TCCState *s, int pushed, int size) {
+  gen_rex(s, 1, 0, 0, REG_RSP);
+  g(s, 0x81);
+  gen_modrm(s, 3, 5, REG_RSP);
+  gen_le32(s, size);
+  s->frame_patch = s->ind - 4;
+  s->frame_pushed = pushed;
+  s->sched_start = s->ind;
+}
+
+void gfunc_prolog(TCCState *s, int t, int nb_params) {
+  int i;
+
   (void)t;
 
-  /* Windows x64 function prologue */
+  sched_flush(s, s->ind);
 
   /* push rbp */
   g(s, 0x55);
@@ -475,6 +1022,27 @@ void gfunc_prolog(TCCState *s, int t) {
   g(s, 0x89);
   gen_modrm(s, 3, REG_RSP, REG_RBP);
 
+  if (s->func_sym && (s->func_sym->flags & SYM_PRIVATE)) {
+    /* Private convention: home only the parameters there are, keeping
+     * the frame 16-byte aligned */
+    int size = (nb_params * 8 + 15) & ~15;
+
+    reg_content_clear(s);
+    for (i = 0; i < nb_params; i++) {
+      if (arg_regs[i] > 7)
+        g(s, 0x41);
+      g(s, 0x50 + (arg_regs[i] & 7));
+      reg_content_set(s, arg_regs[i], -8 * (i + 1), 8, REG_EXT_NONE);
+    }
+    /* sub rsp, 64 (+ 8 to realign after an odd number of pushes) */
+    gen_frame(s, nb_params * 8, 0x40 + size - nb_params * 8);
+
+    s->loc = -size;
+    return;
+  }
+
+  /* Windows x64 function prologue */
+
   /* Save the first 4 parameters by pushing them to stack */
   /* This places them at [rbp-8], [rbp-16], [rbp-24], [rbp-32] */
 
@@ -494,16 +1062,32 @@ void gfunc_prolog(TCCState *s, int t) {
 
   /* sub rsp, N (allocate stack space) */
   /* Allocate 64 bytes (96 - 32) */
-  gen_rex(s, 1, 0, 0, REG_RSP);
-  g(s, 0x83);
-  gen_modrm(s, 3, 5, REG_RSP);
-  g(s, 0x40); /* 64 bytes */
+  gen_frame(s, 32, 0x40);
 
   /* Initialize local variable offset */
   s->loc = -32;
+
+  /* The pushed parameters are still in their registers */
+  reg_content_clear(s);
+  for (i = 0; i < nb_params && i < 4; i++)
+    reg_content_set(s, arg_regs[i], -8 * (i + 1), 8, REG_EXT_NONE);
 }
 
 void gfunc_epilog(TCCState *s) {
+  uint8_t *imm = s->text_section->data + s->frame_patch;
+  int size = ((-s->loc + 15) & ~15) - s->frame_pushed;
+
+  sched_flush(s, s->ind);
+
+  /* Grow the frame over the locals allocated so far; the last epilogue
+     sees them all */
+  if (size > (int)(imm[0] | imm[1] << 8 | imm[2] << 16 | imm[3] << 24)) {
+    imm[0] = (uint8_t)size;
+    imm[1] = (uint8_t)(size >> 8);
+    imm[2] = (uint8_t)(size >> 16);
+    imm[3] = (uint8_t)(size >> 24);
+  }
+
   /* mov rsp, rbp */
   gen_rex(s, 1, REG_RSP, 0, REG_RBP);
   g(s, 0x89);
@@ -514,27 +1098,124 @@ void gfunc_epilog(TCCState *s) {
 
   /* ret */
   g(s, 0xc3);
+  s->sched_start = s->ind;
 }
 
 /*============================================================
  * Function Calls
  *============================================================*/
 
+/* Indirect call through the address in RAX. Each site gets a value
+ * profile number; instrumented builds pass the target to the recording
+ * helper first, and with a profile a dominant target is called directly
+ * behind a compare:
+ *   lea r11, [rip + known]; cmp rax, r11; jne slow; call known; jmp done
+ *   slow: call rax
+ *   done: */
+static void gen_indirect_call(TCCState *s) {
+  int id = prof_new_value_site(s);
+  uint64_t count;
+  Sym *known;
+
+  gv(s, RC_RAX);
+  vpop(s);
+
+  if (s->prof_generate && s->prof_values) {
+    if (!s->prof_value_section)
+      s->prof_value_section = new_section(s, ".profv", 1, 3);
+    while (s->prof_value_section->data_size <
+           (size_t)(id + 1) * sizeof(ProfValueSite))
+      memset(section_ptr_add(s->prof_value_section, sizeof(ProfValueSite)), 0,
+             sizeof(ProfValueSite));
+    if (!s->prof_value_sym)
+      s->prof_value_sym = global_sym_push2(s, "__tcc_profile_value",
+                                           VT_FUNC | VT_VOID, VT_CONST, 0);
+
+    /* lea r11, [rip + site]; call __tcc_profile_value */
+    gen_rex(s, 1, REG_R11, 0, 0);
+    g(s, 0x8d);
+    gen_modrm(s, 0, REG_R11 & 7, REG_RBP);
+    gen_rip_ref(s, s->prof_value_section, id * sizeof(ProfValueSite));
+    g(s, 0xe8);
+    gen_le32(s, 0);
+    text_add_reloc(s, s->ind - 4, s->prof_value_sym);
+  }
+
+  /* The guarded call is set up for the ABI entry of known */
+  known = prof_dominant_target(s, id, &count);
+  if (known) {
+    gen_rex(s, 1, REG_R11, 0, 0);
+    g(s, 0x8d);
+    gen_modrm(s, 0, REG_R11 & 7, REG_RBP);
+    gen_le32(s, 0);
+    text_add_addr_reloc(s, s->ind - 4, known);
+    gen_rex(s, 1, REG_R11, 0, REG_RAX);
+    g(s, 0x39);
+    gen_modrm(s, 3, REG_R11 & 7, REG_RAX);
+    g(s, 0x75); /* jne slow */
+    g(s, 7);
+    g(s, 0xe8);
+    gen_le32(s, 0);
+    text_add_reloc(s, s->ind - 4, known);
+    s->text_relocs[s->nb_text_relocs - 1].count = (int64_t)count;
+    s->text_relocs[s->nb_text_relocs - 1].abi = 1;
+    g(s, 0xeb); /* jmp done */
+    g(s, 2);
+  }
+
+  /* call rax */
+  g(s, 0xff);
+  gen_modrm(s, 3, 2, REG_RAX);
+}
+
+/* Whether calls to func with nb_args arguments use the private
+ * convention: static functions of up to PRIVATE_NB_REG_ARGS parameters
+ * take them all in registers and get no shadow space. Both the call
+ * sites and the definition decide this from the same facts. */
+int gfunc_private(TCCState *s, Sym *func, int nb_args) {
+  return s->pass[PASS_PRIVATE_CALLS] && (func->t & VT_BTYPE) == VT_FUNC &&
+         (func->t & VT_STATIC) && nb_args <= PRIVATE_NB_REG_ARGS;
+}
+
 /* Function call */
 void gfunc_call(TCCState *s, int nb_args) {
   int i;
   int stack_args = 0;
+  int pad = 0;
+  int nb_reg_args = 4;
+  int shadow = 32;
+  SValue *func;
+
+  /* The stack adjustment below clobbers the flags */
+  vcheck_cmp(s);
+  func = s->vtop - nb_args;
+  s->nb_effects++;
 
   /* Windows x64 calling convention:
    * First 4 args in RCX, RDX, R8, R9
    * Remaining args on stack (right to left)
    * 32-byte shadow space required
    * Stack must be 16-byte aligned before call
+   * Direct calls to private functions pass up to 6 args in registers
+   * (R10 and R11 next) and leave out the shadow space.
    */
+  if ((func->r & (VT_VALMASK | VT_LVAL)) == VT_CONST && func->sym &&
+      gfunc_private(s, func->sym, nb_args)) {
+    nb_reg_args = PRIVATE_NB_REG_ARGS;
+    shadow = 0;
+  }
+
+  /* Values computed before the call must survive it: spill the ones
+   * still held in (caller-saved) registers */
+  for (i = 0; i < (s->vtop - s->vstack) - nb_args; i++) {
+    int r = s->vstack[i].r & VT_VALMASK;
+    if (r < NB_REGS)
+      save_reg(s, r);
+  }
 
   /* Calculate stack space for arguments > 4 */
-  if (nb_args > 4) {
-    stack_args = nb_args - 4;
+  if (nb_args > nb_reg_args) {
+    stack_args = nb_args - nb_reg_args;
     /* Align stack to 16 bytes if necessary (stacks args + shadow space) */
     if ((stack_args * 8 + 32) % 16 != 0) {
       /* This is a simplification; a real compiler tracks stack depth.
@@ -547,11 +1228,12 @@ void gfunc_call(TCCState *s, int nb_args) {
       g(s, 0x83);
       gen_modrm(s, 3, 5, REG_RSP);
       g(s, 0x08);
+      pad = 8;
     }
   }
 
   /* Push stack arguments (reverse order) */
-  for (i = nb_args - 1; i >= 4; i--) {
+  for (i = nb_args - 1; i >= nb_reg_args; i--) {
     /* Get argument from stack to register */
     gv(s, RC_INT);
     int r = s->vtop->r & 0xff;
@@ -574,36 +1256,21 @@ void gfunc_call(TCCState *s, int nb_args) {
    * We will force load into specific registers.
    */
 
-  for (i = (nb_args > 4 ? 3 : nb_args - 1); i >= 0; i--) {
-    int r;
-    if (i == 0)
-      r = REG_RCX;
-    else if (i == 1)
-      r = REG_RDX;
-    else if (i == 2)
-      r = REG_R8;
-    else
-      r = REG_R9;
-
-    gv(s, (i == 0) ? RC_RCX : (i == 1) ? RC_RDX : (i == 2) ? RC_R8 : RC_R9);
-
-    /* Move if not in correct register (gv might have picked another if
-     * constrained) */
-    if ((s->vtop->r & 0xff) != r) {
-      int src = s->vtop->r & 0xff;
-      gen_rex(s, 1, src, 0, r);
-      g(s, 0x89);
-      gen_modrm(s, 3, src, r);
-    }
+  for (i = (nb_args > nb_reg_args ? nb_reg_args : nb_args) - 1; i >= 0; i--) {
+    /* Loading into the register spills any argument still waiting in
+     * it */
+    gv(s, arg_classes[i]);
     vpop(s);
   }
 
   /* Allocate shadow space (32 bytes) */
   /* sub rsp, 32 */
-  gen_rex(s, 1, 0, 0, REG_RSP);
-  g(s, 0x83);
-  gen_modrm(s, 3, 5, REG_RSP);
-  g(s, 0x20);
+  if (shadow) {
+    gen_rex(s, 1, 0, 0, REG_RSP);
+    g(s, 0x83);
+    gen_modrm(s, 3, 5, REG_RSP);
+    g(s, shadow);
+  }
 
   /* Get function address and call */
   /* The function address is now at the top of the stack (pushed before args) */
@@ -622,25 +1289,17 @@ void gfunc_call(TCCState *s, int nb_args) {
     Sym *sym = s->vtop->sym;
     /* TODO: Only works for defined symbols in same section */
     gen_le32(s, (int)(sym->c - (s->ind + 4)));
+    text_add_reloc(s, s->ind - 4, sym);
 
     vpop(s);
   } else {
     /* Indirect call */
-    gv(s, RC_INT);
-    int r = s->vtop->r & 0xff;
-    if (r > 7)
-      g(s, 0x41);
-    g(s, 0xff);
-    gen_modrm(s, 3, 2, r & 7);
-    vpop(s);
+    gen_indirect_call(s);
   }
 
   /* Clean up stack (shadow space + stack args + alignment) */
   /* add rsp, N */
-  int stack_adjust = 32 + (stack_args * 8);
-  /* Alignment adjustment not tracked well here, assuming aligned for now */
-  /* In a real implementation we'd track 'stack_depth' to know if we added
-   * padding */
+  int stack_adjust = shadow + (stack_args * 8) + pad;
 
   if (stack_adjust > 0) {
     gen_rex(s, 1, 0, 0, REG_RSP);
@@ -655,12 +1314,16 @@ void gfunc_call(TCCState *s, int nb_args) {
     }
   }
 
+  /* The callee may have written any caller-saved register */
+  reg_content_clear(s);
+
   /* Result in RAX */
   vset(s, VT_INT, REG_RAX, 0);
 }
 
 /* Generate unconditional jump */
 void gjmp(TCCState *s, Sym *l) {
+  sched_flush(s, s->ind);
   g(s, 0xe9); /* JMP rel32 */
   if (l->r == 1) {
     gen_le32(s, (int)(l->c - (s->ind + 4)));
@@ -668,24 +1331,39 @@ void gjmp(TCCState *s, Sym *l) {
     gen_le32(s, (int)l->c);
     l->c = s->ind - 4;
   }
+  text_add_reloc(s, s->ind - 4, NULL);
+
+  /* What follows is not reached from here */
+  reg_content_clear(s);
 }
 
 /* Generate conditional jump */
 /* inv=0: jump if true (NE), inv=1: jump if false (E) */
 void gtst(TCCState *s, int inv, Sym *l) {
   int v = s->vtop->r & 0xff;
-  if (v >= NB_REGS) {
-    v = gv(s, RC_INT);
-  }
-  vpop(s);
+  int cc;
 
-  /* test reg, reg */
-  gen_rex(s, 1, v, 0, v);
-  g(s, 0x85);
-  gen_modrm(s, 3, v, v);
+  if (v == VT_CMP) {
+    /* Flags of the compare just made: jcc right after it */
+    cc = (int)s->vtop->c.i ^ inv;
+    vpop(s);
+    sched_flush(s, s->cmp_end == s->ind ? s->cmp_start : s->ind);
+  } else {
+    if (v >= NB_REGS || (s->vtop->r & VT_LVAL)) {
+      v = gv(s, RC_INT);
+    }
+    vpop(s);
+    sched_flush(s, s->ind);
+
+    /* test reg, reg */
+    gen_rex(s, 1, v, 0, v);
+    g(s, 0x85);
+    gen_modrm(s, 3, v, v);
+    cc = inv ? 0x4 : 0x5; /* JE/JNE */
+  }
 
   g(s, 0x0f);
-  g(s, inv ? 0x84 : 0x85); /* JE/JNE */
+  g(s, 0x80 + cc);
 
   if (l->r == 1) {
     gen_le32(s, (int)(l->c - (s->ind + 4)));
@@ -693,12 +1371,15 @@ void gtst(TCCState *s, int inv, Sym *l) {
     gen_le32(s, (int)l->c);
     l->c = s->ind - 4;
   }
+  text_add_reloc(s, s->ind - 4, NULL);
 }
 
 /* Label definition */
 void glabel(TCCState *s, Sym *l) {
   int p;
 
+  sched_flush(s, s->ind);
+
   /* Patch fixups */
   p = (int)l->c;
   while (p != -1) {
@@ -710,4 +1391,856 @@ void glabel(TCCState *s, Sym *l) {
 
   l->r = 1; /* Defined */
   l->c = s->ind;
+
+  /* Code may now be reached other than from the last compare, with
+     other register contents */
+  s->cmp_end = -1;
+  reg_content_clear(s);
+}
+
+/*============================================================
+ * Section References and Profiling Support
+ *============================================================*/
+
+/* Emit a rel32 RIP-relative reference to offset in section sec */
+void gen_rip_ref(TCCState *s, Section *sec, uint32_t offset) {
+  gen_le32(s, offset);
+  text_add_sec_reloc(s, s->ind - 4, sec);
+}
+
+/* Bump a profile counter: inc qword ptr [rip + counter] */
+void gen_prof_inc(TCCState *s, uint32_t offset) {
+  gen_rex(s, 1, 0, 0, 0);
+  g(s, 0xff);
+  gen_modrm(s, 0, 0, REG_RBP); /* mod 00, rm 101: RIP-relative */
+  gen_rip_ref(s, s->prof_section, offset);
+}
+
+/* call qword ptr [rip + IAT slot] */
+static void gen_call_import(TCCState *s, const char *name) {
+  uint32_t slot = pe_import(s, name);
+  g(s, 0xff);
+  gen_modrm(s, 0, 2, REG_RBP);
+  gen_rip_ref(s, s->idata_section, slot);
+}
+
+/* mov qword ptr [rsp + disp8], imm32 */
+static void gen_store_rsp(TCCState *s, int disp, uint32_t v) {
+  gen_rex(s, 1, 0, 0, REG_RSP);
+  g(s, 0xc7);
+  gen_modrm(s, 1, 0, REG_RSP);
+  g(s, 0x24); /* SIB: base rsp */
+  g(s, disp);
+  gen_le32(s, v);
+}
+
+/* Entry point of an instrumented program: run main, then write the
+ * size bytes of profile data at data to the file named at name (in
+ * .rdata), and return main's result */
+void gen_prof_start(TCCState *s, Sym *main_sym, uint32_t name,
+                    uint32_t data, uint32_t size) {
+  int skip;
+
+  /* push rbx; sub rsp, 80 (shadow space, 3 stack args, 2 locals) */
+  g(s, 0x53);
+  gen_rex(s, 1, 0, 0, REG_RSP);
+  g(s, 0x83);
+  gen_modrm(s, 3, 5, REG_RSP);
+  g(s, 0x50);
+
+  /* call main; mov ebx, eax */
+  g(s, 0xe8);
+  gen_le32(s, 0);
+  text_add_reloc(s, s->ind - 4, main_sym);
+  g(s, 0x89);
+  gen_modrm(s, 3, REG_RAX, REG_RBX);
+
+  /* CreateFileA(name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+   *             FILE_ATTRIBUTE_NORMAL, NULL) */
+  gen_rex(s, 1, REG_RCX, 0, 0);
+  g(s, 0x8d);
+  gen_modrm(s, 0, REG_RCX, REG_RBP);
+  gen_rip_ref(s, s->rdata_section, name);
+  g(s, 0xb8 + REG_RDX);
+  gen_le32(s, 0x40000000);
+  gen_rex(s, 0, REG_R8, 0, REG_R8);
+  g(s, 0x31);
+  gen_modrm(s, 3, REG_R8, REG_R8);
+  gen_rex(s, 0, REG_R9, 0, REG_R9);
+  g(s, 0x31);
+  gen_modrm(s, 3, REG_R9, REG_R9);
+  gen_store_rsp(s, 32, 2);
+  gen_store_rsp(s, 40, 0x80);
+  gen_store_rsp(s, 48, 0);
+  gen_call_import(s, "CreateFileA");
+
+  /* cmp rax, -1; je done */
+  gen_rex(s, 1, 0, 0, REG_RAX);
+  g(s, 0x83);
+  gen_modrm(s, 3, 7, REG_RAX);
+  g(s, 0xff);
+  g(s, 0x74);
+  g(s, 0);
+  skip = s->ind;
+
+  /* mov [rsp+56], rax; WriteFile(h, data, size, &written, NULL) */
+  gen_rex(s, 1, REG_RAX, 0, REG_RSP);
+  g(s, 0x89);
+  gen_modrm(s, 1, REG_RAX, REG_RSP);
+  g(s, 0x24);
+  g(s, 56);
+  gen_rex(s, 1, REG_RAX, 0, REG_RCX);
+  g(s, 0x89);
+  gen_modrm(s, 3, REG_RAX, REG_RCX);
+  gen_rex(s, 1, REG_RDX, 0, 0);
+  g(s, 0x8d);
+  gen_modrm(s, 0, REG_RDX, REG_RBP);
+  gen_rip_ref(s, s->data_section, data);
+  gen_rex(s, 0, 0, 0, REG_R8);
+  g(s, 0xb8 + (REG_R8 & 7));
+  gen_le32(s, size);
+  gen_rex(s, 1, REG_R9, 0, REG_RSP);
+  g(s, 0x8d);
+  gen_modrm(s, 1, REG_R9, REG_RSP);
+  g(s, 0x24);
+  g(s, 64);
+  gen_store_rsp(s, 32, 0);
+  gen_call_import(s, "WriteFile");
+
+  /* CloseHandle(h) */
+  gen_rex(s, 1, REG_RCX, 0, REG_RSP);
+  g(s, 0x8b);
+  gen_modrm(s, 1, REG_RCX, REG_RSP);
+  g(s, 0x24);
+  g(s, 56);
+  gen_call_import(s, "CloseHandle");
+
+  /* done: mov eax, ebx; add rsp, 80; pop rbx; ret */
+  s->text_section->data[skip - 1] = (uint8_t)(s->ind - skip);
+  g(s, 0x89);
+  gen_modrm(s, 3, REG_RBX, REG_RAX);
+  gen_rex(s, 1, 0, 0, REG_RSP);
+  g(s, 0x83);
+  gen_modrm(s, 3, 0, REG_RSP);
+  g(s, 0x50);
+  g(s, 0x5b);
+  g(s, 0xc3);
+}
+
+/* __tcc_profile_value: called with an indirect call target in RAX and
+ * its ProfValueSite in R11. The target is looked up in a table of the
+ * functions defined in the program (rel32 entries after the code) and
+ * counted in the first free or matching slot, otherwise as "other".
+ * Only RCX, RDX, R8 and R10 are used, and saved, so the arguments of
+ * the call survive. */
+void gen_prof_value_helper(TCCState *s, Sym **funcs, int nb_funcs) {
+  uint8_t *p;
+  int table, loop, not_found, found, new0, hit0, new1, hit1, done;
+  int i;
+
+#define JCC8(op) (g(s, (op)), g(s, 0), s->ind)
+#define PATCH8(at, to) (s->text_section->data[(at) - 1] = (uint8_t)((to) - (at)))
+
+  /* push rcx; push rdx; push r8; push r10 */
+  g(s, 0x51);
+  g(s, 0x52);
+  g(s, 0x41);
+  g(s, 0x50);
+  g(s, 0x41);
+  g(s, 0x52);
+
+  /* lea r8, [rip + table]; xor ecx, ecx */
+  gen_rex(s, 1, REG_R8, 0, 0);
+  g(s, 0x8d);
+  gen_modrm(s, 0, REG_R8 & 7, REG_RBP);
+  gen_le32(s, 0);
+  table = s->ind;
+  g(s, 0x31);
+  gen_modrm(s, 3, REG_RCX, REG_RCX);
+
+  /* loop: cmp ecx, nb_funcs; jae other */
+  loop = s->ind;
+  g(s, 0x81);
+  gen_modrm(s, 3, 7, REG_RCX);
+  gen_le32(s, (uint32_t)nb_funcs);
+  not_found = JCC8(0x73);
+
+  /* movsxd r10, [r8 + rcx*4]; lea rdx, [r8 + rcx*4 + 4]; add r10, rdx */
+  g(s, 0x4d);
+  g(s, 0x63);
+  g(s, 0x14);
+  g(s, 0x88);
+  g(s, 0x49);
+  g(s, 0x8d);
+  if (x86_tune_flags(s) & X86_SLOW_LEA3) {
+    /* lea rdx, [r8 + rcx*4]; add rdx, 4 */
+    g(s, 0x14);
+    g(s, 0x88);
+    g(s, 0x48);
+    g(s, 0x83);
+    gen_modrm(s, 3, 0, REG_RDX);
+    g(s, 4);
+  } else {
+    g(s, 0x54);
+    g(s, 0x88);
+    g(s, 0x04);
+  }
+  g(s, 0x49);
+  g(s, 0x01);
+  gen_modrm(s, 3, REG_RDX, REG_R10 & 7);
+
+  /* cmp r10, rax; je found; inc ecx; jmp loop */
+  g(s, 0x49);
+  g(s, 0x39);
+  gen_modrm(s, 3, REG_RAX, REG_R10 & 7);
+  found = JCC8(0x74);
+  g(s, 0xff);
+  gen_modrm(s, 3, 0, REG_RCX);
+  g(s, 0xeb);
+  g(s, (uint8_t)(loop - (s->ind + 1)));
+
+  /* found: inc ecx (slots hold number + 1) */
+  PATCH8(found, s->ind);
+  g(s, 0xff);
+  gen_modrm(s, 3, 0, REG_RCX);
+
+  /* mov edx, [r11]; cmp edx, ecx; je hit0; test edx, edx; je new0 */
+  g(s, 0x41);
+  g(s, 0x8b);
+  gen_modrm(s, 0, REG_RDX, REG_R11 & 7);
+  g(s, 0x39);
+  gen_modrm(s, 3, REG_RCX, REG_RDX);
+  hit0 = JCC8(0x74);
+  g(s, 0x85);
+  gen_modrm(s, 3, REG_RDX, REG_RDX);
+  new0 = JCC8(0x74);
+
+  /* the same with [r11 + 16] for the second slot */
+  g(s, 0x41);
+  g(s, 0x8b);
+  gen_modrm(s, 1, REG_RDX, REG_R11 & 7);
+  g(s, 16);
+  g(s, 0x39);
+  gen_modrm(s, 3, REG_RCX, REG_RDX);
+  hit1 = JCC8(0x74);
+  g(s, 0x85);
+  gen_modrm(s, 3, REG_RDX, REG_RDX);
+  new1 = JCC8(0x74);
+
+  /* other: inc qword [r11 + 32]; jmp done */
+  PATCH8(not_found, s->ind);
+  g(s, 0x49);
+  g(s, 0xff);
+  gen_modrm(s, 1, 0, REG_R11 & 7);
+  g(s, 32);
+  done = JCC8(0xeb);
+
+  /* new0: mov [r11], ecx; hit0: inc qword [r11 + 8]; jmp done */
+  PATCH8(new0, s->ind);
+  g(s, 0x41);
+  g(s, 0x89);
+  gen_modrm(s, 0, REG_RCX, REG_R11 & 7);
+  PATCH8(hit0, s->ind);
+  g(s, 0x49);
+  g(s, 0xff);
+  gen_modrm(s, 1, 0, REG_R11 & 7);
+  g(s, 8);
+  i = JCC8(0xeb);
+
+  /* new1: mov [r11 + 16], ecx; hit1: inc qword [r11 + 24] */
+  PATCH8(new1, s->ind);
+  g(s, 0x41);
+  g(s, 0x89);
+  gen_modrm(s, 1, REG_RCX, REG_R11 & 7);
+  g(s, 16);
+  PATCH8(hit1, s->ind);
+  g(s, 0x49);
+  g(s, 0xff);
+  gen_modrm(s, 1, 0, REG_R11 & 7);
+  g(s, 24);
+
+  /* done: pop r10; pop r8; pop rdx; pop rcx; ret */
+  PATCH8(done, s->ind);
+  PATCH8(i, s->ind);
+  g(s, 0x41);
+  g(s, 0x5a);
+  g(s, 0x41);
+  g(s, 0x58);
+  g(s, 0x5a);
+  g(s, 0x59);
+  g(s, 0xc3);
+
+#undef JCC8
+#undef PATCH8
+
+  /* table: one rel32 per function, bound by the layout */
+  p = s->text_section->data + table - 4;
+  *(int32_t *)p = (int32_t)(s->ind - table);
+  for (i = 0; i < nb_funcs; i++) {
+    gen_le32(s, 0);
+    text_add_addr_reloc(s, s->ind - 4, funcs[i]);
+  }
+}
+
+/*============================================================
+ * ABI Entry Points of Private Functions
+ *============================================================*/
+
+/* A private function whose 5th or 6th parameter arrives in R10/R11
+ * cannot be called through a pointer directly. Every reference to its
+ * address (and every call prepared for the ABI) is pointed at a thunk
+ * that loads those two from the caller's stack arguments:
+ *   mov r10, [rsp + 40]; mov r11, [rsp + 48]; jmp func
+ * Functions of up to 4 parameters are their own ABI entry. */
+void gen_abi_thunks(TCCState *s) {
+  Sym **funcs = NULL, **thunks = NULL;
+  int nb = 0;
+  int i, j;
+
+  for (i = 0; i < s->nb_text_relocs; i++) {
+    TextReloc *rel = &s->text_relocs[i];
+    Sym *f = rel->sym;
+
+    if (!rel->abi || !f || !(f->flags & SYM_ABI_THUNK))
+      continue;
+    for (j = 0; j < nb && funcs[j] != f; j++)
+      ;
+    if (j == nb) {
+      Sym *thunk = global_sym_push2(s, NULL, f->t & ~VT_STATIC, VT_CONST,
+                                    s->ind);
+      thunk->sec = s->text_section;
+      funcs = tcc_realloc(funcs, (nb + 1) * sizeof(Sym *));
+      thunks = tcc_realloc(thunks, (nb + 1) * sizeof(Sym *));
+      funcs[nb] = f;
+      thunks[nb++] = thunk;
+
+      s->func_sym = thunk;
+      text_begin_chunk(s, 0);
+      g(s, 0x4c);
+      g(s, 0x8b);
+      g(s, 0x54);
+      g(s, 0x24);
+      g(s, 40);
+      g(s, 0x4c);
+      g(s, 0x8b);
+      g(s, 0x5c);
+      g(s, 0x24);
+      g(s, 48);
+      g(s, 0xe9);
+      gen_le32(s, 0);
+      text_add_reloc(s, s->ind - 4, f);
+      s->func_sym = NULL;
+      rel = &s->text_relocs[i];
+    }
+    rel->sym = thunks[j];
+  }
+
+  tcc_free(funcs);
+  tcc_free(thunks);
+}
+
+/*============================================================
+ * Target Selection (-march, -mtune)
+ *============================================================*/
+
+typedef struct {
+  const char *name;
+  unsigned features; /* CPU_* */
+} X86Arch;
+
+/* The x86-64 psABI micro-architecture levels */
+static const X86Arch x86_archs[] = {
+    {"x86-64", 0},
+    {"x86-64-v2", CPU_POPCNT},
+    {"x86-64-v3", CPU_POPCNT | CPU_LZCNT | CPU_BMI1 | CPU_BMI2 | CPU_MOVBE |
+                      CPU_AVX2},
+};
+
+static const char *const x86_tunes[NB_TUNES] = {
+    [TUNE_GENERIC] = "generic",
+    [TUNE_INTEL] = "intel",
+    [TUNE_AMD] = "amd",
+    [TUNE_ATOM] = "atom",
+};
+
+/* CPUID on the machine running the compiler; zeros elsewhere */
+static void host_cpuid(unsigned leaf, unsigned sub, unsigned regs[4]) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  __cpuidex((int *)regs, (int)leaf, (int)sub);
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#else
+  (void)leaf;
+  (void)sub;
+  regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#endif
+}
+
+/* Whether the OS saves the YMM registers (XCR0 bits 1 and 2) */
+static int host_ymm_enabled(void) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  return (_xgetbv(0) & 6) == 6;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  unsigned lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return (lo & 6) == 6;
+#else
+  return 0;
+#endif
+}
+
+/* Features of the build host, for -march=native */
+static unsigned host_features(void) {
+  unsigned r[4], max, features = 0;
+
+  host_cpuid(0, 0, r);
+  max = r[0];
+  if (max >= 1) {
+    host_cpuid(1, 0, r);
+    if (r[2] & (1u << 23))
+      features |= CPU_POPCNT;
+    if (r[2] & (1u << 22))
+      features |= CPU_MOVBE;
+    /* AVX2 needs OSXSAVE and the OS saving YMM state */
+    if ((r[2] & (1u << 27)) && host_ymm_enabled() && max >= 7) {
+      host_cpuid(7, 0, r);
+      if (r[1] & (1u << 5))
+        features |= CPU_AVX2;
+    }
+  }
+  if (max >= 7) {
+    host_cpuid(7, 0, r);
+    if (r[1] & (1u << 3))
+      features |= CPU_BMI1;
+    if (r[1] & (1u << 8))
+      features |= CPU_BMI2;
+  }
+  host_cpuid(0x80000000, 0, r);
+  if (r[0] >= 0x80000001) {
+    host_cpuid(0x80000001, 0, r);
+    if (r[2] & (1u << 5))
+      features |= CPU_LZCNT;
+  }
+  return features;
+}
+
+/* Tuning for the build host: by vendor, Atom-class cores by family */
+static int host_tune(void) {
+  unsigned r[4];
+  char vendor[13];
+
+  host_cpuid(0, 0, r);
+  memcpy(vendor, &r[1], 4);
+  memcpy(vendor + 4, &r[3], 4);
+  memcpy(vendor + 8, &r[2], 4);
+  vendor[12] = '\0';
+  if (strcmp(vendor, "AuthenticAMD") == 0 ||
+      strcmp(vendor, "HygonGenuine") == 0)
+    return TUNE_AMD;
+  if (strcmp(vendor, "GenuineIntel") == 0) {
+    unsigned model;
+    host_cpuid(1, 0, r);
+    model = ((r[0] >> 4) & 15) | ((r[0] >> 12) & 0xf0);
+    /* Bonnell through Tremont */
+    if (((r[0] >> 8) & 15) == 6 &&
+        (model == 0x1c || model == 0x26 || model == 0x36 || model == 0x37 ||
+         model == 0x4c || model == 0x5c || model == 0x7a || model == 0x86))
+      return TUNE_ATOM;
+    return TUNE_INTEL;
+  }
+  return TUNE_GENERIC;
+}
+
+/* -march=name; -1 for an unknown name */
+int x86_set_arch(TCCState *s, const char *name) {
+  int i;
+
+  if (strcmp(name, "native") == 0) {
+    s->cpu_features = host_features();
+    s->tune = host_tune();
+    return 0;
+  }
+  for (i = 0; i < (int)(sizeof(x86_archs) / sizeof(x86_archs[0])); i++) {
+    if (strcmp(x86_archs[i].name, name) == 0) {
+      s->cpu_features = x86_archs[i].features;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* -mtune=name; -1 for an unknown name */
+int x86_set_tune(TCCState *s, const char *name) {
+  int i;
+
+  if (strcmp(name, "native") == 0) {
+    s->tune = host_tune();
+    return 0;
+  }
+  for (i = 0; i < NB_TUNES; i++) {
+    if (strcmp(x86_tunes[i], name) == 0) {
+      s->tune = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* A target of target_clones: "default", an extension, or "arch=" and
+ * an -march level; -1 for an unknown name */
+int x86_target_features(const char *name, unsigned *features) {
+  static const X86Arch exts[] = {
+      {"default", 0},       {"popcnt", CPU_POPCNT}, {"lzcnt", CPU_LZCNT},
+      {"bmi", CPU_BMI1},    {"bmi2", CPU_BMI2},     {"movbe", CPU_MOVBE},
+      {"avx2", CPU_AVX2},
+  };
+  int i;
+
+  if (strncmp(name, "arch=", 5) == 0) {
+    for (i = 0; i < (int)(sizeof(x86_archs) / sizeof(x86_archs[0])); i++) {
+      if (strcmp(x86_archs[i].name, name + 5) == 0) {
+        *features = x86_archs[i].features;
+        return 0;
+      }
+    }
+    return -1;
+  }
+  for (i = 0; i < (int)(sizeof(exts) / sizeof(exts[0])); i++) {
+    if (strcmp(exts[i].name, name) == 0) {
+      *features = exts[i].features;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*============================================================
+ * Loop Idioms
+ *============================================================*/
+
+/* The string instructions use fixed registers: spill the values held in
+ * them and let the scheduler see the code before */
+static void idiom_begin(TCCState *s) {
+  int i;
+
+  vcheck_cmp(s);
+  for (i = 0; i <= s->vtop - s->vstack; i++) {
+    int r = s->vstack[i].r & VT_VALMASK;
+    if (r < NB_REGS)
+      save_reg(s, r);
+  }
+  sched_flush(s, s->ind);
+}
+
+static void idiom_end(TCCState *s) {
+  reg_content_clear(s);
+  s->sched_start = s->ind;
+}
+
+/* rcx = count > 0 ? count : 0, also stored to index as the value the
+ * loop counter ends with */
+static void idiom_count(TCCState *s, SValue *count, SValue *index) {
+  load(s, REG_RCX, count);
+  /* xor eax, eax; test rcx, rcx; cmovle rcx, rax */
+  g(s, 0x31);
+  g(s, 0xc0);
+  reg_content_kill(s, REG_RAX);
+  gen_rex(s, 1, REG_RCX, 0, REG_RCX);
+  g(s, 0x85);
+  gen_modrm(s, 3, REG_RCX, REG_RCX);
+  gen_rex(s, 1, REG_RCX, 0, REG_RAX);
+  g(s, 0x0f);
+  g(s, 0x4e);
+  gen_modrm(s, 3, REG_RCX, REG_RAX);
+  store(s, REG_RCX, index);
+}
+
+/* shl rcx, log2(size): elements to bytes */
+static void idiom_scale(TCCState *s, int size) {
+  int shift;
+
+  for (shift = 0; (1 << shift) < size; shift++)
+    ;
+  if (shift) {
+    gen_rex(s, 1, 0, 0, REG_RCX);
+    g(s, 0xc1);
+    gen_modrm(s, 3, 4, REG_RCX);
+    g(s, shift);
+    reg_content_kill(s, REG_RCX);
+  }
+}
+
+/* for (i = 0; i < count; i++) dst[i] = src[i];  ->  rep movsb
+ * RSI and RDI are callee-saved in the Windows ABI */
+void gen_loop_copy(TCCState *s, SValue *dst, SValue *src, SValue *count,
+                   SValue *index, int size) {
+  idiom_begin(s);
+  idiom_count(s, count, index);
+  idiom_scale(s, size);
+  g(s, 0x56); /* push rsi */
+  g(s, 0x57); /* push rdi */
+  load(s, REG_RDI, dst);
+  load(s, REG_RSI, src);
+  g(s, 0xf3); /* rep movsb */
+  g(s, 0xa4);
+  g(s, 0x5f); /* pop rdi */
+  g(s, 0x5e); /* pop rsi */
+  idiom_end(s);
+}
+
+/* for (i = 0; i < count; i++) dst[i] = val;  ->  rep stos. Bytes, and
+ * zero of any width, are stored a byte at a time, which the fast string
+ * microcode handles best; other values one element at a time. */
+void gen_loop_fill(TCCState *s, SValue *dst, SValue *val, SValue *count,
+                   SValue *index, int size) {
+  int bytes = size == 1 || ((val->r & (VT_VALMASK | VT_LVAL | VT_SYM)) ==
+                                VT_CONST &&
+                            val->c.i == 0);
+
+  idiom_begin(s);
+  idiom_count(s, count, index);
+  if (bytes)
+    idiom_scale(s, size);
+  g(s, 0x57); /* push rdi */
+  load(s, REG_RDI, dst);
+  load(s, REG_RAX, val);
+  g(s, 0xf3); /* rep stos */
+  if (bytes) {
+    g(s, 0xaa);
+  } else {
+    if (size == 2)
+      g(s, 0x66);
+    else if (size == 8)
+      g(s, 0x48);
+    g(s, 0xab);
+  }
+  g(s, 0x5f); /* pop rdi */
+  idiom_end(s);
+}
+
+/* while (*p) p++;  ->  SSE2 scan 16 bytes at a time. The loads are
+ * aligned, so they stay in the pages the string is in; the bytes before
+ * p in the first block are masked off. */
+void gen_strlen_scan(TCCState *s, SValue *p) {
+  static const uint8_t scan[] = {
+      0x48, 0x89, 0xc1,       /* mov rcx, rax */
+      0x83, 0xe1, 0x0f,       /* and ecx, 15 */
+      0x48, 0x83, 0xe0, 0xf0, /* and rax, -16 */
+      0x66, 0x0f, 0xef, 0xc0, /* pxor xmm0, xmm0 */
+      0x66, 0x0f, 0x6f, 0x08, /* movdqa xmm1, [rax] */
+      0x66, 0x0f, 0x74, 0xc8, /* pcmpeqb xmm1, xmm0 */
+      0x66, 0x0f, 0xd7, 0xd1, /* pmovmskb edx, xmm1 */
+      0xd3, 0xea,             /* shr edx, cl */
+      0xd3, 0xe2,             /* shl edx, cl */
+      0xeb, 0x10,             /* jmp test */
+      /* loop: */
+      0x48, 0x83, 0xc0, 0x10, /* add rax, 16 */
+      0x66, 0x0f, 0x6f, 0x08, /* movdqa xmm1, [rax] */
+      0x66, 0x0f, 0x74, 0xc8, /* pcmpeqb xmm1, xmm0 */
+      0x66, 0x0f, 0xd7, 0xd1, /* pmovmskb edx, xmm1 */
+      /* test: */
+      0x85, 0xd2,             /* test edx, edx */
+      0x74, 0xec,             /* jz loop */
+      0x0f, 0xbc, 0xd2,       /* bsf edx, edx */
+      0x48, 0x01, 0xd0,       /* add rax, rdx */
+  };
+  size_t i;
+
+  idiom_begin(s);
+  load(s, REG_RAX, p);
+  for (i = 0; i < sizeof(scan); i++)
+    g(s, scan[i]);
+  store(s, REG_RAX, p);
+  idiom_end(s);
+}
+
+/*============================================================
+ * Function Multiversioning
+ *============================================================*/
+
+/* Short conditional jump to be patched by jcc8_here() */
+static int gen_jcc8(TCCState *s, int op) {
+  g(s, op);
+  g(s, 0);
+  return s->ind;
+}
+
+static void jcc8_here(TCCState *s, int at) {
+  s->text_section->data[at - 1] = (uint8_t)(s->ind - at);
+}
+
+/* Body of a target_clones function: jmp qword [rip + slot] */
+void gen_clone_stub(TCCState *s, CloneSet *cs) {
+  while (s->data_section->data_size & 7)
+    *(uint8_t *)section_ptr_add(s->data_section, 1) = 0;
+  cs->slot = (uint32_t)s->data_section->data_size;
+  memset(section_ptr_add(s->data_section, 8), 0, 8);
+
+  g(s, 0xff);
+  gen_modrm(s, 0, 4, REG_RBP);
+  gen_rip_ref(s, s->data_section, cs->slot);
+}
+
+/* test reg32, 1 << bit; jz skip; or r8d, feature */
+static void gen_cpuid_bit(TCCState *s, int reg, int bit, unsigned feature) {
+  int skip;
+
+  gen_rex(s, 0, 0, 0, reg);
+  g(s, 0xf7);
+  gen_modrm(s, 3, 0, reg);
+  gen_le32(s, 1u << bit);
+  skip = gen_jcc8(s, 0x74);
+  gen_rex(s, 0, 0, 0, REG_R8);
+  g(s, 0x83);
+  gen_modrm(s, 3, 1, REG_R8);
+  g(s, feature);
+  jcc8_here(s, skip);
+}
+
+/* mov eax, imm32; xor ecx, ecx; cpuid */
+static void gen_cpuid(TCCState *s, uint32_t leaf) {
+  g(s, 0xb8);
+  gen_le32(s, leaf);
+  g(s, 0x31);
+  gen_modrm(s, 3, REG_RCX, REG_RCX);
+  g(s, 0x0f);
+  g(s, 0xa2);
+}
+
+/* Start-up code run before the entry point when there are clones: one
+ * pass of CPUID collects the CPU_* features in R8D, then every clone
+ * slot gets the first variant whose features are all present */
+int gen_clone_resolver(TCCState *s) {
+  int skip7, skip_ext, no_avx[3];
+  Sym *entry, *start;
+  int i, j;
+
+  if (!s->nb_clone_sets)
+    return 0;
+
+  entry = global_sym_find2(s, s->entry_name);
+  if (!entry || entry->sec != s->text_section) {
+    tcc_error(s, "target_clones needs a '%s' function", s->entry_name);
+    return -1;
+  }
+
+  start = global_sym_push2(s, "__tcc_clone_init", VT_FUNC | VT_INT, VT_CONST,
+                           s->ind);
+  start->sec = s->text_section;
+  s->func_sym = start;
+  text_begin_chunk(s, 0);
+
+  /* push rbx (cpuid writes it); xor r8d, r8d */
+  g(s, 0x53);
+  gen_rex(s, 0, REG_R8, 0, REG_R8);
+  g(s, 0x31);
+  gen_modrm(s, 3, REG_R8, REG_R8);
+
+  /* Highest leaf in r9d, leaf 1 ECX in r10d */
+  gen_cpuid(s, 0);
+  gen_rex(s, 0, REG_RAX, 0, REG_R9);
+  g(s, 0x89);
+  gen_modrm(s, 3, REG_RAX, REG_R9);
+  gen_cpuid(s, 1);
+  gen_rex(s, 0, REG_RCX, 0, REG_R10);
+  g(s, 0x89);
+  gen_modrm(s, 3, REG_RCX, REG_R10);
+  gen_cpuid_bit(s, REG_RCX, 23, CPU_POPCNT);
+  gen_cpuid_bit(s, REG_RCX, 22, CPU_MOVBE);
+
+  /* Leaf 7: BMI1, BMI2, and AVX2 if the OS saves YMM (OSXSAVE, XCR0) */
+  gen_rex(s, 0, 0, 0, REG_R9);
+  g(s, 0x83);
+  gen_modrm(s, 3, 7, REG_R9);
+  g(s, 7);
+  skip7 = gen_jcc8(s, 0x72);
+  gen_cpuid(s, 7);
+  gen_cpuid_bit(s, REG_RBX, 3, CPU_BMI1);
+  gen_cpuid_bit(s, REG_RBX, 8, CPU_BMI2);
+  g(s, 0xf7);
+  gen_modrm(s, 3, 0, REG_RBX);
+  gen_le32(s, 1u << 5);
+  no_avx[0] = gen_jcc8(s, 0x74);
+  gen_rex(s, 0, 0, 0, REG_R10);
+  g(s, 0xf7);
+  gen_modrm(s, 3, 0, REG_R10);
+  gen_le32(s, 1u << 27);
+  no_avx[1] = gen_jcc8(s, 0x74);
+  g(s, 0x31);
+  gen_modrm(s, 3, REG_RCX, REG_RCX);
+  g(s, 0x0f); /* xgetbv */
+  g(s, 0x01);
+  g(s, 0xd0);
+  g(s, 0x83); /* and eax, 6; cmp eax, 6 */
+  gen_modrm(s, 3, 4, REG_RAX);
+  g(s, 6);
+  g(s, 0x83);
+  gen_modrm(s, 3, 7, REG_RAX);
+  g(s, 6);
+  no_avx[2] = gen_jcc8(s, 0x75);
+  gen_rex(s, 0, 0, 0, REG_R8);
+  g(s, 0x83);
+  gen_modrm(s, 3, 1, REG_R8);
+  g(s, CPU_AVX2);
+  for (i = 0; i < 3; i++)
+    jcc8_here(s, no_avx[i]);
+  jcc8_here(s, skip7);
+
+  /* Extended leaf 0x80000001: LZCNT */
+  gen_cpuid(s, 0x80000000);
+  g(s, 0x3d);
+  gen_le32(s, 0x80000001);
+  skip_ext = gen_jcc8(s, 0x72);
+  gen_cpuid(s, 0x80000001);
+  gen_cpuid_bit(s, REG_RCX, 5, CPU_LZCNT);
+  jcc8_here(s, skip_ext);
+
+  for (i = 0; i < s->nb_clone_sets; i++) {
+    CloneSet *cs = &s->clone_sets[i];
+    int store[MAX_CLONES];
+    int nb_store = 0;
+
+    for (j = 0; j < cs->nb_variants; j++) {
+      int next = 0;
+      if (cs->features[j]) {
+        /* mov eax, r8d; and eax, m; cmp eax, m; jne next */
+        gen_rex(s, 0, REG_R8, 0, REG_RAX);
+        g(s, 0x89);
+        gen_modrm(s, 3, REG_R8, REG_RAX);
+        g(s, 0x25);
+        gen_le32(s, cs->features[j]);
+        g(s, 0x3d);
+        gen_le32(s, cs->features[j]);
+        next = gen_jcc8(s, 0x75);
+      }
+      /* lea rax, [rip + variant] */
+      gen_rex(s, 1, REG_RAX, 0, 0);
+      g(s, 0x8d);
+      gen_modrm(s, 0, REG_RAX, REG_RBP);
+      gen_le32(s, 0);
+      text_add_addr_reloc(s, s->ind - 4, cs->variant[j]);
+      if (!next)
+        break;
+      store[nb_store++] = gen_jcc8(s, 0xeb);
+      jcc8_here(s, next);
+    }
+    for (j = 0; j < nb_store; j++)
+      jcc8_here(s, store[j]);
+
+    /* mov [rip + slot], rax */
+    gen_rex(s, 1, REG_RAX, 0, 0);
+    g(s, 0x89);
+    gen_modrm(s, 0, REG_RAX, REG_RBP);
+    gen_rip_ref(s, s->data_section, cs->slot);
+  }
+
+  /* pop rbx; jmp entry */
+  g(s, 0x5b);
+  g(s, 0xe9);
+  gen_le32(s, 0);
+  text_add_reloc(s, s->ind - 4, entry);
+
+  s->func_sym = NULL;
+  s->entry_name = "__tcc_clone_init";
+  return 0;
 }
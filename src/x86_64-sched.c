@@ -0,0 +1,497 @@
+/*
+ * TCC - Tiny C Compiler
+ *
+ * x86-64 instruction scheduling: a list scheduler over the straight-line
+ * code between labels and branches.
+ *
+ * Code is written out as it is parsed, so the scheduler works on the
+ * machine code of a block once its end is reached: it decodes the
+ * instruction forms the code generator emits, builds the dependences
+ * (registers, flags, stack slots and other memory) and lays the block
+ * out again in list-schedule order, using the latencies of the -mtune
+ * core. The block keeps its length and what must not move keeps its
+ * place: branches, calls, pushes and pops, instructions that carry a
+ * relocation, and the targets of short jumps inside the block. A block
+ * with an instruction the decoder does not know is left alone.
+ *
+ * Laying a block out again moves code across positions the parser may
+ * have marked inside it, so a flush that schedules a block raises
+ * sched_barrier to its end: text must not be cut back below it, since
+ * what lies before the cut is no longer the code emitted up to there.
+ */
+
+#include "tcc.h"
+
+#define SCHED_MAX_INSNS 256
+#define SCHED_FLAGS (1u << 16) /* the flags, as one more register */
+#define SCHED_NO_DEP 0xff
+
+#define MEM_LOAD 1
+#define MEM_STORE 2
+
+/* Latency classes */
+enum { LAT_ALU, LAT_LOAD, LAT_MUL, LAT_DIV, LAT_BITOP, NB_LATS };
+
+typedef struct {
+  uint8_t lat[NB_LATS]; /* cycles until the result can be used */
+  int width;            /* instructions issued per cycle */
+} SchedModel;
+
+static const SchedModel sched_models[NB_TUNES] = {
+    [TUNE_GENERIC] = {{1, 5, 3, 26, 3}, 4},
+    [TUNE_INTEL] = {{1, 5, 3, 26, 3}, 4},
+    [TUNE_AMD] = {{1, 4, 3, 14, 1}, 4},
+    [TUNE_ATOM] = {{1, 3, 5, 30, 3}, 2},
+};
+
+typedef struct {
+  int offset, len;
+  uint32_t use, def; /* bit n for register n, and SCHED_FLAGS */
+  int mem;           /* MEM_LOAD | MEM_STORE */
+  int slot_known;    /* the memory is the stack slot [rbp + slot] */
+  int slot;
+  int lat;   /* LAT_* */
+  int fixed; /* keeps its place */
+  int jump;  /* rel8 jump: target offset, else -1 */
+} SchedInsn;
+
+/*============================================================
+ * Decoding
+ *============================================================*/
+
+/* ModRM operand at p: sets *reg (with REX.R) and *rm, the register
+ * for mod 3 or -1 for memory, whose address registers are used. Returns
+ * the length of ModRM, SIB and displacement. */
+static int sched_modrm(const uint8_t *p, int rex, SchedInsn *in, int *reg,
+                       int *rm) {
+  int mod = p[0] >> 6, base = (p[0] & 7) | (rex & 1) << 3, len = 1;
+  int index = -1, disp = 0;
+
+  *reg = (p[0] >> 3 & 7) | (rex & 4) << 1;
+  *rm = -1;
+  if (mod == 3) {
+    *rm = base;
+    return 1;
+  }
+
+  if ((base & 7) == 4) {
+    index = (p[1] >> 3 & 7) | (rex & 2) << 2;
+    base = (p[1] & 7) | (rex & 1) << 3;
+    len++;
+    if (index == REG_RSP)
+      index = -1;
+    if ((base & 7) == REG_RBP && mod == 0) {
+      base = -1;
+      mod = 2;
+    }
+  } else if ((base & 7) == REG_RBP && mod == 0) {
+    /* RIP-relative: refers to another section through a relocation */
+    in->fixed = 1;
+    return len + 4;
+  }
+
+  if (mod == 1)
+    disp = (int8_t)p[len];
+  else if (mod == 2)
+    disp = (int32_t)(p[len] | p[len + 1] << 8 | p[len + 2] << 16 |
+                     (uint32_t)p[len + 3] << 24);
+  len += mod == 1 ? 1 : mod == 2 ? 4 : 0;
+
+  if (base >= 0)
+    in->use |= 1u << base;
+  if (index >= 0)
+    in->use |= 1u << index;
+  in->slot_known = base == REG_RBP && index < 0;
+  in->slot = disp;
+  return len;
+}
+
+/* Operand rm of an instruction that reads it (and writes it if def) */
+static void sched_rm(SchedInsn *in, int rm, int def) {
+  if (rm < 0) {
+    in->mem |= def ? MEM_LOAD | MEM_STORE : MEM_LOAD;
+    in->lat = LAT_LOAD;
+  } else {
+    in->use |= 1u << rm;
+    if (def)
+      in->def |= 1u << rm;
+  }
+}
+
+/* Decode one instruction; 0 for a form the code generator does not
+ * emit (the buffer is padded, so reading past the block is safe) */
+static int sched_decode(const uint8_t *p, SchedInsn *in) {
+  int i = 0, rex = 0, rep = 0, op, reg, rm, ext;
+
+  memset(in, 0, sizeof(*in));
+  in->jump = -1;
+  if (p[i] == 0x66)
+    i++;
+  if (p[i] == 0xf3) {
+    rep = 1;
+    i++;
+  }
+  if ((p[i] & 0xf0) == 0x40)
+    rex = p[i++];
+  op = p[i++];
+
+  switch (op) {
+  case 0x01: /* add, or, and, sub, xor r/m, r */
+  case 0x09:
+  case 0x21:
+  case 0x29:
+  case 0x31:
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    in->def |= SCHED_FLAGS;
+    if ((op == 0x31 || op == 0x29) && rm == reg) {
+      in->def |= 1u << reg; /* zero idiom */
+      break;
+    }
+    in->use |= 1u << reg;
+    sched_rm(in, rm, 1);
+    break;
+
+  case 0x39: /* cmp, test r/m, r */
+  case 0x85:
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    in->use |= 1u << reg;
+    in->def |= SCHED_FLAGS;
+    sched_rm(in, rm, 0);
+    break;
+
+  case 0x88: /* mov r/m, r */
+  case 0x89:
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    in->use |= 1u << reg;
+    if (rm < 0) {
+      in->mem = MEM_STORE;
+    } else {
+      /* A byte move keeps the rest of the destination */
+      in->def |= 1u << rm;
+      if (op == 0x88)
+        in->use |= 1u << rm;
+    }
+    break;
+
+  case 0x8b: /* mov r, r/m */
+  case 0x63: /* movsxd r, r/m */
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    sched_rm(in, rm, 0);
+    in->def |= 1u << reg;
+    break;
+
+  case 0x8d: /* lea r, m */
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    in->def |= 1u << reg;
+    in->slot_known = 0;
+    if (rm >= 0)
+      return 0;
+    break;
+
+  case 0xc7: /* mov r/m, imm32 */
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    i += 4;
+    if (rm < 0)
+      in->mem = MEM_STORE;
+    else
+      in->def |= 1u << rm;
+    break;
+
+  case 0x83: /* op r/m, imm8 */
+  case 0x81: /* op r/m, imm32 */
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    i += op == 0x83 ? 1 : 4;
+    in->def |= SCHED_FLAGS;
+    sched_rm(in, rm, (reg & 7) != 7);
+    break;
+
+  case 0xc1: /* shift r/m, imm8 */
+  case 0xd3: /* shift r/m, cl: flags unchanged for a zero count */
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    if (op == 0xc1)
+      i++;
+    else
+      in->use |= 1u << REG_RCX | SCHED_FLAGS;
+    in->def |= SCHED_FLAGS;
+    sched_rm(in, rm, 1);
+    break;
+
+  case 0xf7:
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    ext = reg & 7;
+    if (ext == 0) { /* test r/m, imm32 */
+      i += 4;
+      in->def |= SCHED_FLAGS;
+      sched_rm(in, rm, 0);
+    } else if (ext == 2 || ext == 3) { /* not, neg */
+      if (ext == 3)
+        in->def |= SCHED_FLAGS;
+      sched_rm(in, rm, 1);
+    } else if (ext >= 4) { /* mul, imul, div, idiv */
+      sched_rm(in, rm, 0);
+      in->use |= 1u << REG_RAX | (ext >= 6 ? 1u << REG_RDX : 0);
+      in->def |= 1u << REG_RAX | 1u << REG_RDX | SCHED_FLAGS;
+      in->lat = ext >= 6 ? LAT_DIV : LAT_MUL;
+    } else {
+      return 0;
+    }
+    break;
+
+  case 0x99: /* cqo, cdq */
+    in->use |= 1u << REG_RAX;
+    in->def |= 1u << REG_RDX;
+    break;
+
+  case 0x0f:
+    op = p[i++];
+    if (op == 0xaf) { /* imul r, r/m */
+      i += sched_modrm(p + i, rex, in, &reg, &rm);
+      sched_rm(in, rm, 0);
+      in->use |= 1u << reg;
+      in->def |= 1u << reg | SCHED_FLAGS;
+      in->lat = LAT_MUL;
+    } else if (op == 0xb6 || op == 0xb7 || op == 0xbe || op == 0xbf) {
+      i += sched_modrm(p + i, rex, in, &reg, &rm); /* movzx, movsx */
+      sched_rm(in, rm, 0);
+      in->def |= 1u << reg;
+    } else if (op >= 0x90 && op <= 0x9f) { /* setcc r/m8 */
+      i += sched_modrm(p + i, rex, in, &reg, &rm);
+      in->use |= SCHED_FLAGS;
+      if (rm < 0)
+        in->mem = MEM_STORE;
+      else
+        sched_rm(in, rm, 1);
+    } else if ((op == 0xb8 && rep) || op == 0xbc || op == 0xbd) {
+      /* popcnt, tzcnt/bsf, lzcnt/bsr; bsf and bsr keep the destination
+         for a zero source */
+      i += sched_modrm(p + i, rex, in, &reg, &rm);
+      sched_rm(in, rm, 0);
+      if (!rep)
+        in->use |= 1u << reg;
+      in->def |= 1u << reg | SCHED_FLAGS;
+      in->lat = LAT_BITOP;
+    } else if (op >= 0x40 && op <= 0x4f) { /* cmovcc r, r/m */
+      i += sched_modrm(p + i, rex, in, &reg, &rm);
+      sched_rm(in, rm, 0);
+      in->use |= 1u << reg | SCHED_FLAGS;
+      in->def |= 1u << reg;
+    } else if (op >= 0xc8 && op <= 0xcf) { /* bswap r */
+      reg = (op & 7) | (rex & 1) << 3;
+      in->use |= 1u << reg;
+      in->def |= 1u << reg;
+    } else if (op == 0x38 && (p[i] == 0xf0 || p[i] == 0xf1)) {
+      op = p[i++]; /* movbe */
+      i += sched_modrm(p + i, rex, in, &reg, &rm);
+      if (rm >= 0)
+        return 0;
+      if (op == 0xf0) {
+        sched_rm(in, rm, 0);
+        in->def |= 1u << reg;
+      } else {
+        in->use |= 1u << reg;
+        in->mem = MEM_STORE;
+      }
+    } else if (op >= 0x80 && op <= 0x8f) { /* jcc rel32 */
+      i += 4;
+      in->fixed = 1;
+    } else {
+      return 0;
+    }
+    break;
+
+  case 0xc4: { /* VEX: shlx, sarx, shrx */
+    int b1 = p[i], b2 = p[i + 1], vreg = ~b2 >> 3 & 15;
+    rex = (b1 & 0x80 ? 0 : 4) | (b1 & 0x40 ? 0 : 2) | (b1 & 0x20 ? 0 : 1);
+    if ((b1 & 0x1f) != 2 || p[i + 2] != 0xf7 || (b2 & 3) == 0)
+      return 0;
+    i += 3;
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    sched_rm(in, rm, 0);
+    in->use |= 1u << vreg;
+    in->def |= 1u << reg;
+  } break;
+
+  case 0x70: case 0x71: case 0x72: case 0x73: /* jcc rel8, jmp rel8 */
+  case 0x74: case 0x75: case 0x76: case 0x77:
+  case 0x78: case 0x79: case 0x7a: case 0x7b:
+  case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+  case 0xeb:
+    in->jump = i + 1 + (int8_t)p[i];
+    i++;
+    in->fixed = 1;
+    break;
+
+  case 0xe8: /* call, jmp rel32 */
+  case 0xe9:
+    i += 4;
+    in->fixed = 1;
+    break;
+
+  case 0xff: /* inc, call, jmp, push r/m */
+    i += sched_modrm(p + i, rex, in, &reg, &rm);
+    in->fixed = 1;
+    break;
+
+  case 0xc3: /* ret */
+    in->fixed = 1;
+    break;
+
+  default:
+    if (op >= 0xb8 && op <= 0xbf) { /* mov r, imm */
+      in->def |= 1u << ((op & 7) | (rex & 1) << 3);
+      i += rex & 8 ? 8 : 4;
+    } else if (op >= 0x50 && op <= 0x5f) { /* push, pop */
+      in->fixed = 1;
+    } else {
+      return 0;
+    }
+    break;
+  }
+
+  in->len = i;
+  return i;
+}
+
+/*============================================================
+ * Scheduling
+ *============================================================*/
+
+/* Cycles from a to b, SCHED_NO_DEP when b does not depend on a. Only
+ * a result read by b costs latency; other dependences keep the order. */
+static int sched_dep(const SchedModel *m, SchedInsn *a, SchedInsn *b) {
+  int lat = SCHED_NO_DEP;
+
+  if (a->fixed || b->fixed || (a->use & b->def) || (a->def & b->def))
+    lat = 0;
+  if (a->mem && b->mem && ((a->mem | b->mem) & MEM_STORE) &&
+      (!a->slot_known || !b->slot_known ||
+       (a->slot < b->slot + 8 && b->slot < a->slot + 8))) {
+    /* A load after a store gets the value forwarded */
+    lat = (a->mem & MEM_STORE) && (b->mem & MEM_LOAD) ? m->lat[LAT_LOAD] : 0;
+  }
+  if ((a->def & b->use) && (lat == SCHED_NO_DEP || m->lat[a->lat] > lat))
+    lat = m->lat[a->lat];
+  return lat;
+}
+
+static void sched_block(TCCState *s, int start, int end) {
+  const SchedModel *m = &sched_models[s->tune];
+  SchedInsn insns[SCHED_MAX_INSNS];
+  int height[SCHED_MAX_INSNS], ready[SCHED_MAX_INSNS];
+  int npred[SCHED_MAX_INSNS], order[SCHED_MAX_INSNS];
+  uint8_t *code, *dep;
+  int n = 0, off, i, j, k, r, cycle, issued, moved = 0;
+
+  code = tcc_malloc(end - start + 16);
+  memcpy(code, s->text_section->data + start, end - start);
+  memset(code + end - start, 0, 16);
+
+  for (off = 0; off < end - start; off += insns[n++].len) {
+    if (n == SCHED_MAX_INSNS || !sched_decode(code + off, &insns[n]))
+      goto done;
+    insns[n].offset = off;
+    if (insns[n].jump >= 0)
+      insns[n].jump += off;
+  }
+  if (off != end - start)
+    goto done;
+
+  /* Relocation sites and the targets of jumps stay where they are */
+  for (r = s->nb_text_relocs - 1;
+       r >= 0 && (int)s->text_relocs[r].offset >= start; r--) {
+    for (i = 0; i < n; i++) {
+      if ((int)s->text_relocs[r].offset < start + insns[i].offset +
+                                              insns[i].len)
+        break;
+    }
+    if (i < n)
+      insns[i].fixed = 1;
+  }
+  for (i = 0; i < n; i++) {
+    if (insns[i].jump < 0 || insns[i].jump >= end - start)
+      continue;
+    for (j = 0; j < n && insns[j].offset != insns[i].jump; j++)
+      ;
+    if (j == n)
+      goto done;
+    insns[j].fixed = 1;
+  }
+
+  /* Dependences, and the longest latency path to the block end */
+  dep = tcc_malloc(n * n);
+  for (i = 0; i < n; i++) {
+    npred[i] = 0;
+    ready[i] = 0;
+    for (j = 0; j < i; j++) {
+      dep[j * n + i] = (uint8_t)sched_dep(m, &insns[j], &insns[i]);
+      if (dep[j * n + i] != SCHED_NO_DEP)
+        npred[i]++;
+    }
+  }
+  for (i = n - 1; i >= 0; i--) {
+    height[i] = m->lat[insns[i].lat];
+    for (j = i + 1; j < n; j++) {
+      if (dep[i * n + j] != SCHED_NO_DEP && dep[i * n + j] + height[j] >
+                                                height[i])
+        height[i] = dep[i * n + j] + height[j];
+    }
+  }
+
+  /* Each cycle, issue the ready instructions on the longest paths */
+  cycle = 0;
+  issued = 0;
+  for (k = 0; k < n;) {
+    int best = -1;
+    for (i = 0; i < n; i++) {
+      if (npred[i] == 0 && ready[i] <= cycle &&
+          (best < 0 || height[i] > height[best]))
+        best = i;
+    }
+    if (best < 0) {
+      cycle++;
+      issued = 0;
+      continue;
+    }
+    order[k++] = best;
+    npred[best] = -1;
+    moved |= best != k - 1;
+    for (j = best + 1; j < n; j++) {
+      if (dep[best * n + j] == SCHED_NO_DEP)
+        continue;
+      npred[j]--;
+      if (cycle + dep[best * n + j] > ready[j])
+        ready[j] = cycle + dep[best * n + j];
+    }
+    if (++issued == m->width) {
+      cycle++;
+      issued = 0;
+    }
+  }
+  tcc_free(dep);
+
+  if (moved) {
+    uint8_t *p = s->text_section->data + start;
+    for (k = 0; k < n; k++) {
+      memcpy(p, code + insns[order[k]].offset, insns[order[k]].len);
+      p += insns[order[k]].len;
+    }
+  }
+
+done:
+  tcc_free(code);
+}
+
+/* The block since the last call ends at end: schedule it. Called at
+ * labels, branches and function boundaries; the code from end on (a
+ * compare whose flags a branch is about to use) stays put. */
+void sched_flush(TCCState *s, int end) {
+  int start = s->sched_start;
+
+  s->sched_start = s->ind;
+  if (!s->pass[PASS_SCHEDULE] || end - start < 2)
+    return;
+  sched_block(s, start, end);
+  s->sched_barrier = end;
+  /* Compare positions kept for the zero idiom are stale now */
+  s->cmp_end = -1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Reentrancy stress test, built with the host compiler against the
+ * compiler sources (see CMakeLists.txt).
+ *
+ * Every test program given on the command line is compiled at -O0,
+ * -O2 and -Os, first one at a time and then by 16 threads at once,
+ * each compilation in its own TCCState. The objects built on the
+ * threads must be byte-identical to the serial ones.
+ */
+
+#include "tcc.h"
+
+#define NB_THREADS 16
+#define NB_ROUNDS 4
+
+static const int stress_levels[][2] = {{0, 0}, {2, 0}, {2, 1}};
+
+#define NB_LEVELS (int)(sizeof(stress_levels) / sizeof(stress_levels[0]))
+
+typedef struct {
+  const char *file;
+  int level;
+  int size;
+  Section obj; /* serial result */
+  int status;
+} StressJob;
+
+typedef struct {
+  StressJob *jobs;
+  int nb_jobs;
+  int failures[NB_THREADS];
+  int compiled[NB_THREADS];
+} Stress;
+
+static int stress_compile(const StressJob *job, Section *obj) {
+  TCCState *s = tcc_new();
+  int ret;
+
+  tcc_set_opt_level(s, job->level, job->size);
+  ret = tcc_compile_object(s, job->file, obj);
+  tcc_delete(s);
+  return ret;
+}
+
+/* Every thread compiles all jobs each round, starting at a different
+   one so that different inputs are in flight together */
+static void stress_worker(void *arg, int worker) {
+  Stress *st = arg;
+  int round, k;
+
+  for (round = 0; round < NB_ROUNDS; round++) {
+    for (k = 0; k < st->nb_jobs; k++) {
+      StressJob *job = &st->jobs[(worker * 7 + round * 3 + k) % st->nb_jobs];
+      Section obj;
+      int ret;
+
+      if (job->status < 0)
+        continue;
+      ret = stress_compile(job, &obj);
+      if (ret < 0 || obj.data_size != job->obj.data_size ||
+          memcmp(obj.data, job->obj.data, obj.data_size) != 0) {
+        fprintf(stderr, "thread %d: %s -O%d%s differs from serial output\n",
+                worker, job->file, job->level, job->size ? "s" : "");
+        st->failures[worker]++;
+      }
+      st->compiled[worker]++;
+      tcc_free(obj.data);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  Stress st;
+  int i, nb_compiled = 0, nb_failures = 0, nb_skipped = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: stress_threads test.c...\n");
+    return 2;
+  }
+  memset(&st, 0, sizeof(st));
+  st.nb_jobs = (argc - 1) * NB_LEVELS;
+  st.jobs = tcc_malloc(st.nb_jobs * sizeof(StressJob));
+  memset(st.jobs, 0, st.nb_jobs * sizeof(StressJob));
+
+  /* Reference objects; programs that need a link (target_clones) are
+     left out */
+  for (i = 0; i < st.nb_jobs; i++) {
+    StressJob *job = &st.jobs[i];
+
+    job->file = argv[1 + i / NB_LEVELS];
+    job->level = stress_levels[i % NB_LEVELS][0];
+    job->size = stress_levels[i % NB_LEVELS][1];
+    job->status = stress_compile(job, &job->obj);
+    if (job->status < 0)
+      nb_skipped++;
+  }
+
+  tcc_parallel(NB_THREADS, stress_worker, &st);
+
+  for (i = 0; i < NB_THREADS; i++) {
+    nb_compiled += st.compiled[i];
+    nb_failures += st.failures[i];
+  }
+  printf("%d compilations on %d threads, %d differing, %d inputs skipped\n",
+         nb_compiled, NB_THREADS, nb_failures, nb_skipped);
+
+  for (i = 0; i < st.nb_jobs; i++)
+    tcc_free(st.jobs[i].obj.data);
+  tcc_free(st.jobs);
+  return nb_failures ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+/* Incremental relink test: the script edits scale() between links */
+static int scale(int x) { return x * 3; }
+
+static int sum(int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++)
+    s = s + scale(i);
+  return s;
+}
+
+static int twice(int x) { return x + x; }
+
+int main() { return twice(sum(4)) - 36; }
@@ -0,0 +1,16 @@
+/* The functions of app.c in another order: an image of the same size
+   with another layout */
+static int twice(int x) { return x + x; }
+
+static int scale(int x) { return x * 3; }
+
+static int sum(int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++)
+    s = s + scale(i);
+  return s;
+}
+
+int main() { return twice(sum(4)) - 36; }
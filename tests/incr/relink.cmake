@@ -0,0 +1,41 @@
+# An incremental link must not patch an executable that another link
+# replaced: link app.exe with -incremental, put an image of the same size
+# with another layout in its place, edit one function and link again.
+# The result must be the image a full write gives.
+#
+# cmake -DTCC=tcc -DSRC=tests/incr -DWORK=dir -P relink.cmake
+
+function(run_tcc)
+  execute_process(COMMAND ${TCC} ${ARGN} WORKING_DIRECTORY ${WORK}
+                  RESULT_VARIABLE ret OUTPUT_QUIET)
+  if(NOT ret EQUAL 0)
+    message(FATAL_ERROR "tcc ${ARGN} failed")
+  endif()
+endfunction()
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+file(READ ${SRC}/app.c app)
+string(REPLACE "x * 3" "x * 3 + 1" edit "${app}")
+file(WRITE ${WORK}/edit.c "${edit}")
+
+run_tcc(-incremental ${SRC}/app.c -o app.exe)
+run_tcc(-incremental ${SRC}/other.c -o other.exe)
+file(SIZE ${WORK}/app.exe app_size)
+file(SIZE ${WORK}/other.exe other_size)
+if(NOT app_size EQUAL other_size)
+  message(FATAL_ERROR "other.exe is not the size of app.exe")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy other.exe app.exe
+                WORKING_DIRECTORY ${WORK})
+
+# ref.exe: the same link with the same database, written in full
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy app.ilk ref.ilk
+                WORKING_DIRECTORY ${WORK})
+run_tcc(-incremental edit.c -o ref.exe)
+run_tcc(-incremental edit.c -o app.exe)
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/app.exe
+                        ${WORK}/ref.exe RESULT_VARIABLE diff)
+if(NOT diff EQUAL 0)
+  message(FATAL_ERROR "app.exe was patched over another link's image")
+endif()
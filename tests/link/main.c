@@ -0,0 +1,12 @@
+/* Two files linked into one program; util.c may come as source or as
+ * an object from -c:
+ *   tcc -c tests/link/util.c -o util.obj
+ *   tcc tests/link/main.c util.obj -o link.exe
+ * Expected exit code: 42 */
+
+int triple(int x);
+int sub(int a, int b);
+
+int main() {
+  return sub(triple(15), 3);
+}
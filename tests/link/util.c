@@ -0,0 +1,13 @@
+/* Functions called from main.c across the link */
+
+static int scale(int x) {
+  return x * 3;
+}
+
+int triple(int x) {
+  return scale(x);
+}
+
+int sub(int a, int b) {
+  return a - b;
+}
@@ -0,0 +1,20 @@
+/* Two files optimized as one program; util.c may come as source or as
+ * an object from -flto -c:
+ *   tcc -flto -c tests/lto/util.c -o util.obj
+ *   tcc -O2 -flto tests/lto/main.c util.obj -o lto.exe
+ * Both files have a static scale(), each its own. The calls of square()
+ * fold although it is defined in the other file, unused() is dropped
+ * and sum6() takes all its arguments in registers.
+ * Expected exit code: 42 */
+
+static int scale(int x) {
+  return x * 2;
+}
+
+int square(int x);
+int triple(int x);
+int sum6(int a, int b, int c, int d, int e, int f);
+
+int main() {
+  return square(5) + triple(scale(1)) + sum6(1, 1, 1, 1, 1, scale(3));
+}
@@ -0,0 +1,21 @@
+/* Functions main.c calls across the module */
+
+static int scale(int x) {
+  return x * 3;
+}
+
+int square(int x) {
+  return x * x;
+}
+
+int triple(int x) {
+  return scale(x);
+}
+
+int sum6(int a, int b, int c, int d, int e, int f) {
+  return a + b + c + d + e + f;
+}
+
+int unused(int x) {
+  return x + 1;
+}
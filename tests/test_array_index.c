@@ -0,0 +1,55 @@
+/* Test byte arrays indexed by int locals whose stack slots held other
+   data before: the index must be extended, not read as 8 bytes */
+int fill(int n) {
+  int a[40];
+  int i;
+  int s;
+  for (i = 0; i < n; i++)
+    a[i] = i * 3 - 100;
+  s = 0;
+  for (i = 0; i < n; i++)
+    s = s + a[i];
+  return s;
+}
+
+int inner(int k) { return k + 1; }
+
+int bytes(int n) {
+  char buf[100];
+  int i;
+  int s;
+  for (i = 0; i < 100; i++)
+    buf[i] = i;
+  s = inner(n);
+  for (i = 0; i < 100; i++)
+    s = s + buf[i];
+  return s;
+}
+
+int ubytes(int n) {
+  unsigned char buf[64];
+  int i;
+  int j;
+  int s;
+  for (i = 0; i < 64; i++)
+    buf[i] = i + 150;
+  s = inner(n);
+  j = 63;
+  for (i = 0; i < 64; i++) {
+    s = s + buf[j];
+    j = j - 1;
+  }
+  return s;
+}
+
+int main() {
+  if (fill(40) != 3 * 780 - 4000)
+    return 1;
+  if (bytes(5) != 6 + 4950)
+    return 2;
+  if (fill(40) != 3 * 780 - 4000)
+    return 3;
+  if (ubytes(7) != 8 + 64 * 150 + 2016)
+    return 4;
+  return 0;
+}
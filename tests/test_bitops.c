@@ -0,0 +1,31 @@
+/* Test bit manipulation builtins, and shifts */
+int main() {
+  int x;
+  long y;
+  int n;
+  x = 0x00f0;
+  y = 1;
+  y = y << 40;
+  n = 3;
+  if (__builtin_popcount(x) != 4)
+    return 1;
+  if (__builtin_clz(x) != 24)
+    return 2;
+  if (__builtin_ctz(x) != 4)
+    return 3;
+  if (__builtin_ctzll(y) != 40)
+    return 4;
+  if (__builtin_clzll(y) != 23)
+    return 5;
+  if (__builtin_bswap32(x) != 0xf0000000)
+    return 6;
+  if (__builtin_popcount(0) != 0)
+    return 7;
+  if ((x << n) != 0x0780)
+    return 8;
+  if ((x >> n) != 0x1e)
+    return 8;
+  if ((x << 4) != 0x0f00)
+    return 9;
+  return 0;
+}
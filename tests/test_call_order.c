@@ -0,0 +1,18 @@
+/* Test calls to functions defined later, and -freorder-functions */
+int square(int x);
+
+int unused_helper(int x) { return x * 3; }
+
+int sum_squares(int a, int b) { return square(a) + square(b); }
+
+int main() {
+  if (sum_squares(3, 4) != 25)
+    return 1;
+  if (twice(21) != 42)
+    return 2;
+  return 0;
+}
+
+int square(int x) { return x * x; }
+
+int twice(int x) { return x + x; }
@@ -0,0 +1,14 @@
+/* Test values held in registers while a call is made */
+int inc(int x) { return x + 1; }
+
+int main() {
+  int a;
+  int b;
+  a = 6;
+  b = 7;
+  if (a * b + inc(a) != 49)
+    return 1;
+  if ((a - b) * (b - inc(b)) != 1)
+    return 2;
+  return 0;
+}
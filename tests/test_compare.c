@@ -0,0 +1,43 @@
+/* Test comparisons used as values and branches, and division */
+int add5(int a, int b, int c, int d, int e) { return a + b + c + d + e; }
+
+int main() {
+  int a;
+  int b;
+  int n;
+  unsigned u;
+  long big;
+  a = 3;
+  b = -7;
+  u = 4000000000;
+  big = 1;
+  big = big << 40;
+
+  n = (a < b) + (b < a) * 2 + (a == 3) * 4;
+  if (n != 6)
+    return 1;
+  if (!(a > b))
+    return 2;
+  n = !a;
+  if (n != 0)
+    return 3;
+  if (a != 3)
+    return 4;
+  if (b < -200000)
+    return 5;
+  if (big < 100000)
+    return 6;
+  if (add5(1, 2, a > b, 4, a < b) != 8)
+    return 7;
+  if (b / 2 != -3)
+    return 8;
+  if (b % 2 != -1)
+    return 9;
+  if (u / 3 != 1333333333)
+    return 10;
+  if (u % 7 != 3)
+    return 11;
+  if (big / 3 != 366503875925)
+    return 12;
+  return 0;
+}
@@ -0,0 +1,31 @@
+/* Test ?: arms with a call or a division while a value computed before
+   the condition is still live: both paths must leave it in one place */
+int one(int x) { return x + 1; }
+
+int by_call(int c, int x) { return (x * 3) + (c ? 2 : one(x)); }
+
+int by_div(int c, int x) { return (x * 5) - (c ? 1 : 100 / (x + 2)); }
+
+int store(int c, int y, int z) {
+  int a[4];
+  a[1] = c ? y : (y * (1000 % ((z & 7) + 1)));
+  return a[1];
+}
+
+int main() {
+  if (by_call(1, 10) != 32)
+    return 1;
+  if (by_call(0, 10) != 41)
+    return 2;
+  if (by_div(1, 8) != 39)
+    return 3;
+  if (by_div(0, 8) != 30)
+    return 4;
+  if (store(1, 5, 3) != 5)
+    return 5;
+  if (store(0, 5, 3) != 0)
+    return 6;
+  if (store(0, 5, 2) != 5)
+    return 7;
+  return 0;
+}
@@ -0,0 +1,95 @@
+/* Calls with constant arguments evaluated at compile time with
+ * -ffold-calls, checked against the same calls made at run time */
+
+__attribute__((const)) int fib(int n) {
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+__attribute__((pure)) unsigned int crc_entry(unsigned int n) {
+  unsigned int c;
+  int k;
+
+  c = n;
+  for (k = 0; k < 8; k++) {
+    if (c & 1)
+      c = (c >> 1) ^ 3988292384; /* 0xedb88320 */
+    else
+      c = c >> 1;
+  }
+  return c;
+}
+
+int gcd(int a, int b) {
+  while (b != 0) {
+    int t;
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* The stores truncate to 32 bits */
+int wrap(int a) {
+  int x;
+  x = a * 65536;
+  x = x * 65536;
+  return x;
+}
+
+int divide(int a, int b) {
+  if (b == 0)
+    return -1;
+  return a / b;
+}
+
+/* Arrays are left to run time */
+int sum3(int n) {
+  int a[3];
+  a[0] = n;
+  a[1] = n + 1;
+  a[2] = n + 2;
+  return a[0] + a[1] + a[2];
+}
+
+int main() {
+  int r;
+  int k;
+
+  r = 0;
+  k = 20;
+
+  if (fib(20) != 6765)
+    return 1;
+  if (fib(k) != fib(20))
+    return 2;
+  r = r + 10;
+
+  k = 17;
+  if (crc_entry(17) != 1789927666)
+    return 3;
+  if (crc_entry(k) != crc_entry(17))
+    return 4;
+  r = r + 10;
+
+  if (gcd(1071, 462) != 21)
+    return 5;
+  if (wrap(3) != 0)
+    return 6;
+  k = 3;
+  if (wrap(k) != wrap(3))
+    return 7;
+  if (divide(7, 0) != -1)
+    return 8;
+  if (divide(-7, 2) != -3)
+    return 9;
+  r = r + 10;
+
+  if (sum3(4) != 15)
+    return 10;
+  r = r + 10;
+
+  return r + fib(3);
+}
@@ -0,0 +1,120 @@
+/* Rotates, byte swaps, abs and min/max, compiled as single instructions
+ * with -fexpr-idioms, checked against arithmetic that does not match */
+
+int main() {
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  unsigned long long w;
+  unsigned long long v;
+  long long m;
+  int a;
+  int b;
+  int c;
+  int k;
+  int r;
+
+  r = 0;
+  x = 305419896; /* 0x12345678 */
+
+  /* rotate left by 8, and right by 8 written both ways round */
+  y = (x << 8) | (x >> 24);
+  if (y != 878082066) /* 0x34567812 */
+    return 1;
+  y = (x >> 8) | (x << 24);
+  if (y != 2014458966) /* 0x78123456 */
+    return 2;
+  k = 4;
+  y = (x << k) | (x >> (32 - k));
+  if (y != 591751041) /* 0x23456781 */
+    return 3;
+  y = x >> k | x << 32 - k;
+  if (y != 2166572391) /* 0x81234567 */
+    return 4;
+  w = 1;
+  w = w << 63;
+  w = (w << k) | (w >> (64 - k));
+  if (w != 8)
+    return 22;
+  /* a signed x >> is arithmetic: no rotate */
+  m = 1;
+  m = m << 63;
+  m = (m << k) | (m >> (64 - k));
+  if (m != 0 - 8)
+    return 21;
+  r = r + 10;
+
+  /* byte swap, from any mix of masks and shifts */
+  y = (x >> 24) | ((x >> 8) & 65280) | ((x << 8) & 16711680) | (x << 24);
+  if (y != 2018915346) /* 0x78563412 */
+    return 5;
+  z = ((x & 255) << 24) | ((x & 65280) << 8) | ((x >> 8) & 65280) |
+      ((x >> 24) & 255);
+  if (z != y)
+    return 6;
+  w = 81985529216486895; /* 0x0123456789abcdef */
+  v = (w << 56) | ((w << 40) & 71776119061217280) |
+      ((w << 24) & 280375465082880) | ((w << 8) & 1095216660480) |
+      ((w >> 8) & 4278190080) | ((w >> 24) & 16711680) |
+      ((w >> 40) & 65280) | (w >> 56);
+  if (v >> 32 != 4023233417) /* 0xefcdab89 */
+    return 7;
+  if ((v & 4294967295) != 1732584193) /* 0x67452301 */
+    return 8;
+  /* not a swap: two bytes stay */
+  y = (x >> 24) | (x << 24);
+  if (y != 2013265938) /* 0x78000012 */
+    return 9;
+  r = r + 10;
+
+  /* abs */
+  a = 0 - 37;
+  b = (a ^ (a >> 31)) - (a >> 31);
+  if (b != 37)
+    return 10;
+  a = 41;
+  b = (a ^ (a >> 31)) - (a >> 31) + 1;
+  if (b != 42)
+    return 11;
+  m = 0 - 5000000000;
+  m = (m ^ (m >> 63)) - (m >> 63);
+  if (m != 5000000000)
+    return 12;
+  r = r + 10;
+
+  /* min and max */
+  a = 0 - 3;
+  b = 8;
+  c = a < b ? a : b;
+  if (c != 0 - 3)
+    return 13;
+  c = a > b ? a : b;
+  if (c != 8)
+    return 14;
+  c = a <= b ? b : a;
+  if (c != 8)
+    return 15;
+  c = b < 5 ? b : 5;
+  if (c != 5)
+    return 16;
+  c = 0 >= a ? 0 : a;
+  if (c != 0)
+    return 17;
+  x = 4000000000;
+  y = 7;
+  z = x < y ? x : y;
+  if (z != 7)
+    return 18;
+  r = r + 10;
+
+  /* conditionals that are no idiom */
+  c = a < b ? b - a : a - b;
+  if (c != 11)
+    return 19;
+  c = a > 0 ? 1 : b > 0 ? 2 : 3;
+  if (c != 2)
+    return 20;
+  r = r + (a < b ? 2 : 1);
+
+  return r;
+}
@@ -0,0 +1,17 @@
+/* Test a right-leaning expression deep enough to run out of registers
+   when evaluated left to right */
+int eval(int a, int b, int c, int d) {
+  return a * b +
+         (b * c +
+          (c * d +
+           (d * a +
+            (a * c +
+             (b * d + (a * a + (b * b + (c * c + (d * d + (a ^ c)))))))))) &
+             255;
+}
+
+int main() {
+  int x;
+  x = eval(1, 2, 3, 4) + (eval(2, 3, 4, 5) | 1) * 2;
+  return x & 255;
+}
@@ -0,0 +1,12 @@
+/* Test a function whose end is reached without a return */
+int first(int k) {
+  if (k)
+    return k;
+}
+
+int second(int k) { return 40; }
+
+int main() {
+  first(0);
+  return 7;
+}
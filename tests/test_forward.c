@@ -0,0 +1,39 @@
+/* Test reuse of registers that still hold a local after a store or load */
+int narrow(int a) {
+  char c;
+  short h;
+  unsigned int u;
+  int r;
+  c = a + 256;
+  h = a * 1000;
+  u = 0 - 1;
+  u = u + a;
+  r = 0;
+  if (c == 1)
+    r = r + 1;
+  if (h == 1000 * a)
+    r = r + 2;
+  if (u == 0)
+    r = r + 4;
+  return r;
+}
+
+int chain(int x, int y) {
+  int t;
+  x = x + 1;
+  y = x * 2;
+  t = x + y;
+  x = t - y;
+  if (x > 100) {
+    t = t + 1;
+  }
+  return t + x + y;
+}
+
+int main() {
+  int a;
+  a = narrow(1);
+  if (a != 7)
+    return a;
+  return chain(4, 0);
+}
@@ -0,0 +1,28 @@
+/* Test that dropping unreferenced code keeps everything main reaches */
+int unused_counter;
+
+static int twice(int x) { return x * 2; }
+
+static int only_dead(int x) { return twice(x) + 1; }
+
+int dead_root(int x) { return only_dead(x) * only_dead(x); }
+
+static int sum6(int a, int b, int c, int d, int e, int f) {
+  return a + b + c + d + e + f + twice(f);
+}
+
+static int by_pointer(long fn) { return fn(1, 2, 3, 4, 5, 6); }
+
+static int deep3(int x) { return x - 1; }
+static int deep2(int x) { return deep3(x) * 2; }
+static int deep1(int x) { return deep2(x) + 3; }
+
+int main() {
+  if (twice(21) != 42)
+    return 1;
+  if (by_pointer(sum6) != 33)
+    return 2;
+  if (deep1(5) != 11)
+    return 3;
+  return 0;
+}
@@ -0,0 +1,44 @@
+/* Test folding of functions with identical code: the copies must keep
+   working through calls and pointers whatever they are folded onto */
+static int even1(int n);
+static int odd1(int n);
+static int even2(int n);
+static int odd2(int n);
+
+static int get_a(int x) { return x + 7; }
+static int get_b(int x) { return x + 7; }
+static int get_c(int x) { return x + 8; }
+
+/* Two sets of functions calling each other, with the same code */
+static int even1(int n) { return n == 0 ? 1 : odd1(n - 1); }
+static int odd1(int n) { return n == 0 ? 0 : even1(n - 1); }
+static int even2(int n) { return n == 0 ? 1 : odd2(n - 1); }
+static int odd2(int n) { return n == 0 ? 0 : even2(n - 1); }
+
+/* The same code calling different functions */
+static int call_a(int x) { return get_a(x) * 2; }
+static int call_c(int x) { return get_c(x) * 2; }
+
+static int apply(long fn, int x) { return fn(x); }
+
+int main() {
+  if (apply(get_a, 1) != 8)
+    return 1;
+  if (apply(get_b, 2) != 9)
+    return 2;
+  if (apply(get_c, 1) != 9)
+    return 3;
+  if (apply(even1, 10) != 1)
+    return 4;
+  if (apply(odd2, 7) != 1)
+    return 5;
+  if (apply(even2, 3) != 0)
+    return 6;
+  if (call_a(1) != 16)
+    return 7;
+  if (call_c(1) != 18)
+    return 8;
+  if (apply(odd1, 4) != 0)
+    return 9;
+  return 0;
+}
@@ -0,0 +1,20 @@
+/* Test calls through function pointers, and their value profile */
+int add(int a, int b) { return a + b; }
+
+int sub(int a, int b) { return a - b; }
+
+int apply(long op, int a, int b) { return op(a, b); }
+
+int main() {
+  int i;
+  int total;
+  total = 0;
+  for (i = 0; i < 10; i = i + 1) {
+    total = total + apply(add, i, 1);
+  }
+  if (total != 55)
+    return 1;
+  if (apply(sub, 7, 2) != 5)
+    return 2;
+  return 0;
+}
@@ -0,0 +1,104 @@
+/* Copy, fill and strlen loops, compiled as string instructions with
+ * -floop-idioms, checked against loops of other shapes */
+
+int main() {
+  int a[20];
+  int b[20];
+  char c[40];
+  char d[40];
+  long long q[5];
+  int i;
+  int j;
+  int n;
+  int v;
+  int *p;
+  char *s;
+  char *t;
+  int r;
+
+  r = 0;
+  n = 20;
+  for (i = 0; i < n; i++)
+    a[i] = i * 7;
+  v = 0 - 3;
+  for (i = 0; i < n; ++i)
+    b[i] = v;
+  if (i != 20)
+    return 1;
+  for (j = 0; j < 20; j = j + 2) {
+    if (b[j] + b[j + 1] != 0 - 6)
+      return 2;
+  }
+
+  /* copy: the counter ends at n */
+  for (i = 0; i < n; i = i + 1) {
+    b[i] = a[i];
+  }
+  if (i != n)
+    return 3;
+  for (j = 0; j < 20; j = j + 1) {
+    if (b[j] != j * 7)
+      return 4;
+  }
+  r = r + 10;
+
+  /* no trips: a negative count leaves the counter at 0 */
+  n = 0 - 5;
+  for (i = 0; i < n; i++)
+    a[i] = 99;
+  if (i != 0)
+    return 5;
+  if (a[0] != 0)
+    return 6;
+
+  /* bytes, through pointers */
+  for (i = 0; i < 40; i++)
+    c[i] = 65;
+  c[37] = 0;
+  s = d;
+  t = c;
+  for (i = 0; i < 40; i++)
+    s[i] = t[i];
+  if (d[36] != 65)
+    return 7;
+  r = r + 10;
+
+  /* strlen, from every alignment */
+  for (j = 0; j < 37; j = j + 1) {
+    t = d + j;
+    while (*t)
+      t++;
+    if (t - d != 37)
+      return 8;
+    s = d + j;
+    while (*s != 0) {
+      s = s + 1;
+    }
+    if (s != t)
+      return 9;
+  }
+  r = r + 10;
+
+  /* 64-bit elements, zero fill */
+  for (i = 0; i < 5; i++)
+    q[i] = 0;
+  q[4] = q[4] + 3;
+  for (i = 0; i < 5; i++)
+    q[i] = q[i] + i;
+  if (q[4] != 7)
+    return 10;
+
+  /* a pointer into the array itself: forward overlap */
+  for (i = 0; i < 20; i++)
+    a[i] = i;
+  p = a + 1;
+  for (i = 0; i < 19; i++)
+    a[i] = p[i];
+  if (a[0] != 1)
+    return 11;
+  if (a[18] != 19)
+    return 12;
+  r = r + 10;
+
+  return r;
+}
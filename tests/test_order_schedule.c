@@ -0,0 +1,42 @@
+/* Test a ?: as the right operand of + needing more registers than the
+   left one: its branches schedule the stores before the left operand,
+   which must then stay where it was emitted */
+int sum(int a, int b, int c, int d, int e, int g) {
+  int x;
+  int y;
+  x = a - b;
+  y = d * 5;
+  return (c - 1) + (c ? (((y + a) - (b - d)) * ((y - x) - (x + d))) : e) + g;
+}
+
+int mix(int a, int b, int c, int d, int e, int g) {
+  int x;
+  int y;
+  x = b * a;
+  y = g * 9;
+  return (x - e) + (c ? (((d * d) + (c - b)) + ((b * e) + (d * y))) : g);
+}
+
+int main() {
+  int a;
+  int b;
+  int c;
+  int d;
+  int i;
+  /* Values the compiler does not know, so sum and mix are not folded */
+  d = 1;
+  for (i = 0; i < 4; i++)
+    d = d + 1;
+  a = d - 3;
+  b = d - 2;
+  c = d - 1;
+  if (sum(a, b, c, d, 6, 7) != 3 + 29 * 22 + 7)
+    return 1;
+  if (sum(a, b, 0, d, 6, 7) != -1 + 6 + 7)
+    return 2;
+  if (mix(a, b, c, d, 6, 7) != 25 + 1 + 18 + 315)
+    return 3;
+  if (mix(a, b, 0, d, 6, 7) != 7)
+    return 4;
+  return 0;
+}
@@ -0,0 +1,26 @@
+/* Test ifs that a profile finds cold, nested in one another: built with
+   -fprofile-use of its own -fprofile-generate run, both bodies go to
+   cold code and the outer one must not fall through into the inner */
+int pick(int c, int d) {
+  int r;
+  r = 1;
+  if (c) {
+    if (d)
+      r = 100;
+    r = r + 1;
+  }
+  return r;
+}
+
+int main() {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < 100; i++)
+    s = s + pick(i == 7, 0);
+  if (s != 101)
+    return 1;
+  if (pick(1, 0) != 2)
+    return 2;
+  return 0;
+}
@@ -0,0 +1,20 @@
+/* Test independent computations that the scheduler may interleave */
+int kernel(int a, int b, int c, int d) {
+  int x;
+  int y;
+  int z;
+  x = a * b + c;
+  y = c * d - a;
+  z = (a + d) * (b - c);
+  return x * 3 + y * 5 + z / 2;
+}
+
+int main() {
+  int i;
+  int sum;
+  sum = 0;
+  for (i = 0; i < 10; i = i + 1) {
+    sum = sum + kernel(i, i + 1, i + 2, i + 3) % 100;
+  }
+  return sum % 256;
+}
@@ -0,0 +1,26 @@
+/* Test calls to static functions, which use the private convention */
+static int add3(int a, int b, int c) { return a + b + c; }
+
+static int sum6(int a, int b, int c, int d, int e, int f) {
+  return a + b + c + d + e + f;
+}
+
+static int sum7(int a, int b, int c, int d, int e, int f, int g) {
+  return a + b + c + d + e + f + g;
+}
+
+int call_sum6(long fn) { return fn(1, 2, 3, 4, 5, 6); }
+
+int main() {
+  if (add3(1, 2, 3) != 6)
+    return 1;
+  if (sum6(1, 2, 3, 4, 5, 6) != 21)
+    return 2;
+  if (sum7(1, 2, 3, 4, 5, 6, 7) != 28)
+    return 3;
+  if (call_sum6(sum6) != 21)
+    return 4;
+  if (add3(sum6(1, 1, 1, 1, 1, 1), 2, 3) != 11)
+    return 5;
+  return 0;
+}
@@ -0,0 +1,20 @@
+/* Test target_clones: a variant is picked at start-up, all agree */
+
+__attribute__((target_clones("popcnt", "arch=x86-64-v3", "default")))
+int bits(int x) {
+  return __builtin_popcount(x) + (x << 2);
+}
+
+__attribute__((target_clones("lzcnt", "default"))) static int lead(int x) {
+  return __builtin_clz(x);
+}
+
+int main() {
+  if (bits(255) != 1028)
+    return 1;
+  if (bits(6) != 26)
+    return 2;
+  if (lead(1) != 31)
+    return 3;
+  return 0;
+}
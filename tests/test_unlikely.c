@@ -0,0 +1,61 @@
+/* Test __builtin_expect and cold block splitting (-fsplit-cold) */
+int check(int x) {
+  if (__builtin_expect(x < 0, 0)) {
+    return 100;
+  }
+  if (__builtin_expect(x > 50, 0)) {
+    x = x - 50;
+  } else {
+    x = x + 1;
+  }
+  return x;
+}
+
+/* Hints inside a condition or an argument are not the if's own */
+int one(int x) { return x + 1; }
+
+int nested(int x, int y) {
+  if (__builtin_expect(x, 0) | y) {
+    x = x + 10;
+  }
+  if (one(__builtin_expect(x, 0)) > 5) {
+    x = x + 100;
+  }
+  return x;
+}
+
+/* An unlikely if inside the cold body of another */
+int inner_cold(int c, int d) {
+  int r;
+  r = 1;
+  if (__builtin_expect(c, 0)) {
+    if (__builtin_expect(d, 0))
+      r = 100;
+    r = r + 1;
+  }
+  return r;
+}
+
+int main() {
+  int a;
+  a = check(5);
+  if (a != 6)
+    return 1;
+  a = check(60);
+  if (a != 10)
+    return 2;
+  a = check(0 - 3);
+  if (a != 100)
+    return 3;
+  if (nested(0, 1) != 110)
+    return 4;
+  if (nested(0, 0) != 0)
+    return 5;
+  if (inner_cold(1, 0) != 2)
+    return 6;
+  if (inner_cold(1, 1) != 101)
+    return 7;
+  if (inner_cold(0, 1) != 1)
+    return 8;
+  return 0;
+}